@@ -0,0 +1,409 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// capture.c: This file contains routines that write and read capture
+//            files, which hold timestamped records of the raw data
+//            frames returned by the ECU.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(WIN32)
+  #include <fcntl.h>
+  #include <unistd.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+#endif
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * Checks the header at the start of a capture file. Headers of version 1
+ * files, which are shorter, are accepted with a zero clock anchor.
+ * @param header Header, of which 'available' bytes were read from the file
+ * @return True if the file is a supported capture file
+ */
+static bool header_supported(mems_capture_header* header, size_t available)
+{
+  if ((available < MEMS_CAPTURE_V1_HEADER_LEN) ||
+      (memcmp(header->magic, MEMS_CAPTURE_MAGIC, sizeof(header->magic)) != 0))
+  {
+    return false;
+  }
+
+  if (header->version == 1)
+  {
+    memset(&header->anchor, 0, sizeof(header->anchor));
+    return (header->header_len >= MEMS_CAPTURE_V1_HEADER_LEN);
+  }
+
+  return (header->version == MEMS_CAPTURE_VERSION) &&
+         (available >= sizeof(mems_capture_header)) &&
+         (header->header_len >= sizeof(mems_capture_header));
+}
+
+/**
+ * Creates a capture file and writes its header, which records the wall-clock
+ * time at which the capture was opened.
+ * @param writer Writer state to initialize
+ * @param path Path of the file to create (an existing file is replaced)
+ * @param d0_response D0 response of the ECU being captured, or NULL if unknown
+ * @return True if the file was created, false otherwise
+ */
+bool mems_capture_open(mems_capture_writer* writer, const char* path, const uint8_t* d0_response)
+{
+  mems_capture_header header;
+
+  memset(writer, 0, sizeof(mems_capture_writer));
+  memset(&header, 0, sizeof(header));
+
+  memcpy(header.magic, MEMS_CAPTURE_MAGIC, sizeof(header.magic));
+  header.version = MEMS_CAPTURE_VERSION;
+  header.header_len = sizeof(header);
+  if (d0_response)
+  {
+    memcpy(header.d0_response, d0_response, MEMS_D0_RESPONSE_LEN);
+  }
+  mems_clock_anchor_now(&header.anchor);
+
+  if ((writer->fp = fopen(path, "wb")) == NULL)
+  {
+    dprintf_err("mems_capture_open(): could not create %s\n", path);
+    return false;
+  }
+
+  if (fwrite(&header, sizeof(header), 1, writer->fp) != 1)
+  {
+    fclose(writer->fp);
+    writer->fp = NULL;
+    return false;
+  }
+
+  writer->start_us = header.anchor.monotonic_us;
+
+  return true;
+}
+
+/**
+ * Appends a record to a capture file.
+ * @param writer Writer opened with mems_capture_open()
+ * @param type One of the mems_record_type values
+ * @param timestamp_us Time of the record relative to the start of the capture
+ * @param payload Record contents
+ * @param length Number of bytes in the payload
+ * @return True if the record was written, false otherwise
+ */
+bool mems_capture_write(mems_capture_writer* writer, uint8_t type, uint64_t timestamp_us,
+                        const void* payload, uint16_t length)
+{
+  mems_capture_record record;
+
+  if (writer->fp == NULL)
+  {
+    return false;
+  }
+
+  memset(&record, 0, sizeof(record));
+  record.type = type;
+  record.length = length;
+  record.timestamp_us = timestamp_us;
+
+  if ((fwrite(&record, sizeof(record), 1, writer->fp) != 1) ||
+      ((length > 0) && (fwrite(payload, length, 1, writer->fp) != 1)))
+  {
+    dprintf_err("mems_capture_write(): write failed\n");
+    return false;
+  }
+
+  writer->records++;
+
+  return true;
+}
+
+/**
+ * Appends a pair of raw data frames to a capture file with the times at
+ * which they were requested and received (relative to the start of the
+ * capture). The frames are written straight from the caller's storage.
+ */
+bool mems_capture_write_frames_at(mems_capture_writer* writer, uint64_t request_us, uint64_t timestamp_us,
+                                  const mems_data_frame_80* frame80, const mems_data_frame_7d* frame7d)
+{
+  mems_capture_record record;
+  mems_capture_frame_times times;
+
+  if (writer->fp == NULL)
+  {
+    return false;
+  }
+
+  memset(&record, 0, sizeof(record));
+  record.type = MEMS_Record_Frames;
+  record.length = sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d) + sizeof(times);
+  record.timestamp_us = timestamp_us;
+  times.request_us = request_us;
+
+  if ((fwrite(&record, sizeof(record), 1, writer->fp) != 1) ||
+      (fwrite(frame80, sizeof(mems_data_frame_80), 1, writer->fp) != 1) ||
+      (fwrite(frame7d, sizeof(mems_data_frame_7d), 1, writer->fp) != 1) ||
+      (fwrite(&times, sizeof(times), 1, writer->fp) != 1))
+  {
+    dprintf_err("mems_capture_write_frames(): write failed\n");
+    return false;
+  }
+
+  writer->records++;
+
+  return true;
+}
+
+/**
+ * Appends a pair of raw data frames to a capture file, timestamped with the
+ * current time. As the time of the request isn't known, it is recorded as
+ * the same time.
+ */
+bool mems_capture_write_frames(mems_capture_writer* writer, const mems_data_frame_80* frame80,
+                               const mems_data_frame_7d* frame7d)
+{
+  uint64_t now = mems_monotonic_us() - writer->start_us;
+
+  return mems_capture_write_frames_at(writer, now, now, frame80, frame7d);
+}
+
+/**
+ * Frame ring subscriber that appends each acquired frame to a capture file,
+ * with the times at which it was requested and received. Register with
+ * mems_ring_subscribe(), passing the mems_capture_writer as the context.
+ */
+void mems_capture_frame_callback(const mems_frame* frame, void* writer)
+{
+  mems_capture_writer* w = (mems_capture_writer*)writer;
+
+  mems_capture_write_frames_at(w,
+                               (frame->request_us > w->start_us) ? (frame->request_us - w->start_us) : 0,
+                               (frame->response_us > w->start_us) ? (frame->response_us - w->start_us) : 0,
+                               &frame->frame80, &frame->frame7d);
+}
+
+/**
+ * IAC sweep callback that appends each step response to a capture file.
+ * Pass the mems_capture_writer as the context of mems_iac_sweep().
+ */
+void mems_capture_iac_callback(const mems_iac_step* step, uint64_t timestamp_us, void* writer)
+{
+  mems_capture_writer* w = (mems_capture_writer*)writer;
+
+  mems_capture_write(w, MEMS_Record_IACStep, timestamp_us - w->start_us, step, sizeof(mems_iac_step));
+}
+
+/**
+ * Flushes and closes a capture file.
+ */
+void mems_capture_close(mems_capture_writer* writer)
+{
+  if (writer->fp)
+  {
+    fclose(writer->fp);
+    writer->fp = NULL;
+  }
+}
+
+/**
+ * Opens a capture file for sequential reading and validates its header.
+ * Files of version 1 and later are supported.
+ * @return True if the file was opened and is a supported capture file
+ */
+bool mems_capture_reader_open(mems_capture_reader* reader, const char* path)
+{
+  memset(reader, 0, sizeof(mems_capture_reader));
+
+  if ((reader->fp = fopen(path, "rb")) == NULL)
+  {
+    dprintf_err("mems_capture_reader_open(): could not open %s\n", path);
+    return false;
+  }
+
+  if (!header_supported(&reader->header,
+                        fread(&reader->header, 1, sizeof(mems_capture_header), reader->fp)) ||
+      (fseek(reader->fp, reader->header.header_len, SEEK_SET) != 0))
+  {
+    dprintf_err("mems_capture_reader_open(): %s is not a supported capture file\n", path);
+    fclose(reader->fp);
+    reader->fp = NULL;
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Reads the next record from a capture file.
+ * @param reader Reader opened with mems_capture_reader_open()
+ * @param record Receives the record header
+ * @param payload Receives the record contents (may be NULL to skip them)
+ * @param max_length Size of the payload buffer; longer payloads are truncated
+ * @return True if a record was read, false at the end of the file or on error
+ */
+bool mems_capture_next(mems_capture_reader* reader, mems_capture_record* record,
+                       uint8_t* payload, uint16_t max_length)
+{
+  uint16_t keep;
+
+  if ((reader->fp == NULL) ||
+      (fread(record, sizeof(mems_capture_record), 1, reader->fp) != 1))
+  {
+    return false;
+  }
+
+  keep = (payload && (record->length < max_length)) ? record->length : (payload ? max_length : 0);
+
+  if ((keep > 0) && (fread(payload, keep, 1, reader->fp) != 1))
+  {
+    return false;
+  }
+
+  if ((record->length > keep) && (fseek(reader->fp, record->length - keep, SEEK_CUR) != 0))
+  {
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Closes a capture file opened for reading.
+ */
+void mems_capture_reader_close(mems_capture_reader* reader)
+{
+  if (reader->fp)
+  {
+    fclose(reader->fp);
+    reader->fp = NULL;
+  }
+}
+
+/**
+ * Maps a whole capture file into memory for reading and validates its
+ * header. Where mmap() is not available, the file is read into a buffer.
+ * @return True if the file was mapped and is a supported capture file
+ */
+bool mems_capture_map_open(mems_capture_map* map, const char* path)
+{
+  size_t available;
+#if !defined(WIN32)
+  struct stat st;
+  void* base;
+  int fd;
+#else
+  FILE* fp;
+  long size;
+  uint8_t* buffer;
+#endif
+
+  memset(map, 0, sizeof(mems_capture_map));
+
+#if !defined(WIN32)
+  if ((fd = open(path, O_RDONLY)) < 0)
+  {
+    dprintf_err("mems_capture_map_open(): could not open %s\n", path);
+    return false;
+  }
+
+  if ((fstat(fd, &st) != 0) || (st.st_size < MEMS_CAPTURE_V1_HEADER_LEN) ||
+      ((base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED))
+  {
+    dprintf_err("mems_capture_map_open(): could not map %s\n", path);
+    close(fd);
+    return false;
+  }
+  close(fd);
+
+  // the records are read once, front to back
+  madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+  map->base = (const uint8_t*)base;
+  map->size = st.st_size;
+#else
+  if ((fp = fopen(path, "rb")) == NULL)
+  {
+    dprintf_err("mems_capture_map_open(): could not open %s\n", path);
+    return false;
+  }
+
+  if ((fseek(fp, 0, SEEK_END) != 0) || ((size = ftell(fp)) < MEMS_CAPTURE_V1_HEADER_LEN) ||
+      (fseek(fp, 0, SEEK_SET) != 0) || ((buffer = (uint8_t*)malloc(size)) == NULL))
+  {
+    fclose(fp);
+    return false;
+  }
+
+  if (fread(buffer, size, 1, fp) != 1)
+  {
+    free(buffer);
+    fclose(fp);
+    return false;
+  }
+  fclose(fp);
+
+  map->base = buffer;
+  map->size = size;
+#endif
+
+  available = (map->size < sizeof(mems_capture_header)) ? map->size : sizeof(mems_capture_header);
+  memcpy(&map->header, map->base, available);
+
+  if (!header_supported(&map->header, available) ||
+      (map->header.header_len > map->size))
+  {
+    dprintf_err("mems_capture_map_open(): %s is not a supported capture file\n", path);
+    mems_capture_map_close(map);
+    return false;
+  }
+
+  map->offset = map->header.header_len;
+
+  return true;
+}
+
+/**
+ * Returns the next record of a mapped capture file. The payload pointer
+ * refers to the mapping itself and remains valid until the file is closed;
+ * the record header is valid until the next call.
+ * @return True if a complete record was found, false at the end of the file
+ */
+bool mems_capture_map_next(mems_capture_map* map, const mems_capture_record** record, const uint8_t** payload)
+{
+  if ((map->base == NULL) || (map->offset + sizeof(mems_capture_record) > map->size))
+  {
+    return false;
+  }
+
+  // records are packed, so their headers aren't necessarily aligned
+  memcpy(&map->record, map->base + map->offset, sizeof(mems_capture_record));
+  if (map->offset + sizeof(mems_capture_record) + map->record.length > map->size)
+  {
+    return false;
+  }
+
+  *record = &map->record;
+  *payload = map->base + map->offset + sizeof(mems_capture_record);
+  map->offset += sizeof(mems_capture_record) + map->record.length;
+
+  return true;
+}
+
+/**
+ * Unmaps a capture file opened with mems_capture_map_open().
+ */
+void mems_capture_map_close(mems_capture_map* map)
+{
+  if (map->base)
+  {
+#if !defined(WIN32)
+    munmap((void*)map->base, map->size);
+#else
+    free((void*)map->base);
+#endif
+    map->base = NULL;
+  }
+}
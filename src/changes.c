@@ -0,0 +1,130 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// changes.c: This file contains the change stream, which compares
+//            successive frames and reports only the fault codes and
+//            switch states that have changed.
+
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+static const char* change_item_names[MEMS_Change_Count] = {
+  "fault_codes",
+  "dtc0",
+  "dtc1",
+  "dtc2",
+  "dtc3",
+  "dtc4",
+  "idle_switch",
+  "park_neutral_switch",
+  "closed_loop"
+};
+
+/**
+ * Sets up a change stream with no subscribers.
+ */
+void mems_change_stream_init(mems_change_stream* stream)
+{
+  memset(stream, 0, sizeof(mems_change_stream));
+}
+
+/**
+ * Registers a callback that is invoked with each change event.
+ * @return True if the callback was registered; false if the maximum number
+ *   of subscribers has been reached
+ */
+bool mems_change_subscribe(mems_change_stream* stream, mems_change_callback callback, void* context)
+{
+  if (stream->subscriber_count >= MEMS_MAX_SUBSCRIBERS)
+  {
+    return false;
+  }
+
+  stream->subscribers[stream->subscriber_count] = callback;
+  stream->contexts[stream->subscriber_count] = context;
+  stream->subscriber_count++;
+
+  return true;
+}
+
+/**
+ * Returns the name of a watched item, as used in the mems_data and raw
+ * frame structs.
+ */
+const char* mems_change_item_name(enum mems_change_item item)
+{
+  return ((item >= 0) && (item < MEMS_Change_Count)) ? change_item_names[item] : "unknown";
+}
+
+/**
+ * Compares a frame's watched items with those of the previous frame and
+ * notifies the subscribers of each one that has changed. The items are
+ * gathered into a small array so that the common case, in which nothing
+ * has changed, costs a single comparison. For the first frame, every item
+ * is reported (with the old value equal to the new) so that subscribers
+ * learn the initial state.
+ * @param stream Change stream set up with mems_change_stream_init()
+ * @param frame Newly acquired frame
+ * @param timestamp_us Monotonic time at which the frame was acquired
+ * @return Number of events emitted
+ */
+int mems_change_update(mems_change_stream* stream, const mems_frame* frame, uint64_t timestamp_us)
+{
+  uint8_t now[MEMS_Change_Count];
+  mems_change_event event;
+  int emitted = 0;
+  int item;
+  uint8_t idx;
+
+  now[MEMS_Change_FaultCodes] = frame->data.fault_codes;
+  now[MEMS_Change_DTC0] = frame->frame80.dtc0;
+  now[MEMS_Change_DTC1] = frame->frame80.dtc1;
+  now[MEMS_Change_DTC2] = frame->frame7d.dtc2;
+  now[MEMS_Change_DTC3] = frame->frame7d.dtc3;
+  now[MEMS_Change_DTC4] = frame->frame7d.dtc4;
+  now[MEMS_Change_IdleSwitch] = frame->data.idle_switch;
+  now[MEMS_Change_ParkNeutralSwitch] = frame->data.park_neutral_switch;
+  now[MEMS_Change_ClosedLoop] = frame->data.closed_loop;
+
+  if (stream->primed && (memcmp(now, stream->last, sizeof(now)) == 0))
+  {
+    return 0;
+  }
+
+  memset(&event, 0, sizeof(event));
+  event.timestamp_us = timestamp_us;
+  event.seq = frame->seq;
+
+  for (item = 0; item < MEMS_Change_Count; ++item)
+  {
+    if (!stream->primed || (now[item] != stream->last[item]))
+    {
+      event.item = item;
+      event.old_value = stream->primed ? stream->last[item] : now[item];
+      event.new_value = now[item];
+      emitted++;
+
+      for (idx = 0; idx < stream->subscriber_count; ++idx)
+      {
+        stream->subscribers[idx](&event, stream->contexts[idx]);
+      }
+    }
+  }
+
+  memcpy(stream->last, now, sizeof(now));
+  stream->primed = true;
+  stream->events += emitted;
+
+  return emitted;
+}
+
+/**
+ * Frame ring subscriber that feeds each acquired frame to a change stream,
+ * timestamped with the time its response arrived. Register with
+ * mems_ring_subscribe(), passing the mems_change_stream as the context.
+ */
+void mems_change_frame_callback(const mems_frame* frame, void* stream)
+{
+  mems_change_update((mems_change_stream*)stream, frame, frame->response_us);
+}
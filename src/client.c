@@ -0,0 +1,109 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// client.c: This file contains routines used by applications to receive
+//           frames from (and send actuator requests to) the roscod
+//           daemon, which shares a single ECU connection among clients.
+
+#if !defined(WIN32)
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * Connects to a running roscod instance.
+ * @param socketPath Path of the daemon's socket, or NULL for MEMS_DAEMON_SOCKET
+ * @return Socket descriptor, or -1 if the connection could not be made
+ */
+int mems_client_connect(const char* socketPath)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  if (socketPath == NULL)
+  {
+    socketPath = MEMS_DAEMON_SOCKET;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(socketPath) >= sizeof(addr.sun_path))
+  {
+    return -1;
+  }
+  strcpy(addr.sun_path, socketPath);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+  {
+    return -1;
+  }
+
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+  {
+    dprintf_err("mems_client_connect(): could not connect to %s\n", socketPath);
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+/**
+ * Waits for the next message from the daemon (a frame, or the result of a
+ * request made with mems_client_send()).
+ * @return True if a complete message was received; false if the daemon
+ *   closed the connection or an error occurred
+ */
+bool mems_client_next(int fd, mems_daemon_msg* msg)
+{
+  uint8_t* ptr = (uint8_t*)msg;
+  size_t remaining = sizeof(mems_daemon_msg);
+  ssize_t got;
+
+  while (remaining > 0)
+  {
+    got = recv(fd, ptr, remaining, 0);
+    if (got <= 0)
+    {
+      return false;
+    }
+    ptr += got;
+    remaining -= got;
+  }
+
+  return true;
+}
+
+/**
+ * Sends a request (MEMS_Msg_Claim, MEMS_Msg_Release, MEMS_Msg_Actuate, or
+ * MEMS_Msg_Subscribe) to the daemon. The outcome arrives later as a MEMS_Msg_Result message.
+ * @param type Message type
+ * @param cmd Actuator command byte for MEMS_Msg_Actuate, or bitmap of
+ *   mems_daemon_stream values for MEMS_Msg_Subscribe
+ * @return True if the request was sent
+ */
+bool mems_client_send(int fd, uint8_t type, uint8_t cmd)
+{
+  mems_daemon_msg msg;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.type = type;
+  msg.cmd = cmd;
+
+  return (send(fd, &msg, sizeof(msg), 0) == sizeof(msg));
+}
+
+/**
+ * Closes the connection to the daemon.
+ */
+void mems_client_close(int fd)
+{
+  close(fd);
+}
+
+#endif // !WIN32
@@ -0,0 +1,144 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// clock.c: This file contains the monotonic time source and sleep
+//          routine used for timestamps and pacing, and the anchor that
+//          relates monotonic times to wall-clock time.
+
+#if defined(WIN32)
+  #include <windows.h>
+#else
+  #include <time.h>
+  #include <unistd.h>
+#endif
+
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Number of attempts made to read the wall clock between two close
+//! readings of the monotonic clock
+#define MEMS_ANCHOR_ATTEMPTS 3
+
+static mems_clock_callback clock_callback = NULL;
+static void* clock_context = NULL;
+
+/**
+ * Replaces the monotonic clock from which all of the library's timestamps are
+ * taken, e.g. with the clock of an external data acquisition system, so that
+ * samples are timestamped in its timebase. This should be called before any
+ * connection is opened.
+ * @param callback Function returning the current time in microseconds, or
+ *   NULL to restore the default (CLOCK_MONOTONIC)
+ * @param context Passed through to the callback
+ */
+void mems_set_clock(mems_clock_callback callback, void* context)
+{
+  clock_context = context;
+  clock_callback = callback;
+}
+
+/**
+ * Returns the current value of the system's monotonic clock, in microseconds.
+ */
+static uint64_t system_monotonic_us()
+{
+#if defined(WIN32)
+  LARGE_INTEGER freq, count;
+
+  QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&count);
+
+  return (uint64_t)((count.QuadPart * 1000000.0) / freq.QuadPart);
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ((uint64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+#endif
+}
+
+/**
+ * Returns the current value of a monotonic clock, in microseconds: the
+ * clock set with mems_set_clock(), or the system's monotonic clock.
+ * The epoch is arbitrary; only differences are meaningful.
+ */
+uint64_t mems_monotonic_us()
+{
+  return clock_callback ? clock_callback(clock_context) : system_monotonic_us();
+}
+
+/**
+ * Returns the current wall-clock time, in microseconds since the Unix epoch.
+ */
+static int64_t realtime_us()
+{
+#if defined(WIN32)
+  FILETIME ft;
+  ULARGE_INTEGER t;
+
+  // FILETIME counts 100 ns intervals since 1601-01-01
+  GetSystemTimeAsFileTime(&ft);
+  t.LowPart = ft.dwLowDateTime;
+  t.HighPart = ft.dwHighDateTime;
+
+  return (int64_t)(t.QuadPart / 10) - 11644473600000000LL;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+
+  return ((int64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+#endif
+}
+
+/**
+ * Pairs the current monotonic time with the wall-clock time. The wall clock
+ * is read between two readings of the monotonic clock, a few times over, and
+ * the closest pair is kept; the midpoint of the two monotonic readings is
+ * taken as the time at which the wall clock was read.
+ * @param anchor Receives the paired times, with half the interval between
+ *   the monotonic readings as the uncertainty
+ */
+void mems_clock_anchor_now(mems_clock_anchor* anchor)
+{
+  uint64_t before;
+  uint64_t after;
+  int64_t wall;
+  int attempt;
+
+  memset(anchor, 0, sizeof(mems_clock_anchor));
+
+  for (attempt = 0; attempt < MEMS_ANCHOR_ATTEMPTS; ++attempt)
+  {
+    before = mems_monotonic_us();
+    wall = realtime_us();
+    after = mems_monotonic_us();
+
+    if ((attempt == 0) || ((after - before + 1) / 2 < anchor->uncertainty_us))
+    {
+      anchor->monotonic_us = before + (after - before) / 2;
+      anchor->realtime_us = wall;
+      anchor->uncertainty_us = (uint32_t)((after - before + 1) / 2);
+    }
+  }
+}
+
+/**
+ * Suspends the calling thread for (at least) the given number of microseconds.
+ */
+void mems_sleep_us(uint64_t us)
+{
+#if defined(WIN32)
+  Sleep((DWORD)((us + 999) / 1000));
+#else
+  struct timespec ts;
+
+  ts.tv_sec = us / 1000000;
+  ts.tv_nsec = (us % 1000000) * 1000;
+  while ((nanosleep(&ts, &ts) != 0) && (errno == EINTR))
+  {
+  }
+#endif
+}
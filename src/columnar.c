@@ -0,0 +1,834 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// columnar.c: This file contains routines that export captures to, and
+//             read them back from, a columnar file format in which each
+//             decoded channel is stored and compressed separately.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Most bytes a chunk can take in any encoding, per row
+#define MEMS_COLUMNAR_MAX_ROW_BYTES 18
+//! Largest number of distinct values in a dictionary-encoded chunk
+#define MEMS_COLUMNAR_DICT_SIZE 256
+//! Number of slots in the hash table used to build a dictionary
+#define MEMS_COLUMNAR_DICT_SLOTS 1024
+
+/**
+ * Where the value of a column is taken from.
+ */
+enum column_source
+{
+  Source_Timestamp,
+  Source_Data,
+  Source_Frame80,
+  Source_Frame7d
+};
+
+typedef struct
+{
+  const char* name;
+  uint8_t type;
+  uint8_t width;
+  uint8_t source;
+  uint8_t offset;
+} column_def;
+
+/**
+ * Columns written by the exporter, in file order.
+ */
+static const column_def columns[MEMS_COLUMNAR_COLUMNS] = {
+  { "timestamp_us",         MEMS_Column_U64, 8, Source_Timestamp, 0 },
+  { "engine_rpm",           MEMS_Column_U16, 2, Source_Data,      offsetof(mems_data, engine_rpm) },
+  { "coolant_temp",         MEMS_Column_U8,  1, Source_Data,      offsetof(mems_data, coolant_temp_c) },
+  { "ambient_temp",         MEMS_Column_U8,  1, Source_Data,      offsetof(mems_data, ambient_temp_c) },
+  { "intake_air_temp",      MEMS_Column_U8,  1, Source_Data,      offsetof(mems_data, intake_air_temp_c) },
+  { "fuel_temp",            MEMS_Column_U8,  1, Source_Data,      offsetof(mems_data, fuel_temp_c) },
+  { "map_kpa",              MEMS_Column_F32, 4, Source_Data,      offsetof(mems_data, map_kpa) },
+  { "battery_voltage",      MEMS_Column_F32, 4, Source_Data,      offsetof(mems_data, battery_voltage) },
+  { "throttle_pot",         MEMS_Column_F32, 4, Source_Data,      offsetof(mems_data, throttle_pot_voltage) },
+  { "idle_switch",          MEMS_Column_U8,  1, Source_Data,      offsetof(mems_data, idle_switch) },
+  { "park_neutral_switch",  MEMS_Column_U8,  1, Source_Data,      offsetof(mems_data, park_neutral_switch) },
+  { "fault_codes",          MEMS_Column_U8,  1, Source_Data,      offsetof(mems_data, fault_codes) },
+  { "iac_position",         MEMS_Column_U8,  1, Source_Data,      offsetof(mems_data, iac_position) },
+  { "idle_error",           MEMS_Column_U16, 2, Source_Data,      offsetof(mems_data, idle_error) },
+  { "ignition_advance",     MEMS_Column_F32, 4, Source_Data,      offsetof(mems_data, ignition_advance) },
+  { "coil_time",            MEMS_Column_F32, 4, Source_Data,      offsetof(mems_data, coil_time) },
+  { "lambda_voltage",       MEMS_Column_U16, 2, Source_Data,      offsetof(mems_data, lambda_voltage_mv) },
+  { "fuel_trim",            MEMS_Column_U8,  1, Source_Data,      offsetof(mems_data, fuel_trim) },
+  { "closed_loop",          MEMS_Column_U8,  1, Source_Data,      offsetof(mems_data, closed_loop) },
+  { "idle_base_pos",        MEMS_Column_U8,  1, Source_Data,      offsetof(mems_data, idle_base_pos) },
+  { "dtc0",                 MEMS_Column_U8,  1, Source_Data,      offsetof(mems_data, dtc) + 0 },
+  { "dtc1",                 MEMS_Column_U8,  1, Source_Data,      offsetof(mems_data, dtc) + 1 },
+  { "dtc2",                 MEMS_Column_U8,  1, Source_Data,      offsetof(mems_data, dtc) + 2 },
+  { "dtc3",                 MEMS_Column_U8,  1, Source_Data,      offsetof(mems_data, dtc) + 3 },
+  { "dtc4",                 MEMS_Column_U8,  1, Source_Data,      offsetof(mems_data, dtc) + 4 },
+  { "unknown0",             MEMS_Column_U8,  1, Source_Frame80,   offsetof(mems_data_frame_80, unknown0) },
+  { "unknown1",             MEMS_Column_U8,  1, Source_Frame80,   offsetof(mems_data_frame_80, unknown1) },
+  { "unknown2",             MEMS_Column_U8,  1, Source_Frame80,   offsetof(mems_data_frame_80, unknown2) },
+  { "unknown3",             MEMS_Column_U8,  1, Source_Frame80,   offsetof(mems_data_frame_80, unknown3) },
+  { "unknown4",             MEMS_Column_U8,  1, Source_Frame7d,   offsetof(mems_data_frame_7d, unknown4) },
+  { "unknown5",             MEMS_Column_U8,  1, Source_Frame7d,   offsetof(mems_data_frame_7d, unknown5) },
+  { "unknown6",             MEMS_Column_U8,  1, Source_Frame7d,   offsetof(mems_data_frame_7d, unknown6) },
+  { "unknown7",             MEMS_Column_U8,  1, Source_Frame7d,   offsetof(mems_data_frame_7d, unknown7) },
+  { "unknown8",             MEMS_Column_U8,  1, Source_Frame7d,   offsetof(mems_data_frame_7d, unknown8) },
+  { "unknown9",             MEMS_Column_U8,  1, Source_Frame7d,   offsetof(mems_data_frame_7d, unknown9) },
+  { "unknownA",             MEMS_Column_U8,  1, Source_Frame7d,   offsetof(mems_data_frame_7d, unknownA) },
+  { "unknownB",             MEMS_Column_U8,  1, Source_Frame7d,   offsetof(mems_data_frame_7d, unknownB) },
+  { "unknownC",             MEMS_Column_U8,  1, Source_Frame7d,   offsetof(mems_data_frame_7d, unknownC) },
+  { "unknownD",             MEMS_Column_U8,  1, Source_Frame7d,   offsetof(mems_data_frame_7d, unknownD) },
+  { "unknownE",             MEMS_Column_U8,  1, Source_Frame7d,   offsetof(mems_data_frame_7d, unknownE) },
+  { "unknownF",             MEMS_Column_U8,  1, Source_Frame7d,   offsetof(mems_data_frame_7d, unknownF) },
+  { "unknown10",            MEMS_Column_U8,  1, Source_Frame7d,   offsetof(mems_data_frame_7d, unknown10) }
+};
+
+/**
+ * Reads a value of the given width (in the host's byte order, which is
+ * little-endian on all supported platforms) into the low bytes of an integer.
+ */
+static uint64_t load_value(const uint8_t* p, uint8_t width)
+{
+  uint64_t value = 0;
+  memcpy(&value, p, width);
+  return value;
+}
+
+static uint8_t* put_varint(uint8_t* out, uint64_t value)
+{
+  while (value >= 0x80)
+  {
+    *out++ = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  *out++ = (uint8_t)value;
+  return out;
+}
+
+/**
+ * Reads a varint, returning NULL if it runs past the end of the buffer.
+ */
+static const uint8_t* get_varint(const uint8_t* in, const uint8_t* end, uint64_t* value)
+{
+  int shift = 0;
+
+  *value = 0;
+  while ((in < end) && (shift < 64))
+  {
+    *value |= (uint64_t)(*in & 0x7F) << shift;
+    if ((*in++ & 0x80) == 0)
+    {
+      return in;
+    }
+    shift += 7;
+  }
+
+  return NULL;
+}
+
+/**
+ * Encodes runs of equal values.
+ * @return Number of bytes written to 'out'
+ */
+static uint32_t encode_rle(const uint8_t* in, uint32_t rows, uint8_t width, uint8_t* out)
+{
+  uint8_t* start = out;
+  uint32_t row = 0;
+  uint32_t run;
+
+  while (row < rows)
+  {
+    run = 1;
+    while ((row + run < rows) && (memcmp(in + (row + run) * width, in + row * width, width) == 0))
+    {
+      run++;
+    }
+
+    out = put_varint(out, run);
+    memcpy(out, in + row * width, width);
+    out += width;
+    row += run;
+  }
+
+  return (uint32_t)(out - start);
+}
+
+/**
+ * Encodes the values as indices into a dictionary of the distinct values.
+ * @return Number of bytes written to 'out', or 0 if there are too many
+ *   distinct values
+ */
+static uint32_t encode_dictionary(const uint8_t* in, uint32_t rows, uint8_t width, uint8_t* out)
+{
+  uint64_t keys[MEMS_COLUMNAR_DICT_SLOTS];
+  int16_t slots[MEMS_COLUMNAR_DICT_SLOTS];
+  uint8_t* start = out;
+  uint8_t* indices;
+  uint64_t value;
+  uint64_t acc = 0;
+  uint32_t slot;
+  uint32_t row;
+  int count = 0;
+  int bits = 0;
+  int filled = 0;
+
+  memset(slots, 0xFF, sizeof(slots));
+
+  // the indices are written after the dictionary, which isn't complete until
+  // every row has been seen, so they are first stored one byte each in the
+  // space that the packed indices will later occupy
+  indices = out + 3 + MEMS_COLUMNAR_DICT_SIZE * width;
+
+  for (row = 0; row < rows; ++row)
+  {
+    value = load_value(in + row * width, width);
+    slot = (uint32_t)((value * 0x9E3779B97F4A7C15ULL) >> 54);
+    while ((slots[slot] >= 0) && (keys[slot] != value))
+    {
+      slot = (slot + 1) & (MEMS_COLUMNAR_DICT_SLOTS - 1);
+    }
+
+    if (slots[slot] < 0)
+    {
+      if (count == MEMS_COLUMNAR_DICT_SIZE)
+      {
+        return 0;
+      }
+      keys[slot] = value;
+      slots[slot] = (int16_t)count;
+      memcpy(out + 2 + count * width, in + row * width, width);
+      count++;
+    }
+    indices[row] = (uint8_t)slots[slot];
+  }
+
+  while ((1 << bits) < count)
+  {
+    bits++;
+  }
+
+  out[0] = (uint8_t)(count & 0xFF);
+  out[1] = (uint8_t)(count >> 8);
+  out += 2 + count * width;
+  *out++ = (uint8_t)bits;
+
+  // pack the indices, least significant bits first; the packed form never
+  // overtakes the unpacked bytes it is read from
+  for (row = 0; (bits > 0) && (row < rows); ++row)
+  {
+    acc |= (uint64_t)indices[row] << filled;
+    filled += bits;
+    while (filled >= 8)
+    {
+      *out++ = (uint8_t)acc;
+      acc >>= 8;
+      filled -= 8;
+    }
+  }
+  if (filled > 0)
+  {
+    *out++ = (uint8_t)acc;
+  }
+
+  return (uint32_t)(out - start);
+}
+
+/**
+ * Encodes the differences between successive integer values.
+ * @return Number of bytes written to 'out'
+ */
+static uint32_t encode_delta(const uint8_t* in, uint32_t rows, uint8_t width, uint8_t* out)
+{
+  uint8_t* start = out;
+  uint64_t prev = 0;
+  uint64_t value;
+  int64_t delta;
+  uint32_t row;
+
+  for (row = 0; row < rows; ++row)
+  {
+    value = load_value(in + row * width, width);
+    delta = (int64_t)(value - prev);
+    out = put_varint(out, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+    prev = value;
+  }
+
+  return (uint32_t)(out - start);
+}
+
+/**
+ * Encodes the buffered values of one column in each applicable way and
+ * writes the smallest result as the column's chunk of the current group.
+ */
+static bool write_chunk(mems_columnar_writer* writer, int column, mems_column_chunk* chunk)
+{
+  const column_def* def = &columns[column];
+  const uint8_t* best = writer->values[column];
+  uint8_t* spare;
+  uint32_t rows = writer->rows;
+  uint32_t length;
+  int encoding;
+
+  chunk->offset = writer->offset;
+  chunk->length = rows * def->width;
+  chunk->encoding = MEMS_Encoding_Plain;
+
+  for (encoding = MEMS_Encoding_RLE; encoding <= MEMS_Encoding_Delta; ++encoding)
+  {
+    // encode into whichever scratch buffer doesn't hold the best result so far
+    spare = (best == writer->scratch[0]) ? writer->scratch[1] : writer->scratch[0];
+
+    switch (encoding)
+    {
+    case MEMS_Encoding_RLE:
+      length = encode_rle(writer->values[column], rows, def->width, spare);
+      break;
+    case MEMS_Encoding_Dictionary:
+      length = encode_dictionary(writer->values[column], rows, def->width, spare);
+      break;
+    default:
+      length = (def->type != MEMS_Column_F32) ? encode_delta(writer->values[column], rows, def->width, spare) : 0;
+      break;
+    }
+
+    if ((length > 0) && (length < chunk->length))
+    {
+      best = spare;
+      chunk->length = length;
+      chunk->encoding = (uint8_t)encoding;
+    }
+  }
+
+  if (fwrite(best, chunk->length, 1, writer->fp) != 1)
+  {
+    dprintf_err("mems_columnar_append(): write failed\n");
+    return false;
+  }
+  writer->offset += chunk->length;
+
+  return true;
+}
+
+/**
+ * Writes the buffered rows as a row group and adds it to the footer.
+ */
+static bool flush_group(mems_columnar_writer* writer)
+{
+  mems_column_group* groups;
+  mems_column_chunk* chunks;
+  uint32_t allocated;
+  int column;
+
+  if (writer->rows == 0)
+  {
+    return true;
+  }
+
+  if (writer->group_count == writer->groups_allocated)
+  {
+    allocated = writer->groups_allocated * 2 + 16;
+    groups = (mems_column_group*)realloc(writer->groups, allocated * sizeof(mems_column_group));
+    if (groups)
+    {
+      writer->groups = groups;
+    }
+    chunks = (mems_column_chunk*)realloc(writer->chunks, allocated * MEMS_COLUMNAR_COLUMNS * sizeof(mems_column_chunk));
+    if (chunks)
+    {
+      writer->chunks = chunks;
+    }
+    if ((groups == NULL) || (chunks == NULL))
+    {
+      return false;
+    }
+    writer->groups_allocated = allocated;
+  }
+
+  memset(&writer->groups[writer->group_count], 0, sizeof(mems_column_group));
+  writer->groups[writer->group_count].first_row = writer->total_rows;
+  writer->groups[writer->group_count].rows = writer->rows;
+
+  chunks = &writer->chunks[writer->group_count * MEMS_COLUMNAR_COLUMNS];
+  memset(chunks, 0, MEMS_COLUMNAR_COLUMNS * sizeof(mems_column_chunk));
+  for (column = 0; column < MEMS_COLUMNAR_COLUMNS; ++column)
+  {
+    if (!write_chunk(writer, column, &chunks[column]))
+    {
+      return false;
+    }
+  }
+
+  writer->group_count++;
+  writer->total_rows += writer->rows;
+  writer->rows = 0;
+
+  return true;
+}
+
+/**
+ * Frees the buffers of a writer and closes its file.
+ */
+static void free_writer(mems_columnar_writer* writer)
+{
+  int column;
+
+  for (column = 0; column < MEMS_COLUMNAR_COLUMNS; ++column)
+  {
+    free(writer->values[column]);
+  }
+  free(writer->scratch[0]);
+  free(writer->scratch[1]);
+  free(writer->groups);
+  free(writer->chunks);
+
+  if (writer->fp)
+  {
+    fclose(writer->fp);
+  }
+
+  memset(writer, 0, sizeof(mems_columnar_writer));
+}
+
+/**
+ * Creates a columnar file and writes its header and column descriptions.
+ * @param writer Writer state to initialize
+ * @param path Path of the file to create (an existing file is replaced)
+ * @param d0_response D0 response of the ECU that was captured, or NULL if unknown
+ * @param rows_per_group Number of rows buffered and written together; 0 for
+ *   MEMS_COLUMNAR_ROWS_PER_GROUP. Larger groups compress better but take
+ *   more memory while writing.
+ * @return True if the file was created, false otherwise
+ */
+bool mems_columnar_open(mems_columnar_writer* writer, const char* path, const uint8_t* d0_response,
+                        uint32_t rows_per_group)
+{
+  mems_columnar_header header;
+  mems_column_info info[MEMS_COLUMNAR_COLUMNS];
+  bool ok = true;
+  int column;
+
+  memset(writer, 0, sizeof(mems_columnar_writer));
+  memset(&header, 0, sizeof(header));
+  memset(info, 0, sizeof(info));
+
+  writer->rows_per_group = (rows_per_group > 0) ? rows_per_group : MEMS_COLUMNAR_ROWS_PER_GROUP;
+
+  for (column = 0; column < MEMS_COLUMNAR_COLUMNS; ++column)
+  {
+    strncpy(info[column].name, columns[column].name, MEMS_COLUMN_NAME_LEN - 1);
+    info[column].type = columns[column].type;
+    info[column].width = columns[column].width;
+    ok = ok && ((writer->values[column] = (uint8_t*)malloc((size_t)writer->rows_per_group * columns[column].width)) != NULL);
+  }
+  ok = ok && ((writer->scratch[0] = (uint8_t*)malloc((size_t)writer->rows_per_group * MEMS_COLUMNAR_MAX_ROW_BYTES +
+                                                    MEMS_COLUMNAR_DICT_SIZE * 8 + 3)) != NULL);
+  ok = ok && ((writer->scratch[1] = (uint8_t*)malloc((size_t)writer->rows_per_group * MEMS_COLUMNAR_MAX_ROW_BYTES +
+                                                    MEMS_COLUMNAR_DICT_SIZE * 8 + 3)) != NULL);
+  if (!ok)
+  {
+    free_writer(writer);
+    return false;
+  }
+
+  memcpy(header.magic, MEMS_COLUMNAR_MAGIC, sizeof(header.magic));
+  header.version = MEMS_COLUMNAR_VERSION;
+  header.header_len = sizeof(header);
+  header.column_count = MEMS_COLUMNAR_COLUMNS;
+  header.rows_per_group = writer->rows_per_group;
+  if (d0_response)
+  {
+    memcpy(header.d0_response, d0_response, MEMS_D0_RESPONSE_LEN);
+  }
+
+  if ((writer->fp = fopen(path, "wb")) == NULL)
+  {
+    dprintf_err("mems_columnar_open(): could not create %s\n", path);
+    free_writer(writer);
+    return false;
+  }
+
+  if ((fwrite(&header, sizeof(header), 1, writer->fp) != 1) ||
+      (fwrite(info, sizeof(info), 1, writer->fp) != 1))
+  {
+    free_writer(writer);
+    return false;
+  }
+
+  writer->offset = sizeof(header) + sizeof(info);
+
+  return true;
+}
+
+/**
+ * Adds a row to a columnar file. Rows are buffered and written a group at a
+ * time.
+ * @param writer Writer opened with mems_columnar_open()
+ * @param timestamp_us Time of the frames relative to the start of the capture
+ * @param frame80 Raw response to the 0x80 command
+ * @param frame7d Raw response to the 0x7D command
+ * @param data Frames as decoded by mems_decode_frames()
+ * @return True if the row was added
+ */
+bool mems_columnar_append(mems_columnar_writer* writer, uint64_t timestamp_us, const mems_data_frame_80* frame80,
+                          const mems_data_frame_7d* frame7d, const mems_data* data)
+{
+  const uint8_t* sources[4];
+  const column_def* def;
+  int column;
+
+  if (writer->fp == NULL)
+  {
+    return false;
+  }
+
+  sources[Source_Timestamp] = (const uint8_t*)&timestamp_us;
+  sources[Source_Data] = (const uint8_t*)data;
+  sources[Source_Frame80] = (const uint8_t*)frame80;
+  sources[Source_Frame7d] = (const uint8_t*)frame7d;
+
+  for (column = 0; column < MEMS_COLUMNAR_COLUMNS; ++column)
+  {
+    def = &columns[column];
+    memcpy(writer->values[column] + writer->rows * def->width, sources[def->source] + def->offset, def->width);
+  }
+
+  if (++writer->rows == writer->rows_per_group)
+  {
+    return flush_group(writer);
+  }
+
+  return true;
+}
+
+/**
+ * Writes any buffered rows, the footer and the trailer, and closes the file.
+ * @return True if everything was written
+ */
+bool mems_columnar_close(mems_columnar_writer* writer)
+{
+  mems_columnar_trailer trailer;
+  uint32_t group;
+  bool ok;
+
+  if (writer->fp == NULL)
+  {
+    return false;
+  }
+
+  ok = flush_group(writer);
+
+  memset(&trailer, 0, sizeof(trailer));
+  trailer.footer_offset = writer->offset;
+  trailer.group_count = writer->group_count;
+  memcpy(trailer.magic, MEMS_COLUMNAR_MAGIC, sizeof(trailer.magic));
+
+  for (group = 0; ok && (group < writer->group_count); ++group)
+  {
+    ok = (fwrite(&writer->groups[group], sizeof(mems_column_group), 1, writer->fp) == 1) &&
+         (fwrite(&writer->chunks[group * MEMS_COLUMNAR_COLUMNS], sizeof(mems_column_chunk),
+                 MEMS_COLUMNAR_COLUMNS, writer->fp) == MEMS_COLUMNAR_COLUMNS);
+  }
+  ok = ok && (fwrite(&trailer, sizeof(trailer), 1, writer->fp) == 1);
+  ok = (fclose(writer->fp) == 0) && ok;
+  writer->fp = NULL;
+
+  free_writer(writer);
+
+  return ok;
+}
+
+/**
+ * Converts a capture file to a columnar file. The capture is mapped into
+ * memory and each pair of frames is decoded with the profile that matches
+ * the capture's D0 response; memory use is bounded by the size of a row
+ * group, however long the capture.
+ * @param capture_path Capture file to convert
+ * @param path Columnar file to create
+ * @param rows_per_group Number of rows per group; 0 for the default
+ * @param rows Receives the number of rows written; may be NULL
+ * @return True if the file was converted
+ */
+bool mems_export_columnar(const char* capture_path, const char* path, uint32_t rows_per_group, uint64_t* rows)
+{
+  mems_capture_map map;
+  mems_columnar_writer writer;
+  const mems_capture_record* record;
+  const uint8_t* payload;
+  const mems_data_frame_80* frame80;
+  const mems_data_frame_7d* frame7d;
+  const mems_profile* profile;
+  mems_data data;
+  bool ok;
+
+  if (!mems_capture_map_open(&map, capture_path))
+  {
+    return false;
+  }
+
+  if (!mems_columnar_open(&writer, path, map.header.d0_response, rows_per_group))
+  {
+    mems_capture_map_close(&map);
+    return false;
+  }
+
+  profile = mems_find_profile(map.header.d0_response);
+  ok = true;
+
+  while (ok && mems_capture_map_next(&map, &record, &payload))
+  {
+    if ((record->type != MEMS_Record_Frames) ||
+        (record->length < sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d)))
+    {
+      continue;
+    }
+
+    frame80 = (const mems_data_frame_80*)payload;
+    frame7d = (const mems_data_frame_7d*)(payload + sizeof(mems_data_frame_80));
+    mems_decode_frames(profile, frame80, frame7d, &data);
+
+    ok = mems_columnar_append(&writer, record->timestamp_us, frame80, frame7d, &data);
+  }
+
+  if (rows)
+  {
+    *rows = writer.total_rows + writer.rows;
+  }
+
+  ok = mems_columnar_close(&writer) && ok;
+  mems_capture_map_close(&map);
+
+  return ok;
+}
+
+/**
+ * Opens a columnar file and reads its column descriptions and footer.
+ * @return True if the file was opened and is a supported columnar file
+ */
+bool mems_columnar_reader_open(mems_columnar_reader* reader, const char* path)
+{
+  mems_columnar_trailer trailer;
+  uint32_t group;
+  uint32_t count;
+  bool ok;
+
+  memset(reader, 0, sizeof(mems_columnar_reader));
+
+  if ((reader->fp = fopen(path, "rb")) == NULL)
+  {
+    dprintf_err("mems_columnar_reader_open(): could not open %s\n", path);
+    return false;
+  }
+
+  ok = (fread(&reader->header, sizeof(mems_columnar_header), 1, reader->fp) == 1) &&
+       (memcmp(reader->header.magic, MEMS_COLUMNAR_MAGIC, sizeof(reader->header.magic)) == 0) &&
+       (reader->header.version == MEMS_COLUMNAR_VERSION) &&
+       (reader->header.header_len == sizeof(mems_columnar_header)) &&
+       (reader->header.column_count > 0) && (reader->header.column_count <= 256);
+
+  count = reader->header.column_count;
+  ok = ok && ((reader->columns = (mems_column_info*)malloc(count * sizeof(mems_column_info))) != NULL) &&
+       (fread(reader->columns, sizeof(mems_column_info), count, reader->fp) == count);
+
+  ok = ok && (fseek(reader->fp, -(long)sizeof(trailer), SEEK_END) == 0) &&
+       (fread(&trailer, sizeof(trailer), 1, reader->fp) == 1) &&
+       (memcmp(trailer.magic, MEMS_COLUMNAR_MAGIC, sizeof(trailer.magic)) == 0) &&
+       (fseek(reader->fp, (long)trailer.footer_offset, SEEK_SET) == 0);
+
+  if (ok && (trailer.group_count > 0))
+  {
+    reader->group_count = trailer.group_count;
+    ok = ((reader->groups = (mems_column_group*)malloc(trailer.group_count * sizeof(mems_column_group))) != NULL) &&
+         ((reader->chunks = (mems_column_chunk*)malloc((size_t)trailer.group_count * count *
+                                                        sizeof(mems_column_chunk))) != NULL);
+
+    for (group = 0; ok && (group < trailer.group_count); ++group)
+    {
+      ok = (fread(&reader->groups[group], sizeof(mems_column_group), 1, reader->fp) == 1) &&
+           (fread(&reader->chunks[group * count], sizeof(mems_column_chunk), count, reader->fp) == count) &&
+           (reader->groups[group].rows <= reader->header.rows_per_group);
+    }
+  }
+
+  if (!ok)
+  {
+    dprintf_err("mems_columnar_reader_open(): %s is not a valid columnar file\n", path);
+    mems_columnar_reader_close(reader);
+  }
+
+  return ok;
+}
+
+/**
+ * Returns the index of the column with the given name, or -1 if there is none.
+ */
+int mems_columnar_find_column(const mems_columnar_reader* reader, const char* name)
+{
+  uint32_t column;
+
+  for (column = 0; column < reader->header.column_count; ++column)
+  {
+    if (strncmp(reader->columns[column].name, name, MEMS_COLUMN_NAME_LEN) == 0)
+    {
+      return (int)column;
+    }
+  }
+
+  return -1;
+}
+
+/**
+ * Decodes a chunk into one value per row.
+ */
+static bool decode_chunk(const uint8_t* in, uint32_t length, uint8_t encoding, uint32_t rows,
+                         uint8_t width, uint8_t* out)
+{
+  const uint8_t* end = in + length;
+  const uint8_t* dict;
+  uint64_t run;
+  uint64_t value;
+  uint64_t acc = 0;
+  uint32_t row = 0;
+  uint32_t count;
+  uint32_t idx;
+  int bits;
+  int filled = 0;
+
+  switch (encoding)
+  {
+  case MEMS_Encoding_Plain:
+    if (length != rows * width)
+    {
+      return false;
+    }
+    memcpy(out, in, length);
+    return true;
+
+  case MEMS_Encoding_RLE:
+    while (row < rows)
+    {
+      if (((in = get_varint(in, end, &run)) == NULL) || (run == 0) || (run > rows - row) || (in + width > end))
+      {
+        return false;
+      }
+      for (; run > 0; --run, ++row)
+      {
+        memcpy(out + row * width, in, width);
+      }
+      in += width;
+    }
+    return true;
+
+  case MEMS_Encoding_Dictionary:
+    if (length < 3)
+    {
+      return false;
+    }
+    count = in[0] | (in[1] << 8);
+    dict = in + 2;
+    if ((count == 0) || (count > MEMS_COLUMNAR_DICT_SIZE) || (length < 3 + count * width))
+    {
+      return false;
+    }
+    in += 2 + count * width;
+    bits = *in++;
+    if ((bits > 8) || ((uint64_t)(end - in) * 8 < (uint64_t)rows * bits))
+    {
+      return false;
+    }
+    for (row = 0; row < rows; ++row)
+    {
+      while (filled < bits)
+      {
+        acc |= (uint64_t)(*in++) << filled;
+        filled += 8;
+      }
+      idx = (uint32_t)(acc & ((1u << bits) - 1));
+      acc >>= bits;
+      filled -= bits;
+      if (idx >= count)
+      {
+        return false;
+      }
+      memcpy(out + row * width, dict + idx * width, width);
+    }
+    return true;
+
+  case MEMS_Encoding_Delta:
+    value = 0;
+    for (row = 0; row < rows; ++row)
+    {
+      if ((in = get_varint(in, end, &run)) == NULL)
+      {
+        return false;
+      }
+      value += (run >> 1) ^ (0 - (run & 1));
+      memcpy(out + row * width, &value, width);
+    }
+    return true;
+
+  default:
+    return false;
+  }
+}
+
+/**
+ * Reads and decodes the values of one column in one row group. Only that
+ * column's chunk is read from the file.
+ * @param reader Reader opened with mems_columnar_reader_open()
+ * @param group Index of the row group
+ * @param column Index of the column (see mems_columnar_find_column())
+ * @param values Receives groups[group].rows values of the column's type
+ * @return True if the values were read
+ */
+bool mems_columnar_read(mems_columnar_reader* reader, uint32_t group, uint32_t column, void* values)
+{
+  const mems_column_chunk* chunk;
+  uint8_t* grown;
+
+  if ((reader->fp == NULL) || (group >= reader->group_count) || (column >= reader->header.column_count))
+  {
+    return false;
+  }
+
+  chunk = &reader->chunks[group * reader->header.column_count + column];
+
+  if (chunk->length > reader->buffer_len)
+  {
+    if ((grown = (uint8_t*)realloc(reader->buffer, chunk->length)) == NULL)
+    {
+      return false;
+    }
+    reader->buffer = grown;
+    reader->buffer_len = chunk->length;
+  }
+
+  if ((fseek(reader->fp, (long)chunk->offset, SEEK_SET) != 0) ||
+      ((chunk->length > 0) && (fread(reader->buffer, chunk->length, 1, reader->fp) != 1)))
+  {
+    return false;
+  }
+
+  return decode_chunk(reader->buffer, chunk->length, chunk->encoding, reader->groups[group].rows,
+                      reader->columns[column].width, (uint8_t*)values);
+}
+
+/**
+ * Closes a columnar file and frees the reader's buffers.
+ */
+void mems_columnar_reader_close(mems_columnar_reader* reader)
+{
+  if (reader->fp)
+  {
+    fclose(reader->fp);
+  }
+  free(reader->columns);
+  free(reader->groups);
+  free(reader->chunks);
+  free(reader->buffer);
+
+  memset(reader, 0, sizeof(mems_columnar_reader));
+}
@@ -0,0 +1,211 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// faults.c: This file contains the fault decoder, which maps each set
+//           trouble code bit to the fault it indicates for the ECU's
+//           variant, both for single frames and over whole captures.
+
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * Descriptions of the faults, indexed by mems_fault.
+ */
+static const mems_fault_info fault_info[MEMS_Fault_Count] = {
+  {  0, "undocumented",         "Undocumented trouble code" },
+  {  1, "coolant_sensor",       "Coolant temperature sensor circuit fault" },
+  {  2, "air_temp_sensor",      "Inlet air temperature sensor circuit fault" },
+  { 10, "fuel_pump_circuit",    "Fuel pump circuit fault" },
+  { 16, "throttle_pot_circuit", "Throttle potentiometer circuit fault" }
+};
+
+/**
+ * Returns the description of a fault. Out-of-range values are described as
+ * undocumented.
+ */
+const mems_fault_info* mems_fault_description(enum mems_fault fault)
+{
+  return &fault_info[((fault >= 0) && (fault < MEMS_Fault_Count)) ? fault : MEMS_Fault_Undocumented];
+}
+
+/**
+ * Gathers the trouble code bytes of a pair of frames into a single bitmap,
+ * with bit MEMS_DTC_BIT(byte, bit) set for each set bit.
+ */
+uint64_t mems_dtc_bits(const mems_data_frame_80* frame80, const mems_data_frame_7d* frame7d)
+{
+  return ((uint64_t)frame80->dtc0) |
+         ((uint64_t)frame80->dtc1 << 8) |
+         ((uint64_t)frame7d->dtc2 << 16) |
+         ((uint64_t)frame7d->dtc3 << 24) |
+         ((uint64_t)frame7d->dtc4 << 32);
+}
+
+/**
+ * Expands a bitmap of trouble code bits into a list of the faults they
+ * indicate. Only the set bits are visited, lowest first.
+ * @param profile Variant profile that maps the bits to faults
+ * @param bits Bitmap as returned by mems_dtc_bits()
+ * @param faults Receives one entry per set bit; must have room for
+ *   MEMS_DTC_BITS entries
+ * @return Number of entries placed in the list
+ */
+int mems_expand_faults(const mems_profile* profile, uint64_t bits, mems_active_fault* faults)
+{
+  int count = 0;
+  int bit;
+
+  while (bits != 0)
+  {
+    bit = __builtin_ctzll(bits);
+    bits &= bits - 1;
+
+    faults[count].bit = (uint8_t)bit;
+    faults[count].fault = profile->faults[bit];
+    count++;
+  }
+
+  return count;
+}
+
+/**
+ * Decodes the faults indicated by the trouble code bytes of a pair of frames.
+ * @param profile Variant profile that maps the bits to faults
+ * @param frame80 Raw response to the 0x80 command
+ * @param frame7d Raw response to the 0x7D command
+ * @param faults Receives the active faults; must have room for MEMS_DTC_BITS entries
+ * @return Number of active faults
+ */
+int mems_decode_faults(const mems_profile* profile, const mems_data_frame_80* frame80,
+                       const mems_data_frame_7d* frame7d, mems_active_fault* faults)
+{
+  return mems_expand_faults(profile, mems_dtc_bits(frame80, frame7d), faults);
+}
+
+/**
+ * Reports each bit in a bitmap of changed trouble code bits to the callback
+ * and updates the per-bit statistics.
+ */
+static void report_changes(mems_fault_summary* summary, uint64_t changed, uint64_t bits,
+                           uint64_t timestamp_us, uint64_t frame, mems_fault_callback callback,
+                           void* context)
+{
+  mems_active_fault fault;
+  mems_fault_stats* stats;
+  bool active;
+  int bit;
+
+  while (changed != 0)
+  {
+    bit = __builtin_ctzll(changed);
+    changed &= changed - 1;
+
+    stats = &summary->bits[bit];
+    active = (bits >> bit) & 1;
+
+    // while a bit is set, 'frames' holds the frame at which its current run
+    // started minus the frames counted in earlier runs; subtracting it from
+    // the frame at which the run ends yields the new total. This way a run
+    // costs nothing until it ends.
+    stats->frames = frame - stats->frames;
+    if (active)
+    {
+      if (stats->onsets == 0)
+      {
+        stats->first_us = timestamp_us;
+      }
+      stats->onsets++;
+    }
+
+    if (callback)
+    {
+      fault.bit = (uint8_t)bit;
+      fault.fault = summary->profile->faults[bit];
+      callback(&fault, active, timestamp_us, context);
+    }
+  }
+}
+
+/**
+ * Scans a capture file for faults. The file is mapped into memory and each
+ * frame's trouble code bytes are gathered into a bitmap that is compared
+ * with the previous one, so that only changes (which are rare) cost more
+ * than a few loads. The bits are mapped to faults using the profile that
+ * matches the D0 response stored in the capture.
+ * @param path Capture file to scan
+ * @param summary Receives the number of frames in which each bit was set,
+ *   and when it was first and last seen
+ * @param callback Function called whenever a bit is set or cleared; may be NULL
+ * @param context Passed through to the callback
+ * @return True if the file was read
+ */
+bool mems_scan_capture_faults(const char* path, mems_fault_summary* summary,
+                              mems_fault_callback callback, void* context)
+{
+  mems_capture_map map;
+  const mems_capture_record* record;
+  const uint8_t* payload;
+  const mems_data_frame_80* frame80;
+  const mems_data_frame_7d* frame7d;
+  uint64_t bits;
+  uint64_t prev = 0;
+  uint64_t prev_us = 0;
+  uint64_t open;
+  int bit;
+
+  memset(summary, 0, sizeof(mems_fault_summary));
+
+  if (!mems_capture_map_open(&map, path))
+  {
+    return false;
+  }
+
+  summary->profile = mems_find_profile(map.header.d0_response);
+
+  while (mems_capture_map_next(&map, &record, &payload))
+  {
+    if ((record->type != MEMS_Record_Frames) ||
+        (record->length < sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d)))
+    {
+      continue;
+    }
+
+    frame80 = (const mems_data_frame_80*)payload;
+    frame7d = (const mems_data_frame_7d*)(payload + sizeof(mems_data_frame_80));
+    bits = mems_dtc_bits(frame80, frame7d);
+
+    if (bits != prev)
+    {
+      // bits that have just cleared were last seen in the previous frame
+      open = prev & ~bits;
+      while (open != 0)
+      {
+        bit = __builtin_ctzll(open);
+        open &= open - 1;
+        summary->bits[bit].last_us = prev_us;
+      }
+
+      report_changes(summary, bits ^ prev, bits, record->timestamp_us, summary->frames, callback, context);
+      summary->seen |= bits;
+      prev = bits;
+    }
+
+    prev_us = record->timestamp_us;
+    summary->frames++;
+  }
+
+  // close the runs of the bits still set at the end of the capture
+  open = prev;
+  while (open != 0)
+  {
+    bit = __builtin_ctzll(open);
+    open &= open - 1;
+    summary->bits[bit].frames = summary->frames - summary->bits[bit].frames;
+    summary->bits[bit].last_us = prev_us;
+  }
+
+  mems_capture_map_close(&map);
+
+  return true;
+}
@@ -0,0 +1,274 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// iac.c: This file contains the closed-loop positioning of the idle air
+//        control valve, which adapts the rate at which step commands are
+//        sent to the rate at which the valve actually responds, and a
+//        sweep that records the valve's response to every step.
+
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Spacing tried first when the valve fails to advance with no spacing at all
+#define IAC_SPACING_INITIAL_US 1000
+//! Upper bound on the spacing between step commands
+#define IAC_SPACING_MAX_US     100000
+//! Number of consecutive advancing steps after which a shorter spacing is tried
+#define IAC_SPEEDUP_AFTER      4
+//! Number of consecutive non-advancing steps after which the move is abandoned
+#define IAC_MAX_STALLS         40
+//! Upper bound on the number of step commands sent in a single move
+#define IAC_MAX_COMMANDS       600
+//! Number of times a move may overshoot and reverse before it is abandoned
+#define IAC_MAX_REVERSALS      4
+
+/**
+ * Sends a single open or close command, no sooner than the given spacing
+ * after the previous one. The caller must hold the connection lock.
+ * @param info State information for the current connection
+ * @param cmd MEMS_OpenIAC or MEMS_CloseIAC
+ * @param spacing_us Minimum time since the previous command completed
+ * @param last_us Completion time of the previous command; updated on return
+ * @param step Receives the command, the position returned and the latency
+ * @return True if the ECU acknowledged the command
+ */
+static bool iac_step(mems_info* info, actuator_cmd cmd, uint32_t spacing_us,
+                     uint64_t* last_us, mems_iac_step* step)
+{
+  uint64_t sent_us = mems_monotonic_us();
+  bool ok;
+
+  if (sent_us < *last_us + spacing_us)
+  {
+    mems_sleep_us(*last_us + spacing_us - sent_us);
+    sent_us = mems_monotonic_us();
+  }
+
+  memset(step, 0, sizeof(mems_iac_step));
+  step->command = cmd;
+
+  ok = mems_command_with_byte(info, cmd, &step->position);
+  *last_us = mems_monotonic_us();
+  step->latency_us = *last_us - sent_us;
+
+  return ok;
+}
+
+/**
+ * Repeatedly sends commands to open or close the idle air control valve
+ * until it reaches the desired position. The valve does not necessarily move
+ * one full step per serial command, depending on the rate at which the
+ * commands are issued, so the spacing between commands is adjusted as the
+ * move progresses: it is lengthened when a command fails to advance the
+ * valve and shortened again after a run of successful steps. The spacing
+ * that was in effect at the end of the move is remembered in the mems_info
+ * and used as the starting point for the next move.
+ *
+ * The connection is held for the whole move, so other threads' requests
+ * are not interleaved with the step commands.
+ * @param info State information for the current connection
+ * @param desired_pos Target position (0 to IAC_MAXIMUM; larger values are
+ *   clamped to IAC_MAXIMUM)
+ * @param result Receives statistics about the move; may be NULL
+ * @return True if the valve reached the (clamped) desired position
+ */
+bool mems_move_iac_ex(mems_info* info, uint8_t desired_pos, mems_iac_result* result)
+{
+  mems_iac_result res;
+  mems_iac_step step;
+  uint8_t current_pos = 0;
+  uint8_t target = (desired_pos > IAC_MAXIMUM) ? IAC_MAXIMUM : desired_pos;
+  uint8_t advancing = 0;
+  uint8_t stalled = 0;
+  uint8_t reversals = 0;
+  uint64_t start_us;
+  uint64_t last_us;
+  uint32_t spacing;
+  actuator_cmd cmd;
+  actuator_cmd prev_cmd = MEMS_OpenIAC;
+  bool have_prev = false;
+  bool ok;
+
+  memset(&res, 0, sizeof(res));
+
+  if (!mems_lock(info))
+  {
+    return false;
+  }
+
+  start_us = mems_monotonic_us();
+  spacing = info->iac_spacing_us;
+
+  // read the current IAC position, and only take action
+  // if we're not already at the desired point
+  ok = mems_command_with_byte(info, MEMS_GetIACPosition, &current_pos);
+  last_us = mems_monotonic_us();
+
+  while (ok && (current_pos != target) &&
+         (res.commands < IAC_MAX_COMMANDS) && (stalled < IAC_MAX_STALLS) &&
+         (reversals < IAC_MAX_REVERSALS))
+  {
+    cmd = (target > current_pos) ? MEMS_OpenIAC : MEMS_CloseIAC;
+    if (have_prev && (cmd != prev_cmd))
+    {
+      // the valve moves more than one position per command and overshot
+      reversals++;
+    }
+    prev_cmd = cmd;
+    have_prev = true;
+    ok = iac_step(info, cmd, spacing, &last_us, &step);
+    res.commands++;
+
+    if (!ok)
+    {
+      break;
+    }
+
+    if (((cmd == MEMS_OpenIAC) && (step.position > current_pos)) ||
+        ((cmd == MEMS_CloseIAC) && (step.position < current_pos)))
+    {
+      stalled = 0;
+      if (++advancing >= IAC_SPEEDUP_AFTER)
+      {
+        // the valve is keeping up; see whether it can go faster
+        advancing = 0;
+        spacing = (spacing * 3) / 4;
+        if (spacing < IAC_SPACING_INITIAL_US)
+        {
+          spacing = 0;
+        }
+      }
+    }
+    else
+    {
+      // the command was acknowledged but the valve didn't move; give it longer
+      advancing = 0;
+      stalled++;
+      res.stalls++;
+      spacing = (spacing == 0) ? IAC_SPACING_INITIAL_US : (spacing * 2);
+      if (spacing > IAC_SPACING_MAX_US)
+      {
+        spacing = IAC_SPACING_MAX_US;
+      }
+    }
+
+    current_pos = step.position;
+  }
+
+  info->iac_spacing_us = spacing;
+  mems_unlock(info);
+
+  res.reached = ok && (current_pos == target);
+  res.final_pos = current_pos;
+  res.spacing_us = spacing;
+  res.elapsed_us = mems_monotonic_us() - start_us;
+
+  if (result)
+  {
+    *result = res;
+  }
+
+  return res.reached;
+}
+
+/**
+ * Drives the valve in one direction until it reaches the given end of its
+ * travel or stops responding, reporting every step to the callback.
+ * @return True if the valve reached the end position
+ */
+static bool iac_sweep_leg(mems_info* info, actuator_cmd cmd, uint8_t end_pos, uint32_t spacing_us,
+                          uint64_t* last_us, uint8_t* pos, mems_iac_step_callback callback,
+                          void* context, mems_iac_result* res)
+{
+  mems_iac_step step;
+  uint8_t stalled = 0;
+
+  while ((*pos != end_pos) && (stalled < IAC_MAX_STALLS) && (res->commands < IAC_MAX_COMMANDS * 2))
+  {
+    if (!iac_step(info, cmd, spacing_us, last_us, &step))
+    {
+      return false;
+    }
+
+    res->commands++;
+    if (callback)
+    {
+      callback(&step, *last_us, context);
+    }
+
+    if (step.position == *pos)
+    {
+      stalled++;
+      res->stalls++;
+    }
+    else
+    {
+      stalled = 0;
+    }
+    *pos = step.position;
+  }
+
+  return (*pos == end_pos);
+}
+
+/**
+ * Characterizes the idle air control valve by driving it fully closed, then
+ * open to IAC_MAXIMUM, then closed again, with a fixed spacing between step
+ * commands. The response to every command is passed to the callback along
+ * with the time at which it was received, so that the step curve can be
+ * recorded (e.g. with mems_capture_iac_callback()). A leg of the sweep is
+ * abandoned if the valve stops advancing, so a sticky valve shows up as a
+ * run of stalled steps in the curve and an unreached end position.
+ *
+ * The connection is held for the whole sweep.
+ * @param info State information for the current connection
+ * @param spacing_us Time between the completion of one command and the
+ *   sending of the next, in microseconds
+ * @param callback Function called for each step; may be NULL
+ * @param context Passed through to the callback
+ * @param result Receives statistics about the sweep; may be NULL
+ * @return True if the valve reached both ends of its travel
+ */
+bool mems_iac_sweep(mems_info* info, uint32_t spacing_us, mems_iac_step_callback callback,
+                    void* context, mems_iac_result* result)
+{
+  mems_iac_result res;
+  uint8_t pos = 0;
+  uint64_t start_us;
+  uint64_t last_us;
+
+  memset(&res, 0, sizeof(res));
+
+  if (!mems_lock(info))
+  {
+    return false;
+  }
+
+  start_us = mems_monotonic_us();
+
+  if (mems_command_with_byte(info, MEMS_GetIACPosition, &pos))
+  {
+    last_us = mems_monotonic_us();
+
+    res.reached = iac_sweep_leg(info, MEMS_CloseIAC, 0, spacing_us, &last_us, &pos,
+                                callback, context, &res) &&
+                  iac_sweep_leg(info, MEMS_OpenIAC, IAC_MAXIMUM, spacing_us, &last_us, &pos,
+                                callback, context, &res) &&
+                  iac_sweep_leg(info, MEMS_CloseIAC, 0, spacing_us, &last_us, &pos,
+                                callback, context, &res);
+  }
+
+  mems_unlock(info);
+
+  res.final_pos = pos;
+  res.spacing_us = spacing_us;
+  res.elapsed_us = mems_monotonic_us() - start_us;
+
+  if (result)
+  {
+    *result = res;
+  }
+
+  return res.reached;
+}
@@ -0,0 +1,345 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// index.c: This file contains the session indexer, which summarizes
+//          capture files into small sidecar files so that queries over
+//          a fleet's logs need not read the frames themselves.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Longest capture path for which an index path can be formed
+#define MEMS_INDEX_PATH_LEN 1024
+
+/**
+ * Records the interval of a trouble code bit that has just cleared (or is
+ * still set at the end of the capture).
+ */
+static void close_interval(mems_session_index* index, const mems_profile* profile, int bit,
+                           uint64_t start_us, uint64_t end_us)
+{
+  mems_fault_interval* interval;
+
+  if (index->fault_interval_count >= MEMS_INDEX_MAX_FAULT_INTERVALS)
+  {
+    index->fault_intervals_dropped++;
+    return;
+  }
+
+  interval = &index->fault_intervals[index->fault_interval_count++];
+  interval->bit = (uint8_t)bit;
+  interval->fault = profile->faults[bit];
+  interval->start_us = start_us;
+  interval->end_us = end_us;
+}
+
+/**
+ * Reads a capture file from start to end and summarizes it. Each frame is
+ * decoded with the profile that matches the capture's D0 response.
+ * @param path Capture file to summarize
+ * @param index Receives the summary
+ * @return True if the file was read
+ */
+bool mems_index_capture(const char* path, mems_session_index* index)
+{
+  mems_capture_map map;
+  const mems_capture_record* record;
+  const uint8_t* payload;
+  const mems_data_frame_80* frame80;
+  const mems_data_frame_7d* frame7d;
+  const mems_profile* profile;
+  mems_data data;
+  mems_channel_summary* ch;
+  double sums[MEMS_Field_Count];
+  uint64_t fault_start_us[MEMS_DTC_BITS];
+  uint64_t bits;
+  uint64_t prev_bits = 0;
+  uint64_t prev_us = 0;
+  uint64_t changed;
+  uint8_t prev_closed_loop = 0;
+  uint32_t bin;
+  float value;
+  int field;
+  int bit;
+
+  memset(index, 0, sizeof(mems_session_index));
+  memset(sums, 0, sizeof(sums));
+
+  if (!mems_capture_map_open(&map, path))
+  {
+    return false;
+  }
+
+  memcpy(index->magic, MEMS_INDEX_MAGIC, sizeof(index->magic));
+  index->version = MEMS_INDEX_VERSION;
+  index->length = sizeof(mems_session_index);
+  memcpy(index->d0_response, map.header.d0_response, MEMS_D0_RESPONSE_LEN);
+
+  profile = mems_find_profile(map.header.d0_response);
+  strncpy(index->profile, profile->name, MEMS_PROFILE_NAME_LEN - 1);
+
+  while (mems_capture_map_next(&map, &record, &payload))
+  {
+    if ((record->type != MEMS_Record_Frames) ||
+        (record->length < sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d)))
+    {
+      continue;
+    }
+
+    frame80 = (const mems_data_frame_80*)payload;
+    frame7d = (const mems_data_frame_7d*)(payload + sizeof(mems_data_frame_80));
+    mems_decode_frames(profile, frame80, frame7d, &data);
+
+    if (index->frames == 0)
+    {
+      index->start_us = record->timestamp_us;
+    }
+    else if (prev_closed_loop)
+    {
+      // the time up to this frame is credited to the state of the previous one
+      index->closed_loop_us += record->timestamp_us - prev_us;
+    }
+
+    for (field = 0; field < MEMS_Field_Count; ++field)
+    {
+      ch = &index->channels[field];
+      value = mems_field_value(&data, (enum mems_field)field);
+      if ((index->frames == 0) || (value < ch->min))
+      {
+        ch->min = value;
+      }
+      if ((index->frames == 0) || (value > ch->max))
+      {
+        ch->max = value;
+      }
+      sums[field] += value;
+    }
+
+    bin = data.engine_rpm / MEMS_INDEX_RPM_BIN_WIDTH;
+    index->rpm_histogram[(bin < MEMS_INDEX_RPM_BINS) ? bin : (MEMS_INDEX_RPM_BINS - 1)]++;
+
+    bits = mems_dtc_bits(frame80, frame7d);
+    if (bits != prev_bits)
+    {
+      changed = bits ^ prev_bits;
+      while (changed != 0)
+      {
+        bit = __builtin_ctzll(changed);
+        changed &= changed - 1;
+
+        if (bits & (1ULL << bit))
+        {
+          fault_start_us[bit] = record->timestamp_us;
+        }
+        else
+        {
+          close_interval(index, profile, bit, fault_start_us[bit], prev_us);
+        }
+      }
+      prev_bits = bits;
+    }
+
+    prev_closed_loop = data.closed_loop;
+    prev_us = record->timestamp_us;
+    index->frames++;
+  }
+
+  while (prev_bits != 0)
+  {
+    bit = __builtin_ctzll(prev_bits);
+    prev_bits &= prev_bits - 1;
+    close_interval(index, profile, bit, fault_start_us[bit], prev_us);
+  }
+
+  index->end_us = prev_us;
+  for (field = 0; (index->frames > 0) && (field < MEMS_Field_Count); ++field)
+  {
+    index->channels[field].mean = (float)(sums[field] / index->frames);
+  }
+
+  mems_capture_map_close(&map);
+
+  return true;
+}
+
+/**
+ * Writes a session index to a file.
+ * @return True if the file was written
+ */
+bool mems_write_index(const mems_session_index* index, const char* path)
+{
+  FILE* fp;
+  bool ok;
+
+  if ((fp = fopen(path, "wb")) == NULL)
+  {
+    dprintf_err("mems_write_index(): could not create %s\n", path);
+    return false;
+  }
+
+  ok = (fwrite(index, sizeof(mems_session_index), 1, fp) == 1);
+  ok = (fclose(fp) == 0) && ok;
+
+  return ok;
+}
+
+/**
+ * Reads a session index written by mems_write_index().
+ * @return True if the file was read and is a supported index
+ */
+bool mems_read_index(mems_session_index* index, const char* path)
+{
+  FILE* fp;
+  bool ok;
+
+  if ((fp = fopen(path, "rb")) == NULL)
+  {
+    return false;
+  }
+
+  ok = (fread(index, sizeof(mems_session_index), 1, fp) == 1) &&
+       (memcmp(index->magic, MEMS_INDEX_MAGIC, sizeof(index->magic)) == 0) &&
+       (index->version == MEMS_INDEX_VERSION) &&
+       (index->length == sizeof(mems_session_index));
+
+  fclose(fp);
+
+  return ok;
+}
+
+/**
+ * Shared state of the workers of mems_index_files().
+ */
+typedef struct
+{
+  const char* const* paths;
+  int count;
+  //! Index of the next file to be claimed by a worker
+  int next;
+  //! Number of files indexed successfully
+  int indexed;
+  mems_index_callback callback;
+  void* context;
+#if !defined(WIN32)
+  //! Serializes the callbacks
+  pthread_mutex_t mutex;
+#endif
+} index_job;
+
+/**
+ * Indexes files until none are left. Each worker claims the next file in
+ * turn, so a long file does not hold up the others.
+ */
+static void* index_worker(void* arg)
+{
+  index_job* job = (index_job*)arg;
+  mems_session_index* index;
+  char sidecar[MEMS_INDEX_PATH_LEN];
+  bool ok;
+  int idx;
+
+  if ((index = (mems_session_index*)malloc(sizeof(mems_session_index))) == NULL)
+  {
+    return NULL;
+  }
+
+  while ((idx = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->count)
+  {
+    ok = (strlen(job->paths[idx]) + sizeof(MEMS_INDEX_SUFFIX) <= sizeof(sidecar)) &&
+         mems_index_capture(job->paths[idx], index);
+    if (ok)
+    {
+      strcpy(sidecar, job->paths[idx]);
+      strcat(sidecar, MEMS_INDEX_SUFFIX);
+      ok = mems_write_index(index, sidecar);
+    }
+
+#if !defined(WIN32)
+    pthread_mutex_lock(&job->mutex);
+#endif
+    if (ok)
+    {
+      job->indexed++;
+    }
+    if (job->callback)
+    {
+      job->callback(job->paths[idx], index, ok, job->context);
+    }
+#if !defined(WIN32)
+    pthread_mutex_unlock(&job->mutex);
+#endif
+  }
+
+  free(index);
+
+  return NULL;
+}
+
+/**
+ * Indexes a set of capture files in parallel, one file per worker thread at
+ * a time, writing each summary beside its capture with MEMS_INDEX_SUFFIX
+ * appended to the name. On Win32, the files are indexed one after another.
+ * @param paths Capture files to index
+ * @param count Number of capture files
+ * @param threads Number of worker threads; 0 for one per file (at most 64)
+ * @param callback Function called as each file is finished; may be NULL
+ * @param context Passed through to the callback
+ * @return Number of files indexed successfully
+ */
+int mems_index_files(const char* const* paths, int count, int threads,
+                     mems_index_callback callback, void* context)
+{
+  index_job job;
+#if !defined(WIN32)
+  pthread_t workers[64];
+  int started = 0;
+  int idx;
+#endif
+
+  memset(&job, 0, sizeof(job));
+  job.paths = paths;
+  job.count = count;
+  job.callback = callback;
+  job.context = context;
+
+#if !defined(WIN32)
+  if ((threads <= 0) || (threads > count))
+  {
+    threads = count;
+  }
+  if (threads > (int)(sizeof(workers) / sizeof(workers[0])))
+  {
+    threads = sizeof(workers) / sizeof(workers[0]);
+  }
+
+  pthread_mutex_init(&job.mutex, NULL);
+
+  for (idx = 0; idx < threads; ++idx)
+  {
+    if (pthread_create(&workers[started], NULL, index_worker, &job) == 0)
+    {
+      started++;
+    }
+  }
+
+  // if no thread could be started, do the work here
+  if (started == 0)
+  {
+    index_worker(&job);
+  }
+
+  for (idx = 0; idx < started; ++idx)
+  {
+    pthread_join(workers[idx], NULL);
+  }
+
+  pthread_mutex_destroy(&job.mutex);
+#else
+  index_worker(&job);
+#endif
+
+  return job.indexed;
+}
@@ -0,0 +1,182 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// lengths.c: This file contains a table of response lengths learned
+//            while exchanging arbitrary commands with the ECU, which
+//            lets a command be answered with a single read of the
+//            right size instead of waiting for the line to go quiet.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+#define MEMS_LENGTH_LINE_LEN 64
+
+//! Time to wait for bytes beyond a learned length, in ms (several
+//! character times at 9600 baud)
+#define MEMS_LENGTH_TRAILING_MS 5
+
+/**
+ * Marks every command's response length as unknown.
+ */
+void mems_length_table_init(mems_length_table* table)
+{
+  int idx;
+
+  for (idx = 0; idx < 256; ++idx)
+  {
+    table->length[idx] = MEMS_LENGTH_UNKNOWN;
+  }
+  table->modified = false;
+}
+
+/**
+ * Merges the response lengths stored in a file into the table. Each line of
+ * the file holds a command byte (hex) and its total response length
+ * (decimal); lines starting with '#' are ignored.
+ * @return True if the file was read, false if it could not be opened or
+ *   contained an invalid line
+ */
+bool mems_length_table_load(mems_length_table* table, const char* path)
+{
+  FILE* fp;
+  char line[MEMS_LENGTH_LINE_LEN];
+  unsigned int cmd;
+  unsigned int len;
+  bool ok = true;
+
+  if ((fp = fopen(path, "r")) == NULL)
+  {
+    dprintf_err("mems_length_table_load(): could not open %s\n", path);
+    return false;
+  }
+
+  while (ok && (fgets(line, sizeof(line), fp) != NULL))
+  {
+    if ((line[0] == '#') || (strspn(line, " \t\r\n") == strlen(line)))
+    {
+      continue;
+    }
+
+    if ((sscanf(line, "%x %u", &cmd, &len) == 2) && (cmd <= 0xFF) && (len > 0) && (len <= INT16_MAX))
+    {
+      table->length[cmd] = (int16_t)len;
+    }
+    else
+    {
+      ok = false;
+    }
+  }
+
+  fclose(fp);
+  table->modified = false;
+
+  return ok;
+}
+
+/**
+ * Writes the known response lengths to a file that can be read back with
+ * mems_length_table_load().
+ * @return True if the file was written
+ */
+bool mems_length_table_save(mems_length_table* table, const char* path)
+{
+  FILE* fp;
+  int idx;
+  bool ok = true;
+
+  if ((fp = fopen(path, "w")) == NULL)
+  {
+    dprintf_err("mems_length_table_save(): could not create %s\n", path);
+    return false;
+  }
+
+  fprintf(fp, "# librosco response lengths: <command> <bytes including echo>\n");
+  for (idx = 0; idx < 256; ++idx)
+  {
+    if (table->length[idx] != MEMS_LENGTH_UNKNOWN)
+    {
+      fprintf(fp, "%02X %d\n", idx, table->length[idx]);
+    }
+  }
+
+  ok = (fclose(fp) == 0);
+  if (ok)
+  {
+    table->modified = false;
+  }
+
+  return ok;
+}
+
+/**
+ * Sends an arbitrary command byte and reads the response. If the length of
+ * the command's response is in the table, exactly that many bytes are read,
+ * so the call returns as soon as the response is complete. Otherwise the
+ * response is read until the line goes quiet and its length is recorded in
+ * the table for the next time, provided that it starts with the echo of the
+ * command. An entry is forgotten if the response turns out to be shorter or
+ * longer than recorded; any bytes still arriving are read until the line
+ * goes quiet, so that they aren't taken for part of the next response.
+ * @param info State information for the current connection
+ * @param table Learned response lengths; updated as responses are seen
+ * @param cmd Command byte to send
+ * @param response Receives the response, including the echo
+ * @param max_length Size of the response buffer
+ * @return Number of bytes received, or -1 if the command could not be sent
+ */
+int16_t mems_command_learned(mems_info* info, mems_length_table* table, uint8_t cmd,
+                             uint8_t* response, uint16_t max_length)
+{
+  int16_t known = table->length[cmd];
+  int16_t got = -1;
+  int16_t more;
+
+  if ((max_length == 0) || !mems_lock(info))
+  {
+    return -1;
+  }
+
+  // discard anything that trickled in late after the previous command
+  while (mems_transport_read(info, response, max_length, 0) > 0)
+  {
+  }
+
+  if (mems_write_serial(info, &cmd, 1) == 1)
+  {
+    if ((known != MEMS_LENGTH_UNKNOWN) && (known <= max_length))
+    {
+      got = mems_read_serial(info, response, known);
+      if ((got == known) && (got < max_length) &&
+          ((more = mems_transport_read(info, response + got, max_length - got, MEMS_LENGTH_TRAILING_MS)) > 0))
+      {
+        got += more;
+        if (got < max_length)
+        {
+          got += mems_read_serial(info, response + got, max_length - got);
+        }
+      }
+
+      if ((got != known) || (response[0] != cmd))
+      {
+        table->length[cmd] = MEMS_LENGTH_UNKNOWN;
+        table->modified = true;
+      }
+    }
+    else
+    {
+      got = mems_read_serial(info, response, max_length);
+      if ((got > 0) && (got < max_length) && (response[0] == cmd))
+      {
+        table->length[cmd] = got;
+        table->modified = true;
+      }
+    }
+  }
+
+  mems_unlock(info);
+
+  return got;
+}
@@ -0,0 +1,285 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// memory.c: This file contains routines that read blocks of the ECU's
+//           memory, pipelining several read requests per exchange so
+//           that a dump runs close to the line rate.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Upper bound on the bytes exchanged in one batch of pipelined requests
+#define MEMS_MEMORY_BATCH_BYTES 4096
+//! Longest memory protocol specification accepted
+#define MEMS_MEMORY_SPEC_LEN 128
+
+/**
+ * Parses a memory protocol specification of the form
+ * "addr=<cmd>:<bytes>,read=<cmd>,block=<n>[,inc][,depth=<n>]", where the
+ * command bytes are in hex. The pipeline depth defaults to 8.
+ * @return True if the specification was complete and valid
+ */
+bool mems_parse_memory_protocol(const char* spec, mems_memory_protocol* protocol)
+{
+  char copy[MEMS_MEMORY_SPEC_LEN];
+  char* token;
+  unsigned int cmd;
+  unsigned int val;
+  bool have_addr = false;
+  bool have_read = false;
+
+  memset(protocol, 0, sizeof(mems_memory_protocol));
+  protocol->pipeline_depth = 8;
+
+  if (strlen(spec) >= sizeof(copy))
+  {
+    return false;
+  }
+  strcpy(copy, spec);
+
+  for (token = strtok(copy, ","); token != NULL; token = strtok(NULL, ","))
+  {
+    if ((sscanf(token, "addr=%x:%u", &cmd, &val) == 2) && (cmd <= 0xFF) && (val >= 1) && (val <= 4))
+    {
+      protocol->address_cmd = cmd;
+      protocol->address_len = val;
+      have_addr = true;
+    }
+    else if ((sscanf(token, "read=%x", &cmd) == 1) && (cmd <= 0xFF))
+    {
+      protocol->read_cmd = cmd;
+      have_read = true;
+    }
+    else if ((sscanf(token, "block=%u", &val) == 1) && (val >= 1) && (val <= MEMS_MAX_MEMORY_BLOCK))
+    {
+      protocol->block_len = val;
+    }
+    else if ((sscanf(token, "depth=%u", &val) == 1) && (val >= 1) && (val <= 255))
+    {
+      protocol->pipeline_depth = val;
+    }
+    else if (strcmp(token, "inc") == 0)
+    {
+      protocol->auto_increment = true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  return have_addr && have_read && (protocol->block_len > 0) &&
+         (protocol->address_cmd != protocol->read_cmd);
+}
+
+/**
+ * Updates a CRC-32 (as used by zlib and PNG) with more data. Start with a
+ * CRC of 0.
+ */
+uint32_t mems_crc32(uint32_t crc, const uint8_t* data, size_t length)
+{
+  static uint32_t table[256];
+  static bool table_ready = false;
+  uint32_t c;
+  int n;
+  int k;
+
+  if (!table_ready)
+  {
+    for (n = 0; n < 256; ++n)
+    {
+      c = (uint32_t)n;
+      for (k = 0; k < 8; ++k)
+      {
+        c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+      }
+      table[n] = c;
+    }
+    table_ready = true;
+  }
+
+  crc = ~crc;
+  while (length-- > 0)
+  {
+    crc = table[(crc ^ *data++) & 0xFF] ^ (crc >> 8);
+  }
+
+  return ~crc;
+}
+
+/**
+ * Sets up the progress of a memory read that has not started yet.
+ */
+void mems_memory_progress_init(mems_memory_progress* progress, uint32_t start, uint32_t length)
+{
+  memset(progress, 0, sizeof(mems_memory_progress));
+  progress->start = start;
+  progress->length = length;
+}
+
+/**
+ * Appends the bytes that select an address to a request.
+ * @return Number of bytes appended
+ */
+static uint16_t append_address(const mems_memory_protocol* protocol, uint32_t address, uint8_t* out)
+{
+  uint16_t len = 0;
+  int shift;
+
+  out[len++] = protocol->address_cmd;
+  for (shift = (protocol->address_len - 1) * 8; shift >= 0; shift -= 8)
+  {
+    out[len++] = (uint8_t)(address >> shift);
+  }
+
+  return len;
+}
+
+/**
+ * Reads a range of the ECU's memory. Several read requests (each with its
+ * address, unless the ECU advances its address on its own) are written in
+ * one go and their responses collected with a single read of the total
+ * expected length, so the link is never left idle waiting for a round trip
+ * per block. Each echo is checked, and the CRC-32 of the data is kept up
+ * to date in the progress structure.
+ *
+ * If the read fails part way, the progress records how far it got, and
+ * calling this function again with the same progress and buffer resumes
+ * from that point.
+ * @param info State information for the current connection
+ * @param protocol Commands with which the ECU's memory is read
+ * @param progress Range to read and progress so far; see mems_memory_progress_init()
+ * @param buffer Receives the data; must hold progress->length bytes, with
+ *   buffer[0] corresponding to progress->start
+ * @param callback Function called after each batch; may be NULL
+ * @param context Passed through to the callback
+ * @return True if the whole range has been read
+ */
+bool mems_read_memory(mems_info* info, const mems_memory_protocol* protocol, mems_memory_progress* progress,
+                      uint8_t* buffer, mems_memory_callback callback, void* context)
+{
+  uint16_t address_bytes = 1 + protocol->address_len;
+  uint16_t request_len = address_bytes + 1;
+  uint16_t max_depth = MEMS_MEMORY_BATCH_BYTES / (request_len + protocol->block_len);
+  uint8_t* request;
+  uint8_t* response;
+  const uint8_t* tx;
+  const uint8_t* rx;
+  uint32_t remaining_blocks;
+  uint32_t address;
+  uint32_t take;
+  uint16_t depth;
+  uint16_t tx_len;
+  uint16_t rx_len;
+  uint16_t echo_len;
+  uint16_t idx;
+  bool need_address = true;
+  bool with_address;
+  bool ok = true;
+
+  if ((protocol->block_len == 0) || (protocol->block_len > MEMS_MAX_MEMORY_BLOCK) ||
+      (protocol->address_len < 1) || (protocol->address_len > 4))
+  {
+    return false;
+  }
+
+  if (max_depth < 1)
+  {
+    max_depth = 1;
+  }
+  if ((protocol->pipeline_depth > 0) && (protocol->pipeline_depth < max_depth))
+  {
+    max_depth = protocol->pipeline_depth;
+  }
+
+  request = (uint8_t*)malloc(max_depth * request_len);
+  response = (uint8_t*)malloc(max_depth * (request_len + protocol->block_len));
+
+  if ((request == NULL) || (response == NULL) || !mems_lock(info))
+  {
+    free(request);
+    free(response);
+    return false;
+  }
+
+  while (ok && (progress->done < progress->length))
+  {
+    remaining_blocks = (progress->length - progress->done + protocol->block_len - 1) / protocol->block_len;
+    depth = (remaining_blocks < max_depth) ? remaining_blocks : max_depth;
+
+    // build the batch of requests, and the length of their combined responses
+    with_address = need_address;
+    tx_len = 0;
+    rx_len = 0;
+    for (idx = 0; idx < depth; ++idx)
+    {
+      address = progress->start + progress->done + (idx * protocol->block_len);
+      if (!protocol->auto_increment || ((idx == 0) && with_address))
+      {
+        tx_len += append_address(protocol, address, request + tx_len);
+        rx_len += address_bytes;
+      }
+      request[tx_len++] = protocol->read_cmd;
+      rx_len += 1 + protocol->block_len;
+    }
+
+    // discard whatever is left of the responses to an earlier batch that
+    // was cut short, which would otherwise be taken for this batch's echoes
+    while (mems_transport_read(info, response, rx_len, 0) > 0)
+    {
+    }
+
+    if ((mems_write_serial(info, request, tx_len) != tx_len) ||
+        (mems_read_serial(info, response, rx_len) != rx_len))
+    {
+      dprintf_err("mems_read_memory(): no complete response at address %08X\n",
+                  progress->start + progress->done);
+      ok = false;
+      break;
+    }
+    need_address = false;
+
+    // walk the responses, checking the echoes and taking the data that
+    // follows each read command
+    tx = request;
+    rx = response;
+    for (idx = 0; ok && (idx < depth); ++idx)
+    {
+      echo_len = (!protocol->auto_increment || ((idx == 0) && with_address)) ? (address_bytes + 1) : 1;
+      if (memcmp(rx, tx, echo_len) != 0)
+      {
+        dprintf_err("mems_read_memory(): bad echo at address %08X\n", progress->start + progress->done);
+        ok = false;
+        break;
+      }
+      tx += echo_len;
+      rx += echo_len;
+
+      take = progress->length - progress->done;
+      if (take > protocol->block_len)
+      {
+        take = protocol->block_len;
+      }
+
+      memcpy(buffer + progress->done, rx, take);
+      progress->crc32 = mems_crc32(progress->crc32, rx, take);
+      progress->done += take;
+      rx += protocol->block_len;
+    }
+
+    if (callback)
+    {
+      callback(progress, buffer, context);
+    }
+  }
+
+  mems_unlock(info);
+
+  free(request);
+  free(response);
+
+  return ok && (progress->done == progress->length);
+}
@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include <libgen.h>
+#include "rosco.h"
+
+static volatile sig_atomic_t quit = 0;
+
+static void handle_signal(int sig)
+{
+  (void)sig;
+  quit = 1;
+}
+
+//! Size of the memory image that is simulated when none is given
+#define DEFAULT_IMAGE_SIZE 16384
+
+/**
+ * Loads the memory image to be served, or makes up a recognizable one if
+ * no file was given.
+ */
+static uint8_t* load_image(const char* path, uint32_t* size)
+{
+  FILE* fp;
+  uint8_t* image;
+  long len;
+  uint32_t idx;
+
+  if (path == NULL)
+  {
+    if ((image = (uint8_t*)malloc(DEFAULT_IMAGE_SIZE)) != NULL)
+    {
+      for (idx = 0; idx < DEFAULT_IMAGE_SIZE; ++idx)
+      {
+        image[idx] = (uint8_t)((idx * 7) ^ (idx >> 8));
+      }
+      *size = DEFAULT_IMAGE_SIZE;
+    }
+    return image;
+  }
+
+  if ((fp = fopen(path, "rb")) == NULL)
+  {
+    return NULL;
+  }
+
+  fseek(fp, 0, SEEK_END);
+  len = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+
+  image = (len > 0) ? (uint8_t*)malloc(len) : NULL;
+  if (image && (fread(image, len, 1, fp) != 1))
+  {
+    free(image);
+    image = NULL;
+  }
+  fclose(fp);
+
+  *size = len;
+  return image;
+}
+
+int main(int argc, char** argv)
+{
+  mems_sim sim;
+  mems_connection_options options;
+  const char* memory_spec = NULL;
+  const char* image_path = NULL;
+  uint8_t* image = NULL;
+  int opt;
+
+  mems_sim_init(&sim);
+  mems_default_connection_options(&options);
+
+  while ((opt = getopt(argc, argv, "b:d:s:g:M:r:h")) != -1)
+  {
+    switch (opt)
+    {
+    case 'b':
+      options.baud = strtoul(optarg, NULL, 0);
+      break;
+    case 'd':
+      sim.response_delay_us = strtoul(optarg, NULL, 0);
+      break;
+    case 's':
+      sim.iac_steps_per_cmd = strtoul(optarg, NULL, 0);
+      break;
+    case 'g':
+      sim.iac_min_spacing_us = strtoul(optarg, NULL, 0);
+      break;
+    case 'M':
+      memory_spec = optarg;
+      break;
+    case 'r':
+      image_path = optarg;
+      break;
+    default:
+      printf("ECU simulator for testing librosco front-ends without a car\n");
+      printf("Usage: %s [-b baud] [-d response-delay-us] [-s iac-steps] [-g iac-gap-us]\n"
+             "       [-M memory-protocol [-r image]]\n", basename(argv[0]));
+      printf(" Responses are paced at the given line rate (default %u).\n", MEMS_DEFAULT_BAUD);
+      printf(" The simulated IAC valve moves iac-steps positions per command (default 1),\n");
+      printf(" and ignores commands that arrive less than iac-gap-us after the last move.\n");
+      printf(" With -M (e.g. addr=A0:2,read=A1,block=64,inc), memory reads are answered\n");
+      printf(" from the image file, or from a generated %u-byte image.\n", DEFAULT_IMAGE_SIZE);
+      return 0;
+    }
+  }
+
+  if (memory_spec)
+  {
+    if (!mems_parse_memory_protocol(memory_spec, &sim.memory_protocol))
+    {
+      printf("Error: invalid memory protocol (%s).\n", memory_spec);
+      return -1;
+    }
+    if ((image = load_image(image_path, &sim.memory_size)) == NULL)
+    {
+      printf("Error: could not load memory image.\n");
+      return -1;
+    }
+    sim.memory = image;
+  }
+
+  if (!mems_sim_start_pty(&sim, &options))
+  {
+    printf("Error: could not start simulator.\n");
+    return -1;
+  }
+
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+
+  printf("%s\n", sim.device_path);
+  fflush(stdout);
+
+  while (!quit)
+  {
+    pause();
+  }
+
+  mems_sim_stop(&sim);
+  free(image);
+
+  return 0;
+}
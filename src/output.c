@@ -0,0 +1,413 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// output.c: This file contains routines that write decoded samples to a
+//           stream as CSV, JSON lines, or capture records, formatting
+//           them without printf() and writing them a block at a time.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Number of digits written after the decimal point of fractional fields
+#define MEMS_OUTPUT_DECIMALS 3
+//! Largest magnitude written; larger values (and NaN) are written as this
+#define MEMS_OUTPUT_MAX_VALUE 1e12f
+
+static const char* format_names[] = { "csv", "jsonl", "binary" };
+
+//! Pairs of decimal digits, for converting two digits at a time
+static const char digit_pairs[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+/**
+ * Returns true if a field's decoded value may have a fractional part, in
+ * which case it is written with MEMS_OUTPUT_DECIMALS digits after the point.
+ */
+static bool field_is_fractional(int field)
+{
+  return (field == MEMS_Field_MAP) ||
+         (field == MEMS_Field_BatteryVoltage) ||
+         (field == MEMS_Field_ThrottlePot) ||
+         (field == MEMS_Field_IgnitionAdvance) ||
+         (field == MEMS_Field_CoilTime);
+}
+
+/**
+ * Writes an unsigned integer in decimal.
+ * @return Pointer just past the last digit
+ */
+static char* put_uint(char* p, uint64_t value)
+{
+  char digits[20];
+  char* d = digits + sizeof(digits);
+  size_t len;
+
+  while (value >= 100)
+  {
+    d -= 2;
+    memcpy(d, digit_pairs + (value % 100) * 2, 2);
+    value /= 100;
+  }
+  if (value >= 10)
+  {
+    d -= 2;
+    memcpy(d, digit_pairs + value * 2, 2);
+  }
+  else
+  {
+    *--d = (char)('0' + value);
+  }
+
+  len = digits + sizeof(digits) - d;
+  memcpy(p, d, len);
+
+  return p + len;
+}
+
+/**
+ * Writes a decoded value, with a fixed number of decimal places if the field
+ * is fractional and as an integer otherwise.
+ */
+static char* put_value(char* p, int field, float value)
+{
+  uint64_t scaled;
+  uint64_t whole;
+  uint64_t frac;
+  int digit;
+
+  if (value < 0.0f)
+  {
+    *p++ = '-';
+    value = -value;
+  }
+
+  // keeps the scaled value (and the length of the sample) within bounds
+  if (!(value < MEMS_OUTPUT_MAX_VALUE))
+  {
+    value = MEMS_OUTPUT_MAX_VALUE;
+  }
+
+  if (!field_is_fractional(field))
+  {
+    return put_uint(p, (uint64_t)(value + 0.5f));
+  }
+
+  scaled = (uint64_t)((double)value * 1000.0 + 0.5);
+  whole = scaled / 1000;
+  frac = scaled % 1000;
+
+  p = put_uint(p, whole);
+  *p++ = '.';
+  for (digit = MEMS_OUTPUT_DECIMALS - 1; digit >= 0; --digit)
+  {
+    p[digit] = (char)('0' + (frac % 10));
+    frac /= 10;
+  }
+
+  return p + MEMS_OUTPUT_DECIMALS;
+}
+
+static char* put_string(char* p, const char* str)
+{
+  size_t len = strlen(str);
+  memcpy(p, str, len);
+  return p + len;
+}
+
+/**
+ * Formats the line that precedes the samples: the column names for CSV,
+ * or the capture header for binary output.
+ * @return Number of bytes written to the buffer
+ */
+static uint32_t format_header(enum mems_output_format format, const uint8_t* d0_response,
+                              bool device_column, const mems_clock_anchor* anchor, char* buffer)
+{
+  mems_capture_header header;
+  char* p = buffer;
+  int field;
+
+  switch (format)
+  {
+  case MEMS_Format_CSV:
+    p = put_string(p, device_column ? "device,timestamp_us,request_us,seq" : "timestamp_us,request_us,seq");
+    for (field = 0; field < MEMS_Field_Count; ++field)
+    {
+      *p++ = ',';
+      p = put_string(p, mems_field_name((enum mems_field)field));
+    }
+    p = put_string(p, ",fault_codes\n");
+    break;
+
+  case MEMS_Format_Binary:
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MEMS_CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = MEMS_CAPTURE_VERSION;
+    header.header_len = sizeof(header);
+    if (d0_response)
+    {
+      memcpy(header.d0_response, d0_response, MEMS_D0_RESPONSE_LEN);
+    }
+    header.anchor = *anchor;
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    break;
+
+  default:
+    break;
+  }
+
+  return (uint32_t)(p - buffer);
+}
+
+/**
+ * Formats a sample, labelled with its device if the output has a device
+ * column. The time of the request is placed before the sample's timestamp
+ * by the frame's own request-to-response latency.
+ * @return Number of bytes written to the buffer (at most
+ *   MEMS_OUTPUT_MAX_SAMPLE_LEN)
+ */
+static uint32_t format_sample(const mems_output* output, uint8_t device, const mems_frame* frame,
+                              uint64_t timestamp_us, char* buffer)
+{
+  mems_capture_record record;
+  mems_capture_frame_times times;
+  uint64_t latency = frame->response_us - frame->request_us;
+  uint64_t request_us = (latency < timestamp_us) ? (timestamp_us - latency) : 0;
+  char* p = buffer;
+  int field;
+
+  switch (output->format)
+  {
+  case MEMS_Format_CSV:
+    if (output->device_column)
+    {
+      p = put_uint(p, device);
+      *p++ = ',';
+    }
+    p = put_uint(p, timestamp_us);
+    *p++ = ',';
+    p = put_uint(p, request_us);
+    *p++ = ',';
+    p = put_uint(p, frame->seq);
+    for (field = 0; field < MEMS_Field_Count; ++field)
+    {
+      *p++ = ',';
+      p = put_value(p, field, mems_field_value(&frame->data, (enum mems_field)field));
+    }
+    *p++ = ',';
+    p = put_uint(p, frame->data.fault_codes);
+    *p++ = '\n';
+    break;
+
+  case MEMS_Format_JSONL:
+    if (output->device_column)
+    {
+      p = put_string(p, "{\"device\":");
+      p = put_uint(p, device);
+      p = put_string(p, ",\"timestamp_us\":");
+    }
+    else
+    {
+      p = put_string(p, "{\"timestamp_us\":");
+    }
+    p = put_uint(p, timestamp_us);
+    p = put_string(p, ",\"request_us\":");
+    p = put_uint(p, request_us);
+    p = put_string(p, ",\"seq\":");
+    p = put_uint(p, frame->seq);
+    for (field = 0; field < MEMS_Field_Count; ++field)
+    {
+      p = put_string(p, ",\"");
+      p = put_string(p, mems_field_name((enum mems_field)field));
+      p = put_string(p, "\":");
+      p = put_value(p, field, mems_field_value(&frame->data, (enum mems_field)field));
+    }
+    p = put_string(p, ",\"fault_codes\":");
+    p = put_uint(p, frame->data.fault_codes);
+    p = put_string(p, "}\n");
+    break;
+
+  case MEMS_Format_Binary:
+    memset(&record, 0, sizeof(record));
+    record.type = MEMS_Record_Frames;
+    record.length = sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d) + sizeof(times);
+    record.timestamp_us = timestamp_us;
+    times.request_us = request_us;
+    memcpy(p, &record, sizeof(record));
+    p += sizeof(record);
+    memcpy(p, &frame->frame80, sizeof(mems_data_frame_80));
+    p += sizeof(mems_data_frame_80);
+    memcpy(p, &frame->frame7d, sizeof(mems_data_frame_7d));
+    p += sizeof(mems_data_frame_7d);
+    memcpy(p, &times, sizeof(times));
+    p += sizeof(times);
+    break;
+
+  default:
+    break;
+  }
+
+  return (uint32_t)(p - buffer);
+}
+
+/**
+ * Looks up an output format by name ("csv", "jsonl" or "binary").
+ * @return True if the name was recognized
+ */
+bool mems_parse_output_format(const char* name, enum mems_output_format* format)
+{
+  int idx;
+
+  for (idx = MEMS_Format_CSV; idx <= MEMS_Format_Binary; ++idx)
+  {
+    if (strcmp(name, format_names[idx]) == 0)
+    {
+      *format = (enum mems_output_format)idx;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/**
+ * Prepares to write samples to a stream, and buffers the header (if any)
+ * of the chosen format.
+ * @param output Output state to initialize
+ * @param fp Stream to write to, e.g. stdout
+ * @param format One of the mems_output_format values
+ * @param flush_interval_ms Longest time a sample may wait in the buffer, in
+ *   ms; 0 to write only when the buffer fills or is flushed
+ * @param d0_response D0 response of the ECU, stored in the header of binary
+ *   output; may be NULL
+ * @param device_column If true, each sample is labelled with the index of
+ *   the device that produced it. Binary output can't be labelled, as it is
+ *   read back as a capture file of a single ECU.
+ * @return True if the format is supported
+ */
+bool mems_output_open(mems_output* output, FILE* fp, enum mems_output_format format,
+                      uint32_t flush_interval_ms, const uint8_t* d0_response, bool device_column)
+{
+  mems_clock_anchor anchor;
+
+  memset(output, 0, sizeof(mems_output));
+
+  if ((format < MEMS_Format_CSV) || (format > MEMS_Format_Binary) ||
+      ((format == MEMS_Format_Binary) && device_column))
+  {
+    return false;
+  }
+
+  output->fp = fp;
+  output->format = (uint8_t)format;
+  output->flush_interval_ms = flush_interval_ms;
+  output->device_column = device_column;
+  mems_clock_anchor_now(&anchor);
+  output->start_us = anchor.monotonic_us;
+  output->last_flush_us = output->start_us;
+  output->used = format_header(format, d0_response, device_column, &anchor, output->buffer);
+
+  return true;
+}
+
+/**
+ * Writes the buffered output to the stream.
+ * @return True if everything was written
+ */
+bool mems_output_flush(mems_output* output)
+{
+  bool ok = true;
+
+  if (output->fp == NULL)
+  {
+    return false;
+  }
+
+  if (output->used > 0)
+  {
+    ok = (fwrite(output->buffer, output->used, 1, output->fp) == 1);
+    output->used = 0;
+  }
+  ok = (fflush(output->fp) == 0) && ok;
+  output->last_flush_us = mems_monotonic_us();
+
+  return ok;
+}
+
+/**
+ * Adds a sample to the output. The buffer is written first if the sample
+ * might not fit, and afterwards if the flush interval has passed.
+ * @param output Output opened with mems_output_open()
+ * @param device Index of the device that produced the sample
+ * @param frame Sample to write
+ * @param timestamp_us Time of the sample relative to the start of the output
+ * @return True unless writing to the stream failed
+ */
+bool mems_output_device_frame(mems_output* output, uint8_t device, const mems_frame* frame,
+                              uint64_t timestamp_us)
+{
+  if (output->fp == NULL)
+  {
+    return false;
+  }
+
+  if ((output->used + MEMS_OUTPUT_MAX_SAMPLE_LEN > sizeof(output->buffer)) && !mems_output_flush(output))
+  {
+    return false;
+  }
+
+  output->used += format_sample(output, device, frame, timestamp_us, output->buffer + output->used);
+  output->samples++;
+
+  if ((output->flush_interval_ms > 0) &&
+      (mems_monotonic_us() >= output->last_flush_us + output->flush_interval_ms * 1000ULL))
+  {
+    return mems_output_flush(output);
+  }
+
+  return true;
+}
+
+/**
+ * Adds a sample from a single device to the output.
+ */
+bool mems_output_frame(mems_output* output, const mems_frame* frame, uint64_t timestamp_us)
+{
+  return mems_output_device_frame(output, 0, frame, timestamp_us);
+}
+
+/**
+ * Frame ring subscriber that adds each acquired frame to an output stream,
+ * timestamped with the time its response arrived. Register with
+ * mems_ring_subscribe(), passing the mems_output as the context.
+ */
+void mems_output_frame_callback(const mems_frame* frame, void* output)
+{
+  mems_output* out = (mems_output*)output;
+
+  mems_output_frame(out, frame, (frame->response_us > out->start_us) ? (frame->response_us - out->start_us) : 0);
+}
+
+/**
+ * Writes any buffered output. The stream itself is left open.
+ * @return True if everything was written
+ */
+bool mems_output_close(mems_output* output)
+{
+  bool ok = mems_output_flush(output);
+
+  output->fp = NULL;
+
+  return ok;
+}
@@ -0,0 +1,314 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// poll.c: This file contains the multi-device poller, which samples
+//         several ECUs concurrently and merges their samples into a
+//         single stream ordered by one monotonic clock.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * Samples of one device that are waiting to be merged, and the state of
+ * the thread that acquires them.
+ */
+typedef struct
+{
+  mems_info* info;
+  mems_device_sample queue[MEMS_POLL_QUEUE_LEN];
+  //! Number of samples added to and taken from the queue
+  uint32_t added;
+  uint32_t taken;
+  //! Time at which the device's current read began. Its next sample can't
+  //! have an earlier timestamp, so samples of other devices up to this time
+  //! may be merged without waiting for it.
+  uint64_t watermark_us;
+  //! Set when the device has no more samples to give
+  bool done;
+} poll_device;
+
+typedef struct
+{
+  poll_device devices[MEMS_MAX_DEVICES];
+  int count;
+  uint32_t samples_per_device;
+  uint64_t start_us;
+  //! Set when the callback asks to stop
+  bool stop;
+#if !defined(WIN32)
+  pthread_mutex_t mutex;
+  //! Signalled whenever a queue, watermark or 'done' flag changes
+  pthread_cond_t changed;
+#endif
+} poll_job;
+
+typedef struct
+{
+  poll_job* job;
+  int device;
+} poll_worker;
+
+/**
+ * Reads a sample from a device and labels it with the device and the time
+ * at which its response arrived.
+ * @return True if the sample was read
+ */
+static bool acquire(poll_job* job, int device, uint32_t seq, mems_device_sample* sample)
+{
+  poll_device* dev = &job->devices[device];
+  mems_info* info = dev->info;
+  uint64_t timestamp_us;
+
+  if (!mems_read_raw(info, &sample->frame.frame80, &sample->frame.frame7d))
+  {
+    return false;
+  }
+
+  // a transport may supply recorded response times (e.g. replay), so the
+  // timestamp is kept from going back past the start of polling or of the
+  // read, on which the merge relies
+  timestamp_us = (info->last_response_us > job->start_us) ? (info->last_response_us - job->start_us) : 0;
+  sample->timestamp_us = (timestamp_us > dev->watermark_us) ? timestamp_us : dev->watermark_us;
+  sample->device = (uint8_t)device;
+  sample->frame.seq = seq;
+  sample->frame.request_us = info->last_request_us;
+  sample->frame.response_us = info->last_response_us;
+  mems_decode_frames(info->profile ? info->profile : mems_default_profile(),
+                     &sample->frame.frame80, &sample->frame.frame7d, &sample->frame.data);
+
+  return true;
+}
+
+#if !defined(WIN32)
+/**
+ * Reads samples from one device into its queue until the requested number
+ * of reads have been made or polling is stopped. A full queue holds up the
+ * reads until the merger has caught up.
+ */
+static void* poll_worker_main(void* arg)
+{
+  poll_worker* self = (poll_worker*)arg;
+  poll_job* job = self->job;
+  poll_device* dev = &job->devices[self->device];
+  mems_device_sample sample;
+  uint32_t reads = 0;
+  uint32_t seq = 0;
+
+  while ((job->samples_per_device == 0) || (reads < job->samples_per_device))
+  {
+    pthread_mutex_lock(&job->mutex);
+    while (!job->stop && (dev->added - dev->taken == MEMS_POLL_QUEUE_LEN))
+    {
+      pthread_cond_wait(&job->changed, &job->mutex);
+    }
+    if (job->stop)
+    {
+      pthread_mutex_unlock(&job->mutex);
+      break;
+    }
+    dev->watermark_us = mems_monotonic_us() - job->start_us;
+    pthread_cond_broadcast(&job->changed);
+    pthread_mutex_unlock(&job->mutex);
+
+    reads++;
+    if (acquire(job, self->device, seq, &sample))
+    {
+      seq++;
+      pthread_mutex_lock(&job->mutex);
+      dev->queue[dev->added % MEMS_POLL_QUEUE_LEN] = sample;
+      dev->added++;
+      pthread_cond_broadcast(&job->changed);
+      pthread_mutex_unlock(&job->mutex);
+    }
+  }
+
+  pthread_mutex_lock(&job->mutex);
+  dev->done = true;
+  pthread_cond_broadcast(&job->changed);
+  pthread_mutex_unlock(&job->mutex);
+
+  return NULL;
+}
+
+/**
+ * Finds the sample that comes next in the merged stream. This is the
+ * earliest of the samples at the heads of the queues (the lowest device
+ * index breaks ties), provided that every device with an empty queue is
+ * either finished or has begun a read after that sample's time.
+ * @return Index of the device whose head sample is next, -1 if a device
+ *   must be waited for, or -2 if every device is finished and drained
+ */
+static int next_device(const poll_job* job)
+{
+  const poll_device* dev;
+  const mems_device_sample* head;
+  int best = -1;
+  bool pending = false;
+  int device;
+
+  for (device = 0; device < job->count; ++device)
+  {
+    dev = &job->devices[device];
+    if (dev->added != dev->taken)
+    {
+      head = &dev->queue[dev->taken % MEMS_POLL_QUEUE_LEN];
+      if ((best < 0) ||
+          (head->timestamp_us < job->devices[best].queue[job->devices[best].taken % MEMS_POLL_QUEUE_LEN].timestamp_us))
+      {
+        best = device;
+      }
+    }
+    else if (!dev->done)
+    {
+      pending = true;
+    }
+  }
+
+  if (best < 0)
+  {
+    return pending ? -1 : -2;
+  }
+
+  head = &job->devices[best].queue[job->devices[best].taken % MEMS_POLL_QUEUE_LEN];
+  for (device = 0; device < job->count; ++device)
+  {
+    dev = &job->devices[device];
+    if ((dev->added == dev->taken) && !dev->done && (dev->watermark_us < head->timestamp_us))
+    {
+      return -1;
+    }
+  }
+
+  return best;
+}
+#endif
+
+/**
+ * Samples several ECUs concurrently and delivers their samples as a single
+ * stream, ordered by the time at which each was received. One thread reads
+ * from each device, so a slow or unresponsive device doesn't hold up the
+ * others' reads; all samples are timestamped with the same monotonic clock.
+ * The samples are merged as a k-way merge of the per-device queues: a
+ * sample is delivered once no other device can still produce an earlier
+ * one. On Win32, the devices are read in turn from the calling thread.
+ * @param devices Connected devices whose links have been initialized (see
+ *   mems_init_link())
+ * @param count Number of devices (at most MEMS_MAX_DEVICES)
+ * @param samples_per_device Number of reads to make from each device; 0 to
+ *   read until the callback returns false
+ * @param callback Function called with each sample
+ * @param context Passed through to the callback
+ * @return True if at least one sample was delivered
+ */
+bool mems_poll_devices(mems_info* const* devices, int count, uint32_t samples_per_device,
+                       mems_device_sample_callback callback, void* context)
+{
+  poll_job* job;
+  mems_device_sample sample;
+  uint64_t delivered = 0;
+  int device;
+#if !defined(WIN32)
+  poll_worker workers[MEMS_MAX_DEVICES];
+  pthread_t ids[MEMS_MAX_DEVICES];
+  bool started[MEMS_MAX_DEVICES];
+  poll_device* dev;
+  int next;
+#else
+  uint32_t reads;
+  uint32_t seq[MEMS_MAX_DEVICES];
+#endif
+
+  if ((count < 1) || (count > MEMS_MAX_DEVICES) ||
+      ((job = (poll_job*)calloc(1, sizeof(poll_job))) == NULL))
+  {
+    return false;
+  }
+
+  job->count = count;
+  job->samples_per_device = samples_per_device;
+  job->start_us = mems_monotonic_us();
+  for (device = 0; device < count; ++device)
+  {
+    job->devices[device].info = devices[device];
+  }
+
+#if !defined(WIN32)
+  pthread_mutex_init(&job->mutex, NULL);
+  pthread_cond_init(&job->changed, NULL);
+
+  for (device = 0; device < count; ++device)
+  {
+    workers[device].job = job;
+    workers[device].device = device;
+    started[device] = (pthread_create(&ids[device], NULL, poll_worker_main, &workers[device]) == 0);
+    if (!started[device])
+    {
+      job->devices[device].done = true;
+    }
+  }
+
+  pthread_mutex_lock(&job->mutex);
+  while (!job->stop)
+  {
+    if ((next = next_device(job)) == -2)
+    {
+      break;
+    }
+    if (next < 0)
+    {
+      pthread_cond_wait(&job->changed, &job->mutex);
+      continue;
+    }
+
+    dev = &job->devices[next];
+    sample = dev->queue[dev->taken % MEMS_POLL_QUEUE_LEN];
+    dev->taken++;
+    pthread_cond_broadcast(&job->changed);
+    pthread_mutex_unlock(&job->mutex);
+
+    delivered++;
+    if (!callback(&sample, context))
+    {
+      pthread_mutex_lock(&job->mutex);
+      job->stop = true;
+      pthread_cond_broadcast(&job->changed);
+      break;
+    }
+
+    pthread_mutex_lock(&job->mutex);
+  }
+  pthread_mutex_unlock(&job->mutex);
+
+  for (device = 0; device < count; ++device)
+  {
+    if (started[device])
+    {
+      pthread_join(ids[device], NULL);
+    }
+  }
+
+  pthread_cond_destroy(&job->changed);
+  pthread_mutex_destroy(&job->mutex);
+#else
+  // reading the devices in turn yields samples already in time order
+  memset(seq, 0, sizeof(seq));
+  for (reads = 0; !job->stop && ((samples_per_device == 0) || (reads < samples_per_device)); ++reads)
+  {
+    for (device = 0; !job->stop && (device < count); ++device)
+    {
+      if (acquire(job, device, seq[device], &sample))
+      {
+        seq[device]++;
+        delivered++;
+        job->stop = !callback(&sample, context);
+      }
+    }
+  }
+#endif
+
+  free(job);
+
+  return (delivered > 0);
+}
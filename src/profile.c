@@ -0,0 +1,575 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// profile.c: This file contains the registry of ECU variant profiles,
+//            which are selected by the response to the D0 command and
+//            describe the layout of the data frames for that variant.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+#define MEMS_PROFILE_LINE_LEN 256
+
+/**
+ * Names used for the decoded fields in profile files, indexed by mems_field.
+ */
+static const char* field_names[MEMS_Field_Count] = {
+  "engine_rpm",
+  "coolant_temp",
+  "ambient_temp",
+  "intake_air_temp",
+  "fuel_temp",
+  "map_kpa",
+  "battery_voltage",
+  "throttle_pot",
+  "idle_switch",
+  "park_neutral_switch",
+  "iac_position",
+  "idle_error",
+  "ignition_advance",
+  "coil_time",
+  "lambda_voltage",
+  "fuel_trim",
+  "closed_loop",
+  "idle_base_pos"
+};
+
+/**
+ * Faults indicated by the trouble code bits on the MEMS 1.6; the other
+ * bits are undocumented.
+ */
+#define MEMS_1_6_FAULTS {                                          \
+    [MEMS_DTC_BIT(0, 0)] = MEMS_Fault_CoolantSensor,              \
+    [MEMS_DTC_BIT(0, 1)] = MEMS_Fault_AirTempSensor,              \
+    [MEMS_DTC_BIT(1, 1)] = MEMS_Fault_FuelPumpCircuit,            \
+    [MEMS_DTC_BIT(1, 7)] = MEMS_Fault_ThrottlePotCircuit          \
+  }
+
+/**
+ * Compiled-in profiles. The last entry has an all-zero mask and therefore
+ * matches any D0 response; it describes the layout documented in rosco.h.
+ */
+static const mems_profile builtin_profiles[] = {
+  {
+    "Mini SPi",
+    { 0x99, 0x00, 0x03, 0x03 },
+    { 0xFF, 0xFF, 0xFF, 0xFF },
+    sizeof(mems_data_frame_80),
+    sizeof(mems_data_frame_7d),
+    0,
+    0,
+    // 0x01-0x03, 0x11-0x13, 0xF7, 0xF8, 0xFD, 0xFE
+    { 0x0E, 0x00, 0x0E, 0x00, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x80, 0x61 },
+    {
+      { MEMS_ReqData80,  1, 2, 1.0,   0.0 },  // engine_rpm
+      { MEMS_ReqData80,  3, 1, 1.0,   0.0 },  // coolant_temp
+      { MEMS_ReqData80,  4, 1, 1.0,   0.0 },  // ambient_temp
+      { MEMS_ReqData80,  5, 1, 1.0,   0.0 },  // intake_air_temp
+      { MEMS_ReqData80,  6, 1, 1.0,   0.0 },  // fuel_temp
+      { MEMS_ReqData80,  7, 1, 1.0,   0.0 },  // map_kpa
+      { MEMS_ReqData80,  8, 1, 0.1,   0.0 },  // battery_voltage
+      { MEMS_ReqData80,  9, 1, 0.02,  0.0 },  // throttle_pot
+      { MEMS_ReqData80, 10, 1, 1.0,   0.0 },  // idle_switch
+      { MEMS_ReqData80, 12, 1, 1.0,   0.0 },  // park_neutral_switch
+      { MEMS_ReqData80, 18, 1, 1.0,   0.0 },  // iac_position
+      { MEMS_ReqData80, 19, 2, 1.0,   0.0 },  // idle_error
+      { MEMS_ReqData80, 22, 1, 0.5, -24.0 },  // ignition_advance
+      { MEMS_ReqData80, 23, 2, 0.002, 0.0 },  // coil_time
+      { MEMS_ReqData7D,  6, 1, 5.0,   0.0 },  // lambda_voltage
+      { MEMS_ReqData7D, 11, 1, 1.0,   0.0 },  // fuel_trim
+      { MEMS_ReqData7D, 10, 1, 1.0,   0.0 },  // closed_loop
+      { MEMS_ReqData7D, 15, 1, 1.0,   0.0 }   // idle_base_pos
+    },
+    MEMS_1_6_FAULTS
+  },
+  {
+    "Generic MEMS 1.6",
+    { 0x00, 0x00, 0x00, 0x00 },
+    { 0x00, 0x00, 0x00, 0x00 },
+    sizeof(mems_data_frame_80),
+    sizeof(mems_data_frame_7d),
+    0,
+    0,
+    { 0x0E, 0x00, 0x0E, 0x00, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x80, 0x61 },
+    {
+      { MEMS_ReqData80,  1, 2, 1.0,   0.0 },
+      { MEMS_ReqData80,  3, 1, 1.0,   0.0 },
+      { MEMS_ReqData80,  4, 1, 1.0,   0.0 },
+      { MEMS_ReqData80,  5, 1, 1.0,   0.0 },
+      { MEMS_ReqData80,  6, 1, 1.0,   0.0 },
+      { MEMS_ReqData80,  7, 1, 1.0,   0.0 },
+      { MEMS_ReqData80,  8, 1, 0.1,   0.0 },
+      { MEMS_ReqData80,  9, 1, 0.02,  0.0 },
+      { MEMS_ReqData80, 10, 1, 1.0,   0.0 },
+      { MEMS_ReqData80, 12, 1, 1.0,   0.0 },
+      { MEMS_ReqData80, 18, 1, 1.0,   0.0 },
+      { MEMS_ReqData80, 19, 2, 1.0,   0.0 },
+      { MEMS_ReqData80, 22, 1, 0.5, -24.0 },
+      { MEMS_ReqData80, 23, 2, 0.002, 0.0 },
+      { MEMS_ReqData7D,  6, 1, 5.0,   0.0 },
+      { MEMS_ReqData7D, 11, 1, 1.0,   0.0 },
+      { MEMS_ReqData7D, 10, 1, 1.0,   0.0 },
+      { MEMS_ReqData7D, 15, 1, 1.0,   0.0 }
+    },
+    MEMS_1_6_FAULTS
+  }
+};
+
+#define MEMS_NUM_BUILTIN_PROFILES (sizeof(builtin_profiles) / sizeof(builtin_profiles[0]))
+
+//! Profiles loaded at runtime with mems_load_profiles(); these take precedence
+static mems_profile* loaded_profiles = NULL;
+static unsigned int loaded_profile_count = 0;
+
+/**
+ * Returns the catch-all profile that is used when no other profile matches.
+ */
+const mems_profile* mems_default_profile()
+{
+  return &builtin_profiles[MEMS_NUM_BUILTIN_PROFILES - 1];
+}
+
+/**
+ * Returns true if the masked D0 response matches the profile's identifier.
+ */
+static bool profile_matches(const mems_profile* profile, const uint8_t* d0_response)
+{
+  int idx;
+
+  for (idx = 0; idx < MEMS_D0_RESPONSE_LEN; ++idx)
+  {
+    if ((d0_response[idx] & profile->d0_mask[idx]) != (profile->d0_id[idx] & profile->d0_mask[idx]))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Finds the profile describing the ECU that returned the given D0 response.
+ * Profiles loaded from a file are searched before the compiled-in table.
+ * @param d0_response Four bytes returned by the ECU after the D0 echo
+ * @return Matching profile; never NULL, as the default profile matches anything
+ */
+const mems_profile* mems_find_profile(const uint8_t* d0_response)
+{
+  unsigned int idx;
+
+  for (idx = 0; idx < loaded_profile_count; ++idx)
+  {
+    if (profile_matches(&loaded_profiles[idx], d0_response))
+    {
+      return &loaded_profiles[idx];
+    }
+  }
+
+  for (idx = 0; idx < MEMS_NUM_BUILTIN_PROFILES; ++idx)
+  {
+    if (profile_matches(&builtin_profiles[idx], d0_response))
+    {
+      return &builtin_profiles[idx];
+    }
+  }
+
+  return mems_default_profile();
+}
+
+/**
+ * Returns the name by which a decoded field is known in profile files, or
+ * NULL if the field is out of range.
+ */
+const char* mems_field_name(enum mems_field field)
+{
+  return ((field >= 0) && (field < MEMS_Field_Count)) ? field_names[field] : NULL;
+}
+
+/**
+ * Returns the value of one of the decoded fields of a mems_data struct, so
+ * that the fields can be handled generically (e.g. for statistics or export).
+ */
+float mems_field_value(const mems_data* data, enum mems_field field)
+{
+  switch (field)
+  {
+  case MEMS_Field_EngineRPM:         return data->engine_rpm;
+  case MEMS_Field_CoolantTemp:       return data->coolant_temp_c;
+  case MEMS_Field_AmbientTemp:       return data->ambient_temp_c;
+  case MEMS_Field_IntakeAirTemp:     return data->intake_air_temp_c;
+  case MEMS_Field_FuelTemp:          return data->fuel_temp_c;
+  case MEMS_Field_MAP:               return data->map_kpa;
+  case MEMS_Field_BatteryVoltage:    return data->battery_voltage;
+  case MEMS_Field_ThrottlePot:       return data->throttle_pot_voltage;
+  case MEMS_Field_IdleSwitch:        return data->idle_switch;
+  case MEMS_Field_ParkNeutralSwitch: return data->park_neutral_switch;
+  case MEMS_Field_IACPosition:       return data->iac_position;
+  case MEMS_Field_IdleError:         return data->idle_error;
+  case MEMS_Field_IgnitionAdvance:   return data->ignition_advance;
+  case MEMS_Field_CoilTime:          return data->coil_time;
+  case MEMS_Field_LambdaVoltage:     return data->lambda_voltage_mv;
+  case MEMS_Field_FuelTrim:          return data->fuel_trim;
+  case MEMS_Field_ClosedLoop:        return data->closed_loop;
+  case MEMS_Field_IdleBasePos:       return data->idle_base_pos;
+  default:                           return 0.0f;
+  }
+}
+
+/**
+ * Returns true if the profile lists the given command byte as an actuator test.
+ */
+bool mems_profile_supports_actuator(const mems_profile* profile, uint8_t cmd)
+{
+  return (profile->actuators[cmd >> 3] & (1 << (cmd & 0x07))) != 0;
+}
+
+/**
+ * Parses a list of whitespace-separated hex bytes.
+ * @return Number of bytes parsed, or -1 if a token was not a valid byte
+ */
+static int parse_hex_list(const char* str, uint8_t* out, int max)
+{
+  int count = 0;
+  char* end;
+  unsigned long val;
+
+  while (*str != '\0')
+  {
+    while (isspace((unsigned char)*str))
+    {
+      str++;
+    }
+    if (*str == '\0')
+    {
+      break;
+    }
+
+    val = strtoul(str, &end, 16);
+    if ((end == str) || (val > 0xFF) || (count >= max))
+    {
+      return -1;
+    }
+    out[count++] = (uint8_t)val;
+    str = end;
+  }
+
+  return count;
+}
+
+/**
+ * Removes leading and trailing whitespace from a string in place.
+ */
+static char* trim(char* str)
+{
+  char* end;
+
+  while (isspace((unsigned char)*str))
+  {
+    str++;
+  }
+
+  end = str + strlen(str);
+  while ((end > str) && isspace((unsigned char)*(end - 1)))
+  {
+    end--;
+  }
+  *end = '\0';
+
+  return str;
+}
+
+/**
+ * Applies a single "key = value" line to the profile being parsed.
+ * @return True if the key was recognized and the value was valid
+ */
+static bool apply_profile_setting(mems_profile* profile, const char* key, const char* value)
+{
+  bool status = false;
+  unsigned int frame, offset, width;
+  unsigned int byte, bit;
+  float scale, bias;
+  uint8_t cmds[256];
+  int count;
+  int idx;
+
+  if (strcmp(key, "id") == 0)
+  {
+    status = (parse_hex_list(value, profile->d0_id, MEMS_D0_RESPONSE_LEN) == MEMS_D0_RESPONSE_LEN);
+  }
+  else if (strcmp(key, "mask") == 0)
+  {
+    status = (parse_hex_list(value, profile->d0_mask, MEMS_D0_RESPONSE_LEN) == MEMS_D0_RESPONSE_LEN);
+  }
+  else if (strcmp(key, "frame80_len") == 0)
+  {
+    profile->frame80_len = (uint8_t)strtoul(value, NULL, 0);
+    status = (profile->frame80_len > 0) && (profile->frame80_len <= sizeof(mems_data_frame_80));
+  }
+  else if (strcmp(key, "frame7d_len") == 0)
+  {
+    profile->frame7d_len = (uint8_t)strtoul(value, NULL, 0);
+    status = (profile->frame7d_len > 0) && (profile->frame7d_len <= sizeof(mems_data_frame_7d));
+  }
+  else if (strcmp(key, "read_timeout_ms") == 0)
+  {
+    profile->read_timeout_ms = (uint16_t)strtoul(value, NULL, 0);
+    status = true;
+  }
+  else if (strcmp(key, "command_gap_ms") == 0)
+  {
+    profile->command_gap_ms = (uint16_t)strtoul(value, NULL, 0);
+    status = true;
+  }
+  else if (strcmp(key, "actuators") == 0)
+  {
+    count = parse_hex_list(value, cmds, sizeof(cmds));
+    if (count >= 0)
+    {
+      memset(profile->actuators, 0, sizeof(profile->actuators));
+      for (idx = 0; idx < count; ++idx)
+      {
+        profile->actuators[cmds[idx] >> 3] |= (1 << (cmds[idx] & 0x07));
+      }
+      status = true;
+    }
+  }
+  else if ((sscanf(key, "fault.dtc%u.%u", &byte, &bit) == 2) && (byte < MEMS_DTC_BYTES) && (bit < 8))
+  {
+    for (idx = 0; idx < MEMS_Fault_Count; ++idx)
+    {
+      if (strcmp(value, mems_fault_description((enum mems_fault)idx)->name) == 0)
+      {
+        profile->faults[MEMS_DTC_BIT(byte, bit)] = (uint8_t)idx;
+        status = true;
+        break;
+      }
+    }
+  }
+  else if (strncmp(key, "field.", 6) == 0)
+  {
+    for (idx = 0; idx < MEMS_Field_Count; ++idx)
+    {
+      if (strcmp(key + 6, field_names[idx]) == 0)
+      {
+        if ((sscanf(value, "%x %u %u %f %f", &frame, &offset, &width, &scale, &bias) == 5) &&
+            ((frame == 0) || (frame == MEMS_ReqData80) || (frame == MEMS_ReqData7D)) &&
+            (width >= 1) && (width <= 2) && (offset + width <= 0xFF))
+        {
+          profile->fields[idx].frame = (uint8_t)frame;
+          profile->fields[idx].offset = (uint8_t)offset;
+          profile->fields[idx].width = (uint8_t)width;
+          profile->fields[idx].scale = scale;
+          profile->fields[idx].bias = bias;
+          status = true;
+        }
+        break;
+      }
+    }
+  }
+
+  return status;
+}
+
+/**
+ * Loads additional variant profiles from a text file, so that new variants
+ * can be supported without rebuilding the library. Each profile starts with
+ * its name in square brackets, and any setting that is not given is
+ * inherited from the default profile (except the mask, which defaults to an
+ * exact match on all four bytes). Example:
+ *
+ *   [Mini SPi (late)]
+ *   id = 99 00 03 04
+ *   mask = FF FF FF FF
+ *   frame7d_len = 32
+ *   actuators = 11 01 12 02 F7 F8 FD FE
+ *   field.lambda_voltage = 7D 6 1 5.0 0.0
+ *   fault.dtc1.7 = throttle_pot_circuit
+ *
+ * Profiles should be loaded before any connection is initialized, as the
+ * registry is not protected against concurrent modification.
+ * @param path Path to the profile file
+ * @return Number of profiles loaded, or -1 if the file could not be read or parsed
+ */
+int mems_load_profiles(const char* path)
+{
+  FILE* fp;
+  char line[MEMS_PROFILE_LINE_LEN];
+  char* str;
+  char* sep;
+  mems_profile* current = NULL;
+  mems_profile* grown;
+  unsigned int first_new = loaded_profile_count;
+  unsigned int line_num = 0;
+  bool ok = true;
+
+  if ((fp = fopen(path, "r")) == NULL)
+  {
+    dprintf_err("mems_load_profiles(): could not open %s\n", path);
+    return -1;
+  }
+
+  while (ok && (fgets(line, sizeof(line), fp) != NULL))
+  {
+    line_num++;
+    str = trim(line);
+
+    if ((*str == '\0') || (*str == '#'))
+    {
+      continue;
+    }
+
+    if (*str == '[')
+    {
+      sep = strchr(str, ']');
+      grown = realloc(loaded_profiles, (loaded_profile_count + 1) * sizeof(mems_profile));
+      if ((sep == NULL) || (grown == NULL))
+      {
+        ok = false;
+      }
+      else
+      {
+        *sep = '\0';
+        loaded_profiles = grown;
+        current = &loaded_profiles[loaded_profile_count++];
+        memcpy(current, mems_default_profile(), sizeof(mems_profile));
+        memset(current->d0_mask, 0xFF, MEMS_D0_RESPONSE_LEN);
+        strncpy(current->name, str + 1, MEMS_PROFILE_NAME_LEN - 1);
+        current->name[MEMS_PROFILE_NAME_LEN - 1] = '\0';
+      }
+    }
+    else if ((current != NULL) && ((sep = strchr(str, '=')) != NULL))
+    {
+      *sep = '\0';
+      ok = apply_profile_setting(current, trim(str), trim(sep + 1));
+    }
+    else
+    {
+      ok = false;
+    }
+  }
+
+  fclose(fp);
+
+  if (!ok)
+  {
+    dprintf_err("mems_load_profiles(): error at %s:%u\n", path, line_num);
+    loaded_profile_count = first_new;
+    return -1;
+  }
+
+  return (int)(loaded_profile_count - first_new);
+}
+
+/**
+ * Extracts the raw big-endian value of a field from the appropriate frame.
+ * @return True if the field is present in the portion of the frame the
+ *   profile says the ECU returns
+ */
+static bool read_field(const mems_profile* profile, const mems_field_layout* layout,
+                       const uint8_t* frame80, const uint8_t* frame7d, uint16_t* raw)
+{
+  const uint8_t* frame;
+  uint8_t len;
+
+  if (layout->frame == MEMS_ReqData80)
+  {
+    frame = frame80;
+    len = profile->frame80_len;
+  }
+  else if (layout->frame == MEMS_ReqData7D)
+  {
+    frame = frame7d;
+    len = profile->frame7d_len;
+  }
+  else
+  {
+    return false;
+  }
+
+  if (layout->offset + layout->width > len)
+  {
+    return false;
+  }
+
+  *raw = frame[layout->offset];
+  if (layout->width == 2)
+  {
+    *raw = (*raw << 8) | frame[layout->offset + 1];
+  }
+
+  return true;
+}
+
+/**
+ * Decodes a pair of raw data frames into the compact data struct, using the
+ * field layout and scaling described by the given profile.
+ */
+void mems_decode_frames(const mems_profile* profile, const mems_data_frame_80* frame80,
+                        const mems_data_frame_7d* frame7d, mems_data* data)
+{
+  const uint8_t* f80 = (const uint8_t*)frame80;
+  const uint8_t* f7d = (const uint8_t*)frame7d;
+  const mems_field_layout* layout;
+  uint16_t raw;
+  float value;
+  int field;
+
+  memset(data, 0, sizeof(mems_data));
+
+  for (field = 0; field < MEMS_Field_Count; ++field)
+  {
+    layout = &profile->fields[field];
+    if (!read_field(profile, layout, f80, f7d, &raw))
+    {
+      continue;
+    }
+    value = (raw * layout->scale) + layout->bias;
+
+    switch (field)
+    {
+    case MEMS_Field_EngineRPM:         data->engine_rpm = (uint16_t)value;            break;
+    case MEMS_Field_CoolantTemp:       data->coolant_temp_c = (uint8_t)value;         break;
+    case MEMS_Field_AmbientTemp:       data->ambient_temp_c = (uint8_t)value;         break;
+    case MEMS_Field_IntakeAirTemp:     data->intake_air_temp_c = (uint8_t)value;      break;
+    case MEMS_Field_FuelTemp:          data->fuel_temp_c = (uint8_t)value;            break;
+    case MEMS_Field_MAP:               data->map_kpa = value;                         break;
+    case MEMS_Field_BatteryVoltage:    data->battery_voltage = value;                 break;
+    case MEMS_Field_ThrottlePot:       data->throttle_pot_voltage = value;            break;
+    case MEMS_Field_IdleSwitch:        data->idle_switch = (raw == 0) ? 0 : 1;        break;
+    case MEMS_Field_ParkNeutralSwitch: data->park_neutral_switch = (raw == 0) ? 0 : 1; break;
+    case MEMS_Field_IACPosition:       data->iac_position = (uint8_t)value;           break;
+    case MEMS_Field_IdleError:         data->idle_error = (uint16_t)value;            break;
+    case MEMS_Field_IgnitionAdvance:   data->ignition_advance = value;                break;
+    case MEMS_Field_CoilTime:          data->coil_time = value;                       break;
+    case MEMS_Field_LambdaVoltage:     data->lambda_voltage_mv = (uint16_t)value;     break;
+    case MEMS_Field_FuelTrim:          data->fuel_trim = (uint8_t)value;              break;
+    case MEMS_Field_ClosedLoop:        data->closed_loop = (uint8_t)value;            break;
+    case MEMS_Field_IdleBasePos:       data->idle_base_pos = (uint8_t)value;          break;
+    default:                                                                          break;
+    }
+  }
+
+  data->dtc[0] = frame80->dtc0;
+  data->dtc[1] = frame80->dtc1;
+  data->dtc[2] = frame7d->dtc2;
+  data->dtc[3] = frame7d->dtc3;
+  data->dtc[4] = frame7d->dtc4;
+
+  if (frame80->dtc0 & 0x01)   // coolant temp sensor fault
+    data->fault_codes |= (1 << 0);
+
+  if (frame80->dtc0 & 0x02)   // intake air temp sensor fault
+    data->fault_codes |= (1 << 1);
+
+  if (frame80->dtc1 & 0x02)   // fuel pump circuit fault
+    data->fault_codes |= (1 << 2);
+
+  if (frame80->dtc1 & 0x80)   // throttle pot circuit fault
+    data->fault_codes |= (1 << 3);
+}
@@ -22,38 +22,40 @@
 #include "rosco_internal.h"
 
 /**
- * Reads bytes from the serial device using an OS-specific call.
+ * Reads bytes from the ECU through the connection's transport, continuing
+ * until the requested quantity has arrived or the transport times out.
+ * Each read waits for the response timeout of the variant profile, if it
+ * has one, and otherwise according to the transport's own policy.
  * @param buffer Buffer into which data should be read
  * @param quantity Number of bytes to read
- * @return Number of bytes read from the device, or -1 if no bytes could be read
+ * @return Number of bytes read from the device
  */
 int16_t mems_read_serial(mems_info* info, uint8_t* buffer, uint16_t quantity)
 {
+  const mems_profile* profile = info->profile ? info->profile : mems_default_profile();
+  int timeout_ms = (profile->read_timeout_ms > 0) ? profile->read_timeout_ms : -1;
   int16_t totalBytesRead = 0;
-  int16_t bytesRead = -1;
+  int bytesRead = -1;
   uint8_t *buffer_pt = buffer;
-  int x = 0;
 
   if (mems_is_connected(info))
   {
     do
     {
-#if defined(WIN32)
-      DWORD w32BytesRead = 0;
-      if ((ReadFile(info->sd, (UCHAR *) buffer_pt, quantity, &w32BytesRead, NULL) == TRUE) &&
-          (w32BytesRead > 0))
+      bytesRead = info->transport->read(info->transport_ctx, buffer_pt, quantity - totalBytesRead, timeout_ms);
+      if (bytesRead > 0)
       {
-        bytesRead = w32BytesRead;
+        totalBytesRead += bytesRead;
+        buffer_pt += bytesRead;
       }
-#else
-      bytesRead = read(info->sd, buffer_pt, quantity);
-#endif
-      totalBytesRead += bytesRead;
-      buffer_pt += bytesRead;
-
     } while ((bytesRead > 0) && (totalBytesRead < quantity));
   }
 
+  if (totalBytesRead > 0)
+  {
+    info->last_activity_us = mems_monotonic_us();
+  }
+
   if (totalBytesRead < quantity)
   {
     dprintf_err("mems_read_serial(): expected %d, got %d\n", quantity, totalBytesRead);
@@ -63,28 +65,30 @@ int16_t mems_read_serial(mems_info* info, uint8_t* buffer, uint16_t quantity)
 }
 
 /**
- * Writes bytes to the serial device using an OS-specific call
+ * Writes bytes to the ECU through the connection's transport. If the variant
+ * profile asks for a minimum gap between commands, the write is held back
+ * until that long after the previous one.
  * @param buffer Buffer from which written data should be drawn
  * @param quantity Number of bytes to write
  * @return Number of bytes written to the device, or -1 if no bytes could be written
  */
 int16_t mems_write_serial(mems_info* info, uint8_t* buffer, uint16_t quantity)
 {
+  const mems_profile* profile = info->profile ? info->profile : mems_default_profile();
+  uint64_t gap_us = (uint64_t)profile->command_gap_ms * 1000;
+  uint64_t elapsed_us;
   int16_t bytesWritten = -1;
-  int x = 0;
 
   if (mems_is_connected(info))
   {
-#if defined(WIN32)
-    DWORD w32BytesWritten = 0;
-    if ((WriteFile(info->sd, (UCHAR *) buffer, quantity, &w32BytesWritten, NULL) == TRUE) &&
-        (w32BytesWritten == quantity))
+    if ((gap_us > 0) && (info->last_command_us > 0) &&
+        ((elapsed_us = mems_monotonic_us() - info->last_command_us) < gap_us))
     {
-      bytesWritten = w32BytesWritten;
+      mems_sleep_us(gap_us - elapsed_us);
     }
-#else
-    bytesWritten = write(info->sd, buffer, quantity);
-#endif
+
+    bytesWritten = info->transport->write(info->transport_ctx, buffer, quantity);
+    info->last_command_us = mems_monotonic_us();
   }
 
   return bytesWritten;
@@ -172,6 +176,16 @@ bool mems_init_link(mems_info* info, uint8_t* d0_response_buffer)
     return false;
   }
 
+  // select the frame layout and timing for this variant
+  info->profile = mems_find_profile(d0_response_buffer);
+
+  // relate this session's timestamps to wall-clock time
+  if ((info->transport->anchor == NULL) ||
+      !info->transport->anchor(info->transport_ctx, &info->anchor))
+  {
+    mems_clock_anchor_now(&info->anchor);
+  }
+
   return true;
 }
 
@@ -203,16 +217,28 @@ void mems_unlock(mems_info* info)
 
 /**
  * Sends a command to read a frame of data from the ECU, and returns the raw frame.
+ * The number of bytes expected in each frame is taken from the variant profile,
+ * so that the read completes as soon as the last byte arrives. Any trailing
+ * bytes in the structs that the variant does not send are zeroed.
+ * The times at which the frame was requested and its last byte received are
+ * left in info->last_request_us and info->last_response_us.
  */
 bool mems_read_raw(mems_info* info, mems_data_frame_80* frame80, mems_data_frame_7d* frame7d)
 {
     bool status = false;
+    const mems_profile* profile = info->profile ? info->profile : mems_default_profile();
+    uint8_t len80 = profile->frame80_len;
+    uint8_t len7d = profile->frame7d_len;
+
+    memset(frame80, 0, sizeof(mems_data_frame_80));
+    memset(frame7d, 0, sizeof(mems_data_frame_7d));
 
     if (mems_lock(info))
     {
+      info->last_request_us = mems_monotonic_us();
       if (mems_send_command(info, MEMS_ReqData80))
       {
-        if (mems_read_serial(info, (uint8_t*)(frame80), sizeof(mems_data_frame_80)) == sizeof(mems_data_frame_80))
+        if (mems_read_serial(info, (uint8_t*)(frame80), len80) == len80)
         {
           status = true;
         }
@@ -230,7 +256,7 @@ bool mems_read_raw(mems_info* info, mems_data_frame_80* frame80, mems_data_frame
       {
         if (mems_send_command(info, MEMS_ReqData7D))
         {
-          if (!mems_read_serial(info, (uint8_t*)(frame7d), sizeof(mems_data_frame_7d)) == sizeof(mems_data_frame_7d))
+          if (mems_read_serial(info, (uint8_t*)(frame7d), len7d) != len7d)
           {
             dprintf_err("mems_read_raw(): failed to read data frame in response to cmd 0x7D\n");
             status = false;
@@ -243,6 +269,15 @@ bool mems_read_raw(mems_info* info, mems_data_frame_80* frame80, mems_data_frame
         }
       }
 
+      if (status)
+      {
+        info->last_response_us = mems_monotonic_us();
+        if (info->transport->frame_times)
+        {
+          info->transport->frame_times(info->transport_ctx, &info->last_request_us, &info->last_response_us);
+        }
+      }
+
       mems_unlock(info);
     }
 
@@ -250,7 +285,8 @@ bool mems_read_raw(mems_info* info, mems_data_frame_80* frame80, mems_data_frame
 }
 
 /**
- * Sends an command to read a frame of data from the ECU, and parses the returned frame.
+ * Sends an command to read a frame of data from the ECU, and parses the returned frame
+ * according to the layout described by the variant profile.
  */
 bool mems_read(mems_info* info, mems_data* data)
 {
@@ -260,40 +296,8 @@ bool mems_read(mems_info* info, mems_data* data)
 
   if (mems_read_raw(info, &dframe80, &dframe7d))
   {
-    memset(data, 0, sizeof(mems_data));
-
-    data->engine_rpm           = ((uint16_t)dframe80.engine_rpm_hi << 8) | dframe80.engine_rpm_lo;
-    data->coolant_temp_c       = dframe80.coolant_temp;
-    data->ambient_temp_c       = dframe80.ambient_temp;
-    data->intake_air_temp_c    = dframe80.intake_air_temp;
-    data->fuel_temp_c          = dframe80.fuel_temp;
-    data->map_kpa              = dframe80.map_kpa;
-    data->battery_voltage      = dframe80.battery_voltage / 10.0;
-    data->throttle_pot_voltage = dframe80.throttle_pot * 0.02;
-    data->idle_switch          = (dframe80.idle_switch == 0) ? 0 : 1;
-    data->park_neutral_switch  = (dframe80.park_neutral_switch == 0) ? 0 : 1;
-    data->fault_codes          = 0;
-    data->iac_position         = dframe80.iac_position;
-    data->coil_time            = (((uint16_t)dframe80.coil_time_hi << 8) | dframe80.coil_time_lo) * 0.002;
-    data->idle_error           = ((uint16_t)dframe80.idle_error_hi << 8) | dframe80.idle_error_lo;
-    data->ignition_advance     = (dframe80.ignition_advance * 0.5) - 24.0;
-    data->lambda_voltage_mv    = dframe7d.lambda_voltage * 5;
-    data->fuel_trim            = dframe7d.fuel_trim;
-    data->closed_loop          = dframe7d.closed_loop;
-    data->idle_base_pos        = dframe7d.idle_base_pos;
-
-    if (dframe80.dtc0 & 0x01)   // coolant temp sensor fault
-      data->fault_codes |= (1 << 0);
-
-    if (dframe80.dtc0 & 0x02)   // intake air temp sensor fault
-      data->fault_codes |= (1 << 1);
-
-    if (dframe80.dtc1 & 0x02)   // fuel pump circuit fault
-      data->fault_codes |= (1 << 2);
-
-    if (dframe80.dtc1 & 0x80)   // throttle pot circuit fault
-      data->fault_codes |= (1 << 3);
-
+    mems_decode_frames(info->profile ? info->profile : mems_default_profile(),
+                       &dframe80, &dframe7d, data);
     success = true;
   }
 
@@ -317,37 +321,58 @@ bool mems_read_iac_position(mems_info* info, uint8_t* position)
 }
 
 /**
- * Repeatedly send command to open or close the idle air control valve until
- * it is in the desired position. The valve does not necessarily move one full
- * step per serial command, depending on the rate at which the commands are
- * issued.
+ * Moves the idle air control valve to the desired position.
+ * See mems_move_iac_ex() for details.
  */
 bool mems_move_iac(mems_info* info, uint8_t desired_pos)
 {
-  bool status = false;
-  uint16_t attempts = 0;
-  uint8_t current_pos = 0;
-  actuator_cmd cmd;
+  return mems_move_iac_ex(info, desired_pos, NULL);
+}
+
+/**
+ * Sends a command and reads the single byte of data that follows the echo.
+ * The caller must hold the lock.
+ */
+bool mems_command_with_byte(mems_info* info, uint8_t cmd, uint8_t* data)
+{
+  uint8_t response = 0x00;
 
-  // read the current IAC position, and only take action
-  // if we're not already at the desired point
-  if (mems_read_iac_position(info, &current_pos))
+  if (mems_send_command(info, cmd) &&
+      (mems_read_serial(info, &response, 1) == 1))
   {
-    if ((desired_pos < current_pos) ||
-        ((desired_pos > current_pos) && (current_pos < IAC_MAXIMUM)))
+    if (data)
     {
-      cmd = (desired_pos > current_pos) ? MEMS_OpenIAC : MEMS_CloseIAC;
-
-      do {
-        status = mems_test_actuator(info, cmd, &current_pos);
-        attempts += 1;
-      } while (status && (current_pos != desired_pos) && (attempts < 300));
+      *data = response;
     }
+    return true;
   }
 
-  status = (desired_pos == current_pos);
+  return false;
+}
 
-  return status;
+/**
+ * Returns the number of bytes that the ECU sends after the echo of the given
+ * command: the frame lengths of the connection's profile for the data
+ * requests, and a single byte for the IAC, fault and actuator commands.
+ */
+int16_t mems_response_len(const mems_info* info, uint8_t cmd)
+{
+  const mems_profile* profile = info->profile ? info->profile : mems_default_profile();
+
+  switch (cmd)
+  {
+  case 0xCA:
+  case 0x75:
+    return 0;
+  case 0xD0:
+    return MEMS_D0_RESPONSE_LEN;
+  case MEMS_ReqData80:
+    return profile->frame80_len;
+  case MEMS_ReqData7D:
+    return profile->frame7d_len;
+  default:
+    return 1;
+  }
 }
 
 /**
@@ -356,19 +381,10 @@ bool mems_move_iac(mems_info* info, uint8_t desired_pos)
 bool mems_test_actuator(mems_info* info, actuator_cmd cmd, uint8_t* data)
 {
   bool status = false;
-  uint8_t response = 0x00;
 
   if (mems_lock(info))
   {
-    if (mems_send_command(info, cmd) &&
-        (mems_read_serial(info, &response, 1) == 1))
-    {
-      if (data)
-      {
-        *data = response;
-      }
-      status = true;
-    }
+    status = mems_command_with_byte(info, cmd, data);
     mems_unlock(info);
   }
   return status;
@@ -398,7 +414,11 @@ bool mems_clear_faults(mems_info* info)
 }
 
 /**
- * Sends a simple heartbeat (ping) command to check connectivity
+ * Sends a simple heartbeat (ping) command to check connectivity. If a
+ * keep-alive threshold has been set with mems_set_keepalive(), the command
+ * is only sent when nothing has been received from the ECU for that long;
+ * otherwise the data traffic already proves (and maintains) the link, and
+ * the call returns success without using any line time.
  */
 bool mems_heartbeat(mems_info* info)
 {
@@ -407,11 +427,18 @@ bool mems_heartbeat(mems_info* info)
 
   if (mems_lock(info))
   {
+    if ((info->keepalive_ms > 0) && (info->last_activity_us > 0) &&
+        ((mems_monotonic_us() - info->last_activity_us) < ((uint64_t)info->keepalive_ms * 1000)))
+    {
+      info->heartbeats_skipped++;
+      status = true;
+    }
     // send the command and check for one additional byte after the
     // echoed command byte (should be 0x00)
-    if (mems_send_command(info, (uint8_t)MEMS_Heartbeat) &&
-        (mems_read_serial(info, &response, 1) == 1))
+    else if (mems_send_command(info, (uint8_t)MEMS_Heartbeat) &&
+             (mems_read_serial(info, &response, 1) == 1))
     {
+      info->heartbeats_sent++;
       status = true;
     }
     mems_unlock(info);
@@ -420,3 +447,17 @@ bool mems_heartbeat(mems_info* info)
   return status;
 }
 
+/**
+ * Sets the idle time after which mems_heartbeat() actually pings the ECU.
+ * Front-ends can then call mems_heartbeat() on a timer as before, and
+ * heartbeats are only sent when the link would otherwise go idle.
+ * @param idle_ms Idle threshold in ms; 0 restores the default of always pinging
+ */
+void mems_set_keepalive(mems_info* info, uint32_t idle_ms)
+{
+  if (mems_lock(info))
+  {
+    info->keepalive_ms = idle_ms;
+    mems_unlock(info);
+  }
+}
@@ -0,0 +1,998 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// query.c: This file contains the query engine, which evaluates a filter
+//          expression over the frames of many capture files in parallel
+//          and aggregates the channels of the frames that match.
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(WIN32)
+  #include <sys/stat.h>
+#endif
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Number of records scanned by one task. Chunk boundaries depend only on
+//! the files, never on the number of threads, which keeps results repeatable.
+#define MEMS_QUERY_CHUNK_RECORDS 65536
+//! Maximum number of worker threads
+#define MEMS_QUERY_MAX_THREADS 64
+//! Deepest nesting of parentheses and 'not' accepted by the parser, which
+//! bounds its recursion (parentheses add no nodes to the query, so the
+//! number of nodes doesn't)
+#define MEMS_QUERY_MAX_DEPTH 256
+//! Marks a task that maps a file and splits it into chunks
+#define MEMS_QUERY_PLAN UINT32_MAX
+
+/**
+ * Three-valued outcome of evaluating a query over a range of values.
+ */
+enum query_outcome
+{
+  Outcome_Never = 0,
+  Outcome_Maybe = 1,
+  Outcome_Always = 2
+};
+
+//! Words and symbols accepted by the query parser
+enum query_token
+{
+  Token_End,
+  Token_Field,
+  Token_Number,
+  Token_Compare,
+  Token_And,
+  Token_Or,
+  Token_Not,
+  Token_Open,
+  Token_Close,
+  Token_Invalid
+};
+
+typedef struct
+{
+  const char* pos;
+  enum query_token token;
+  int field;
+  int compare;
+  float number;
+  int depth;
+  mems_query* query;
+} query_parser;
+
+/**
+ * Reads the next token of a query.
+ */
+static void next_token(query_parser* p)
+{
+  char word[32];
+  char* end;
+  size_t len = 0;
+  int field;
+
+  while (isspace((unsigned char)*p->pos))
+  {
+    p->pos++;
+  }
+
+  p->token = Token_Invalid;
+
+  if (*p->pos == '\0')
+  {
+    p->token = Token_End;
+  }
+  else if (isalpha((unsigned char)*p->pos) || (*p->pos == '_'))
+  {
+    while ((isalnum((unsigned char)p->pos[len]) || (p->pos[len] == '_')) && (len < sizeof(word) - 1))
+    {
+      word[len] = p->pos[len];
+      len++;
+    }
+    word[len] = '\0';
+    p->pos += len;
+
+    if (strcmp(word, "and") == 0)
+    {
+      p->token = Token_And;
+    }
+    else if (strcmp(word, "or") == 0)
+    {
+      p->token = Token_Or;
+    }
+    else if (strcmp(word, "not") == 0)
+    {
+      p->token = Token_Not;
+    }
+    else
+    {
+      for (field = 0; field < MEMS_Field_Count; ++field)
+      {
+        if (strcmp(word, mems_field_name((enum mems_field)field)) == 0)
+        {
+          p->token = Token_Field;
+          p->field = field;
+        }
+      }
+    }
+  }
+  else if (isdigit((unsigned char)*p->pos) || (*p->pos == '-') || (*p->pos == '.'))
+  {
+    p->number = strtof(p->pos, &end);
+    if (end != p->pos)
+    {
+      p->token = Token_Number;
+      p->pos = end;
+    }
+  }
+  else
+  {
+    p->token = Token_Compare;
+    if (strncmp(p->pos, "<=", 2) == 0)      { p->compare = MEMS_Compare_LE; p->pos += 2; }
+    else if (strncmp(p->pos, ">=", 2) == 0) { p->compare = MEMS_Compare_GE; p->pos += 2; }
+    else if (strncmp(p->pos, "==", 2) == 0) { p->compare = MEMS_Compare_EQ; p->pos += 2; }
+    else if (strncmp(p->pos, "!=", 2) == 0) { p->compare = MEMS_Compare_NE; p->pos += 2; }
+    else if (strncmp(p->pos, "&&", 2) == 0) { p->token = Token_And;         p->pos += 2; }
+    else if (strncmp(p->pos, "||", 2) == 0) { p->token = Token_Or;          p->pos += 2; }
+    else if (*p->pos == '<')                { p->compare = MEMS_Compare_LT; p->pos++; }
+    else if (*p->pos == '>')                { p->compare = MEMS_Compare_GT; p->pos++; }
+    else if (*p->pos == '=')                { p->compare = MEMS_Compare_EQ; p->pos++; }
+    else if (*p->pos == '!')                { p->token = Token_Not;         p->pos++; }
+    else if (*p->pos == '(')                { p->token = Token_Open;        p->pos++; }
+    else if (*p->pos == ')')                { p->token = Token_Close;       p->pos++; }
+    else                                    { p->token = Token_Invalid; }
+  }
+}
+
+/**
+ * Appends a node to the compiled query.
+ */
+static bool emit(query_parser* p, uint8_t op, uint8_t field, uint8_t compare, float value)
+{
+  mems_query_node* node;
+
+  if (p->query->count >= MEMS_QUERY_MAX_NODES)
+  {
+    return false;
+  }
+
+  node = &p->query->nodes[p->query->count++];
+  node->op = op;
+  node->field = field;
+  node->compare = compare;
+  node->reserved = 0;
+  node->value = value;
+
+  return true;
+}
+
+static bool parse_or(query_parser* p);
+
+/**
+ * factor := "not" factor | "(" expression ")" | field compare number
+ * Nesting is limited to MEMS_QUERY_MAX_DEPTH levels.
+ */
+static bool parse_factor(query_parser* p)
+{
+  int field;
+  int compare;
+  bool ok;
+
+  if ((p->token == Token_Not) || (p->token == Token_Open))
+  {
+    if (p->depth >= MEMS_QUERY_MAX_DEPTH)
+    {
+      return false;
+    }
+    p->depth++;
+
+    if (p->token == Token_Not)
+    {
+      next_token(p);
+      ok = parse_factor(p) && emit(p, MEMS_Query_Not, 0, 0, 0.0f);
+    }
+    else
+    {
+      next_token(p);
+      ok = parse_or(p) && (p->token == Token_Close);
+      if (ok)
+      {
+        next_token(p);
+      }
+    }
+
+    p->depth--;
+    return ok;
+  }
+
+  if (p->token != Token_Field)
+  {
+    return false;
+  }
+  field = p->field;
+
+  next_token(p);
+  if (p->token != Token_Compare)
+  {
+    return false;
+  }
+  compare = p->compare;
+
+  next_token(p);
+  if (p->token != Token_Number)
+  {
+    return false;
+  }
+
+  if (!emit(p, MEMS_Query_Compare, (uint8_t)field, (uint8_t)compare, p->number))
+  {
+    return false;
+  }
+  next_token(p);
+
+  return true;
+}
+
+/**
+ * term := factor ("and" factor)*
+ */
+static bool parse_and(query_parser* p)
+{
+  if (!parse_factor(p))
+  {
+    return false;
+  }
+
+  while (p->token == Token_And)
+  {
+    next_token(p);
+    if (!parse_factor(p) || !emit(p, MEMS_Query_And, 0, 0, 0.0f))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * expression := term ("or" term)*
+ */
+static bool parse_or(query_parser* p)
+{
+  if (!parse_and(p))
+  {
+    return false;
+  }
+
+  while (p->token == Token_Or)
+  {
+    next_token(p);
+    if (!parse_and(p) || !emit(p, MEMS_Query_Or, 0, 0, 0.0f))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Compiles a filter expression such as
+ * "coolant_temp > 90 and (engine_rpm < 700 or not idle_switch == 1)".
+ * Channels are named as in profile files (see mems_field_name()); the
+ * comparisons are <, <=, >, >=, == (or =) and !=, and they may be combined
+ * with and (&&), or (||), not (!) and parentheses.
+ * @return True if the expression was valid
+ */
+bool mems_parse_query(const char* text, mems_query* query)
+{
+  query_parser p;
+
+  memset(query, 0, sizeof(mems_query));
+  memset(&p, 0, sizeof(p));
+  p.pos = text;
+  p.query = query;
+
+  next_token(&p);
+
+  return parse_or(&p) && (p.token == Token_End);
+}
+
+/**
+ * Returns true if a single comparison holds.
+ */
+static bool compare_value(uint8_t compare, float x, float value)
+{
+  switch (compare)
+  {
+  case MEMS_Compare_LT: return (x < value);
+  case MEMS_Compare_LE: return (x <= value);
+  case MEMS_Compare_GT: return (x > value);
+  case MEMS_Compare_GE: return (x >= value);
+  case MEMS_Compare_EQ: return (x == value);
+  case MEMS_Compare_NE: return (x != value);
+  default:              return false;
+  }
+}
+
+/**
+ * Evaluates a compiled query against a decoded sample.
+ * @return True if the sample matches
+ */
+bool mems_query_match(const mems_query* query, const mems_data* data)
+{
+  bool stack[MEMS_QUERY_MAX_NODES];
+  const mems_query_node* node;
+  int depth = 0;
+  int idx;
+
+  for (idx = 0; idx < query->count; ++idx)
+  {
+    node = &query->nodes[idx];
+    switch (node->op)
+    {
+    case MEMS_Query_Compare:
+      stack[depth++] = compare_value(node->compare, mems_field_value(data, (enum mems_field)node->field), node->value);
+      break;
+    case MEMS_Query_And:
+      depth--;
+      stack[depth - 1] = stack[depth - 1] && stack[depth];
+      break;
+    case MEMS_Query_Or:
+      depth--;
+      stack[depth - 1] = stack[depth - 1] || stack[depth];
+      break;
+    case MEMS_Query_Not:
+      stack[depth - 1] = !stack[depth - 1];
+      break;
+    }
+  }
+
+  return (depth > 0) && stack[depth - 1];
+}
+
+/**
+ * Decides whether a comparison can hold for a value known to lie in [lo, hi].
+ */
+static enum query_outcome compare_range(uint8_t compare, float lo, float hi, float value)
+{
+  switch (compare)
+  {
+  case MEMS_Compare_LT: return (hi < value) ? Outcome_Always : ((lo >= value) ? Outcome_Never : Outcome_Maybe);
+  case MEMS_Compare_LE: return (hi <= value) ? Outcome_Always : ((lo > value) ? Outcome_Never : Outcome_Maybe);
+  case MEMS_Compare_GT: return (lo > value) ? Outcome_Always : ((hi <= value) ? Outcome_Never : Outcome_Maybe);
+  case MEMS_Compare_GE: return (lo >= value) ? Outcome_Always : ((hi < value) ? Outcome_Never : Outcome_Maybe);
+  case MEMS_Compare_EQ:
+    return ((value < lo) || (value > hi)) ? Outcome_Never : (((lo == hi) && (lo == value)) ? Outcome_Always : Outcome_Maybe);
+  case MEMS_Compare_NE:
+    return ((value < lo) || (value > hi)) ? Outcome_Always : (((lo == hi) && (lo == value)) ? Outcome_Never : Outcome_Maybe);
+  default:
+    return Outcome_Maybe;
+  }
+}
+
+/**
+ * Evaluates a query over the channel ranges stored in a session index.
+ * @return False if no frame of the session can match
+ */
+static bool index_may_match(const mems_query* query, const mems_session_index* index)
+{
+  uint8_t stack[MEMS_QUERY_MAX_NODES];
+  const mems_query_node* node;
+  int depth = 0;
+  int idx;
+
+  for (idx = 0; idx < query->count; ++idx)
+  {
+    node = &query->nodes[idx];
+    switch (node->op)
+    {
+    case MEMS_Query_Compare:
+      stack[depth++] = compare_range(node->compare, index->channels[node->field].min,
+                                     index->channels[node->field].max, node->value);
+      break;
+    case MEMS_Query_And:
+      depth--;
+      stack[depth - 1] = (stack[depth] < stack[depth - 1]) ? stack[depth] : stack[depth - 1];
+      break;
+    case MEMS_Query_Or:
+      depth--;
+      stack[depth - 1] = (stack[depth] > stack[depth - 1]) ? stack[depth] : stack[depth - 1];
+      break;
+    case MEMS_Query_Not:
+      stack[depth - 1] = Outcome_Always - stack[depth - 1];
+      break;
+    }
+  }
+
+  return (index->frames > 0) && (depth > 0) && (stack[depth - 1] != Outcome_Never);
+}
+
+/**
+ * Aggregates of the frames of one chunk.
+ */
+typedef struct
+{
+  uint64_t frames;
+  uint64_t matched;
+  mems_query_channel channels[MEMS_Field_Count];
+} query_partial;
+
+/**
+ * State of one file of the query.
+ */
+typedef struct
+{
+  mems_capture_map map;
+  const mems_profile* profile;
+  //! Offsets at which the chunks start, plus the end of the last
+  size_t* chunk_offsets;
+  uint32_t chunk_count;
+  //! Results of each chunk, merged in order once all are done
+  query_partial* partials;
+  //! Number of chunks not yet scanned; the last to finish unmaps the file
+  int chunks_left;
+  bool failed;
+  bool skipped;
+  //! Number of frames in the file, when taken from its index
+  uint64_t indexed_frames;
+} query_file;
+
+typedef struct
+{
+  int file;
+  uint32_t chunk;
+} query_task;
+
+/**
+ * Double-ended queue of tasks. The owning worker pushes and pops at the
+ * tail; other workers steal from the head, taking the oldest (and, for
+ * plan tasks, typically largest) piece of work.
+ */
+typedef struct
+{
+  query_task* tasks;
+  int head;
+  int tail;
+  int capacity;
+#if !defined(WIN32)
+  pthread_mutex_t mutex;
+#endif
+} task_deque;
+
+typedef struct
+{
+  const char* const* paths;
+  const mems_query* query;
+  bool use_index;
+  query_file* files;
+  task_deque deques[MEMS_QUERY_MAX_THREADS];
+  int workers;
+  //! Tasks pushed but not yet finished; the workers stop when it reaches zero
+  int pending;
+  //! Tasks waiting in the deques, not yet taken by any worker
+  int queued;
+#if !defined(WIN32)
+  pthread_mutex_t mutex;
+  //! Signalled whenever a task is queued or the last task is finished
+  pthread_cond_t changed;
+#endif
+} query_job;
+
+typedef struct
+{
+  query_job* job;
+  int id;
+} query_worker;
+
+static void deque_lock(task_deque* dq)
+{
+#if !defined(WIN32)
+  pthread_mutex_lock(&dq->mutex);
+#endif
+}
+
+static void deque_unlock(task_deque* dq)
+{
+#if !defined(WIN32)
+  pthread_mutex_unlock(&dq->mutex);
+#endif
+}
+
+/**
+ * Wakes the workers that are waiting for a task to be queued.
+ */
+static void job_notify(query_job* job)
+{
+#if !defined(WIN32)
+  pthread_mutex_lock(&job->mutex);
+  pthread_cond_broadcast(&job->changed);
+  pthread_mutex_unlock(&job->mutex);
+#endif
+}
+
+/**
+ * Adds a task at the tail of a deque.
+ */
+static bool deque_push(query_job* job, task_deque* dq, int file, uint32_t chunk)
+{
+  query_task* grown;
+  bool ok = true;
+
+  deque_lock(dq);
+
+  if (dq->tail == dq->capacity)
+  {
+    // reclaim the space before the head before growing
+    if (dq->head > 0)
+    {
+      memmove(dq->tasks, dq->tasks + dq->head, (dq->tail - dq->head) * sizeof(query_task));
+      dq->tail -= dq->head;
+      dq->head = 0;
+    }
+    else if ((grown = realloc(dq->tasks, (dq->capacity * 2 + 16) * sizeof(query_task))) != NULL)
+    {
+      dq->tasks = grown;
+      dq->capacity = dq->capacity * 2 + 16;
+    }
+    else
+    {
+      ok = false;
+    }
+  }
+
+  if (ok)
+  {
+    dq->tasks[dq->tail].file = file;
+    dq->tasks[dq->tail].chunk = chunk;
+    dq->tail++;
+    __atomic_add_fetch(&job->pending, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&job->queued, 1, __ATOMIC_RELEASE);
+  }
+
+  deque_unlock(dq);
+
+  if (ok)
+  {
+    job_notify(job);
+  }
+
+  return ok;
+}
+
+/**
+ * Takes a task from the tail (own deque) or the head (stealing) of a deque.
+ */
+static bool deque_take(query_job* job, task_deque* dq, bool steal, query_task* task)
+{
+  bool found = false;
+
+  deque_lock(dq);
+
+  if (dq->tail > dq->head)
+  {
+    found = true;
+    if (steal)
+    {
+      *task = dq->tasks[dq->head++];
+    }
+    else
+    {
+      *task = dq->tasks[--dq->tail];
+    }
+    __atomic_sub_fetch(&job->queued, 1, __ATOMIC_RELAXED);
+  }
+
+  deque_unlock(dq);
+
+  return found;
+}
+
+/**
+ * Returns true if the index beside a capture file exists, is at least as
+ * new as the capture, and shows that no frame of it can match.
+ */
+static bool ruled_out_by_index(const char* path, const mems_query* query, uint64_t* frames)
+{
+#if !defined(WIN32)
+  mems_session_index index;
+  struct stat capture;
+  struct stat sidecar;
+  char* index_path;
+  bool ruled_out = false;
+
+  if ((index_path = (char*)malloc(strlen(path) + sizeof(MEMS_INDEX_SUFFIX))) == NULL)
+  {
+    return false;
+  }
+  strcpy(index_path, path);
+  strcat(index_path, MEMS_INDEX_SUFFIX);
+
+  if ((stat(path, &capture) == 0) && (stat(index_path, &sidecar) == 0) &&
+      (sidecar.st_mtime >= capture.st_mtime) && mems_read_index(&index, index_path) &&
+      !index_may_match(query, &index))
+  {
+    *frames = index.frames;
+    ruled_out = true;
+  }
+
+  free(index_path);
+
+  return ruled_out;
+#else
+  return false;
+#endif
+}
+
+static void scan_chunk(query_job* job, int idx, uint32_t chunk);
+
+/**
+ * Maps a file, divides it into chunks of MEMS_QUERY_CHUNK_RECORDS records,
+ * and queues a scan task for each chunk on the worker's own deque.
+ */
+static void plan_file(query_job* job, int worker, int idx)
+{
+  query_file* file = &job->files[idx];
+  mems_capture_map walk;
+  const mems_capture_record* record;
+  const uint8_t* payload;
+  size_t* grown;
+  uint32_t allocated = 0;
+  uint32_t records = 0;
+  uint32_t chunk;
+
+  if (job->use_index && ruled_out_by_index(job->paths[idx], job->query, &file->indexed_frames))
+  {
+    file->skipped = true;
+    return;
+  }
+
+  if (!mems_capture_map_open(&file->map, job->paths[idx]))
+  {
+    file->failed = true;
+    return;
+  }
+  file->profile = mems_find_profile(file->map.header.d0_response);
+
+  // only the record headers are touched while finding the chunk boundaries
+  walk = file->map;
+  do
+  {
+    if ((records % MEMS_QUERY_CHUNK_RECORDS) == 0)
+    {
+      if (file->chunk_count + 1 >= allocated)
+      {
+        allocated = allocated * 2 + 8;
+        if ((grown = realloc(file->chunk_offsets, allocated * sizeof(size_t))) == NULL)
+        {
+          file->failed = true;
+          mems_capture_map_close(&file->map);
+          return;
+        }
+        file->chunk_offsets = grown;
+      }
+      file->chunk_offsets[file->chunk_count++] = walk.offset;
+    }
+    records++;
+  } while (mems_capture_map_next(&walk, &record, &payload));
+
+  // a boundary found after the last record starts an empty chunk; the
+  // entry after the final chunk marks its end
+  if (file->chunk_offsets[file->chunk_count - 1] == walk.offset)
+  {
+    file->chunk_count--;
+  }
+  file->chunk_offsets[file->chunk_count] = walk.offset;
+
+  if ((file->chunk_count == 0) ||
+      ((file->partials = (query_partial*)calloc(file->chunk_count, sizeof(query_partial))) == NULL))
+  {
+    file->failed = (file->chunk_count > 0);
+    mems_capture_map_close(&file->map);
+    return;
+  }
+
+  file->chunks_left = file->chunk_count;
+  for (chunk = 0; chunk < file->chunk_count; ++chunk)
+  {
+    if (!deque_push(job, &job->deques[worker], idx, chunk))
+    {
+      // scan it here rather than lose it
+      scan_chunk(job, idx, chunk);
+    }
+  }
+}
+
+/**
+ * Decodes the frames of one chunk and aggregates those that match.
+ */
+static void scan_chunk(query_job* job, int idx, uint32_t chunk)
+{
+  query_file* file = &job->files[idx];
+  query_partial* part = &file->partials[chunk];
+  mems_capture_map cursor = file->map;
+  const mems_capture_record* record;
+  const uint8_t* payload;
+  mems_data data;
+  mems_query_channel* ch;
+  size_t end = file->chunk_offsets[chunk + 1];
+  float value;
+  int field;
+
+  cursor.offset = file->chunk_offsets[chunk];
+
+  while ((cursor.offset < end) && mems_capture_map_next(&cursor, &record, &payload))
+  {
+    if ((record->type != MEMS_Record_Frames) ||
+        (record->length < sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d)))
+    {
+      continue;
+    }
+
+    mems_decode_frames(file->profile, (const mems_data_frame_80*)payload,
+                       (const mems_data_frame_7d*)(payload + sizeof(mems_data_frame_80)), &data);
+    part->frames++;
+
+    if (!mems_query_match(job->query, &data))
+    {
+      continue;
+    }
+
+    for (field = 0; field < MEMS_Field_Count; ++field)
+    {
+      ch = &part->channels[field];
+      value = mems_field_value(&data, (enum mems_field)field);
+      if ((part->matched == 0) || (value < ch->min))
+      {
+        ch->min = value;
+      }
+      if ((part->matched == 0) || (value > ch->max))
+      {
+        ch->max = value;
+      }
+      ch->sum += value;
+    }
+    part->matched++;
+  }
+
+  if (__atomic_sub_fetch(&file->chunks_left, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    mems_capture_map_close(&file->map);
+  }
+}
+
+/**
+ * Runs tasks from the worker's own deque, stealing from the others when it
+ * is empty, until every task has been finished. A worker that finds no
+ * task sleeps until one is queued.
+ */
+static void* query_worker_main(void* arg)
+{
+  query_worker* self = (query_worker*)arg;
+  query_job* job = self->job;
+  query_task task;
+  bool found;
+  int victim;
+
+  while (__atomic_load_n(&job->pending, __ATOMIC_ACQUIRE) > 0)
+  {
+    found = deque_take(job, &job->deques[self->id], false, &task);
+    for (victim = 1; !found && (victim < job->workers); ++victim)
+    {
+      found = deque_take(job, &job->deques[(self->id + victim) % job->workers], true, &task);
+    }
+
+    if (!found)
+    {
+      // the remaining tasks are running elsewhere and may yet queue more
+#if !defined(WIN32)
+      pthread_mutex_lock(&job->mutex);
+      while ((__atomic_load_n(&job->queued, __ATOMIC_ACQUIRE) == 0) &&
+             (__atomic_load_n(&job->pending, __ATOMIC_ACQUIRE) > 0))
+      {
+        pthread_cond_wait(&job->changed, &job->mutex);
+      }
+      pthread_mutex_unlock(&job->mutex);
+#endif
+      continue;
+    }
+
+    if (task.chunk == MEMS_QUERY_PLAN)
+    {
+      plan_file(job, self->id, task.file);
+    }
+    else
+    {
+      scan_chunk(job, task.file, task.chunk);
+    }
+
+    if (__atomic_sub_fetch(&job->pending, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+      job_notify(job);
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Adds the aggregates of one chunk to the overall result.
+ */
+static void merge_partial(mems_query_result* result, const query_partial* part)
+{
+  int field;
+
+  if (part->matched > 0)
+  {
+    for (field = 0; field < MEMS_Field_Count; ++field)
+    {
+      if ((result->matched == 0) || (part->channels[field].min < result->channels[field].min))
+      {
+        result->channels[field].min = part->channels[field].min;
+      }
+      if ((result->matched == 0) || (part->channels[field].max > result->channels[field].max))
+      {
+        result->channels[field].max = part->channels[field].max;
+      }
+      result->channels[field].sum += part->channels[field].sum;
+    }
+  }
+
+  result->frames += part->frames;
+  result->matched += part->matched;
+}
+
+/**
+ * Evaluates a query over the frames of a set of capture files. Each file is
+ * mapped into memory and divided into chunks, which a pool of worker threads
+ * decodes and filters; a worker that runs out of chunks steals from the
+ * others. The partial results are merged in file and chunk order, and the
+ * chunks don't depend on the number of threads, so the result is the same
+ * however many threads are used.
+ * @param paths Capture files to query
+ * @param count Number of capture files
+ * @param query Compiled filter expression
+ * @param threads Number of worker threads (at most 64); 0 for one per file
+ * @param use_index If true, files whose up-to-date index shows that no frame
+ *   can match are skipped without being read
+ * @param result Receives the aggregates over the matching frames
+ * @param matched_per_file Receives the number of matching frames in each
+ *   file; may be NULL
+ * @return True if the query ran (individual files may still have failed;
+ *   see result->files_failed)
+ */
+bool mems_query_files(const char* const* paths, int count, const mems_query* query, int threads,
+                      bool use_index, mems_query_result* result, uint64_t* matched_per_file)
+{
+  query_job* job;
+  query_worker workers[MEMS_QUERY_MAX_THREADS];
+#if !defined(WIN32)
+  pthread_t ids[MEMS_QUERY_MAX_THREADS];
+  bool started[MEMS_QUERY_MAX_THREADS];
+#endif
+  query_file* file;
+  uint64_t matched;
+  uint32_t chunk;
+  int idx;
+  bool ok = true;
+
+  memset(result, 0, sizeof(mems_query_result));
+
+  if (((job = (query_job*)calloc(1, sizeof(query_job))) == NULL) ||
+      ((job->files = (query_file*)calloc((count > 0) ? count : 1, sizeof(query_file))) == NULL))
+  {
+    free(job);
+    return false;
+  }
+
+  job->paths = paths;
+  job->query = query;
+  job->use_index = use_index;
+
+#if !defined(WIN32)
+  job->workers = ((threads <= 0) || (threads > count)) ? count : threads;
+  if (job->workers > MEMS_QUERY_MAX_THREADS)
+  {
+    job->workers = MEMS_QUERY_MAX_THREADS;
+  }
+#endif
+  if (job->workers < 1)
+  {
+    job->workers = 1;
+  }
+
+#if !defined(WIN32)
+  pthread_mutex_init(&job->mutex, NULL);
+  pthread_cond_init(&job->changed, NULL);
+#endif
+
+  for (idx = 0; idx < job->workers; ++idx)
+  {
+#if !defined(WIN32)
+    pthread_mutex_init(&job->deques[idx].mutex, NULL);
+#endif
+    workers[idx].job = job;
+    workers[idx].id = idx;
+  }
+
+  // the files are dealt out in turn, so each worker starts with its own
+  for (idx = 0; ok && (idx < count); ++idx)
+  {
+    ok = deque_push(job, &job->deques[idx % job->workers], idx, MEMS_QUERY_PLAN);
+  }
+
+  if (ok)
+  {
+#if !defined(WIN32)
+    for (idx = 1; idx < job->workers; ++idx)
+    {
+      started[idx] = (pthread_create(&ids[idx], NULL, query_worker_main, &workers[idx]) == 0);
+    }
+#endif
+
+    // the calling thread is worker 0
+    query_worker_main(&workers[0]);
+
+#if !defined(WIN32)
+    for (idx = 1; idx < job->workers; ++idx)
+    {
+      if (started[idx])
+      {
+        pthread_join(ids[idx], NULL);
+      }
+    }
+#endif
+  }
+
+  for (idx = 0; idx < count; ++idx)
+  {
+    file = &job->files[idx];
+    matched = result->matched;
+
+    if (file->failed)
+    {
+      result->files_failed++;
+    }
+    else
+    {
+      result->files++;
+      if (file->skipped)
+      {
+        result->files_skipped++;
+        result->frames += file->indexed_frames;
+      }
+      for (chunk = 0; chunk < file->chunk_count; ++chunk)
+      {
+        merge_partial(result, &file->partials[chunk]);
+      }
+    }
+
+    if (matched_per_file)
+    {
+      matched_per_file[idx] = result->matched - matched;
+    }
+
+    free(file->chunk_offsets);
+    free(file->partials);
+  }
+
+  for (idx = 0; idx < job->workers; ++idx)
+  {
+#if !defined(WIN32)
+    pthread_mutex_destroy(&job->deques[idx].mutex);
+#endif
+    free(job->deques[idx].tasks);
+  }
+#if !defined(WIN32)
+  pthread_cond_destroy(&job->changed);
+  pthread_mutex_destroy(&job->mutex);
+#endif
+  free(job->files);
+  free(job);
+
+  return ok;
+}
@@ -2,12 +2,18 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <string.h>
 #include <strings.h>
 #include <stdlib.h>
 #include <libgen.h>
 #include "rosco.h"
 
+#if defined(WIN32)
+  #include <io.h>
+  #include <fcntl.h>
+#endif
+
 enum command_idx
 {
   MC_Read = 0,
@@ -21,7 +27,12 @@ enum command_idx
   MC_Coil = 8,
   MC_Injectors = 9,
   MC_Interactive = 10,
-  MC_Num_Commands = 11
+  MC_IAC_Sweep = 11,
+  MC_Script = 12,
+  MC_Scan = 13,
+  MC_Dump = 14,
+  MC_Faults = 15,
+  MC_Num_Commands = 16
 };
 
 static const char* commands[] = { "read",
@@ -34,7 +45,12 @@ static const char* commands[] = { "read",
   "ac",
   "coil",
   "injectors",
-  "interactive"
+  "interactive",
+  "iac-sweep",
+  "script",
+  "scan",
+  "dump",
+  "faults"
 };
 
 
@@ -55,52 +71,112 @@ void printbuf(uint8_t* buf, unsigned int count)
 }
 
 
-int16_t readserial(mems_info* info, uint8_t* buffer, uint16_t quantity)
+void print_iac_step(const mems_iac_step* step, uint64_t timestamp_us, void* capture)
 {
-  int16_t bytesread = -1;
+  printf("%s %3u  %6u us\n", (step->command == MEMS_OpenIAC) ? "open " : "close",
+         step->position, step->latency_us);
+
+  if (capture)
+  {
+    mems_capture_iac_callback(step, timestamp_us, capture);
+  }
+}
 
-#if defined (WIN32)
-  DWORD w32BytesRead = 0;
 
-  if ((ReadFile(info->sd, (UCHAR *) buffer, quantity, &w32BytesRead, NULL) == TRUE) && (w32BytesRead > 0))
+void print_script_step(const mems_script_step* step, const uint8_t* response,
+                       uint16_t length, bool passed, void* context)
+{
+  (void)context;
+  printf("%3u: ", step->line);
+  printbuf((uint8_t*)response, length);
+  if (!passed)
   {
-    bytesread = w32BytesRead;
+    printf("Step on line %u failed.\n", step->line);
   }
-#else
-  bytesread = read(info->sd, buffer, quantity);
-#endif
+}
+
+
+/**
+ * Appends each newly read batch of memory to the dump file, so that an
+ * interrupted dump can be resumed from what has been saved.
+ */
+void save_dump_progress(const mems_memory_progress* progress, const uint8_t* buffer, void* fp)
+{
+  long saved = ftell((FILE*)fp);
 
-  return bytesread;
+  if ((saved >= 0) && ((uint32_t)saved < progress->done))
+  {
+    fwrite(buffer + saved, progress->done - saved, 1, (FILE*)fp);
+    fflush((FILE*)fp);
+  }
+  printf("\r%u / %u bytes", progress->done, progress->length);
+  fflush(stdout);
 }
 
 
-int16_t writeserial(mems_info* info, uint8_t* buffer, uint16_t quantity)
+/**
+ * Reads a range of ECU memory into a file. If the file already holds the
+ * start of the range, the dump resumes where it left off.
+ */
+bool dump_memory(mems_info* info, const mems_memory_protocol* protocol, const char* path,
+                 uint32_t start, uint32_t length)
 {
-  int16_t byteswritten = -1;
+  mems_memory_progress progress;
+  uint8_t* buffer;
+  FILE* fp;
+  long existing = 0;
+  bool status = false;
 
-#if defined(WIN32)
-  DWORD w32BytesWritten = 0;
+  if ((buffer = (uint8_t*)malloc(length)) == NULL)
+  {
+    printf("Error allocating dump buffer memory.\n");
+    return false;
+  }
+
+  mems_memory_progress_init(&progress, start, length);
 
-  if ((WriteFile(info->sd, (UCHAR*) buffer, quantity, &w32BytesWritten, NULL) == TRUE) &&
-      (w32BytesWritten == quantity))
+  if ((fp = fopen(path, "r+b")) != NULL)
+  {
+    fseek(fp, 0, SEEK_END);
+    existing = ftell(fp);
+    if ((existing > 0) && ((uint32_t)existing <= length) &&
+        (fseek(fp, 0, SEEK_SET) == 0) && (fread(buffer, existing, 1, fp) == 1))
+    {
+      progress.done = existing;
+      progress.crc32 = mems_crc32(0, buffer, existing);
+      printf("Resuming at offset %ld.\n", existing);
+    }
+    fseek(fp, progress.done, SEEK_SET);
+  }
+  else
   {
-    byteswritten = w32BytesWritten;
+    fp = fopen(path, "wb");
   }
-#else
-  byteswritten = write(info->sd, buffer, quantity);
-#endif
 
-  return byteswritten;
+  if (fp == NULL)
+  {
+    printf("Error: could not create dump file (%s).\n", path);
+  }
+  else
+  {
+    status = mems_read_memory(info, protocol, &progress, buffer, save_dump_progress, fp);
+    printf("\n%s: %u bytes from 0x%X, CRC-32 %08X\n", status ? "Complete" : "Incomplete",
+           progress.done, start, progress.crc32);
+    fclose(fp);
+  }
+
+  free(buffer);
+
+  return status;
 }
 
 
-bool interactive_mode(mems_info* info, uint8_t* response_buffer)
+bool interactive_mode(mems_info* info, uint8_t* response_buffer, uint16_t buffer_size, mems_length_table* lengths)
 {
   size_t icmd_size = 8;
   char* icmd_buf_ptr;
   uint8_t icmd;
-  ssize_t bytes_read = 0;
-  ssize_t total_bytes_read = 0;
+  int16_t total_bytes_read = 0;
   bool quit = false;
 
   if ((icmd_buf_ptr = (char*)malloc(icmd_size)) != NULL)
@@ -118,24 +194,17 @@ bool interactive_mode(mems_info* info, uint8_t* response_buffer)
         icmd = strtoul(icmd_buf_ptr, NULL, 16);
         if ((icmd >= 0) && (icmd <= 0xff))
         {
-          if (writeserial(info, &icmd, 1) == 1)
-          {
-            bytes_read = 0;
-            total_bytes_read = 0;
-            do
-            {
-              bytes_read = readserial(info, response_buffer + total_bytes_read, 1);
-              total_bytes_read += bytes_read;
-            } while (bytes_read > 0);
+          // commands seen before are read by their learned length; new ones
+          // are read until the line goes quiet, and their length is learned
+          total_bytes_read = mems_command_learned(info, lengths, icmd, response_buffer, buffer_size);
 
-            if (total_bytes_read > 0)
-            {
-              printbuf(response_buffer, total_bytes_read);
-            }
-            else
-            {
-              printf("No response from ECU.\n");
-            }
+          if (total_bytes_read > 0)
+          {
+            printbuf(response_buffer, total_bytes_read);
+          }
+          else if (total_bytes_read == 0)
+          {
+            printf("No response from ECU.\n");
           }
           else
           {
@@ -160,15 +229,163 @@ bool interactive_mode(mems_info* info, uint8_t* response_buffer)
   {
     printf("Error allocating command buffer memory.\n");
   }
+
+  return true;
+}
+
+/**
+ * Prints the statistics of each decoded channel, as kept by the stats
+ * engine while the frames were acquired.
+ */
+void print_stats(FILE* fp, const mems_stats* stats)
+{
+  mems_stats_snapshot snap;
+  int field;
+
+  fprintf(fp, "%-20s %8s %10s %10s %10s %10s %10s %10s %10s\n",
+          "channel", "samples", "min", "max", "mean", "stddev", "p50", "p90", "p99");
+  for (field = 0; field < MEMS_Field_Count; ++field)
+  {
+    if (mems_stats_read(stats, (enum mems_field)field, &snap) && (snap.count > 0))
+    {
+      fprintf(fp, "%-20s %8llu %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+              mems_field_name((enum mems_field)field), (unsigned long long)snap.count,
+              snap.min, snap.max, snap.mean, snap.stddev, snap.p50, snap.p90, snap.p99);
+    }
+  }
 }
 
+/**
+ * Prints a sample from one of several devices, either through the output
+ * stream (if a format was chosen) or as text.
+ */
+bool print_device_sample(const mems_device_sample* sample, void* output)
+{
+  const mems_data* data = &sample->frame.data;
+  const uint8_t* frameptr;
+  uint8_t bufidx;
+
+  if (((mems_output*)output)->fp)
+  {
+    return mems_output_device_frame((mems_output*)output, sample->device, &sample->frame, sample->timestamp_us);
+  }
+
+  printf("Device %u at %llu us\n", sample->device, (unsigned long long)sample->timestamp_us);
+  printf("RPM: %u\nCoolant (deg C): %u\nAmbient (deg C): %u\nIntake air (deg C): %u\n"
+         "Fuel temp (deg C): %u\nMAP (kPa): %f\nMain voltage: %f\nThrottle pot voltage: %f\n"
+         "Idle switch: %u\nPark/neutral switch: %u\nFault codes: %u\nIAC position: %u\n",
+         data->engine_rpm, data->coolant_temp_c, data->ambient_temp_c,
+         data->intake_air_temp_c, data->fuel_temp_c, data->map_kpa, data->battery_voltage,
+         data->throttle_pot_voltage, data->idle_switch, data->park_neutral_switch,
+         data->fault_codes, data->iac_position);
+
+  frameptr = (const uint8_t*)&sample->frame.frame80;
+  printf("80: ");
+  for (bufidx = 0; bufidx < sizeof(mems_data_frame_80); ++bufidx)
+  {
+    printf("%02X ", frameptr[bufidx]);
+  }
+  frameptr = (const uint8_t*)&sample->frame.frame7d;
+  printf("\n7D: ");
+  for (bufidx = 0; bufidx < sizeof(mems_data_frame_7d); ++bufidx)
+  {
+    printf("%02X ", frameptr[bufidx]);
+  }
+  printf("\n-------------\n");
+
+  return true;
+}
+
+
+/**
+ * Connects to each device in a comma-separated list and reads samples from
+ * all of them concurrently, printing them as one stream in time order.
+ */
+bool read_devices(char* devlist, uint32_t samples, const mems_connection_options* options,
+                  const enum mems_output_format* format, uint32_t flush_ms, FILE* msg_fp)
+{
+  mems_info* infos;
+  mems_info* devices[MEMS_MAX_DEVICES];
+  uint8_t d0_response[MEMS_MAX_DEVICES][MEMS_D0_RESPONSE_LEN];
+  mems_output output;
+  char* name;
+  int count = 0;
+  int idx;
+  bool success = true;
+
+  if ((infos = (mems_info*)calloc(MEMS_MAX_DEVICES, sizeof(mems_info))) == NULL)
+  {
+    fprintf(msg_fp, "Error allocating device memory.\n");
+    return false;
+  }
+
+  for (name = strtok(devlist, ","); success && name; name = strtok(NULL, ","))
+  {
+    if (count == MEMS_MAX_DEVICES)
+    {
+      fprintf(msg_fp, "Error: at most %d devices may be read together.\n", MEMS_MAX_DEVICES);
+      success = false;
+    }
+    else
+    {
+      mems_init(&infos[count]);
+      devices[count] = &infos[count];
+      if (!mems_connect_spec(&infos[count], name, options))
+      {
+        fprintf(msg_fp, "Error: could not open serial device (%s).\n", name);
+        mems_cleanup(&infos[count]);
+        success = false;
+      }
+      else if (!mems_init_link(&infos[count], d0_response[count]))
+      {
+        fprintf(msg_fp, "Error in initialization sequence (%s).\n", name);
+        mems_disconnect(&infos[count]);
+        mems_cleanup(&infos[count]);
+        success = false;
+      }
+      else
+      {
+        fprintf(msg_fp, "Device %d (%s): D0 response %02X %02X %02X %02X, profile %s\n", count, name,
+                d0_response[count][0], d0_response[count][1], d0_response[count][2], d0_response[count][3],
+                infos[count].profile->name);
+        count++;
+      }
+    }
+  }
+
+  if (success)
+  {
+    fprintf(msg_fp, "\n");
+    memset(&output, 0, sizeof(output));
+    if (format)
+    {
+      mems_output_open(&output, stdout, *format, flush_ms, d0_response[0], true);
+    }
+
+    success = mems_poll_devices(devices, count, samples, print_device_sample, &output);
+
+    if (output.fp)
+    {
+      mems_output_close(&output);
+    }
+  }
+
+  for (idx = 0; idx < count; ++idx)
+  {
+    mems_disconnect(&infos[idx]);
+    mems_cleanup(&infos[idx]);
+  }
+  free(infos);
+
+  return success;
+}
+
+
 int main(int argc, char **argv)
 {
   bool success = false;
   int cmd_idx = 0;
   mems_data data;
-  mems_data_frame_80 frame80;
-  mems_data_frame_7d frame7d;
   librosco_version ver;
   mems_info info;
   uint8_t* frameptr;
@@ -184,76 +401,309 @@ int main(int argc, char **argv)
   // this is twice as large as the micro's on-chip ROM, so it's probably sufficient
   uint8_t response_buffer[16384];
 
+#if defined(WIN32)
   char win32devicename[16];
+#endif
+  mems_connection_options options;
+  int opt;
+  char* devname;
+  char* cmdname;
+  char* capture_path = NULL;
+  mems_capture_writer capture;
+  mems_iac_result iac_result;
+  mems_script script;
+  mems_length_table lengths;
+  mems_scan_entry command_map[256];
+  int map_count;
+  FILE* map_fp;
+  char* lengths_path = NULL;
+  char* memory_spec = NULL;
+  mems_memory_protocol memory_protocol;
+  mems_frame_ring ring;
+  const mems_frame* frame;
+  char* trigger_spec = NULL;
+  mems_trigger_options trigger_options;
+  mems_trigger trigger;
+  mems_active_fault faults[MEMS_DTC_BITS];
+  const mems_fault_info* fault_info;
+  int fault_count;
+  int fault_idx;
+  char* format_name = NULL;
+  enum mems_output_format output_format = MEMS_Format_CSV;
+  uint32_t flush_ms = 1000;
+  mems_output output;
+  mems_stats stats;
+  bool show_stats = false;
+  FILE* msg_fp = stdout;
+  static const struct option long_options[] = {
+    { "format", required_argument, NULL, 'f' },
+    { "flush", required_argument, NULL, 'F' },
+    { NULL, 0, NULL, 0 }
+  };
 
   ver = mems_get_lib_version();
+  mems_default_connection_options(&options);
 
-  if (argc < 3)
+  while ((opt = getopt_long(argc, argv, "b:f:F:l:LM:St:T:w:", long_options, NULL)) != -1)
+  {
+    switch (opt)
+    {
+    case 'b':
+      options.baud = strtoul(optarg, NULL, 0);
+      break;
+    case 'f':
+      format_name = optarg;
+      break;
+    case 'F':
+      flush_ms = strtoul(optarg, NULL, 0);
+      break;
+    case 'l':
+      lengths_path = optarg;
+      break;
+    case 'L':
+      options.low_latency = true;
+      break;
+    case 'M':
+      memory_spec = optarg;
+      break;
+    case 'S':
+      show_stats = true;
+      break;
+    case 't':
+      options.ftdi_latency_ms = strtoul(optarg, NULL, 0);
+      break;
+    case 'T':
+      trigger_spec = optarg;
+      break;
+    case 'w':
+      capture_path = optarg;
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (argc - optind < 2)
   {
     printf("readmems using librosco v%d.%d.%d\n", ver.major, ver.minor, ver.patch);
     printf("Diagnostic utility using ROSCO protocol for MEMS 1.6 systems\n");
-    printf("Usage: %s <serial device> <command> [read-loop-count]\n", basename(argv[0]));
+    printf("Usage: %s [options] <serial device> <command> [read-loop-count]\n", basename(argv[0]));
     printf(" where <command> is one of the following:\n");
     for (cmd_idx = 0; cmd_idx < MC_Num_Commands; ++cmd_idx)
     {
       printf("\t%s\n", commands[cmd_idx]);
     }
     printf(" and [read-loop-count] is either a number or 'inf' to read forever.\n");
+    printf("For iac-sweep, the third argument is the spacing between steps in microseconds.\n");
+    printf("For script, the third argument is the file of commands to run.\n");
+    printf("For scan, the third argument is the file to write the command map to (default stdout).\n");
+    printf("For dump, the arguments are <file> <start address> <length>, and -M is required.\n");
+    printf(" The sim device has no memory to dump; memssim -M simulates one.\n");
+    printf("The serial device may also be tcp:<host>:<port> (serial bridge), replay:<file>\n");
+    printf(" (capture file), replay-rt:<file> (capture at recorded rate), or sim (simulated ECU).\n");
+    printf("For read and read-raw, several devices may be given, separated by commas; they are\n");
+    printf(" sampled concurrently and printed as one stream in time order, labelled by device\n");
+    printf(" (in any format but binary, whose readers expect the frames of a single ECU).\n");
+    printf("Options:\n");
+    printf("\t-b <baud>  line rate (default %u)\n", MEMS_DEFAULT_BAUD);
+    printf("\t-f, --format=<csv|jsonl|binary>\n");
+    printf("\t           write the samples acquired by read/read-raw in a format suited\n");
+    printf("\t           to other programs, with the other messages sent to stderr\n");
+    printf("\t-F, --flush=<ms>\n");
+    printf("\t           with -f, longest time a sample is buffered (default 1000)\n");
+    printf("\t-l <file>  keep the response lengths learned by interactive/scan in a file\n");
+    printf("\t-L         request low-latency handling from the serial driver\n");
+    printf("\t-M <spec>  memory read commands, e.g. addr=A0:2,read=A1,block=64[,inc][,depth=8]\n");
+    printf("\t-S         with read/read-raw, print statistics of each channel at the end\n");
+    printf("\t-t <ms>    set the latency timer of FTDI adapters\n");
+    printf("\t-T <spec>  with -w, only record frames around a trigger, e.g.\n");
+    printf("\t           rpmdrop=800,faults,idle=200,lambda[,pre=10000][,post=5000]\n");
+    printf("\t-w <file>  record the frames acquired by read/read-raw, or the steps of\n");
+    printf("\t           iac-sweep, to a capture file\n");
+    printf("Additional ECU variant profiles may be loaded from the file named by $ROSCO_PROFILES.\n");
 
     return 0;
   }
 
-  while ((cmd_idx < MC_Num_Commands) && (strcasecmp(argv[2], commands[cmd_idx]) != 0))
+  devname = argv[optind];
+  cmdname = argv[optind + 1];
+
+  while ((cmd_idx < MC_Num_Commands) && (strcasecmp(cmdname, commands[cmd_idx]) != 0))
   {
     cmd_idx += 1;
   }
 
   if (cmd_idx >= MC_Num_Commands)
   {
-    printf("Invalid command: %s\n", argv[2]);
+    printf("Invalid command: %s\n", cmdname);
     return -1;
   }
 
-  if (argc >= 4)
+  if (argc - optind >= 3)
   {
-    if (strcmp(argv[3], "inf") == 0)
+    if (strcmp(argv[optind + 2], "inf") == 0)
     {
       read_inf = true;
     }
     else
     {
-      read_loop_count = strtoul(argv[3], NULL, 0);
+      read_loop_count = strtoul(argv[optind + 2], NULL, 0);
     }
   }
 
+  if ((cmd_idx == MC_Dump) &&
+      ((argc - optind < 5) || !memory_spec || !mems_parse_memory_protocol(memory_spec, &memory_protocol)))
+  {
+    printf("Error: dump requires -M <memory protocol> and <file> <start> <length>.\n");
+    return -1;
+  }
+
+  if ((cmd_idx == MC_Dump) && (strcmp(devname, "sim") == 0))
+  {
+    printf("Error: the sim device has no memory; dump from the device of memssim -M instead.\n");
+    return -1;
+  }
+
+  if (trigger_spec && (!capture_path || !mems_parse_trigger_options(trigger_spec, &trigger_options)))
+  {
+    printf("Error: -T requires -w <file> and a valid trigger specification.\n");
+    return -1;
+  }
+
+  if (format_name)
+  {
+    if (!mems_parse_output_format(format_name, &output_format))
+    {
+      printf("Error: unknown output format (%s).\n", format_name);
+      return -1;
+    }
+
+    // keep stdout for the samples alone, so that it can be parsed
+    msg_fp = stderr;
+#if defined(WIN32)
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+  }
+
   if (cmd_idx != MC_Interactive)
   {
-    printf("Running command: %s\n", commands[cmd_idx]);
+    fprintf(msg_fp, "Running command: %s\n", commands[cmd_idx]);
+  }
+
+  // optional file of additional ECU variant profiles
+  if ((getenv("ROSCO_PROFILES") != NULL) && (mems_load_profiles(getenv("ROSCO_PROFILES")) < 0))
+  {
+    fprintf(msg_fp, "Warning: could not load profiles from %s\n", getenv("ROSCO_PROFILES"));
+  }
+
+  // several devices, separated by commas, are sampled together
+  if (strchr(devname, ',') != NULL)
+  {
+    if (((cmd_idx != MC_Read) && (cmd_idx != MC_Read_Raw)) || capture_path)
+    {
+      fprintf(msg_fp, "Error: several devices may only be given for read and read-raw, without -w.\n");
+      return -1;
+    }
+
+    // binary output is read back as the capture of a single ECU, so the
+    // samples of several can't be written to it (see mems_output_open())
+    if (format_name && (output_format == MEMS_Format_Binary))
+    {
+      fprintf(msg_fp, "Error: binary output may only be written for a single device.\n");
+      return -1;
+    }
+
+    return read_devices(devname, read_inf ? 0 : read_loop_count, &options,
+                        format_name ? &output_format : NULL, flush_ms, msg_fp) ? 0 : -2;
   }
 
   mems_init(&info);
+  memset(&capture, 0, sizeof(capture));
+  memset(&trigger, 0, sizeof(trigger));
+  memset(&output, 0, sizeof(output));
 
 #if defined(WIN32)
   // correct for microsoft's legacy nonsense by prefixing with "\\.\"
-  strcpy(win32devicename, "\\\\.\\");
-  strncat(win32devicename, argv[1], 16);
-  if (mems_connect(&info, win32devicename))
+  // (only for COM port names, not for the other transports' specifications)
+  if (strchr(devname, ':') == NULL)
+  {
+    strcpy(win32devicename, "\\\\.\\");
+    strncat(win32devicename, devname, 16);
+    devname = win32devicename;
+  }
+  if (mems_connect_spec(&info, devname, &options))
 #else
-  if (mems_connect(&info, argv[1]))
+  if (mems_connect_spec(&info, devname, &options))
 #endif
   {
+    if (options.ftdi_latency_ms > 0)
+    {
+      if (info.latency.is_ftdi)
+      {
+        fprintf(msg_fp, "FTDI latency timer: %d ms before, %d ms after\n",
+                info.latency.before_ms, info.latency.after_ms);
+      }
+      else
+      {
+        fprintf(msg_fp, "Device is not an FTDI adapter; latency timer unchanged.\n");
+      }
+    }
+
     if (mems_init_link(&info, response_buffer))
     {
-      printf("ECU responded to D0 command with: %02X %02X %02X %02X\n\n",
-             response_buffer[0], response_buffer[1], response_buffer[2], response_buffer[3]);
+      fprintf(msg_fp, "ECU responded to D0 command with: %02X %02X %02X %02X\n",
+              response_buffer[0], response_buffer[1], response_buffer[2], response_buffer[3]);
+      fprintf(msg_fp, "Using profile: %s\n\n", info.profile->name);
+
+      // samples are acquired into a ring, from which the capture file
+      // (if any) is written directly
+      if (!mems_ring_init(&ring, 16))
+      {
+        fprintf(msg_fp, "Error allocating frame buffer memory.\n");
+        cmd_idx = MC_Num_Commands;
+      }
+      else if (capture_path && ((cmd_idx == MC_Read) || (cmd_idx == MC_Read_Raw) || (cmd_idx == MC_IAC_Sweep)))
+      {
+        if (!mems_capture_open(&capture, capture_path, response_buffer))
+        {
+          fprintf(msg_fp, "Error: could not create capture file (%s).\n", capture_path);
+          cmd_idx = MC_Num_Commands;
+        }
+        else if (!trigger_spec)
+        {
+          mems_ring_subscribe(&ring, mems_capture_frame_callback, &capture);
+        }
+        else if (mems_trigger_init(&trigger, &trigger_options, &capture))
+        {
+          mems_ring_subscribe(&ring, mems_trigger_frame_callback, &trigger);
+        }
+        else
+        {
+          fprintf(msg_fp, "Error allocating trigger buffer memory.\n");
+          cmd_idx = MC_Num_Commands;
+        }
+      }
+
+      if (format_name && ((cmd_idx == MC_Read) || (cmd_idx == MC_Read_Raw)))
+      {
+        mems_output_open(&output, stdout, output_format, flush_ms, response_buffer, false);
+        mems_ring_subscribe(&ring, mems_output_frame_callback, &output);
+      }
+
+      if (show_stats && ((cmd_idx == MC_Read) || (cmd_idx == MC_Read_Raw)))
+      {
+        mems_stats_init(&stats, (1u << MEMS_Field_Count) - 1);
+        mems_ring_subscribe(&ring, mems_stats_frame_callback, &stats);
+      }
 
       switch (cmd_idx)
       {
       case MC_Read:
         while (read_inf || (read_loop_count-- > 0))
         {
-          if (mems_read(&info, &data))
+          if (((frame = mems_read_frame(&info, &ring)) != NULL) && !output.fp)
           {
+            data = frame->data;
             printf("RPM: %u\nCoolant (deg C): %u\nAmbient (deg C): %u\nIntake air (deg C): %u\n"
                    "Fuel temp (deg C): %u\nMAP (kPa): %f\nMain voltage: %f\nThrottle pot voltage: %f\n"
                    "Idle switch: %u\nPark/neutral switch: %u\nFault codes: %u\nIAC position: %u\n"
@@ -262,17 +712,17 @@ int main(int argc, char **argv)
                    data.intake_air_temp_c, data.fuel_temp_c, data.map_kpa, data.battery_voltage,
                    data.throttle_pot_voltage, data.idle_switch, data.park_neutral_switch,
                    data.fault_codes, data.iac_position);
-            success = true;
           }
+          success = success || (frame != NULL);
         }
         break;
 
       case MC_Read_Raw:
         while (read_inf || (read_loop_count-- > 0))
         {
-          if (mems_read_raw(&info, &frame80, &frame7d))
+          if (((frame = mems_read_frame(&info, &ring)) != NULL) && !output.fp)
           {
-            frameptr = (uint8_t*)&frame80;
+            frameptr = (uint8_t*)&frame->frame80;
             printf("80: ");
             for (bufidx = 0; bufidx < sizeof(mems_data_frame_80); ++bufidx)
             {
@@ -280,14 +730,32 @@ int main(int argc, char **argv)
             }
             printf("\n");
 
-            frameptr = (uint8_t*)&frame7d;
+            frameptr = (uint8_t*)&frame->frame7d;
             printf("7D: ");
             for (bufidx = 0; bufidx < sizeof(mems_data_frame_7d); ++bufidx)
             {
               printf("%02X ", frameptr[bufidx]);
             }
             printf("\n");
+          }
+          success = success || (frame != NULL);
+        }
+        break;
 
+      case MC_Faults:
+        while (read_inf || (read_loop_count-- > 0))
+        {
+          if ((frame = mems_read_frame(&info, &ring)) != NULL)
+          {
+            fault_count = mems_decode_faults(info.profile, &frame->frame80, &frame->frame7d, faults);
+            printf("%d active fault(s)\n", fault_count);
+            for (fault_idx = 0; fault_idx < fault_count; ++fault_idx)
+            {
+              fault_info = mems_fault_description((enum mems_fault)faults[fault_idx].fault);
+              printf("  dtc%u bit %u: %s", faults[fault_idx].bit / 8, faults[fault_idx].bit % 8,
+                     fault_info->description);
+              printf((fault_info->code > 0) ? " (code %u)\n" : "\n", fault_info->code);
+            }
             success = true;
           }
         }
@@ -358,28 +826,106 @@ int main(int argc, char **argv)
         success = mems_test_actuator(&info, MEMS_TestInjectors, NULL);
         break;
 
+      case MC_Dump:
+        success = dump_memory(&info, &memory_protocol, argv[optind + 2],
+                              strtoul(argv[optind + 3], NULL, 0), strtoul(argv[optind + 4], NULL, 0));
+        break;
+
       case MC_Interactive:
-        success = interactive_mode(&info, response_buffer);
+      case MC_Scan:
+        mems_length_table_init(&lengths);
+        if (lengths_path)
+        {
+          mems_length_table_load(&lengths, lengths_path);
+        }
+
+        if (cmd_idx == MC_Interactive)
+        {
+          success = interactive_mode(&info, response_buffer, sizeof(response_buffer), &lengths);
+        }
+        else if ((map_count = mems_scan_commands(&info, NULL, &lengths, command_map, NULL, NULL)) >= 0)
+        {
+          map_fp = (argc - optind >= 3) ? fopen(argv[optind + 2], "w") : stdout;
+          if (map_fp == NULL)
+          {
+            printf("Error: could not create command map (%s).\n", argv[optind + 2]);
+          }
+          else
+          {
+            success = mems_write_command_map(command_map, map_count, map_fp);
+            if (map_fp != stdout)
+            {
+              fclose(map_fp);
+              printf("Probed %d commands.\n", map_count);
+            }
+          }
+        }
+
+        if (lengths_path && lengths.modified && !mems_length_table_save(&lengths, lengths_path))
+        {
+          printf("Warning: could not save response lengths to %s\n", lengths_path);
+        }
+        break;
+
+      case MC_IAC_Sweep:
+        // the optional third argument is the step spacing rather than a loop count
+        read_loop_count = (argc - optind >= 3) ? read_loop_count : 0;
+        success = mems_iac_sweep(&info, read_loop_count, print_iac_step,
+                                 capture_path ? &capture : NULL, &iac_result);
+        printf("%s after %u commands (%u stalled) in %.3f s; final position %u\n",
+               success ? "Sweep complete" : "Sweep incomplete", iac_result.commands,
+               iac_result.stalls, iac_result.elapsed_us / 1000000.0, iac_result.final_pos);
+        break;
+
+      case MC_Script:
+        if (argc - optind < 3)
+        {
+          printf("Error: no script file given.\n");
+        }
+        else if (!mems_load_script(&script, argv[optind + 2]))
+        {
+          printf("Error: could not load script (%s).\n", argv[optind + 2]);
+        }
+        else
+        {
+          success = mems_run_script(&info, &script, print_script_step, NULL);
+          mems_free_script(&script);
+        }
         break;
 
       default:
         printf("Error: invalid command\n");
         break;
       }
+
+      if (capture_path)
+      {
+        if (trigger_spec)
+        {
+          fprintf(msg_fp, "Trigger fired %u time(s).\n", trigger.fired);
+        }
+        mems_capture_close(&capture);
+      }
+      if (output.fp)
+      {
+        mems_output_close(&output);
+      }
+      if (show_stats && ((cmd_idx == MC_Read) || (cmd_idx == MC_Read_Raw)))
+      {
+        print_stats(msg_fp, &stats);
+      }
+      mems_trigger_free(&trigger);
+      mems_ring_free(&ring);
     }
     else
     {
-      printf("Error in initialization sequence.\n");
+      fprintf(msg_fp, "Error in initialization sequence.\n");
     }
     mems_disconnect(&info);
   }
   else
   {
-#if defined(WIN32)
-    printf("Error: could not open serial device (%s).\n", win32devicename);
-#else
-    printf("Error: could not open serial device (%s).\n", argv[1]);
-#endif
+    fprintf(msg_fp, "Error: could not open serial device (%s).\n", devname);
   }
 
   mems_cleanup(&info);
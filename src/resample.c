@@ -0,0 +1,419 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// resample.c: This file contains routines that resample the decoded
+//             channels, which the ECU delivers at irregular times, onto
+//             a fixed-rate grid so that they can be aligned with data
+//             from other sources.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * Returns the time of the first grid point at or after the given time.
+ */
+static uint64_t first_point(const mems_resample_options* options, uint64_t time_us)
+{
+  uint64_t period = options->period_us;
+
+  if (time_us >= options->origin_us)
+  {
+    return options->origin_us + ((time_us - options->origin_us + period - 1) / period) * period;
+  }
+
+  return options->origin_us - ((options->origin_us - time_us) / period) * period;
+}
+
+/**
+ * Returns the weight given to the later of two samples at a grid point
+ * between them: 0 for zero-order hold, the fraction of the interval that has
+ * passed for linear interpolation, or NaN if the samples are further apart
+ * than the longest gap allowed.
+ */
+static float point_weight(const mems_resample_options* options, uint64_t point_us,
+                          uint64_t before_us, uint64_t after_us)
+{
+  if (point_us == before_us)
+  {
+    return 0.0f;
+  }
+
+  if ((options->max_gap_us > 0) && (after_us - before_us > options->max_gap_us))
+  {
+    return NAN;
+  }
+
+  if (options->method == MEMS_Resample_Linear)
+  {
+    return (float)((double)(point_us - before_us) / (double)(after_us - before_us));
+  }
+
+  return 0.0f;
+}
+
+/**
+ * Returns the monotonic time of a grid point that falls on a whole number of
+ * periods of wall-clock time, so that data resampled at the same rate from
+ * different sources (or different sessions) shares the same grid instants.
+ * @param anchor Clock anchor of the session (see mems_init_link())
+ * @param period_us Interval between grid points, in microseconds
+ * @return Time to use as the origin_us of a mems_resample_options; the
+ *   anchor's own monotonic time if its wall-clock time is unknown
+ */
+uint64_t mems_resample_origin(const mems_clock_anchor* anchor, uint32_t period_us)
+{
+  uint64_t offset;
+
+  if ((anchor->realtime_us <= 0) || (period_us == 0))
+  {
+    return anchor->monotonic_us;
+  }
+
+  offset = (uint64_t)anchor->realtime_us % period_us;
+
+  return anchor->monotonic_us + ((offset > 0) ? (period_us - offset) : 0);
+}
+
+/**
+ * Prepares to resample a stream of samples. Grid points are passed to the
+ * callback as the samples that follow them arrive.
+ * @param resampler Resampler state to initialize
+ * @param options Grid and method; the period must not be zero
+ * @param callback Function called with the values at each grid point
+ * @param context Passed through to the callback
+ */
+void mems_resampler_init(mems_resampler* resampler, const mems_resample_options* options,
+                         mems_resample_callback callback, void* context)
+{
+  memset(resampler, 0, sizeof(mems_resampler));
+  resampler->options = *options;
+  resampler->callback = callback;
+  resampler->context = context;
+}
+
+/**
+ * Adds a sample to a streaming resampler, and produces the grid points
+ * between the previous sample and this one. Samples older than the previous
+ * one are ignored; a sample at the same time replaces it.
+ * @param resampler Resampler set up with mems_resampler_init()
+ * @param timestamp_us Time at which the sample was taken
+ * @param data Decoded sample
+ * @return Number of grid points produced
+ */
+uint32_t mems_resample_add(mems_resampler* resampler, uint64_t timestamp_us, const mems_data* data)
+{
+  float values[MEMS_Field_Count];
+  float out[MEMS_Field_Count];
+  uint32_t produced = 0;
+  float weight;
+  int field;
+
+  for (field = 0; field < MEMS_Field_Count; ++field)
+  {
+    values[field] = mems_field_value(data, (enum mems_field)field);
+  }
+
+  if (!resampler->started)
+  {
+    resampler->started = true;
+    resampler->next_us = first_point(&resampler->options, timestamp_us);
+  }
+  else if (timestamp_us < resampler->last_us)
+  {
+    return 0;
+  }
+  else
+  {
+    while (resampler->next_us < timestamp_us)
+    {
+      weight = point_weight(&resampler->options, resampler->next_us, resampler->last_us, timestamp_us);
+      for (field = 0; field < MEMS_Field_Count; ++field)
+      {
+        out[field] = resampler->last[field] + weight * (values[field] - resampler->last[field]);
+      }
+
+      resampler->callback(resampler->next_us, out, resampler->context);
+      resampler->next_us += resampler->options.period_us;
+      resampler->points++;
+      produced++;
+    }
+  }
+
+  resampler->last_us = timestamp_us;
+  memcpy(resampler->last, values, sizeof(values));
+
+  return produced;
+}
+
+/**
+ * Frame ring subscriber that adds each acquired frame to a streaming
+ * resampler. The frame is taken to have been sampled midway between its
+ * request and its response. Register with mems_ring_subscribe(), passing
+ * the mems_resampler as the context.
+ */
+void mems_resample_frame_callback(const mems_frame* frame, void* resampler)
+{
+  mems_resample_add((mems_resampler*)resampler,
+                    frame->request_us + (frame->response_us - frame->request_us) / 2, &frame->data);
+}
+
+/**
+ * Works out the grid points that lie within a set of sample times, and for
+ * each point, the samples either side of it and the weight of the later one.
+ * The same plan is then applied to each channel with mems_resample_apply().
+ * @param options Grid and method; the period must not be zero
+ * @param times Sample times, in non-decreasing order
+ * @param count Number of samples
+ * @param first_us Receives the time of the first grid point
+ * @param lower Receives, for each point, the index of the latest sample at
+ *   or before it; may be NULL to only count the points
+ * @param upper Receives, for each point, the index of the sample after that
+ *   (or the same index at the end)
+ * @param weight Receives, for each point, the weight of the upper sample
+ * @param max_points Size of the lower, upper and weight arrays
+ * @return Number of grid points from the first sample to the last
+ */
+uint32_t mems_resample_grid(const mems_resample_options* options, const uint64_t* times, uint32_t count,
+                            uint64_t* first_us, uint32_t* lower, uint32_t* upper, float* weight, uint32_t max_points)
+{
+  uint64_t point;
+  uint64_t points;
+  uint32_t k;
+  uint32_t i = 0;
+
+  if ((count == 0) || (options->period_us == 0))
+  {
+    return 0;
+  }
+
+  *first_us = first_point(options, times[0]);
+  if (*first_us > times[count - 1])
+  {
+    return 0;
+  }
+
+  points = (times[count - 1] - *first_us) / options->period_us + 1;
+  if (points > UINT32_MAX)
+  {
+    points = UINT32_MAX;
+  }
+  if (lower == NULL)
+  {
+    return (uint32_t)points;
+  }
+  if (points > max_points)
+  {
+    points = max_points;
+  }
+
+  // the grid and the samples are walked together, so the plan is built in
+  // a single pass
+  point = *first_us;
+  for (k = 0; k < points; ++k)
+  {
+    while ((i + 1 < count) && (times[i + 1] <= point))
+    {
+      i++;
+    }
+
+    lower[k] = i;
+    upper[k] = (i + 1 < count) ? (i + 1) : i;
+    weight[k] = (upper[k] != i) ? point_weight(options, point, times[i], times[upper[k]]) : 0.0f;
+    point += options->period_us;
+  }
+
+  return (uint32_t)points;
+}
+
+/**
+ * Resamples one channel according to a plan made by mems_resample_grid().
+ * The loop has no branches and touches the plan as flat arrays, so that the
+ * compiler can vectorize it.
+ * @param input Values of the channel at the sample times
+ * @param output Receives the values at the grid points
+ */
+void mems_resample_apply(const uint32_t* lower, const uint32_t* upper, const float* weight, uint32_t points,
+                         const float* input, float* output)
+{
+  uint32_t k;
+
+  for (k = 0; k < points; ++k)
+  {
+    output[k] = input[lower[k]] + weight[k] * (input[upper[k]] - input[lower[k]]);
+  }
+}
+
+/**
+ * Counts the frame records in a mapped capture.
+ */
+static uint32_t count_frames(mems_capture_map* map)
+{
+  const mems_capture_record* record;
+  const uint8_t* payload;
+  uint32_t count = 0;
+
+  while (mems_capture_map_next(map, &record, &payload))
+  {
+    if ((record->type == MEMS_Record_Frames) &&
+        (record->length >= sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d)))
+    {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+/**
+ * Resamples all of the decoded channels of a capture file onto a fixed grid.
+ * The frames are decoded into one array per channel, the grid is planned
+ * once from their times, and each channel is then resampled in turn.
+ * Each frame is taken to have been sampled midway between its request and
+ * its response. When the capture has a clock anchor, the grid is aligned
+ * to whole periods of wall-clock time (options->origin_us is not used).
+ * @param path Capture file to read
+ * @param options Grid and method; the period must not be zero
+ * @param result Receives the resampled channels; release with mems_resampled_free()
+ * @return True if the capture was read and resampled
+ */
+bool mems_resample_capture(const char* path, const mems_resample_options* options, mems_resampled* result)
+{
+  mems_capture_map map;
+  mems_resample_options grid = *options;
+  mems_capture_frame_times times;
+  const mems_capture_record* record;
+  const mems_profile* profile;
+  const uint8_t* payload;
+  mems_data data;
+  uint64_t* sample_us = NULL;
+  float* samples[MEMS_Field_Count];
+  uint32_t* lower = NULL;
+  uint32_t* upper = NULL;
+  float* weight = NULL;
+  uint64_t request_us;
+  uint32_t count;
+  uint32_t n = 0;
+  int field;
+  bool ok;
+
+  memset(result, 0, sizeof(mems_resampled));
+  memset(samples, 0, sizeof(samples));
+
+  if ((options->period_us == 0) || !mems_capture_map_open(&map, path))
+  {
+    return false;
+  }
+
+  count = count_frames(&map);
+  map.offset = map.header.header_len;
+  profile = mems_find_profile(map.header.d0_response);
+
+  ok = (count > 0) && ((sample_us = (uint64_t*)malloc(count * sizeof(uint64_t))) != NULL);
+  for (field = 0; ok && (field < MEMS_Field_Count); ++field)
+  {
+    ok = ((samples[field] = (float*)malloc(count * sizeof(float))) != NULL);
+  }
+
+  // decode the frames into one array per channel
+  while (ok && (n < count) && mems_capture_map_next(&map, &record, &payload))
+  {
+    if ((record->type != MEMS_Record_Frames) ||
+        (record->length < sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d)))
+    {
+      continue;
+    }
+
+    request_us = record->timestamp_us;
+    if (record->length >= sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d) + sizeof(times))
+    {
+      memcpy(&times, payload + sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d), sizeof(times));
+      if (times.request_us <= record->timestamp_us)
+      {
+        request_us = times.request_us;
+      }
+    }
+
+    // keeps the times in order, as the grid is planned in a single pass
+    sample_us[n] = request_us + (record->timestamp_us - request_us) / 2;
+    if ((n > 0) && (sample_us[n] < sample_us[n - 1]))
+    {
+      sample_us[n] = sample_us[n - 1];
+    }
+
+    mems_decode_frames(profile, (const mems_data_frame_80*)payload,
+                       (const mems_data_frame_7d*)(payload + sizeof(mems_data_frame_80)), &data);
+    for (field = 0; field < MEMS_Field_Count; ++field)
+    {
+      samples[field][n] = mems_field_value(&data, (enum mems_field)field);
+    }
+    n++;
+  }
+
+  // the capture's times are measured from its anchor
+  grid.origin_us = mems_resample_origin(&map.header.anchor, grid.period_us) - map.header.anchor.monotonic_us;
+
+  if (ok && ((result->points = mems_resample_grid(&grid, sample_us, n, &result->first_us, NULL, NULL, NULL, 0)) > 0))
+  {
+    ok = ((lower = (uint32_t*)malloc(result->points * sizeof(uint32_t))) != NULL) &&
+         ((upper = (uint32_t*)malloc(result->points * sizeof(uint32_t))) != NULL) &&
+         ((weight = (float*)malloc(result->points * sizeof(float))) != NULL);
+
+    if (ok)
+    {
+      mems_resample_grid(&grid, sample_us, n, &result->first_us, lower, upper, weight, result->points);
+    }
+
+    for (field = 0; ok && (field < MEMS_Field_Count); ++field)
+    {
+      if ((result->values[field] = (float*)malloc(result->points * sizeof(float))) == NULL)
+      {
+        ok = false;
+      }
+      else
+      {
+        mems_resample_apply(lower, upper, weight, result->points, samples[field], result->values[field]);
+      }
+    }
+  }
+
+  result->period_us = grid.period_us;
+  if (map.header.anchor.realtime_us > 0)
+  {
+    result->first_realtime_us = map.header.anchor.realtime_us + (int64_t)result->first_us;
+  }
+
+  free(lower);
+  free(upper);
+  free(weight);
+  free(sample_us);
+  for (field = 0; field < MEMS_Field_Count; ++field)
+  {
+    free(samples[field]);
+  }
+  mems_capture_map_close(&map);
+
+  if (!ok)
+  {
+    mems_resampled_free(result);
+  }
+
+  return ok;
+}
+
+/**
+ * Releases the channel arrays of a resampled capture.
+ */
+void mems_resampled_free(mems_resampled* result)
+{
+  int field;
+
+  for (field = 0; field < MEMS_Field_Count; ++field)
+  {
+    free(result->values[field]);
+    result->values[field] = NULL;
+  }
+  result->points = 0;
+}
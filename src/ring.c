@@ -0,0 +1,121 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// ring.c: This file contains the frame ring, which holds preallocated
+//         slots that data frames are read into directly, and the
+//         notification of subscribers as each frame is acquired.
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * Allocates the slots for a frame ring. This is the only allocation made
+ * by the ring; acquiring frames does not allocate.
+ * @param ring Ring to initialize
+ * @param capacity Number of slots; rounded up to the next power of two
+ * @return True if the slot storage was allocated, false otherwise
+ */
+bool mems_ring_init(mems_frame_ring* ring, uint32_t capacity)
+{
+  uint32_t size = 1;
+
+  memset(ring, 0, sizeof(mems_frame_ring));
+
+  if (capacity == 0)
+  {
+    return false;
+  }
+
+  while (size < capacity)
+  {
+    size <<= 1;
+  }
+
+  if ((ring->slots = calloc(size, sizeof(mems_frame))) == NULL)
+  {
+    return false;
+  }
+  ring->capacity = size;
+
+  return true;
+}
+
+/**
+ * Releases the slot storage for a frame ring.
+ */
+void mems_ring_free(mems_frame_ring* ring)
+{
+  free(ring->slots);
+  ring->slots = NULL;
+  ring->capacity = 0;
+  ring->subscriber_count = 0;
+}
+
+/**
+ * Registers a callback that is invoked (from the acquiring thread) with a
+ * pointer to each new frame.
+ * @return True if the callback was registered; false if the maximum number
+ *   of subscribers has been reached
+ */
+bool mems_ring_subscribe(mems_frame_ring* ring, mems_frame_callback callback, void* context)
+{
+  if (ring->subscriber_count >= MEMS_MAX_SUBSCRIBERS)
+  {
+    return false;
+  }
+
+  ring->subscribers[ring->subscriber_count] = callback;
+  ring->contexts[ring->subscriber_count] = context;
+  ring->subscriber_count++;
+
+  return true;
+}
+
+/**
+ * Returns the frame with the given sequence number, if it is still held in the ring.
+ * The ring holds at most capacity - 1 readable frames, since the next read
+ * goes straight into the slot of the oldest one.
+ * @return Pointer to the slot, or NULL if the frame has been overwritten,
+ *   is being overwritten, or has not yet been acquired
+ */
+const mems_frame* mems_ring_get(const mems_frame_ring* ring, uint32_t seq)
+{
+  if (((uint32_t)(ring->head - seq) == 0) || ((uint32_t)(ring->head - seq) >= ring->capacity))
+  {
+    return NULL;
+  }
+
+  return &ring->slots[seq & (ring->capacity - 1)];
+}
+
+/**
+ * Reads a sample from the ECU directly into the next slot of the ring,
+ * decodes it in place, and notifies the subscribers.
+ * @return Pointer to the slot holding the new frame, or NULL if the read failed.
+ *   The slot remains valid until the ring wraps around to it again.
+ */
+const mems_frame* mems_read_frame(mems_info* info, mems_frame_ring* ring)
+{
+  mems_frame* slot = &ring->slots[ring->head & (ring->capacity - 1)];
+  uint8_t idx;
+
+  if (!mems_read_raw(info, &slot->frame80, &slot->frame7d))
+  {
+    return NULL;
+  }
+
+  mems_decode_frames(info->profile ? info->profile : mems_default_profile(),
+                     &slot->frame80, &slot->frame7d, &slot->data);
+  slot->request_us = info->last_request_us;
+  slot->response_us = info->last_response_us;
+  slot->seq = ring->head++;
+
+  for (idx = 0; idx < ring->subscriber_count; ++idx)
+  {
+    ring->subscribers[idx](slot, ring->contexts[idx]);
+  }
+
+  return slot;
+}
@@ -8,6 +8,8 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
 
 #if defined(WIN32)
   #include <windows.h>
@@ -30,6 +32,17 @@ extern "C" {
 
 #define IAC_MAXIMUM 0xB4
 
+//! Number of bytes returned by the ECU after the echo of the D0 command
+#define MEMS_D0_RESPONSE_LEN 4
+//! Maximum length of a variant profile name, including the terminator
+#define MEMS_PROFILE_NAME_LEN 32
+//! Number of trouble code bytes in the data frames (dtc0-dtc1 in 0x80, dtc2-dtc4 in 0x7D)
+#define MEMS_DTC_BYTES 5
+//! Number of trouble code bits; bit n is bit (n % 8) of byte dtc(n / 8)
+#define MEMS_DTC_BITS (MEMS_DTC_BYTES * 8)
+//! Index of a trouble code bit given its byte (0-4) and bit (0-7)
+#define MEMS_DTC_BIT(byte, bit) (((byte) * 8) + (bit))
+
 /**
  * These general commands are used to request data and clear fault codes.
  */
@@ -184,8 +197,317 @@ typedef struct
     uint8_t fuel_trim;
     uint8_t closed_loop;
     uint8_t idle_base_pos;
+    //! Raw trouble code bytes dtc0-dtc4; see mems_decode_faults()
+    uint8_t dtc[MEMS_DTC_BYTES];
 } mems_data;
 
+/**
+ * Identifiers for the decoded fields in the mems_data struct that are
+ * located and scaled according to the active variant profile.
+ */
+enum mems_field
+{
+    MEMS_Field_EngineRPM = 0,
+    MEMS_Field_CoolantTemp,
+    MEMS_Field_AmbientTemp,
+    MEMS_Field_IntakeAirTemp,
+    MEMS_Field_FuelTemp,
+    MEMS_Field_MAP,
+    MEMS_Field_BatteryVoltage,
+    MEMS_Field_ThrottlePot,
+    MEMS_Field_IdleSwitch,
+    MEMS_Field_ParkNeutralSwitch,
+    MEMS_Field_IACPosition,
+    MEMS_Field_IdleError,
+    MEMS_Field_IgnitionAdvance,
+    MEMS_Field_CoilTime,
+    MEMS_Field_LambdaVoltage,
+    MEMS_Field_FuelTrim,
+    MEMS_Field_ClosedLoop,
+    MEMS_Field_IdleBasePos,
+    MEMS_Field_Count
+};
+
+/**
+ * Faults that may be indicated by the trouble code bits. Each variant
+ * profile maps every trouble code bit to one of these.
+ */
+enum mems_fault
+{
+    //! The meaning of the bit is not known
+    MEMS_Fault_Undocumented = 0,
+    MEMS_Fault_CoolantSensor,
+    MEMS_Fault_AirTempSensor,
+    MEMS_Fault_FuelPumpCircuit,
+    MEMS_Fault_ThrottlePotCircuit,
+    MEMS_Fault_Count
+};
+
+/**
+ * Description of a fault.
+ */
+typedef struct
+{
+    //! Fault code number shown by diagnostic tools; 0 if there is none
+    uint8_t code;
+    //! Name by which the fault is known in profile files
+    const char* name;
+    //! Human-readable description
+    const char* description;
+} mems_fault_info;
+
+/**
+ * A trouble code bit that is set, and the fault it indicates.
+ */
+typedef struct
+{
+    //! Index of the bit (see MEMS_DTC_BIT())
+    uint8_t bit;
+    //! One of the mems_fault values
+    uint8_t fault;
+} mems_active_fault;
+
+/**
+ * Location and scaling of one decoded field within the raw data frames.
+ * The decoded value is (raw * scale) + bias, where 'raw' is the big-endian
+ * value of 'width' bytes starting at 'offset' in the frame returned by
+ * the 'frame' command.
+ */
+typedef struct
+{
+    //! Command whose response contains the field (0x80 or 0x7D); 0 if absent
+    uint8_t frame;
+    //! Offset of the most significant byte within the frame
+    uint8_t offset;
+    //! Number of bytes in the field (1 or 2)
+    uint8_t width;
+    //! Multiplier applied to the raw value
+    float scale;
+    //! Constant added after scaling
+    float bias;
+} mems_field_layout;
+
+/**
+ * Describes one ECU variant, as identified by its response to the D0
+ * command. Profiles are matched by comparing the masked D0 response.
+ */
+typedef struct
+{
+    //! Human-readable name of the variant
+    char name[MEMS_PROFILE_NAME_LEN];
+    //! Expected D0 response bytes
+    uint8_t d0_id[MEMS_D0_RESPONSE_LEN];
+    //! Mask applied to the D0 response before comparison (0x00 = wildcard)
+    uint8_t d0_mask[MEMS_D0_RESPONSE_LEN];
+    //! Number of bytes (including the length byte) in the 0x80 frame
+    uint8_t frame80_len;
+    //! Number of bytes (including the length byte) in the 0x7D frame
+    uint8_t frame7d_len;
+    //! Time to wait for each part of an expected response before giving up,
+    //! in ms (0 = the transport's own timeout policy, e.g. the serial line's
+    //! VTIME; this is what the built-in profiles use)
+    uint16_t read_timeout_ms;
+    //! Minimum spacing between consecutive commands, in ms (0 = none)
+    uint16_t command_gap_ms;
+    //! Bitmap of command bytes accepted as actuator tests (bit n = command n)
+    uint8_t actuators[32];
+    //! Location and scaling of each decoded field
+    mems_field_layout fields[MEMS_Field_Count];
+    //! Fault (mems_fault) indicated by each trouble code bit
+    uint8_t faults[MEMS_DTC_BITS];
+} mems_profile;
+
+//! Maximum number of callbacks that may subscribe to a frame ring
+#define MEMS_MAX_SUBSCRIBERS 8
+
+/**
+ * One slot in a frame ring. The transport reads the raw frames directly
+ * into the slot, and the decoded data is stored alongside them so that
+ * consumers can work from the slot by reference.
+ */
+typedef struct
+{
+    //! Sequence number of the sample held in this slot
+    uint32_t seq;
+    //! Raw response to the 0x80 command
+    mems_data_frame_80 frame80;
+    //! Raw response to the 0x7D command
+    mems_data_frame_7d frame7d;
+    //! Data decoded from the raw frames using the connection's profile
+    mems_data data;
+    //! Monotonic time at which the 0x80 request was sent, in microseconds
+    uint64_t request_us;
+    //! Monotonic time at which the last byte of the 0x7D response arrived,
+    //! in microseconds
+    uint64_t response_us;
+} mems_frame;
+
+/**
+ * Callback invoked with each newly acquired frame. The frame pointer refers
+ * to the ring slot itself and is only valid until the slot is reused.
+ */
+typedef void (*mems_frame_callback)(const mems_frame* frame, void* context);
+
+/**
+ * Fixed-size ring of preallocated frame slots. Samples are acquired into the
+ * ring without intermediate copies or per-sample allocation. A ring has a
+ * single producer (the thread calling mems_read_frame()).
+ */
+typedef struct
+{
+    //! Preallocated slot storage
+    mems_frame* slots;
+    //! Number of slots (a power of two)
+    uint32_t capacity;
+    //! Sequence number that will be assigned to the next acquired frame
+    uint32_t head;
+    //! Callbacks notified of each acquired frame
+    mems_frame_callback subscribers[MEMS_MAX_SUBSCRIBERS];
+    //! Opaque context pointers passed to the callbacks
+    void* contexts[MEMS_MAX_SUBSCRIBERS];
+    //! Number of registered callbacks
+    uint8_t subscriber_count;
+} mems_frame_ring;
+
+/**
+ * Items watched for changes by a mems_change_stream. The DTC bytes are taken
+ * from the raw frames; the others are decoded values.
+ */
+enum mems_change_item
+{
+    MEMS_Change_FaultCodes = 0,
+    MEMS_Change_DTC0,
+    MEMS_Change_DTC1,
+    MEMS_Change_DTC2,
+    MEMS_Change_DTC3,
+    MEMS_Change_DTC4,
+    MEMS_Change_IdleSwitch,
+    MEMS_Change_ParkNeutralSwitch,
+    MEMS_Change_ClosedLoop,
+    MEMS_Change_Count
+};
+
+/**
+ * A change in the value of one watched item between successive frames.
+ */
+typedef struct
+{
+    //! Monotonic time at which the frame showing the change was acquired, in microseconds
+    uint64_t timestamp_us;
+    //! Sequence number of the frame showing the change
+    uint32_t seq;
+    //! One of the mems_change_item values
+    uint8_t item;
+    uint8_t old_value;
+    uint8_t new_value;
+    uint8_t reserved;
+} mems_change_event;
+
+/**
+ * Callback invoked with each change event.
+ */
+typedef void (*mems_change_callback)(const mems_change_event* event, void* context);
+
+/**
+ * Compares successive frames and notifies subscribers only of the items
+ * that changed, so that consumers interested in transitions need not look
+ * at every sample.
+ */
+typedef struct
+{
+    //! Values of the watched items in the previous frame
+    uint8_t last[MEMS_Change_Count];
+    //! Set once the first frame has been seen
+    bool primed;
+    //! Number of events emitted so far
+    uint32_t events;
+    //! Callbacks notified of each change
+    mems_change_callback subscribers[MEMS_MAX_SUBSCRIBERS];
+    //! Opaque context pointers passed to the callbacks
+    void* contexts[MEMS_MAX_SUBSCRIBERS];
+    //! Number of registered callbacks
+    uint8_t subscriber_count;
+} mems_change_stream;
+
+//! Number of most recent samples over which the windowed statistics are kept
+#define MEMS_STATS_WINDOW 64
+//! Number of percentiles estimated for each channel (see mems_stats_snapshot)
+#define MEMS_STATS_QUANTILES 3
+
+/**
+ * Statistics of one channel as of the latest sample, as returned by
+ * mems_stats_read().
+ */
+typedef struct
+{
+    //! Number of samples seen since the statistics were initialized
+    uint64_t count;
+    float min;
+    float max;
+    float mean;
+    float stddev;
+    //! Statistics over the last MEMS_STATS_WINDOW samples
+    float window_min;
+    float window_max;
+    float window_mean;
+    float window_stddev;
+    //! Estimated 50th, 90th and 99th percentiles over all samples
+    float p50;
+    float p90;
+    float p99;
+} mems_stats_snapshot;
+
+/**
+ * P-square estimator for a single quantile, which tracks five markers
+ * instead of storing the samples.
+ */
+typedef struct
+{
+    float q[5];
+    int32_t n[5];
+    double np[5];
+} mems_quantile_sketch;
+
+/**
+ * Incremental state for one channel. Only the thread feeding samples may
+ * touch it; other threads read the published snapshot.
+ */
+typedef struct
+{
+    //! Welford running mean and sum of squared deviations
+    double mean;
+    double m2;
+    //! Most recent samples, indexed by sample number modulo MEMS_STATS_WINDOW
+    float window[MEMS_STATS_WINDOW];
+    double window_sum;
+    double window_sumsq;
+    //! Sample numbers of the candidates for the window minimum and maximum,
+    //! as monotonic queues (ring buffers)
+    uint64_t min_queue[MEMS_STATS_WINDOW];
+    uint64_t max_queue[MEMS_STATS_WINDOW];
+    uint32_t min_head;
+    uint32_t min_len;
+    uint32_t max_head;
+    uint32_t max_len;
+    mems_quantile_sketch quantiles[MEMS_STATS_QUANTILES];
+    //! Published results, guarded by mems_stats::sequence
+    mems_stats_snapshot snapshot;
+} mems_channel_stats;
+
+/**
+ * Streaming statistics over a set of decoded channels. Samples are added
+ * by a single thread (typically as a frame ring subscriber); any number of
+ * other threads may read the results without locking.
+ */
+typedef struct
+{
+    //! Bitmap of the channels (1 << mems_field) that are tracked
+    uint32_t channel_mask;
+    //! Sequence lock: odd while the snapshots are being updated
+    volatile uint32_t sequence;
+    mems_channel_stats channels[MEMS_Field_Count];
+} mems_stats;
+
 /**
  * Major/minor/patch version numbers for this build of the library
  */
@@ -199,6 +521,94 @@ typedef struct
   uint8_t patch;
 } librosco_version;
 
+//! Baud rate used by the ECU's diagnostic port
+#define MEMS_DEFAULT_BAUD 9600
+
+/**
+ * Serial line settings used when opening the connection to the ECU.
+ * Initialize with mems_default_connection_options() and then override
+ * individual fields as needed.
+ */
+typedef struct
+{
+    //! Line rate in bits per second (must be a rate supported by the OS)
+    uint32_t baud;
+    //! Minimum number of bytes for a read to return (termios VMIN)
+    uint8_t vmin;
+    //! Inter-byte read timeout in tenths of a second (termios VTIME)
+    uint8_t vtime;
+    //! Request low-latency handling from the serial driver (Linux ASYNC_LOW_LATENCY);
+    //! ignored on Win32 and by the simulator
+    bool low_latency;
+    //! Latency timer to program into FTDI adapters, in ms (0 leaves it unchanged)
+    uint8_t ftdi_latency_ms;
+    //! Root of the sysfs tree used to find the adapter (NULL for "/sys")
+    const char* sysfs_root;
+} mems_connection_options;
+
+/**
+ * Relates the monotonic clock used for timestamps to wall-clock time, so that
+ * samples can be aligned with data recorded by other systems. A monotonic
+ * time t corresponds to the wall-clock time realtime_us + (t - monotonic_us).
+ */
+typedef struct
+{
+    //! Monotonic time at which the wall clock was read, in microseconds
+    uint64_t monotonic_us;
+    //! Wall-clock time, in microseconds since the Unix epoch (0 if unknown)
+    int64_t realtime_us;
+    //! Largest error in the pairing of the two times, in microseconds
+    uint32_t uncertainty_us;
+    uint32_t reserved;
+} mems_clock_anchor;
+
+/**
+ * Function that returns the current time, in microseconds, in place of the
+ * library's monotonic clock (see mems_set_clock()). Successive values must
+ * not decrease.
+ */
+typedef uint64_t (*mems_clock_callback)(void* context);
+
+/**
+ * Result of an attempt to tune the latency timer of a USB-serial adapter.
+ */
+typedef struct
+{
+    //! True if the device was identified as an FTDI adapter
+    bool is_ftdi;
+    //! Latency timer value (ms) found before tuning, or -1 if unknown
+    int before_ms;
+    //! Latency timer value (ms) read back after tuning, or -1 if unknown
+    int after_ms;
+} mems_latency_report;
+
+/**
+ * Operations implemented by each transport (serial port, TCP bridge,
+ * capture replay, in-memory loopback). The protocol layer performs all I/O
+ * through these, so it does not depend on a file descriptor.
+ */
+typedef struct
+{
+    //! Short name of the transport, for diagnostics
+    const char* name;
+    //! Reads up to 'quantity' bytes, waiting at most 'timeout_ms' for data to
+    //! arrive (-1 selects the transport's own timeout policy). Returns the
+    //! number of bytes read, 0 on timeout, or -1 on error.
+    int (*read)(void* ctx, uint8_t* buffer, uint16_t quantity, int timeout_ms);
+    //! Writes (or queues, for transports that batch output) 'quantity'
+    //! bytes. Returns the number of bytes accepted, or -1 on error.
+    int (*write)(void* ctx, const uint8_t* buffer, uint16_t quantity);
+    //! Flushes any queued output and releases the transport's resources.
+    void (*close)(void* ctx);
+    //! Optional. Replaces the request and response times of the frame just
+    //! read with times recorded by the transport, and returns true; NULL or
+    //! false to keep the times measured by the protocol layer.
+    bool (*frame_times)(void* ctx, uint64_t* request_us, uint64_t* response_us);
+    //! Optional. Provides the clock anchor of the session, for transports
+    //! whose times come from a recording; NULL or false to take a new one.
+    bool (*anchor)(void* ctx, mems_clock_anchor* anchor);
+} mems_transport_ops;
+
 /**
  * Contains information about the state of the current connection to the ECU.
  */
@@ -215,21 +625,1329 @@ typedef struct
     //! Lock to prevent multiple simultaneous open/close/read/write operations
     pthread_mutex_t mutex;
 #endif
+    //! Variant profile selected from the D0 response during mems_init_link()
+    const mems_profile* profile;
+    //! Line settings that were applied when the connection was opened
+    mems_connection_options options;
+    //! Outcome of FTDI latency timer tuning performed at connect time
+    mems_latency_report latency;
+    //! Transport carrying the connection; NULL when disconnected
+    const mems_transport_ops* transport;
+    //! Transport-specific state passed to the transport operations
+    void* transport_ctx;
+    //! Monotonic time at which data was last received from the ECU, in microseconds
+    uint64_t last_activity_us;
+    //! Wall-clock time of the session, taken by mems_init_link()
+    mems_clock_anchor anchor;
+    //! Monotonic times at which the last frame read by mems_read_raw() was
+    //! requested and its last byte received, in microseconds
+    uint64_t last_request_us;
+    uint64_t last_response_us;
+    //! Idle time after which mems_heartbeat() pings the ECU, in ms (0 = always ping)
+    uint32_t keepalive_ms;
+    //! Number of heartbeat commands actually sent to the ECU
+    uint32_t heartbeats_sent;
+    //! Number of mems_heartbeat() calls skipped because the link was already active
+    uint32_t heartbeats_skipped;
+    //! Spacing between IAC step commands learned by the last move, in microseconds
+    uint32_t iac_spacing_us;
+    //! Monotonic time at which a command was last written to the ECU, in microseconds
+    uint64_t last_command_us;
 } mems_info;
 
+//! Maximum number of ECUs that may be polled together
+#define MEMS_MAX_DEVICES 8
+//! Number of samples from each device that may be waiting to be merged
+#define MEMS_POLL_QUEUE_LEN 32
+
+/**
+ * Sample acquired by mems_poll_devices(), labelled with its device.
+ */
+typedef struct
+{
+    //! Index of the device in the list passed to mems_poll_devices()
+    uint8_t device;
+    //! Monotonic time at which the sample was received, in microseconds
+    //! since polling started; the same clock is used for every device
+    uint64_t timestamp_us;
+    //! Raw and decoded sample; 'seq' counts the samples of this device
+    mems_frame frame;
+} mems_device_sample;
+
+/**
+ * Function called by mems_poll_devices() with each sample, in order of
+ * timestamp across all devices. Calls are made from the thread that called
+ * mems_poll_devices().
+ * @return False to stop polling
+ */
+typedef bool (*mems_device_sample_callback)(const mems_device_sample* sample, void* context);
+
+/**
+ * Outcome of a move of the idle air control valve.
+ */
+typedef struct
+{
+    //! True if the valve reached the requested position
+    bool reached;
+    //! Position reported by the ECU after the last command
+    uint8_t final_pos;
+    //! Number of step commands sent
+    uint16_t commands;
+    //! Number of step commands after which the valve had not advanced
+    uint16_t stalls;
+    //! Command spacing in use at the end of the move, in microseconds
+    uint32_t spacing_us;
+    //! Time taken by the move, in microseconds
+    uint64_t elapsed_us;
+} mems_iac_result;
+
+/**
+ * Response to a single IAC step command, as recorded by mems_iac_sweep().
+ * This is also the payload of MEMS_Record_IACStep capture records.
+ */
+typedef struct
+{
+    //! MEMS_OpenIAC or MEMS_CloseIAC
+    uint8_t command;
+    //! Position returned by the ECU in response to the command
+    uint8_t position;
+    uint16_t reserved;
+    //! Time from sending the command to receiving the response, in microseconds
+    uint32_t latency_us;
+} mems_iac_step;
+
+/**
+ * Function called by mems_iac_sweep() for each step command. The timestamp
+ * is the monotonic time at which the response was received, in microseconds.
+ */
+typedef void (*mems_iac_step_callback)(const mems_iac_step* step, uint64_t timestamp_us, void* context);
+
+//! Maximum number of response bytes that a script step can check
+#define MEMS_SCRIPT_MAX_EXPECT 32
+//! Script step response length meaning "the usual length for this command"
+#define MEMS_SCRIPT_DEFAULT_LEN -1
+
+/**
+ * A single step of a command script.
+ */
+typedef struct
+{
+    //! True if 'command' is sent; false for a step that only waits
+    bool send;
+    //! Command byte
+    uint8_t command;
+    //! Number of bytes expected after the echo, or MEMS_SCRIPT_DEFAULT_LEN
+    int16_t response_len;
+    //! Number of bytes after the echo that are checked against 'expect'
+    uint8_t expect_len;
+    //! Expected values of the bytes following the echo
+    uint8_t expect[MEMS_SCRIPT_MAX_EXPECT];
+    //! Bits of each byte that are compared (0x00 for a wildcard)
+    uint8_t expect_mask[MEMS_SCRIPT_MAX_EXPECT];
+    //! Time to wait after the step, in milliseconds
+    uint32_t delay_ms;
+    //! Line of the script file on which the step was defined
+    uint16_t line;
+} mems_script_step;
+
+/**
+ * A sequence of commands to be run in a single session with the ECU.
+ */
+typedef struct
+{
+    mems_script_step* steps;
+    uint16_t count;
+} mems_script;
+
+/**
+ * Function called by mems_run_script() after each step that sends a
+ * command. The response includes the echo of the command byte.
+ */
+typedef void (*mems_script_callback)(const mems_script_step* step, const uint8_t* response,
+                                     uint16_t length, bool passed, void* context);
+
+//! Length table entry for a command whose response has not been seen yet
+#define MEMS_LENGTH_UNKNOWN -1
+
+/**
+ * Response lengths learned for each command byte, so that a command seen
+ * before can be answered with a single read of the right size.
+ */
+typedef struct
+{
+    //! Total response length (including the echo) of each command byte,
+    //! or MEMS_LENGTH_UNKNOWN
+    int16_t length[256];
+    //! Set when an entry has changed since the table was loaded or saved
+    bool modified;
+} mems_length_table;
+
+//! Number of response bytes kept for each command in a command map
+#define MEMS_SCAN_MAX_RESPONSE 64
+
+/**
+ * Settings for a scan of the command space.
+ */
+typedef struct
+{
+    //! Bitmap of the command bytes to send (bit n of byte n/8 for command n)
+    uint8_t commands[32];
+    //! Longest wait for the first byte of a response, in milliseconds
+    int first_byte_timeout_ms;
+    //! Longest wait for each further part of a response, in milliseconds
+    int gap_timeout_ms;
+    //! Shortest wait that the timeouts may be adapted down to, in milliseconds
+    int min_timeout_ms;
+} mems_scan_options;
+
+/**
+ * What the ECU returned in response to one command of a scan.
+ */
+typedef struct
+{
+    //! Command byte that was sent
+    uint8_t command;
+    //! True if at least one byte was received
+    bool responded;
+    //! True if the first byte received was the echo of the command
+    bool echoed;
+    //! Total number of bytes received, including the echo
+    uint16_t length;
+    //! Time from sending the command to receiving the first byte, in microseconds
+    uint32_t latency_us;
+    //! The first MEMS_SCAN_MAX_RESPONSE bytes of the response
+    uint8_t response[MEMS_SCAN_MAX_RESPONSE];
+} mems_scan_entry;
+
+/**
+ * Function called by mems_scan_commands() after each command is probed.
+ */
+typedef void (*mems_scan_callback)(const mems_scan_entry* entry, void* context);
+
+//! Largest block of memory that a single read command may return
+#define MEMS_MAX_MEMORY_BLOCK 256
+
+/**
+ * Describes the commands with which an ECU's memory is read. The ROSCO
+ * memory access commands are not documented, so these are supplied by the
+ * caller (e.g. from a command map produced by mems_scan_commands()). Every
+ * byte sent, including address bytes, is expected to be echoed.
+ */
+typedef struct
+{
+    //! Command byte that precedes an address
+    uint8_t address_cmd;
+    //! Number of address bytes sent after address_cmd, most significant first (1-4)
+    uint8_t address_len;
+    //! Command byte that returns a block of memory at the current address
+    uint8_t read_cmd;
+    //! Number of bytes returned after the echo of read_cmd
+    uint16_t block_len;
+    //! True if the ECU advances its address by block_len after each read,
+    //! so that the address only needs to be sent once
+    bool auto_increment;
+    //! Number of read requests sent before their responses are collected
+    uint8_t pipeline_depth;
+} mems_memory_protocol;
+
+/**
+ * Progress of a memory read, which can be resumed after a failure by
+ * passing the same structure to mems_read_memory() again.
+ */
+typedef struct
+{
+    //! Address of the first byte to read
+    uint32_t start;
+    //! Total number of bytes to read
+    uint32_t length;
+    //! Number of bytes read so far; reading resumes at start + done
+    uint32_t done;
+    //! CRC-32 of the bytes read so far
+    uint32_t crc32;
+} mems_memory_progress;
+
+/**
+ * Function called by mems_read_memory() after each batch of blocks is read.
+ */
+typedef void (*mems_memory_callback)(const mems_memory_progress* progress, const uint8_t* buffer, void* context);
+
+//! Identifies a librosco capture file
+#define MEMS_CAPTURE_MAGIC "ROSCOCAP"
+//! Version of the capture file layout written by this library
+#define MEMS_CAPTURE_VERSION 2
+//! Size of the header of version 1 capture files, which have no clock anchor
+#define MEMS_CAPTURE_V1_HEADER_LEN 16
+
+/**
+ * Types of records stored in a capture file.
+ */
+enum mems_record_type
+{
+    //! Payload is a mems_data_frame_80 followed by a mems_data_frame_7d and
+    //! (from version 2) a mems_capture_frame_times
+    MEMS_Record_Frames = 1,
+    //! Payload is a mems_iac_step
+    MEMS_Record_IACStep = 2,
+    //! Payload is a mems_trigger_event
+    MEMS_Record_Trigger = 3
+};
+
+/**
+ * Header at the start of a capture file. Capture files are written in the
+ * host's byte order, which is little-endian on all supported platforms.
+ */
+typedef struct
+{
+    //! MEMS_CAPTURE_MAGIC (not terminated)
+    char magic[8];
+    //! MEMS_CAPTURE_VERSION
+    uint16_t version;
+    //! Size of this header in bytes
+    uint16_t header_len;
+    //! D0 response of the ECU that was captured
+    uint8_t d0_response[MEMS_D0_RESPONSE_LEN];
+    //! Wall-clock time at which the capture was opened (from version 2; zero
+    //! when read from a version 1 file). Its monotonic_us is the time from
+    //! which the records' timestamps are measured.
+    mems_clock_anchor anchor;
+} mems_capture_header;
+
+/**
+ * Header preceding each record in a capture file.
+ */
+typedef struct
+{
+    //! One of the mems_record_type values
+    uint8_t type;
+    uint8_t reserved;
+    //! Number of payload bytes following this header
+    uint16_t length;
+    uint32_t reserved2;
+    //! Time of the record, in microseconds since the capture was opened. For
+    //! frames, this is when the last byte of the response arrived.
+    uint64_t timestamp_us;
+} mems_capture_record;
+
+/**
+ * Trails the raw frames in the payload of a MEMS_Record_Frames record.
+ */
+typedef struct
+{
+    //! Time at which the frame was requested, in microseconds since the
+    //! capture was opened
+    uint64_t request_us;
+} mems_capture_frame_times;
+
+/**
+ * State for writing a capture file.
+ */
+typedef struct
+{
+    //! Output stream
+    FILE* fp;
+    //! Monotonic time at which the capture was opened, in microseconds
+    uint64_t start_us;
+    //! Number of records written so far
+    uint32_t records;
+} mems_capture_writer;
+
+/**
+ * State for reading a capture file sequentially.
+ */
+typedef struct
+{
+    //! Input stream
+    FILE* fp;
+    //! Header read from the start of the file
+    mems_capture_header header;
+} mems_capture_reader;
+
+/**
+ * State for reading a capture file that is mapped into memory in its
+ * entirety, which lets batch scans walk the records without a copy or a
+ * system call per record.
+ */
+typedef struct
+{
+    //! Start of the mapped file
+    const uint8_t* base;
+    //! Size of the file in bytes
+    size_t size;
+    //! Offset of the next record
+    size_t offset;
+    //! Header read from the start of the file
+    mems_capture_header header;
+    //! Copy of the header of the current record
+    mems_capture_record record;
+} mems_capture_map;
+
+/**
+ * Formats in which samples may be written by a mems_output stream.
+ */
+enum mems_output_format
+{
+    //! One line of comma-separated values per sample, after a header line
+    MEMS_Format_CSV = 0,
+    //! One JSON object per line
+    MEMS_Format_JSONL,
+    //! Capture file layout: a mems_capture_header, then a MEMS_Record_Frames
+    //! record per sample (so the output may be replayed or indexed)
+    MEMS_Format_Binary
+};
+
+//! Size of the buffer in which a mems_output stream collects samples
+#define MEMS_OUTPUT_BUFFER_LEN 65536
+//! Most bytes that a single sample can take in any output format
+#define MEMS_OUTPUT_MAX_SAMPLE_LEN 1024
+
+/**
+ * State for writing decoded samples to a stream. Samples are formatted
+ * without printf() into a block buffer, which is written when it fills or
+ * when the flush interval has passed since it was last written, so output
+ * to a pipe costs one write per block rather than one per line.
+ */
+typedef struct
+{
+    //! Output stream
+    FILE* fp;
+    //! One of the mems_output_format values
+    uint8_t format;
+    //! True if each sample is labelled with the device that produced it
+    bool device_column;
+    //! Longest time a sample may wait in the buffer, in ms (0 to write
+    //! only when the buffer fills or is flushed explicitly)
+    uint32_t flush_interval_ms;
+    //! Monotonic time at which the stream was opened, in microseconds
+    uint64_t start_us;
+    //! Monotonic time at which the buffer was last written
+    uint64_t last_flush_us;
+    //! Number of samples written so far
+    uint64_t samples;
+    //! Number of bytes in the buffer
+    uint32_t used;
+    char buffer[MEMS_OUTPUT_BUFFER_LEN];
+} mems_output;
+
+/**
+ * Occurrences of one trouble code bit over a capture.
+ */
+typedef struct
+{
+    //! Times of the first and last frames in which the bit was set, relative
+    //! to the start of the capture
+    uint64_t first_us;
+    uint64_t last_us;
+    //! Number of frames in which the bit was set
+    uint64_t frames;
+    //! Number of times the bit went from clear to set
+    uint32_t onsets;
+} mems_fault_stats;
+
+/**
+ * Result of scanning a capture file for faults.
+ */
+typedef struct
+{
+    //! Profile selected from the capture's D0 response
+    const mems_profile* profile;
+    //! Number of frames scanned
+    uint64_t frames;
+    //! Bitmap of the trouble code bits that were set at any point
+    uint64_t seen;
+    mems_fault_stats bits[MEMS_DTC_BITS];
+} mems_fault_summary;
+
+/**
+ * Function called by mems_scan_capture_faults() whenever a trouble code bit
+ * is set or cleared.
+ */
+typedef void (*mems_fault_callback)(const mems_active_fault* fault, bool active, uint64_t timestamp_us, void* context);
+
+//! Identifies a librosco session index (sidecar) file
+#define MEMS_INDEX_MAGIC "ROSCOIDX"
+//! Version of the session index layout
+#define MEMS_INDEX_VERSION 1
+//! Appended to the path of a capture file to form the path of its index
+#define MEMS_INDEX_SUFFIX ".idx"
+//! Width of each engine speed histogram bin, in RPM
+#define MEMS_INDEX_RPM_BIN_WIDTH 250
+//! Number of engine speed histogram bins; the last also counts all higher speeds
+#define MEMS_INDEX_RPM_BINS 32
+//! Maximum number of fault intervals kept in a session index
+#define MEMS_INDEX_MAX_FAULT_INTERVALS 64
+
+/**
+ * Range and mean of one decoded channel over a session.
+ */
+typedef struct
+{
+    float min;
+    float max;
+    float mean;
+} mems_channel_summary;
+
+/**
+ * Period during which a trouble code bit was continuously set.
+ */
+typedef struct
+{
+    //! Index of the bit (see MEMS_DTC_BIT())
+    uint8_t bit;
+    //! Fault indicated by the bit (mems_fault)
+    uint8_t fault;
+    uint8_t reserved[6];
+    //! Times of the first and last frames of the interval, relative to the
+    //! start of the capture
+    uint64_t start_us;
+    uint64_t end_us;
+} mems_fault_interval;
+
+/**
+ * Summary of one capture file, stored beside it as a sidecar file so that
+ * fleet-wide queries need not read the frames. Like capture files, index
+ * files are written in the host's byte order.
+ */
+typedef struct
+{
+    //! MEMS_INDEX_MAGIC (not terminated)
+    char magic[8];
+    //! MEMS_INDEX_VERSION
+    uint16_t version;
+    //! Size of this struct in bytes
+    uint16_t length;
+    //! D0 response of the ECU that was captured
+    uint8_t d0_response[MEMS_D0_RESPONSE_LEN];
+    //! Name of the profile used to decode the frames
+    char profile[MEMS_PROFILE_NAME_LEN];
+    //! Number of frames in the capture
+    uint64_t frames;
+    //! Times of the first and last frames, relative to the start of the capture
+    uint64_t start_us;
+    uint64_t end_us;
+    //! Time spent in closed-loop fuel control
+    uint64_t closed_loop_us;
+    //! Range and mean of each decoded channel, indexed by mems_field
+    mems_channel_summary channels[MEMS_Field_Count];
+    //! Number of frames in each engine speed bin
+    uint32_t rpm_histogram[MEMS_INDEX_RPM_BINS];
+    //! Number of entries in fault_intervals
+    uint32_t fault_interval_count;
+    //! Number of intervals that did not fit in fault_intervals
+    uint32_t fault_intervals_dropped;
+    //! Periods during which trouble code bits were set, in order of their end
+    mems_fault_interval fault_intervals[MEMS_INDEX_MAX_FAULT_INTERVALS];
+} mems_session_index;
+
+/**
+ * Function called by mems_index_files() as each file is finished. Calls are
+ * serialized, but may come from any of the worker threads.
+ * @param index Summary of the file; valid only during the call
+ * @param ok True if the file was read and its index written
+ */
+typedef void (*mems_index_callback)(const char* path, const mems_session_index* index, bool ok, void* context);
+
+//! Maximum number of nodes (comparisons and operators) in a query
+#define MEMS_QUERY_MAX_NODES 32
+
+/**
+ * Kinds of node in a compiled query.
+ */
+enum mems_query_op
+{
+    //! Compares a decoded channel with a constant
+    MEMS_Query_Compare = 0,
+    //! Logical operators applied to the results of the preceding nodes
+    MEMS_Query_And,
+    MEMS_Query_Or,
+    MEMS_Query_Not
+};
+
+/**
+ * Comparisons that may be made between a channel and a constant.
+ */
+enum mems_query_compare
+{
+    MEMS_Compare_LT = 0,
+    MEMS_Compare_LE,
+    MEMS_Compare_GT,
+    MEMS_Compare_GE,
+    MEMS_Compare_EQ,
+    MEMS_Compare_NE
+};
+
+/**
+ * One node of a compiled query.
+ */
+typedef struct
+{
+    //! One of the mems_query_op values
+    uint8_t op;
+    //! Channel compared (mems_field), for MEMS_Query_Compare
+    uint8_t field;
+    //! One of the mems_query_compare values, for MEMS_Query_Compare
+    uint8_t compare;
+    uint8_t reserved;
+    //! Constant compared against, for MEMS_Query_Compare
+    float value;
+} mems_query_node;
+
+/**
+ * Filter expression compiled by mems_parse_query(), held in postfix order.
+ */
+typedef struct
+{
+    mems_query_node nodes[MEMS_QUERY_MAX_NODES];
+    uint8_t count;
+} mems_query;
+
+/**
+ * Aggregate of one channel over the frames that matched a query.
+ */
+typedef struct
+{
+    float min;
+    float max;
+    double sum;
+} mems_query_channel;
+
+/**
+ * Result of running a query over a set of capture files.
+ */
+typedef struct
+{
+    //! Number of files that could be read (including those ruled out by their index)
+    uint32_t files;
+    //! Number of files whose index showed that no frame could match
+    uint32_t files_skipped;
+    //! Number of files that could not be read
+    uint32_t files_failed;
+    //! Number of frames in the files
+    uint64_t frames;
+    //! Number of frames that matched the query
+    uint64_t matched;
+    //! Aggregates over the matching frames, indexed by mems_field; the mean
+    //! of a channel is its sum divided by 'matched'
+    mems_query_channel channels[MEMS_Field_Count];
+} mems_query_result;
+
+//! Identifies a librosco columnar export file
+#define MEMS_COLUMNAR_MAGIC "ROSCOCOL"
+//! Version of the columnar file layout
+#define MEMS_COLUMNAR_VERSION 1
+//! Default number of rows buffered and written together as a row group
+#define MEMS_COLUMNAR_ROWS_PER_GROUP 65536
+//! Number of columns written by the exporter: the timestamp, the decoded
+//! fields of mems_data (with one column per trouble code byte), and the
+//! raw bytes of the frames whose meaning is unknown
+#define MEMS_COLUMNAR_COLUMNS 42
+//! Length of a column name, including the terminator
+#define MEMS_COLUMN_NAME_LEN 24
+
+/**
+ * Types of the values stored in a column.
+ */
+enum mems_column_type
+{
+    MEMS_Column_U8 = 0,
+    MEMS_Column_U16,
+    MEMS_Column_U64,
+    MEMS_Column_F32
+};
+
+/**
+ * Ways in which the values of a column chunk may be encoded. The exporter
+ * encodes each chunk in every applicable way and keeps the smallest.
+ */
+enum mems_column_encoding
+{
+    //! Values stored one after another
+    MEMS_Encoding_Plain = 0,
+    //! Runs of equal values, each stored as a varint count and the value
+    MEMS_Encoding_RLE,
+    //! Up to 256 distinct values, followed by a bit-packed index per row
+    MEMS_Encoding_Dictionary,
+    //! Zigzag varint differences between successive values (integers only)
+    MEMS_Encoding_Delta
+};
+
+/**
+ * Header at the start of a columnar file. It is followed by one
+ * mems_column_info per column, then the row groups, then the footer that
+ * locates the column chunks of each group, and finally a
+ * mems_columnar_trailer. Like capture files, columnar files are written in
+ * the host's byte order.
+ */
+typedef struct
+{
+    //! MEMS_COLUMNAR_MAGIC (not terminated)
+    char magic[8];
+    //! MEMS_COLUMNAR_VERSION
+    uint16_t version;
+    //! Size of this header in bytes
+    uint16_t header_len;
+    //! D0 response of the ECU that was captured
+    uint8_t d0_response[MEMS_D0_RESPONSE_LEN];
+    //! Number of column descriptors following the header
+    uint32_t column_count;
+    //! Maximum number of rows in a row group
+    uint32_t rows_per_group;
+} mems_columnar_header;
+
+/**
+ * Description of one column of a columnar file.
+ */
+typedef struct
+{
+    char name[MEMS_COLUMN_NAME_LEN];
+    //! One of the mems_column_type values
+    uint8_t type;
+    //! Size of each value in bytes
+    uint8_t width;
+    uint8_t reserved[6];
+} mems_column_info;
+
+/**
+ * Footer entry for a row group, followed in the file by one
+ * mems_column_chunk per column.
+ */
+typedef struct
+{
+    //! Index of the group's first row in the file
+    uint64_t first_row;
+    //! Number of rows in the group
+    uint32_t rows;
+    uint32_t reserved;
+} mems_column_group;
+
+/**
+ * Location of the values of one column within a row group.
+ */
+typedef struct
+{
+    //! Offset of the encoded values from the start of the file
+    uint64_t offset;
+    //! Number of bytes of encoded values
+    uint32_t length;
+    //! One of the mems_column_encoding values
+    uint8_t encoding;
+    uint8_t reserved[3];
+} mems_column_chunk;
+
+/**
+ * Record at the very end of a columnar file that locates the footer.
+ */
+typedef struct
+{
+    //! Offset of the footer from the start of the file
+    uint64_t footer_offset;
+    //! Number of row groups described by the footer
+    uint32_t group_count;
+    uint32_t reserved;
+    //! MEMS_COLUMNAR_MAGIC (not terminated)
+    char magic[8];
+} mems_columnar_trailer;
+
+/**
+ * State for writing a columnar file. Only the rows of the current group
+ * are held in memory, so files of any length can be written.
+ */
+typedef struct
+{
+    //! Output stream
+    FILE* fp;
+    //! Offset at which the next chunk will be written
+    uint64_t offset;
+    //! Maximum number of rows in a row group
+    uint32_t rows_per_group;
+    //! Number of rows buffered for the current group
+    uint32_t rows;
+    //! Number of rows written in earlier groups
+    uint64_t total_rows;
+    //! Buffered values of each column, stored one after another
+    uint8_t* values[MEMS_COLUMNAR_COLUMNS];
+    //! Buffers used to encode a chunk in each of the candidate ways
+    uint8_t* scratch[2];
+    //! Footer entries for the groups written so far
+    mems_column_group* groups;
+    mems_column_chunk* chunks;
+    uint32_t group_count;
+    uint32_t groups_allocated;
+} mems_columnar_writer;
+
+/**
+ * State for reading a columnar file. The footer is read when the file is
+ * opened; the values of each column chunk are read only when requested, so
+ * columns that aren't needed are never read.
+ */
+typedef struct
+{
+    //! Input stream
+    FILE* fp;
+    //! Header read from the start of the file
+    mems_columnar_header header;
+    //! Descriptions of the columns (header.column_count entries)
+    mems_column_info* columns;
+    //! Row groups (group_count entries)
+    mems_column_group* groups;
+    uint32_t group_count;
+    //! Chunk locations, group_count * header.column_count entries in group order
+    mems_column_chunk* chunks;
+    //! Holds the encoded values of the chunk being read
+    uint8_t* buffer;
+    uint32_t buffer_len;
+} mems_columnar_reader;
+
+/**
+ * Conditions on which a trigger capture fires. Each is enabled by setting
+ * bit (1 << condition) in mems_trigger_options::conditions.
+ */
+enum mems_trigger_condition
+{
+    //! Engine speed falls faster than rpm_drop_per_s
+    MEMS_Trigger_RPMDrop = 0,
+    //! The decoded fault codes change
+    MEMS_Trigger_FaultChange,
+    //! The idle error reaches idle_error_limit
+    MEMS_Trigger_IdleError,
+    //! The lambda sensor status changes
+    MEMS_Trigger_LambdaFlip,
+    MEMS_Trigger_Count
+};
+
+/**
+ * Settings for a trigger capture.
+ */
+typedef struct
+{
+    //! Bitmap of the enabled conditions (1 << mems_trigger_condition)
+    uint32_t conditions;
+    //! Time before the trigger for which frames are written, in milliseconds
+    uint32_t pre_trigger_ms;
+    //! Time after the trigger for which frames are written, in milliseconds
+    uint32_t post_trigger_ms;
+    //! Number of frames held in memory; bounds the pre-trigger window
+    uint32_t capacity;
+    //! Rate of fall in engine speed that fires MEMS_Trigger_RPMDrop, in RPM per second
+    float rpm_drop_per_s;
+    //! Idle error that fires MEMS_Trigger_IdleError
+    uint16_t idle_error_limit;
+} mems_trigger_options;
+
+/**
+ * Marks the point at which a trigger fired. This is the payload of
+ * MEMS_Record_Trigger capture records; the record's timestamp is the time
+ * of the frame that fired it.
+ */
+typedef struct
+{
+    //! One of the mems_trigger_condition values
+    uint8_t condition;
+    uint8_t reserved[3];
+    //! Sequence number of the frame that fired the trigger
+    uint32_t seq;
+    //! Value that fired the trigger (RPM/s, fault codes, idle error, or lambda status)
+    float value;
+} mems_trigger_event;
+
+/**
+ * A frame held in the pre-trigger history, with the time it was acquired.
+ */
+typedef struct
+{
+    uint64_t timestamp_us;
+    //! Time at which the frame was requested, on the same clock as timestamp_us
+    uint64_t request_us;
+    uint32_t seq;
+    mems_data_frame_80 frame80;
+    mems_data_frame_7d frame7d;
+} mems_trigger_sample;
+
+/**
+ * State of a trigger capture. The most recent frames are kept in a fixed
+ * history; when a condition fires, those within the pre-trigger window are
+ * written to the capture file, followed by the frames acquired during the
+ * post-trigger window.
+ */
+typedef struct
+{
+    mems_trigger_options options;
+    //! Capture file to which the windows are written
+    mems_capture_writer* writer;
+    //! Preallocated history of recent frames
+    mems_trigger_sample* history;
+    //! Number of history slots (a power of two)
+    uint32_t capacity;
+    //! Number of frames added to the history so far
+    uint64_t count;
+    //! Number of frames already written to the capture file (the history
+    //! index from which writing continues)
+    uint64_t written;
+    //! Monotonic time until which frames are written, in microseconds;
+    //! zero when no trigger is active
+    uint64_t post_until_us;
+    //! Values of the previous frame, against which changes are detected
+    uint64_t last_us;
+    uint16_t last_rpm;
+    uint8_t last_faults;
+    uint8_t last_lambda;
+    //! Bitmap of the conditions that held for the previous frame
+    uint32_t holding;
+    //! Number of times a condition has fired
+    uint32_t fired;
+} mems_trigger;
+
+/**
+ * Ways in which channel values are computed at the points of a fixed grid
+ * from samples taken at irregular times.
+ */
+enum mems_resample_method
+{
+    //! Zero-order hold: the value of the latest sample at or before the point
+    MEMS_Resample_Hold = 0,
+    //! Linear interpolation between the samples either side of the point
+    MEMS_Resample_Linear
+};
+
+/**
+ * Describes the grid onto which samples are resampled.
+ */
+typedef struct
+{
+    //! One of the mems_resample_method values
+    uint8_t method;
+    uint8_t reserved[3];
+    //! Interval between grid points, in microseconds
+    uint32_t period_us;
+    //! Time of one of the grid points, in microseconds; the grid extends a
+    //! whole number of periods either side of it (see mems_resample_origin())
+    uint64_t origin_us;
+    //! Longest interval between samples across which values are held or
+    //! interpolated, in microseconds; grid points in a longer gap are NaN
+    //! (0 for no limit)
+    uint64_t max_gap_us;
+} mems_resample_options;
+
+/**
+ * Function called with the values of all of the decoded channels (indexed
+ * by mems_field) at a point of the grid.
+ */
+typedef void (*mems_resample_callback)(uint64_t timestamp_us, const float* values, void* context);
+
+/**
+ * State of a streaming resampler. A grid point is produced once the first
+ * sample after it has arrived, so values lag the input by one sample.
+ */
+typedef struct
+{
+    mems_resample_options options;
+    mems_resample_callback callback;
+    void* context;
+    //! True once the first sample has arrived
+    bool started;
+    //! Time of the next grid point to be produced
+    uint64_t next_us;
+    //! Time and channel values of the latest sample
+    uint64_t last_us;
+    float last[MEMS_Field_Count];
+    //! Number of grid points produced so far
+    uint64_t points;
+} mems_resampler;
+
+/**
+ * Channels of a capture resampled onto a fixed grid, stored as one array per
+ * channel.
+ */
+typedef struct
+{
+    //! Number of grid points
+    uint32_t points;
+    //! Interval between grid points, in microseconds
+    uint32_t period_us;
+    //! Time of the first grid point, in microseconds since the capture was opened
+    uint64_t first_us;
+    //! Wall-clock time of the first grid point, in microseconds since the
+    //! Unix epoch (0 if the capture has no clock anchor)
+    int64_t first_realtime_us;
+    //! Values of each channel (indexed by mems_field) at the grid points
+    float* values[MEMS_Field_Count];
+} mems_resampled;
+
+//! Largest response that the simulator produces for a single command byte
+#define MEMS_SIM_MAX_RESPONSE (1 + MEMS_MAX_MEMORY_BLOCK)
+
+#if !defined(WIN32)
+/**
+ * State for the ECU simulator, which answers ROSCO commands with a set of
+ * configurable frames. It can be served over a pseudo-terminal so that it
+ * may stand in for a real ECU on a serial device path.
+ */
+typedef struct
+{
+    //! Bytes returned after the echo of the D0 command
+    uint8_t d0_response[MEMS_D0_RESPONSE_LEN];
+    //! Frame returned in response to the 0x80 command
+    mems_data_frame_80 frame80;
+    //! Frame returned in response to the 0x7D command
+    mems_data_frame_7d frame7d;
+    //! Current position of the simulated idle air control valve
+    uint8_t iac_position;
+    //! Number of positions the valve moves for each open/close command
+    uint8_t iac_steps_per_cmd;
+    //! Minimum time between open/close commands for the valve to move, in
+    //! microseconds; commands arriving sooner are acknowledged but ignored
+    uint32_t iac_min_spacing_us;
+    //! Monotonic time at which the valve last accepted a command
+    uint64_t iac_last_move_us;
+    //! Contents of the simulated memory, or NULL if memory reads are not simulated
+    const uint8_t* memory;
+    //! Size of the simulated memory; addresses wrap around at this size
+    uint32_t memory_size;
+    //! Commands through which the simulated memory is read
+    mems_memory_protocol memory_protocol;
+    //! Current address of the simulated memory pointer
+    uint32_t memory_address;
+    //! Number of address bytes still to be received after the address command
+    uint8_t address_bytes_pending;
+    //! Additional delay before each response is sent, in microseconds
+    uint32_t response_delay_us;
+    //! Line settings applied to the pseudo-terminal; 'baud' also paces the
+    //! simulated transmission so that line rates can be benchmarked
+    mems_connection_options options;
+    //! Master side of the pseudo-terminal
+    int master_fd;
+    //! Slave side of the pseudo-terminal, held open while the simulator runs
+    int slave_fd;
+    //! Path of the slave device, to be passed to mems_connect()
+    char device_path[64];
+    //! Thread servicing the pseudo-terminal
+    pthread_t thread;
+    //! Set while the service thread should keep running
+    volatile bool running;
+    //! Lock protecting the simulated ECU state
+    pthread_mutex_t mutex;
+} mems_sim;
+#endif
+
+//! Default path of the Unix domain socket on which roscod accepts clients
+#define MEMS_DAEMON_SOCKET "/tmp/roscod.sock"
+
+/**
+ * Types of messages exchanged between roscod and its clients.
+ */
+enum mems_daemon_msg_type
+{
+    //! Daemon to client, on connection: 'frame80' holds the D0 response
+    MEMS_Msg_Hello = 1,
+    //! Daemon to client: a newly acquired pair of data frames
+    MEMS_Msg_Frame,
+    //! Client to daemon: request exclusive control of the actuators
+    MEMS_Msg_Claim,
+    //! Client to daemon: give up exclusive control of the actuators
+    MEMS_Msg_Release,
+    //! Client to daemon: run the actuator test in 'cmd'
+    MEMS_Msg_Actuate,
+    //! Daemon to client: outcome of a Claim, Release, Actuate, or Subscribe request
+    MEMS_Msg_Result,
+    //! Client to daemon: choose the messages to receive; 'cmd' is a bitmap
+    //! of mems_daemon_stream values (frames only by default)
+    MEMS_Msg_Subscribe,
+    //! Daemon to client: the item in 'cmd' (a mems_change_item) has changed
+    //! to the value in 'data'; 'seq' is the sequence number of the frame
+    MEMS_Msg_Change
+};
+
+/**
+ * Streams to which a client of roscod may subscribe.
+ */
+enum mems_daemon_stream
+{
+    //! Every acquired frame, as MEMS_Msg_Frame messages
+    MEMS_Stream_Frames = 0x01,
+    //! Changes in fault codes and switch states, as MEMS_Msg_Change messages
+    MEMS_Stream_Changes = 0x02
+};
+
+/**
+ * Status values returned in MEMS_Msg_Result messages.
+ */
+enum mems_daemon_status
+{
+    MEMS_Status_OK = 0,
+    //! Another client holds exclusive control of the actuators
+    MEMS_Status_Denied,
+    //! The command was sent but the ECU did not respond as expected
+    MEMS_Status_Failed
+};
+
+/**
+ * Fixed-size message exchanged over the roscod socket.
+ */
+typedef struct
+{
+    //! One of the mems_daemon_msg_type values
+    uint8_t type;
+    //! Command byte (Actuate and Result messages)
+    uint8_t cmd;
+    //! One of the mems_daemon_status values (Result messages)
+    uint8_t status;
+    //! Byte returned by the ECU after the echo (Result messages)
+    uint8_t data;
+    //! Sequence number of the frame (Frame messages)
+    uint32_t seq;
+    //! Monotonic time at which the frame was acquired, in microseconds
+    uint64_t timestamp_us;
+    //! Raw response to the 0x80 command (Frame messages)
+    mems_data_frame_80 frame80;
+    //! Raw response to the 0x7D command (Frame messages)
+    mems_data_frame_7d frame7d;
+} mems_daemon_msg;
+
+//! Identifies a librosco shared-memory frame ring
+#define MEMS_SHM_MAGIC "ROSCOSHM"
+//! Version of the shared-memory layout
+#define MEMS_SHM_VERSION 1
+
+/**
+ * Header at the start of a shared-memory frame ring. It is followed by
+ * 'capacity' mems_shm_record structs.
+ */
+typedef struct
+{
+    //! MEMS_SHM_MAGIC (not terminated)
+    char magic[8];
+    //! MEMS_SHM_VERSION
+    uint32_t version;
+    //! Number of records in the ring (a power of two)
+    uint32_t capacity;
+    //! Size of each record in bytes
+    uint32_t record_size;
+    //! D0 response of the ECU being published
+    uint8_t d0_response[MEMS_D0_RESPONSE_LEN];
+    //! Number of records published so far; written last for each record
+    volatile uint64_t head;
+    uint8_t reserved[32];
+} mems_shm_header;
+
+/**
+ * One published sample in a shared-memory frame ring.
+ */
+typedef struct
+{
+    //! One more than the record's sequence number once it is complete;
+    //! zero while the publisher is writing it
+    volatile uint64_t seq;
+    //! Monotonic time at which the frame was acquired, in microseconds
+    uint64_t timestamp_us;
+    //! Raw response to the 0x80 command
+    mems_data_frame_80 frame80;
+    //! Raw response to the 0x7D command
+    mems_data_frame_7d frame7d;
+    uint8_t reserved[4];
+} mems_shm_record;
+
+/**
+ * State for publishing frames into a shared-memory ring.
+ */
+typedef struct
+{
+    //! Name of the POSIX shared-memory object
+    char name[64];
+    //! Size of the mapping in bytes
+    size_t size;
+    //! Mapped ring header
+    mems_shm_header* header;
+    //! Mapped ring records
+    mems_shm_record* records;
+} mems_shm_publisher;
+
+/**
+ * State for consuming frames from a shared-memory ring. Readers map the ring
+ * read-only, so any number of them may attach without affecting the
+ * publisher or each other.
+ */
+typedef struct
+{
+    //! Size of the mapping in bytes
+    size_t size;
+    //! Mapped ring header
+    const mems_shm_header* header;
+    //! Mapped ring records
+    const mems_shm_record* records;
+    //! Sequence number of the next record to be returned
+    uint64_t next;
+    //! Number of records that were overwritten before they could be read
+    uint64_t missed;
+} mems_shm_reader;
+
 void mems_init(mems_info* info);
 bool mems_init_link(mems_info* info, uint8_t* d0_response_buffer);
 void mems_cleanup(mems_info* info);
+void mems_set_clock(mems_clock_callback callback, void* context);
+void mems_clock_anchor_now(mems_clock_anchor* anchor);
+uint64_t mems_monotonic_us();
 bool mems_connect(mems_info* info, const char* devPath);
+void mems_default_connection_options(mems_connection_options* options);
+bool mems_connect_with_options(mems_info* info, const char* devPath, const mems_connection_options* options);
+bool mems_tune_ftdi_latency(const char* devPath, const char* sysfs_root, uint8_t latency_ms,
+                            mems_latency_report* report);
+bool mems_connect_transport(mems_info* info, const mems_transport_ops* ops, void* ctx);
+bool mems_connect_replay(mems_info* info, const char* capturePath, bool realtime);
+#if !defined(WIN32)
+bool mems_connect_tcp(mems_info* info, const char* host, uint16_t port);
+bool mems_connect_loopback(mems_info* info, mems_sim* sim);
+#endif
+bool mems_connect_spec(mems_info* info, const char* spec, const mems_connection_options* options);
+int16_t mems_transport_read(mems_info* info, uint8_t* buffer, uint16_t quantity, int timeout_ms);
+int16_t mems_transport_write(mems_info* info, const uint8_t* buffer, uint16_t quantity);
 void mems_disconnect(mems_info* info);
 bool mems_is_connected(mems_info* info);
 bool mems_read_raw(mems_info* info, mems_data_frame_80* frame80, mems_data_frame_7d* frame7d);
 bool mems_read(mems_info* info, mems_data* data);
 bool mems_read_iac_position(mems_info* info, uint8_t* position);
 bool mems_move_iac(mems_info* info, uint8_t desired_pos);
+bool mems_move_iac_ex(mems_info* info, uint8_t desired_pos, mems_iac_result* result);
+bool mems_iac_sweep(mems_info* info, uint32_t spacing_us, mems_iac_step_callback callback,
+                    void* context, mems_iac_result* result);
+bool mems_load_script(mems_script* script, const char* path);
+void mems_free_script(mems_script* script);
+int16_t mems_response_len(const mems_info* info, uint8_t cmd);
+bool mems_run_script(mems_info* info, const mems_script* script, mems_script_callback callback, void* context);
+void mems_length_table_init(mems_length_table* table);
+bool mems_length_table_load(mems_length_table* table, const char* path);
+bool mems_length_table_save(mems_length_table* table, const char* path);
+int16_t mems_command_learned(mems_info* info, mems_length_table* table, uint8_t cmd,
+                             uint8_t* response, uint16_t max_length);
+void mems_default_scan_options(mems_scan_options* options);
+int mems_scan_commands(mems_info* info, const mems_scan_options* options, mems_length_table* lengths,
+                       mems_scan_entry* map, mems_scan_callback callback, void* context);
+bool mems_write_command_map(const mems_scan_entry* map, int count, FILE* fp);
+bool mems_parse_memory_protocol(const char* spec, mems_memory_protocol* protocol);
+uint32_t mems_crc32(uint32_t crc, const uint8_t* data, size_t length);
+void mems_memory_progress_init(mems_memory_progress* progress, uint32_t start, uint32_t length);
+bool mems_read_memory(mems_info* info, const mems_memory_protocol* protocol, mems_memory_progress* progress,
+                      uint8_t* buffer, mems_memory_callback callback, void* context);
 bool mems_test_actuator(mems_info* info, actuator_cmd cmd, uint8_t* data);
 bool mems_clear_faults(mems_info* info);
 bool mems_heartbeat(mems_info* info);
+void mems_set_keepalive(mems_info* info, uint32_t idle_ms);
+
+const mems_profile* mems_default_profile();
+const mems_profile* mems_find_profile(const uint8_t* d0_response);
+int mems_load_profiles(const char* path);
+bool mems_profile_supports_actuator(const mems_profile* profile, uint8_t cmd);
+const char* mems_field_name(enum mems_field field);
+float mems_field_value(const mems_data* data, enum mems_field field);
+void mems_decode_frames(const mems_profile* profile, const mems_data_frame_80* frame80,
+                        const mems_data_frame_7d* frame7d, mems_data* data);
+
+bool mems_ring_init(mems_frame_ring* ring, uint32_t capacity);
+void mems_ring_free(mems_frame_ring* ring);
+bool mems_ring_subscribe(mems_frame_ring* ring, mems_frame_callback callback, void* context);
+void mems_stats_init(mems_stats* stats, uint32_t channel_mask);
+void mems_stats_update(mems_stats* stats, const mems_data* data);
+void mems_stats_frame_callback(const mems_frame* frame, void* stats);
+bool mems_stats_read(const mems_stats* stats, enum mems_field channel, mems_stats_snapshot* snapshot);
+const mems_frame* mems_ring_get(const mems_frame_ring* ring, uint32_t seq);
+const mems_frame* mems_read_frame(mems_info* info, mems_frame_ring* ring);
+bool mems_poll_devices(mems_info* const* devices, int count, uint32_t samples_per_device,
+                       mems_device_sample_callback callback, void* context);
+void mems_change_stream_init(mems_change_stream* stream);
+bool mems_change_subscribe(mems_change_stream* stream, mems_change_callback callback, void* context);
+int mems_change_update(mems_change_stream* stream, const mems_frame* frame, uint64_t timestamp_us);
+void mems_change_frame_callback(const mems_frame* frame, void* stream);
+const char* mems_change_item_name(enum mems_change_item item);
+
+bool mems_capture_open(mems_capture_writer* writer, const char* path, const uint8_t* d0_response);
+bool mems_capture_write(mems_capture_writer* writer, uint8_t type, uint64_t timestamp_us,
+                        const void* payload, uint16_t length);
+bool mems_capture_write_frames(mems_capture_writer* writer, const mems_data_frame_80* frame80,
+                               const mems_data_frame_7d* frame7d);
+void mems_capture_frame_callback(const mems_frame* frame, void* writer);
+void mems_capture_iac_callback(const mems_iac_step* step, uint64_t timestamp_us, void* writer);
+void mems_capture_close(mems_capture_writer* writer);
+bool mems_capture_reader_open(mems_capture_reader* reader, const char* path);
+bool mems_capture_next(mems_capture_reader* reader, mems_capture_record* record,
+                       uint8_t* payload, uint16_t max_length);
+void mems_capture_reader_close(mems_capture_reader* reader);
+bool mems_capture_map_open(mems_capture_map* map, const char* path);
+bool mems_capture_map_next(mems_capture_map* map, const mems_capture_record** record, const uint8_t** payload);
+void mems_capture_map_close(mems_capture_map* map);
+bool mems_parse_output_format(const char* name, enum mems_output_format* format);
+bool mems_output_open(mems_output* output, FILE* fp, enum mems_output_format format,
+                      uint32_t flush_interval_ms, const uint8_t* d0_response, bool device_column);
+bool mems_output_frame(mems_output* output, const mems_frame* frame, uint64_t timestamp_us);
+bool mems_output_device_frame(mems_output* output, uint8_t device, const mems_frame* frame,
+                              uint64_t timestamp_us);
+void mems_output_frame_callback(const mems_frame* frame, void* output);
+bool mems_output_flush(mems_output* output);
+bool mems_output_close(mems_output* output);
+
+const mems_fault_info* mems_fault_description(enum mems_fault fault);
+uint64_t mems_dtc_bits(const mems_data_frame_80* frame80, const mems_data_frame_7d* frame7d);
+int mems_expand_faults(const mems_profile* profile, uint64_t bits, mems_active_fault* faults);
+int mems_decode_faults(const mems_profile* profile, const mems_data_frame_80* frame80,
+                       const mems_data_frame_7d* frame7d, mems_active_fault* faults);
+bool mems_scan_capture_faults(const char* path, mems_fault_summary* summary,
+                              mems_fault_callback callback, void* context);
+bool mems_index_capture(const char* path, mems_session_index* index);
+bool mems_write_index(const mems_session_index* index, const char* path);
+bool mems_read_index(mems_session_index* index, const char* path);
+int mems_index_files(const char* const* paths, int count, int threads,
+                     mems_index_callback callback, void* context);
+bool mems_parse_query(const char* text, mems_query* query);
+bool mems_query_match(const mems_query* query, const mems_data* data);
+bool mems_query_files(const char* const* paths, int count, const mems_query* query, int threads,
+                      bool use_index, mems_query_result* result, uint64_t* matched_per_file);
+bool mems_columnar_open(mems_columnar_writer* writer, const char* path, const uint8_t* d0_response,
+                        uint32_t rows_per_group);
+bool mems_columnar_append(mems_columnar_writer* writer, uint64_t timestamp_us, const mems_data_frame_80* frame80,
+                          const mems_data_frame_7d* frame7d, const mems_data* data);
+bool mems_columnar_close(mems_columnar_writer* writer);
+bool mems_export_columnar(const char* capture_path, const char* path, uint32_t rows_per_group, uint64_t* rows);
+bool mems_columnar_reader_open(mems_columnar_reader* reader, const char* path);
+int mems_columnar_find_column(const mems_columnar_reader* reader, const char* name);
+bool mems_columnar_read(mems_columnar_reader* reader, uint32_t group, uint32_t column, void* values);
+void mems_columnar_reader_close(mems_columnar_reader* reader);
+
+bool mems_parse_trigger_options(const char* spec, mems_trigger_options* options);
+bool mems_trigger_init(mems_trigger* trigger, const mems_trigger_options* options, mems_capture_writer* writer);
+bool mems_trigger_add(mems_trigger* trigger, const mems_frame* frame, uint64_t timestamp_us);
+void mems_trigger_frame_callback(const mems_frame* frame, void* trigger);
+void mems_trigger_free(mems_trigger* trigger);
+
+uint64_t mems_resample_origin(const mems_clock_anchor* anchor, uint32_t period_us);
+void mems_resampler_init(mems_resampler* resampler, const mems_resample_options* options,
+                         mems_resample_callback callback, void* context);
+uint32_t mems_resample_add(mems_resampler* resampler, uint64_t timestamp_us, const mems_data* data);
+void mems_resample_frame_callback(const mems_frame* frame, void* resampler);
+uint32_t mems_resample_grid(const mems_resample_options* options, const uint64_t* times, uint32_t count,
+                            uint64_t* first_us, uint32_t* lower, uint32_t* upper, float* weight, uint32_t max_points);
+void mems_resample_apply(const uint32_t* lower, const uint32_t* upper, const float* weight, uint32_t points,
+                         const float* input, float* output);
+bool mems_resample_capture(const char* path, const mems_resample_options* options, mems_resampled* result);
+void mems_resampled_free(mems_resampled* result);
+
+#if !defined(WIN32)
+void mems_sim_init(mems_sim* sim);
+uint16_t mems_sim_respond(mems_sim* sim, uint8_t cmd, uint8_t* response);
+bool mems_sim_start_pty(mems_sim* sim, const mems_connection_options* options);
+void mems_sim_stop(mems_sim* sim);
+
+int mems_client_connect(const char* socketPath);
+bool mems_client_next(int fd, mems_daemon_msg* msg);
+bool mems_client_send(int fd, uint8_t type, uint8_t cmd);
+void mems_client_close(int fd);
+
+bool mems_shm_create(mems_shm_publisher* pub, const char* name, uint32_t capacity, const uint8_t* d0_response);
+void mems_shm_publish(mems_shm_publisher* pub, uint64_t timestamp_us,
+                      const mems_data_frame_80* frame80, const mems_data_frame_7d* frame7d);
+void mems_shm_frame_callback(const mems_frame* frame, void* publisher);
+void mems_shm_destroy(mems_shm_publisher* pub);
+bool mems_shm_attach(mems_shm_reader* reader, const char* name);
+const mems_shm_record* mems_shm_next(mems_shm_reader* reader);
+bool mems_shm_still_valid(const mems_shm_reader* reader, const mems_shm_record* record);
+void mems_shm_detach(mems_shm_reader* reader);
+#endif
 
 librosco_version mems_get_lib_version();
 
@@ -3,13 +3,32 @@
 
 #include <stdbool.h>
 
-bool mems_openserial(mems_info *info, const char *devPath);
+#if !defined(WIN32)
+  #include <termios.h>
+#endif
+
+bool mems_openserial(mems_info *info, const char *devPath, const mems_connection_options* options);
 bool mems_send_command(mems_info *info, uint8_t cmd);
+bool mems_command_with_byte(mems_info* info, uint8_t cmd, uint8_t* data);
 int16_t mems_read_serial(mems_info* info, uint8_t *buffer, uint16_t quantity);
 int16_t mems_write_serial(mems_info* info, uint8_t *buffer, uint16_t quantity);
 bool mems_lock(mems_info* info);
 void mems_unlock(mems_info* info);
 uint8_t temperature_value_to_degrees_f(uint8_t val);
+void mems_sleep_us(uint64_t us);
+bool mems_capture_write_frames_at(mems_capture_writer* writer, uint64_t request_us, uint64_t timestamp_us,
+                                  const mems_data_frame_80* frame80, const mems_data_frame_7d* frame7d);
+
+extern const mems_transport_ops mems_serial_transport;
+
+#if !defined(WIN32)
+bool mems_baud_to_speed(uint32_t baud, speed_t* speed);
+#endif
+
+#if defined(linux)
+bool mems_sysfs_read_int(const char* path, int* value);
+bool mems_sysfs_write_int(const char* path, int value);
+#endif
 
 #endif // LIBMEMS_INTERNAL_H
 
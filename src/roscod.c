@@ -0,0 +1,538 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <libgen.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "rosco.h"
+
+//! Maximum number of simultaneously connected clients
+#define MAX_CLIENTS 32
+//! Number of messages that may be queued for a slow client before frames are dropped
+#define CLIENT_QUEUE_MSGS 64
+//! No client holds exclusive control of the actuators
+#define NO_OWNER -1
+//! Permissions of the socket: only the daemon's user and group may connect
+#define SOCKET_MODE 0660
+//! Delay before the first retry after a failed read, in ms; it doubles with
+//! each further failure, up to READ_RETRY_MAX_MS
+#define READ_RETRY_MIN_MS 10
+#define READ_RETRY_MAX_MS 2000
+//! Shortest interval between repeated warnings about failed reads, in ms
+#define READ_WARNING_INTERVAL_MS 5000
+
+typedef struct
+{
+  int fd;
+  uint8_t in[sizeof(mems_daemon_msg)];
+  size_t in_len;
+  uint8_t out[CLIENT_QUEUE_MSGS * sizeof(mems_daemon_msg)];
+  size_t out_len;
+  uint32_t dropped;
+  //! Bitmap of the mems_daemon_stream values the client receives
+  uint8_t streams;
+} client;
+
+typedef struct
+{
+  mems_info info;
+  uint8_t d0[MEMS_D0_RESPONSE_LEN];
+  client clients[MAX_CLIENTS];
+  int owner;
+  mems_change_stream changes;
+} daemon_state;
+
+static volatile sig_atomic_t quit = 0;
+
+static void handle_signal(int sig)
+{
+  (void)sig;
+  quit = 1;
+}
+
+/**
+ * Sends as much of a client's queued output as the socket will take.
+ */
+static void flush_client(client* c)
+{
+  ssize_t sent;
+
+  while (c->out_len > 0)
+  {
+    sent = send(c->fd, c->out, c->out_len, MSG_DONTWAIT);
+    if (sent <= 0)
+    {
+      break;
+    }
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+  }
+}
+
+/**
+ * Queues a message for a client. Messages are only ever queued whole, so a
+ * slow client loses entire frames rather than falling out of sync.
+ */
+static bool queue_msg(client* c, const mems_daemon_msg* msg)
+{
+  if (c->out_len + sizeof(mems_daemon_msg) > sizeof(c->out))
+  {
+    c->dropped++;
+    return false;
+  }
+
+  memcpy(c->out + c->out_len, msg, sizeof(mems_daemon_msg));
+  c->out_len += sizeof(mems_daemon_msg);
+
+  return true;
+}
+
+static void drop_client(daemon_state* d, int idx)
+{
+  if (d->clients[idx].dropped > 0)
+  {
+    printf("Client %d disconnected (%u frames dropped)\n", idx, d->clients[idx].dropped);
+  }
+
+  close(d->clients[idx].fd);
+  d->clients[idx].fd = -1;
+
+  if (d->owner == idx)
+  {
+    d->owner = NO_OWNER;
+  }
+}
+
+/**
+ * Frame ring subscriber that fans each acquired frame out to every client.
+ */
+static void fan_out(const mems_frame* frame, void* context)
+{
+  daemon_state* d = (daemon_state*)context;
+  mems_daemon_msg msg;
+  int idx;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.type = MEMS_Msg_Frame;
+  msg.seq = frame->seq;
+  msg.timestamp_us = frame->response_us;
+  msg.frame80 = frame->frame80;
+  msg.frame7d = frame->frame7d;
+
+  for (idx = 0; idx < MAX_CLIENTS; ++idx)
+  {
+    if ((d->clients[idx].fd >= 0) && (d->clients[idx].streams & MEMS_Stream_Frames))
+    {
+      queue_msg(&d->clients[idx], &msg);
+      flush_client(&d->clients[idx]);
+    }
+  }
+}
+
+/**
+ * Change stream subscriber that sends each change to the clients that
+ * have asked for changes.
+ */
+static void fan_out_change(const mems_change_event* event, void* context)
+{
+  daemon_state* d = (daemon_state*)context;
+  mems_daemon_msg msg;
+  int idx;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.type = MEMS_Msg_Change;
+  msg.cmd = event->item;
+  msg.data = event->new_value;
+  msg.seq = event->seq;
+  msg.timestamp_us = event->timestamp_us;
+
+  for (idx = 0; idx < MAX_CLIENTS; ++idx)
+  {
+    if ((d->clients[idx].fd >= 0) && (d->clients[idx].streams & MEMS_Stream_Changes))
+    {
+      queue_msg(&d->clients[idx], &msg);
+      flush_client(&d->clients[idx]);
+    }
+  }
+}
+
+/**
+ * Sends a client the current value of every item watched for changes.
+ */
+static void send_change_state(daemon_state* d, int idx)
+{
+  mems_daemon_msg msg;
+  int item;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.type = MEMS_Msg_Change;
+  msg.timestamp_us = mems_monotonic_us();
+
+  for (item = 0; item < MEMS_Change_Count; ++item)
+  {
+    msg.cmd = item;
+    msg.data = d->changes.last[item];
+    queue_msg(&d->clients[idx], &msg);
+  }
+}
+
+/**
+ * Carries out a request from a client. Only one client at a time may hold
+ * exclusive control; while it does, actuator requests from the others are
+ * denied. Without an owner, requests are served first-come, first-served.
+ * Only the actuator tests listed in the ECU's profile may be requested.
+ */
+static void handle_request(daemon_state* d, int idx, const mems_daemon_msg* req)
+{
+  mems_daemon_msg result;
+
+  memset(&result, 0, sizeof(result));
+  result.type = MEMS_Msg_Result;
+  result.cmd = req->cmd;
+  result.status = MEMS_Status_OK;
+
+  switch (req->type)
+  {
+  case MEMS_Msg_Claim:
+    if ((d->owner != NO_OWNER) && (d->owner != idx))
+    {
+      result.status = MEMS_Status_Denied;
+    }
+    else
+    {
+      d->owner = idx;
+    }
+    break;
+
+  case MEMS_Msg_Release:
+    if (d->owner == idx)
+    {
+      d->owner = NO_OWNER;
+    }
+    break;
+
+  case MEMS_Msg_Actuate:
+    if (((d->owner != NO_OWNER) && (d->owner != idx)) ||
+        !mems_profile_supports_actuator(d->info.profile, req->cmd))
+    {
+      result.status = MEMS_Status_Denied;
+    }
+    else if (!mems_test_actuator(&d->info, (actuator_cmd)req->cmd, &result.data))
+    {
+      result.status = MEMS_Status_Failed;
+    }
+    break;
+
+  case MEMS_Msg_Subscribe:
+    // a new subscriber to changes first learns the current state
+    if ((req->cmd & MEMS_Stream_Changes) && !(d->clients[idx].streams & MEMS_Stream_Changes) &&
+        d->changes.primed)
+    {
+      send_change_state(d, idx);
+    }
+    d->clients[idx].streams = req->cmd;
+    break;
+
+  default:
+    return;
+  }
+
+  queue_msg(&d->clients[idx], &result);
+  flush_client(&d->clients[idx]);
+}
+
+/**
+ * Reads whatever a client has sent and handles each complete request.
+ * @return False if the client has disconnected
+ */
+static bool service_client(daemon_state* d, int idx)
+{
+  client* c = &d->clients[idx];
+  ssize_t got;
+
+  got = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, MSG_DONTWAIT);
+  if (got == 0 || ((got < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)))
+  {
+    return false;
+  }
+
+  if (got > 0)
+  {
+    c->in_len += got;
+    if (c->in_len == sizeof(mems_daemon_msg))
+    {
+      handle_request(d, idx, (mems_daemon_msg*)c->in);
+      c->in_len = 0;
+    }
+  }
+
+  return true;
+}
+
+static void accept_client(daemon_state* d, int listen_fd)
+{
+  mems_daemon_msg hello;
+  int fd;
+  int idx;
+
+  if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+  {
+    return;
+  }
+
+  for (idx = 0; idx < MAX_CLIENTS; ++idx)
+  {
+    if (d->clients[idx].fd < 0)
+    {
+      memset(&d->clients[idx], 0, sizeof(client));
+      d->clients[idx].fd = fd;
+      d->clients[idx].streams = MEMS_Stream_Frames;
+
+      memset(&hello, 0, sizeof(hello));
+      hello.type = MEMS_Msg_Hello;
+      memcpy(&hello.frame80, d->d0, MEMS_D0_RESPONSE_LEN);
+      queue_msg(&d->clients[idx], &hello);
+      flush_client(&d->clients[idx]);
+      return;
+    }
+  }
+
+  printf("Rejecting client: limit of %d reached\n", MAX_CLIENTS);
+  close(fd);
+}
+
+static int open_listener(const char* path)
+{
+  struct sockaddr_un addr;
+  int fd;
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  unlink(path);
+
+  if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+  {
+    return -1;
+  }
+
+  // the mode is set before listening, so no client can connect before then
+  if ((bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) ||
+      (chmod(path, SOCKET_MODE) != 0) ||
+      (listen(fd, 8) != 0))
+  {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+int main(int argc, char** argv)
+{
+  static daemon_state d;
+  mems_connection_options options;
+  mems_frame_ring ring;
+  mems_shm_publisher shm;
+  const char* shm_name = NULL;
+  struct pollfd pfds[MAX_CLIENTS + 1];
+  int client_of[MAX_CLIENTS + 1];
+  const char* socket_path = MEMS_DAEMON_SOCKET;
+  uint32_t interval_ms = 0;
+  uint64_t next_sample_us = 0;
+  uint64_t last_warning_us = 0;
+  uint64_t retry_ms;
+  uint32_t failures = 0;
+  uint64_t now;
+  int listen_fd;
+  int nfds;
+  int timeout;
+  int opt;
+  int idx;
+  int status = -2;
+
+  mems_default_connection_options(&options);
+  memset(&shm, 0, sizeof(shm));
+
+  while ((opt = getopt(argc, argv, "s:m:b:i:Lt:")) != -1)
+  {
+    switch (opt)
+    {
+    case 's':
+      socket_path = optarg;
+      break;
+    case 'm':
+      shm_name = optarg;
+      break;
+    case 'b':
+      options.baud = strtoul(optarg, NULL, 0);
+      break;
+    case 'i':
+      interval_ms = strtoul(optarg, NULL, 0);
+      break;
+    case 'L':
+      options.low_latency = true;
+      break;
+    case 't':
+      options.ftdi_latency_ms = strtoul(optarg, NULL, 0);
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (optind >= argc)
+  {
+    printf("roscod: shares one MEMS ECU connection among many local clients\n");
+    printf("Usage: %s [-s socket] [-m shm-name] [-i interval-ms] [-b baud] [-L] [-t ms] <serial device>\n", basename(argv[0]));
+    printf(" Clients connect to the socket (default %s) to receive every frame\n", MEMS_DAEMON_SOCKET);
+    printf(" (or only changes in fault codes and switch states, on request)\n");
+    printf(" and to request actuator tests. With -m, frames are also published to a\n");
+    printf(" shared-memory ring (e.g. /rosco) that local readers can map directly.\n");
+    return 0;
+  }
+
+  for (idx = 0; idx < MAX_CLIENTS; ++idx)
+  {
+    d.clients[idx].fd = -1;
+  }
+  d.owner = NO_OWNER;
+
+  signal(SIGINT, handle_signal);
+  signal(SIGTERM, handle_signal);
+  signal(SIGPIPE, SIG_IGN);
+
+  mems_init(&d.info);
+  mems_change_stream_init(&d.changes);
+  mems_change_subscribe(&d.changes, fan_out_change, &d);
+
+  if (!mems_ring_init(&ring, 16) || !mems_ring_subscribe(&ring, fan_out, &d) ||
+      !mems_ring_subscribe(&ring, mems_change_frame_callback, &d.changes))
+  {
+    printf("Error allocating frame buffer memory.\n");
+  }
+  else if (!mems_connect_spec(&d.info, argv[optind], &options))
+  {
+    printf("Error: could not open serial device (%s).\n", argv[optind]);
+  }
+  else if (!mems_init_link(&d.info, d.d0))
+  {
+    printf("Error in initialization sequence.\n");
+  }
+  else if (shm_name && (!mems_shm_create(&shm, shm_name, 1024, d.d0) ||
+                        !mems_ring_subscribe(&ring, mems_shm_frame_callback, &shm)))
+  {
+    printf("Error: could not create shared-memory ring %s.\n", shm_name);
+  }
+  else if ((listen_fd = open_listener(socket_path)) < 0)
+  {
+    printf("Error: could not listen on %s.\n", socket_path);
+  }
+  else
+  {
+    printf("Serving %s (%s) on %s\n", argv[optind], d.info.profile->name, socket_path);
+    fflush(stdout);
+
+    while (!quit)
+    {
+      pfds[0].fd = listen_fd;
+      pfds[0].events = POLLIN;
+      nfds = 1;
+      for (idx = 0; idx < MAX_CLIENTS; ++idx)
+      {
+        if (d.clients[idx].fd >= 0)
+        {
+          pfds[nfds].fd = d.clients[idx].fd;
+          pfds[nfds].events = POLLIN | ((d.clients[idx].out_len > 0) ? POLLOUT : 0);
+          client_of[nfds] = idx;
+          nfds++;
+        }
+      }
+
+      now = mems_monotonic_us();
+      timeout = (next_sample_us > now) ? (int)((next_sample_us - now + 999) / 1000) : 0;
+
+      if (poll(pfds, nfds, timeout) > 0)
+      {
+        if (pfds[0].revents & POLLIN)
+        {
+          accept_client(&d, listen_fd);
+        }
+
+        for (idx = 1; idx < nfds; ++idx)
+        {
+          if (pfds[idx].revents & (POLLIN | POLLHUP | POLLERR))
+          {
+            if (!service_client(&d, client_of[idx]))
+            {
+              drop_client(&d, client_of[idx]);
+              continue;
+            }
+          }
+          if (pfds[idx].revents & POLLOUT)
+          {
+            flush_client(&d.clients[client_of[idx]]);
+          }
+        }
+      }
+
+      if (mems_monotonic_us() >= next_sample_us)
+      {
+        next_sample_us = mems_monotonic_us() + (interval_ms * 1000);
+        if (mems_read_frame(&d.info, &ring) != NULL)
+        {
+          failures = 0;
+        }
+        else
+        {
+          // back off while the ECU is unresponsive, rather than spinning
+          failures++;
+          retry_ms = (failures < 16) ? ((uint64_t)READ_RETRY_MIN_MS << (failures - 1)) : READ_RETRY_MAX_MS;
+          retry_ms = (retry_ms < READ_RETRY_MAX_MS) ? retry_ms : READ_RETRY_MAX_MS;
+          if (retry_ms > interval_ms)
+          {
+            next_sample_us = mems_monotonic_us() + (retry_ms * 1000);
+          }
+
+          if ((last_warning_us == 0) || (mems_monotonic_us() - last_warning_us >= READ_WARNING_INTERVAL_MS * 1000ULL))
+          {
+            fprintf(stderr, "Warning: failed to read frame from ECU (%u consecutive failures)\n", failures);
+            last_warning_us = mems_monotonic_us();
+          }
+        }
+      }
+    }
+
+    close(listen_fd);
+    unlink(socket_path);
+    status = 0;
+  }
+
+  for (idx = 0; idx < MAX_CLIENTS; ++idx)
+  {
+    if (d.clients[idx].fd >= 0)
+    {
+      drop_client(&d, idx);
+    }
+  }
+
+  if (shm_name)
+  {
+    mems_shm_destroy(&shm);
+  }
+  mems_ring_free(&ring);
+  mems_disconnect(&d.info);
+  mems_cleanup(&d.info);
+
+  return status;
+}
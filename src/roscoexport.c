@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include "rosco.h"
+
+static const char* encoding_names[] = { "plain", "rle", "dictionary", "delta" };
+
+/**
+ * Prints the columns of a columnar file with the size of each after encoding
+ * and the encodings chosen for its chunks.
+ */
+static int list_columns(const char* path)
+{
+  mems_columnar_reader reader;
+  const mems_column_chunk* chunk;
+  uint64_t rows = 0;
+  uint64_t encoded;
+  uint32_t used;
+  uint32_t column;
+  uint32_t group;
+  int encoding;
+
+  if (!mems_columnar_reader_open(&reader, path))
+  {
+    return -1;
+  }
+
+  for (group = 0; group < reader.group_count; ++group)
+  {
+    rows += reader.groups[group].rows;
+  }
+  printf("%s: %llu row(s) in %u group(s)\n", path, (unsigned long long)rows, reader.group_count);
+
+  for (column = 0; column < reader.header.column_count; ++column)
+  {
+    encoded = 0;
+    used = 0;
+    for (group = 0; group < reader.group_count; ++group)
+    {
+      chunk = &reader.chunks[group * reader.header.column_count + column];
+      encoded += chunk->length;
+      used |= 1 << chunk->encoding;
+    }
+
+    printf("%-24s %10llu bytes (%5.1f%%) ", reader.columns[column].name, (unsigned long long)encoded,
+           (rows > 0) ? (100.0 * encoded / (rows * reader.columns[column].width)) : 0.0);
+    for (encoding = MEMS_Encoding_Plain; encoding <= MEMS_Encoding_Delta; ++encoding)
+    {
+      if (used & (1 << encoding))
+      {
+        printf(" %s", encoding_names[encoding]);
+      }
+    }
+    printf("\n");
+  }
+
+  mems_columnar_reader_close(&reader);
+
+  return 0;
+}
+
+/**
+ * Prints the values of the named columns (separated by commas) as CSV. Only
+ * those columns are read from the file.
+ */
+static int dump_columns(const char* path, char* names)
+{
+  mems_columnar_reader reader;
+  int selected[MEMS_COLUMNAR_COLUMNS];
+  uint8_t* values[MEMS_COLUMNAR_COLUMNS];
+  const mems_column_info* info;
+  const uint8_t* p;
+  char* name;
+  uint32_t group;
+  uint32_t row;
+  uint64_t u64;
+  uint16_t u16;
+  float f32;
+  int count = 0;
+  int idx;
+  int status = 0;
+
+  if (!mems_columnar_reader_open(&reader, path))
+  {
+    return -1;
+  }
+
+  for (name = strtok(names, ","); name && (count < MEMS_COLUMNAR_COLUMNS); name = strtok(NULL, ","))
+  {
+    if ((selected[count] = mems_columnar_find_column(&reader, name)) < 0)
+    {
+      printf("Error: no column named '%s'.\n", name);
+      status = -1;
+      break;
+    }
+    values[count] = (uint8_t*)malloc((size_t)reader.header.rows_per_group * reader.columns[selected[count]].width);
+    count++;
+  }
+
+  for (idx = 0; (status == 0) && (idx < count); ++idx)
+  {
+    printf("%s%s", (idx > 0) ? "," : "", reader.columns[selected[idx]].name);
+  }
+  if (status == 0)
+  {
+    printf("\n");
+  }
+
+  for (group = 0; (status == 0) && (group < reader.group_count); ++group)
+  {
+    for (idx = 0; idx < count; ++idx)
+    {
+      if ((values[idx] == NULL) || !mems_columnar_read(&reader, group, selected[idx], values[idx]))
+      {
+        printf("Error reading column '%s'.\n", reader.columns[selected[idx]].name);
+        status = -1;
+      }
+    }
+
+    for (row = 0; (status == 0) && (row < reader.groups[group].rows); ++row)
+    {
+      for (idx = 0; idx < count; ++idx)
+      {
+        info = &reader.columns[selected[idx]];
+        p = values[idx] + row * info->width;
+        printf("%s", (idx > 0) ? "," : "");
+
+        switch (info->type)
+        {
+        case MEMS_Column_U8:
+          printf("%u", *p);
+          break;
+        case MEMS_Column_U16:
+          memcpy(&u16, p, sizeof(u16));
+          printf("%u", u16);
+          break;
+        case MEMS_Column_U64:
+          memcpy(&u64, p, sizeof(u64));
+          printf("%llu", (unsigned long long)u64);
+          break;
+        default:
+          memcpy(&f32, p, sizeof(f32));
+          printf("%g", f32);
+          break;
+        }
+      }
+      printf("\n");
+    }
+  }
+
+  for (idx = 0; idx < count; ++idx)
+  {
+    free(values[idx]);
+  }
+  mems_columnar_reader_close(&reader);
+
+  return status;
+}
+
+/**
+ * Resamples the channels of a capture file onto a fixed grid and writes them
+ * to a CSV file, one line per grid point.
+ */
+static int export_resampled(const char* capture_path, const char* path, const mems_resample_options* options)
+{
+  mems_resampled result;
+  FILE* fp;
+  uint32_t point;
+  int field;
+  bool ok;
+
+  if (!mems_resample_capture(capture_path, options, &result))
+  {
+    printf("Error resampling %s.\n", capture_path);
+    return -1;
+  }
+
+  if ((fp = fopen(path, "w")) == NULL)
+  {
+    printf("Error creating %s.\n", path);
+    mems_resampled_free(&result);
+    return -1;
+  }
+
+  fprintf(fp, "timestamp_us,realtime_us");
+  for (field = 0; field < MEMS_Field_Count; ++field)
+  {
+    fprintf(fp, ",%s", mems_field_name((enum mems_field)field));
+  }
+  fprintf(fp, "\n");
+
+  for (point = 0; point < result.points; ++point)
+  {
+    fprintf(fp, "%llu,%lld", (unsigned long long)(result.first_us + (uint64_t)point * result.period_us),
+            (result.first_realtime_us > 0) ? (long long)(result.first_realtime_us + (int64_t)point * result.period_us) : 0LL);
+    for (field = 0; field < MEMS_Field_Count; ++field)
+    {
+      fprintf(fp, ",%g", result.values[field][point]);
+    }
+    fprintf(fp, "\n");
+  }
+
+  ok = (fclose(fp) == 0);
+  printf("Wrote %u point(s) at %u us intervals to %s.\n", result.points, result.period_us, path);
+  mems_resampled_free(&result);
+
+  return ok ? 0 : -1;
+}
+
+int main(int argc, char** argv)
+{
+  mems_resample_options resample;
+  uint32_t rows_per_group = 0;
+  uint64_t rows = 0;
+  double rate_hz = 0.0;
+  char* columns = NULL;
+  bool list = false;
+  int opt;
+
+  memset(&resample, 0, sizeof(resample));
+
+  while ((opt = getopt(argc, argv, "c:g:lm:r:s:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'c':
+      columns = optarg;
+      break;
+    case 'g':
+      rows_per_group = (uint32_t)strtoul(optarg, NULL, 0);
+      break;
+    case 'l':
+      list = true;
+      break;
+    case 'm':
+      resample.method = (strcmp(optarg, "linear") == 0) ? MEMS_Resample_Linear : MEMS_Resample_Hold;
+      break;
+    case 'r':
+      rate_hz = strtod(optarg, NULL);
+      break;
+    case 's':
+      resample.max_gap_us = strtoull(optarg, NULL, 0) * 1000;
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (list && (optind < argc))
+  {
+    return list_columns(argv[optind]);
+  }
+
+  if (columns && (optind < argc))
+  {
+    return dump_columns(argv[optind], columns);
+  }
+
+  if (optind + 1 >= argc)
+  {
+    printf("rosco-export: converts capture files to a columnar format\n");
+    printf("Usage: %s [-g rows] <capture file> <output file>\n", basename(argv[0]));
+    printf("       %s -l <columnar file>\n", basename(argv[0]));
+    printf("       %s -c <column>[,<column>...] <columnar file>\n", basename(argv[0]));
+    printf("       %s -r <Hz> [-m hold|linear] [-s ms] <capture file> <CSV file>\n", basename(argv[0]));
+    printf(" Each decoded channel and unknown frame byte is stored as a separately encoded column,\n");
+    printf(" in groups of %d rows unless -g is given.\n", MEMS_COLUMNAR_ROWS_PER_GROUP);
+    printf(" -l lists the columns of a columnar file and how well each was compressed.\n");
+    printf(" -c prints the named columns as CSV, reading only those columns.\n");
+    printf(" -r resamples the decoded channels onto a fixed-rate grid, aligned to wall-clock time if the\n");
+    printf("    capture records it, holding each value (-m hold, the default) or interpolating (-m linear).\n");
+    printf("    Points in gaps of more than -s ms between frames are left empty (NaN).\n");
+    return 0;
+  }
+
+  if (rate_hz > 0.0)
+  {
+    resample.period_us = (uint32_t)(1000000.0 / rate_hz + 0.5);
+    return export_resampled(argv[optind], argv[optind + 1], &resample);
+  }
+
+  if (!mems_export_columnar(argv[optind], argv[optind + 1], rows_per_group, &rows))
+  {
+    printf("Error converting %s.\n", argv[optind]);
+    return -1;
+  }
+
+  printf("Wrote %llu row(s) to %s.\n", (unsigned long long)rows, argv[optind + 1]);
+
+  return 0;
+}
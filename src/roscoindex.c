@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include "rosco.h"
+
+/**
+ * Prints a one-line summary of each file as it is finished.
+ */
+static void report(const char* path, const mems_session_index* index, bool ok, void* context)
+{
+  (void)context;
+  if (!ok)
+  {
+    printf("%s: failed\n", path);
+    return;
+  }
+
+  printf("%s: %s, %llu frames, %.1f s, %.0f%% closed loop, %u fault interval(s)\n", path, index->profile,
+         (unsigned long long)index->frames, (index->end_us - index->start_us) / 1000000.0,
+         (index->end_us > index->start_us) ? (100.0 * index->closed_loop_us / (index->end_us - index->start_us)) : 0.0,
+         index->fault_interval_count + index->fault_intervals_dropped);
+}
+
+/**
+ * Returns true if the capture's index exists and is newer than the capture.
+ */
+static bool index_is_current(const char* path)
+{
+  struct stat capture;
+  struct stat sidecar;
+  char* index_path;
+  bool current;
+
+  if ((index_path = (char*)malloc(strlen(path) + sizeof(MEMS_INDEX_SUFFIX))) == NULL)
+  {
+    return false;
+  }
+  strcpy(index_path, path);
+  strcat(index_path, MEMS_INDEX_SUFFIX);
+
+  current = (stat(path, &capture) == 0) && (stat(index_path, &sidecar) == 0) &&
+            (sidecar.st_mtime >= capture.st_mtime);
+
+  free(index_path);
+
+  return current;
+}
+
+int main(int argc, char** argv)
+{
+  const char** paths;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  bool force = false;
+  int count = 0;
+  int indexed;
+  int opt;
+  int idx;
+
+  while ((opt = getopt(argc, argv, "fj:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'f':
+      force = true;
+      break;
+    case 'j':
+      threads = strtol(optarg, NULL, 0);
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (optind >= argc)
+  {
+    printf("rosco-index: summarizes capture files into sidecar index files\n");
+    printf("Usage: %s [-j threads] [-f] <capture file> [...]\n", basename(argv[0]));
+    printf(" Each capture's summary is written beside it with '%s' appended to its name.\n", MEMS_INDEX_SUFFIX);
+    printf(" Captures whose index is newer than the capture are skipped unless -f is given.\n");
+    printf(" Files are indexed in parallel, by one thread per CPU unless -j is given.\n");
+    return 0;
+  }
+
+  if ((paths = (const char**)malloc((argc - optind) * sizeof(char*))) == NULL)
+  {
+    printf("Error allocating memory.\n");
+    return -1;
+  }
+
+  for (idx = optind; idx < argc; ++idx)
+  {
+    if (force || !index_is_current(argv[idx]))
+    {
+      paths[count++] = argv[idx];
+    }
+  }
+
+  indexed = mems_index_files(paths, count, (threads > 0) ? (int)threads : 1, report, NULL);
+  printf("Indexed %d of %d file(s) (%d already up to date).\n", indexed, count, (argc - optind) - count);
+
+  free(paths);
+
+  return (indexed == count) ? 0 : -1;
+}
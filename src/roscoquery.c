@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "rosco.h"
+
+typedef struct
+{
+  char** paths;
+  int count;
+  int allocated;
+} path_list;
+
+/**
+ * Appends a copy of a path to the list.
+ */
+static bool add_path(path_list* list, const char* path)
+{
+  char** grown;
+
+  if (list->count == list->allocated)
+  {
+    if ((grown = (char**)realloc(list->paths, (list->allocated * 2 + 16) * sizeof(char*))) == NULL)
+    {
+      return false;
+    }
+    list->paths = grown;
+    list->allocated = list->allocated * 2 + 16;
+  }
+
+  if ((list->paths[list->count] = strdup(path)) == NULL)
+  {
+    return false;
+  }
+  list->count++;
+
+  return true;
+}
+
+static int compare_paths(const void* a, const void* b)
+{
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * Adds a capture file to the list, or, for a directory, each regular file
+ * in it other than index sidecars, sorted by name.
+ */
+static bool add_argument(path_list* list, const char* arg)
+{
+  struct stat st;
+  struct dirent* entry;
+  DIR* dir;
+  char path[1024];
+  size_t len;
+  int first = list->count;
+  bool ok = true;
+
+  if ((stat(arg, &st) != 0) || !S_ISDIR(st.st_mode))
+  {
+    return add_path(list, arg);
+  }
+
+  if ((dir = opendir(arg)) == NULL)
+  {
+    return false;
+  }
+
+  while (ok && ((entry = readdir(dir)) != NULL))
+  {
+    len = strlen(entry->d_name);
+    if ((len >= sizeof(MEMS_INDEX_SUFFIX) - 1) &&
+        (strcmp(entry->d_name + len - (sizeof(MEMS_INDEX_SUFFIX) - 1), MEMS_INDEX_SUFFIX) == 0))
+    {
+      continue;
+    }
+
+    snprintf(path, sizeof(path), "%s/%s", arg, entry->d_name);
+    if ((stat(path, &st) == 0) && S_ISREG(st.st_mode))
+    {
+      ok = add_path(list, path);
+    }
+  }
+  closedir(dir);
+
+  qsort(list->paths + first, list->count - first, sizeof(char*), compare_paths);
+
+  return ok;
+}
+
+int main(int argc, char** argv)
+{
+  mems_query query;
+  mems_query_result result;
+  path_list list;
+  uint64_t* matched;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  bool use_index = true;
+  bool per_file = false;
+  int status = 0;
+  int opt;
+  int idx;
+
+  while ((opt = getopt(argc, argv, "j:nv")) != -1)
+  {
+    switch (opt)
+    {
+    case 'j':
+      threads = strtol(optarg, NULL, 0);
+      break;
+    case 'n':
+      use_index = false;
+      break;
+    case 'v':
+      per_file = true;
+      break;
+    default:
+      break;
+    }
+  }
+
+  if (optind + 1 >= argc)
+  {
+    printf("rosco-query: finds the frames of capture files that match a filter\n");
+    printf("Usage: %s [-j threads] [-n] [-v] \"<expression>\" <capture file or directory> [...]\n", basename(argv[0]));
+    printf(" The expression compares channels with numbers, e.g. \"coolant_temp > 90 and engine_rpm < 700\".\n");
+    printf(" Channels are named as in profile files; comparisons may be combined with and, or, not and ().\n");
+    printf(" Files are queried in parallel, by one thread per CPU unless -j is given.\n");
+    printf(" Files whose index (see rosco-index) rules out a match are skipped unless -n is given.\n");
+    printf(" With -v, the number of matching frames in each file is printed.\n");
+    return 0;
+  }
+
+  if (!mems_parse_query(argv[optind], &query))
+  {
+    printf("Error: could not parse the expression \"%s\".\n", argv[optind]);
+    return -1;
+  }
+
+  memset(&list, 0, sizeof(list));
+  for (idx = optind + 1; idx < argc; ++idx)
+  {
+    if (!add_argument(&list, argv[idx]))
+    {
+      printf("Error reading %s.\n", argv[idx]);
+      return -1;
+    }
+  }
+
+  if ((matched = (uint64_t*)calloc((list.count > 0) ? list.count : 1, sizeof(uint64_t))) == NULL)
+  {
+    printf("Error allocating memory.\n");
+    return -1;
+  }
+
+  if (!mems_query_files((const char* const*)list.paths, list.count, &query, (threads > 0) ? (int)threads : 1,
+                        use_index, &result, matched))
+  {
+    printf("Error running the query.\n");
+    status = -1;
+  }
+  else
+  {
+    if (per_file)
+    {
+      for (idx = 0; idx < list.count; ++idx)
+      {
+        printf("%s: %llu\n", list.paths[idx], (unsigned long long)matched[idx]);
+      }
+    }
+
+    printf("%llu of %llu frame(s) matched in %d file(s) (%d skipped by index, %d failed).\n",
+           (unsigned long long)result.matched, (unsigned long long)result.frames,
+           result.files, result.files_skipped, result.files_failed);
+
+    for (idx = 0; (result.matched > 0) && (idx < MEMS_Field_Count); ++idx)
+    {
+      printf("%-30s min %10.2f  max %10.2f  mean %10.2f\n", mems_field_name((enum mems_field)idx),
+             result.channels[idx].min, result.channels[idx].max,
+             result.channels[idx].sum / result.matched);
+    }
+
+    status = (result.files_failed == 0) ? 0 : -1;
+  }
+
+  for (idx = 0; idx < list.count; ++idx)
+  {
+    free(list.paths[idx]);
+  }
+  free(list.paths);
+  free(matched);
+
+  return status;
+}
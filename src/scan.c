@@ -0,0 +1,248 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// scan.c: This file contains a scanner that probes a range of command
+//         bytes and records how the ECU responds to each, to help map
+//         the commands that are not yet documented.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Size of the buffer into which each response is read
+#define MEMS_SCAN_READ_LEN 512
+//! Adapted timeouts are this multiple of the slowest recent response time
+#define MEMS_SCAN_TIMEOUT_MARGIN 4
+//! The slowest response time decays by 1/2^n per command, so that a single
+//! late response doesn't slow down the rest of the scan
+#define MEMS_SCAN_DECAY_SHIFT 3
+
+/**
+ * Sets up scan options that probe every command byte except those known to
+ * drive actuators (0x10-0x1F, injectors, coil and IAC) or to clear faults.
+ */
+void mems_default_scan_options(mems_scan_options* options)
+{
+  static const uint8_t unsafe[] = { MEMS_ClearFaults, MEMS_TestInjectors, MEMS_FireCoil,
+                                    MEMS_OpenIAC, MEMS_CloseIAC };
+  unsigned int idx;
+
+  memset(options, 0, sizeof(mems_scan_options));
+  memset(options->commands, 0xFF, sizeof(options->commands));
+
+  // the "on" half of each relay/valve test
+  options->commands[0x10 >> 3] = 0x00;
+  options->commands[0x18 >> 3] = 0x00;
+
+  for (idx = 0; idx < sizeof(unsafe); ++idx)
+  {
+    options->commands[unsafe[idx] >> 3] &= ~(1 << (unsafe[idx] & 0x07));
+  }
+
+  options->first_byte_timeout_ms = 250;
+  options->gap_timeout_ms = 100;
+  options->min_timeout_ms = 5;
+}
+
+/**
+ * Derives a timeout from the slowest recent response time, within
+ * the given bounds. Until something has been observed, the maximum is used.
+ */
+static int adapt_timeout(uint32_t slowest_us, int min_ms, int max_ms)
+{
+  int ms;
+
+  if (slowest_us == 0)
+  {
+    return max_ms;
+  }
+
+  ms = (int)((((uint64_t)slowest_us * MEMS_SCAN_TIMEOUT_MARGIN) + 999) / 1000);
+
+  if (ms < min_ms)
+  {
+    ms = min_ms;
+  }
+  if (ms > max_ms)
+  {
+    ms = max_ms;
+  }
+
+  return ms;
+}
+
+/**
+ * Probes each command byte selected in the options and records the ECU's
+ * response. Instead of waiting for a fixed timeout after every command, the
+ * scanner times the responses it sees and shortens its timeouts to a margin
+ * above the slowest recent one. A command that seems to go unanswered is
+ * given the full first-byte timeout before the scan moves on. Where the
+ * length of a response is already in the table, the read stops as soon as
+ * that many bytes have arrived; other lengths are learned into the table as
+ * they are seen.
+ *
+ * The connection is held for the whole scan.
+ * @param info State information for the current connection
+ * @param options Commands to probe and timeout bounds; NULL for the defaults
+ * @param lengths Table of learned response lengths; may be NULL
+ * @param map Receives one entry per probed command, in command order; must
+ *   have room for 256 entries
+ * @param callback Function called after each command is probed; may be NULL
+ * @param context Passed through to the callback
+ * @return Number of entries placed in the map, or -1 on a write failure
+ */
+int mems_scan_commands(mems_info* info, const mems_scan_options* options, mems_length_table* lengths,
+                       mems_scan_entry* map, mems_scan_callback callback, void* context)
+{
+  mems_scan_options defaults;
+  uint8_t buffer[MEMS_SCAN_READ_LEN];
+  mems_scan_entry* entry;
+  uint32_t slowest_us = 0;
+  uint64_t sent_us;
+  uint64_t last_us;
+  uint64_t now_us;
+  int16_t known;
+  int timeout;
+  int want;
+  int got;
+  int total;
+  int count = 0;
+  int cmd;
+
+  if (options == NULL)
+  {
+    mems_default_scan_options(&defaults);
+    options = &defaults;
+  }
+
+  if (!mems_lock(info))
+  {
+    return -1;
+  }
+
+  for (cmd = 0; cmd < 256; ++cmd)
+  {
+    if (!(options->commands[cmd >> 3] & (1 << (cmd & 0x07))))
+    {
+      continue;
+    }
+
+    entry = &map[count++];
+    memset(entry, 0, sizeof(mems_scan_entry));
+    entry->command = (uint8_t)cmd;
+
+    // discard anything that trickled in late after the previous command
+    while (mems_transport_read(info, buffer, sizeof(buffer), 0) > 0)
+    {
+    }
+
+    buffer[0] = (uint8_t)cmd;
+    if (mems_transport_write(info, buffer, 1) != 1)
+    {
+      dprintf_err("mems_scan_commands(): failed to send command %02X\n", cmd);
+      count = -1;
+      break;
+    }
+    sent_us = mems_monotonic_us();
+    last_us = sent_us;
+
+    known = lengths ? lengths->length[cmd] : MEMS_LENGTH_UNKNOWN;
+    slowest_us -= (slowest_us >> MEMS_SCAN_DECAY_SHIFT);
+    timeout = adapt_timeout(slowest_us, options->min_timeout_ms, options->first_byte_timeout_ms);
+    total = 0;
+
+    do
+    {
+      want = ((known != MEMS_LENGTH_UNKNOWN) && (known <= MEMS_SCAN_READ_LEN)) ?
+             (known - total) : (MEMS_SCAN_READ_LEN - total);
+      if (want <= 0)
+      {
+        break;
+      }
+
+      got = mems_transport_read(info, buffer + total, want, timeout);
+      if ((got == 0) && (total == 0) && (timeout < options->first_byte_timeout_ms))
+      {
+        // before concluding that the command goes unanswered, allow the
+        // full timeout, so that a slow response isn't mistaken for the
+        // next command's
+        got = mems_transport_read(info, buffer, want, options->first_byte_timeout_ms - timeout);
+      }
+      if (got > 0)
+      {
+        now_us = mems_monotonic_us();
+        if (now_us - last_us > slowest_us)
+        {
+          slowest_us = now_us - last_us;
+        }
+        if (total == 0)
+        {
+          entry->latency_us = now_us - sent_us;
+        }
+        last_us = now_us;
+        total += got;
+        timeout = adapt_timeout(slowest_us, options->min_timeout_ms, options->gap_timeout_ms);
+      }
+    } while (got > 0);
+
+    entry->responded = (total > 0);
+    entry->echoed = (total > 0) && (buffer[0] == cmd);
+    entry->length = total;
+    memcpy(entry->response, buffer, (total < MEMS_SCAN_MAX_RESPONSE) ? total : MEMS_SCAN_MAX_RESPONSE);
+
+    if (total > 0)
+    {
+      info->last_activity_us = last_us;
+    }
+
+    if (lengths && (total != known))
+    {
+      lengths->length[cmd] = ((known == MEMS_LENGTH_UNKNOWN) && (total > 0)) ? total : MEMS_LENGTH_UNKNOWN;
+      lengths->modified = true;
+    }
+
+    if (callback)
+    {
+      callback(entry, context);
+    }
+  }
+
+  mems_unlock(info);
+
+  return count;
+}
+
+/**
+ * Writes a command map produced by mems_scan_commands() as a JSON array
+ * with one object per probed command.
+ * @return True if the map was written
+ */
+bool mems_write_command_map(const mems_scan_entry* map, int count, FILE* fp)
+{
+  int idx;
+  int pos;
+  int shown;
+
+  fprintf(fp, "[\n");
+
+  for (idx = 0; idx < count; ++idx)
+  {
+    fprintf(fp, "  {\"command\": \"%02X\", \"responded\": %s, \"echoed\": %s, \"length\": %u, "
+                "\"latency_us\": %u, \"response\": \"",
+            map[idx].command, map[idx].responded ? "true" : "false",
+            map[idx].echoed ? "true" : "false", map[idx].length, map[idx].latency_us);
+
+    shown = (map[idx].length < MEMS_SCAN_MAX_RESPONSE) ? map[idx].length : MEMS_SCAN_MAX_RESPONSE;
+    for (pos = 0; pos < shown; ++pos)
+    {
+      fprintf(fp, (pos == 0) ? "%02X" : " %02X", map[idx].response[pos]);
+    }
+
+    fprintf(fp, "\"}%s\n", (idx + 1 < count) ? "," : "");
+  }
+
+  fprintf(fp, "]\n");
+
+  return (ferror(fp) == 0);
+}
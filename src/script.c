@@ -0,0 +1,278 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// script.c: This file contains routines that load and run command
+//           scripts, which send a sequence of commands to the ECU in a
+//           single session and check the responses.
+//
+// Each line of a script is either a wait:
+//
+//   wait <ms>
+//
+// or a command byte (in hex), optionally followed by the number of bytes
+// expected after the echo, the values expected for those bytes ("??"
+// matches any value), and a time to wait after the response:
+//
+//   <cmd> [len <n>] [expect <byte> ...] [wait <ms>]
+//
+// Text following a '#' is ignored.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+#define MEMS_SCRIPT_LINE_LEN 256
+//! Largest response (after the echo) that a script step may request
+#define MEMS_SCRIPT_MAX_RESPONSE 255
+
+/**
+ * Parses a single hex byte, or "??" as a wildcard.
+ * @return True if the token was valid
+ */
+static bool parse_expect_byte(const char* token, uint8_t* value, uint8_t* mask)
+{
+  char* end;
+  unsigned long val;
+
+  if (strcmp(token, "??") == 0)
+  {
+    *value = 0x00;
+    *mask = 0x00;
+    return true;
+  }
+
+  val = strtoul(token, &end, 16);
+  *value = (uint8_t)val;
+  *mask = 0xFF;
+
+  return (*end == '\0') && (end != token) && (val <= 0xFF);
+}
+
+/**
+ * Parses a decimal number of at most the given value.
+ * @return True if the token was valid
+ */
+static bool parse_number(const char* token, unsigned long max, unsigned long* value)
+{
+  char* end;
+
+  if (token == NULL)
+  {
+    return false;
+  }
+
+  *value = strtoul(token, &end, 10);
+
+  return (*end == '\0') && (end != token) && (*value <= max);
+}
+
+/**
+ * Parses one line of a script into a step.
+ * @return True if the line was valid
+ */
+static bool parse_script_line(char* line, mems_script_step* step)
+{
+  char* token = strtok(line, " \t\r\n");
+  char* end;
+  unsigned long val;
+  bool in_expect = false;
+
+  if (strcmp(token, "wait") == 0)
+  {
+    step->send = false;
+    if (!parse_number(strtok(NULL, " \t\r\n"), UINT32_MAX, &val))
+    {
+      return false;
+    }
+    step->delay_ms = val;
+    return (strtok(NULL, " \t\r\n") == NULL);
+  }
+
+  val = strtoul(token, &end, 16);
+  if ((*end != '\0') || (val > 0xFF))
+  {
+    return false;
+  }
+  step->send = true;
+  step->command = (uint8_t)val;
+  step->response_len = MEMS_SCRIPT_DEFAULT_LEN;
+
+  while ((token = strtok(NULL, " \t\r\n")) != NULL)
+  {
+    if (strcmp(token, "len") == 0)
+    {
+      in_expect = false;
+      if (!parse_number(strtok(NULL, " \t\r\n"), MEMS_SCRIPT_MAX_RESPONSE, &val))
+      {
+        return false;
+      }
+      step->response_len = (int16_t)val;
+    }
+    else if (strcmp(token, "wait") == 0)
+    {
+      in_expect = false;
+      if (!parse_number(strtok(NULL, " \t\r\n"), UINT32_MAX, &val))
+      {
+        return false;
+      }
+      step->delay_ms = val;
+    }
+    else if (strcmp(token, "expect") == 0)
+    {
+      in_expect = true;
+    }
+    else if (in_expect && (step->expect_len < MEMS_SCRIPT_MAX_EXPECT))
+    {
+      if (!parse_expect_byte(token, &step->expect[step->expect_len], &step->expect_mask[step->expect_len]))
+      {
+        return false;
+      }
+      step->expect_len++;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  return (step->response_len == MEMS_SCRIPT_DEFAULT_LEN) || (step->expect_len <= step->response_len);
+}
+
+/**
+ * Loads a command script from a file.
+ * @param script Receives the steps; free with mems_free_script()
+ * @param path Path of the script file
+ * @return True if the whole script was valid
+ */
+bool mems_load_script(mems_script* script, const char* path)
+{
+  FILE* fp;
+  char line[MEMS_SCRIPT_LINE_LEN];
+  char* comment;
+  mems_script_step* grown;
+  unsigned int line_num = 0;
+  bool ok = true;
+
+  memset(script, 0, sizeof(mems_script));
+
+  if ((fp = fopen(path, "r")) == NULL)
+  {
+    dprintf_err("mems_load_script(): could not open %s\n", path);
+    return false;
+  }
+
+  while (ok && (fgets(line, sizeof(line), fp) != NULL))
+  {
+    line_num++;
+
+    if ((comment = strchr(line, '#')) != NULL)
+    {
+      *comment = '\0';
+    }
+    if (strspn(line, " \t\r\n") == strlen(line))
+    {
+      continue;
+    }
+
+    if ((script->count == UINT16_MAX) ||
+        ((grown = realloc(script->steps, (script->count + 1) * sizeof(mems_script_step))) == NULL))
+    {
+      ok = false;
+    }
+    else
+    {
+      script->steps = grown;
+      memset(&script->steps[script->count], 0, sizeof(mems_script_step));
+      script->steps[script->count].line = line_num;
+      ok = parse_script_line(line, &script->steps[script->count]);
+      script->count++;
+    }
+  }
+
+  fclose(fp);
+
+  if (!ok)
+  {
+    dprintf_err("mems_load_script(): error at %s:%u\n", path, line_num);
+    mems_free_script(script);
+  }
+
+  return ok;
+}
+
+/**
+ * Releases the steps of a script loaded with mems_load_script().
+ */
+void mems_free_script(mems_script* script)
+{
+  free(script->steps);
+  script->steps = NULL;
+  script->count = 0;
+}
+
+/**
+ * Runs a command script. The connection is held for the whole script, and
+ * each response is read by its expected length rather than until the line
+ * goes quiet, so consecutive commands follow each other at line rate. The
+ * script stops at the first step whose response is short, does not echo
+ * the command, or does not match the expected values.
+ * @param info State information for the current connection
+ * @param script Steps to run
+ * @param callback Function called with the response to each command; may be NULL
+ * @param context Passed through to the callback
+ * @return True if every step completed and matched its expected response
+ */
+bool mems_run_script(mems_info* info, const mems_script* script, mems_script_callback callback, void* context)
+{
+  uint8_t response[1 + MEMS_SCRIPT_MAX_RESPONSE];
+  const mems_script_step* step;
+  uint16_t idx;
+  int16_t len;
+  int16_t got;
+  uint8_t pos;
+  bool passed = true;
+
+  if (!mems_lock(info))
+  {
+    return false;
+  }
+
+  for (idx = 0; passed && (idx < script->count); ++idx)
+  {
+    step = &script->steps[idx];
+
+    if (step->send)
+    {
+      len = (step->response_len == MEMS_SCRIPT_DEFAULT_LEN) ?
+            mems_response_len(info, step->command) : step->response_len;
+      got = 0;
+
+      if (mems_write_serial(info, (uint8_t*)&step->command, 1) == 1)
+      {
+        got = mems_read_serial(info, response, 1 + len);
+      }
+
+      passed = (got == 1 + len) && (response[0] == step->command) && (step->expect_len <= len);
+      for (pos = 0; passed && (pos < step->expect_len); ++pos)
+      {
+        passed = ((response[1 + pos] ^ step->expect[pos]) & step->expect_mask[pos]) == 0;
+      }
+
+      if (callback)
+      {
+        callback(step, response, (got > 0) ? got : 0, passed, context);
+      }
+    }
+
+    if (passed && (step->delay_ms > 0))
+    {
+      mems_sleep_us((uint64_t)step->delay_ms * 1000);
+    }
+  }
+
+  mems_unlock(info);
+
+  return passed;
+}
@@ -10,13 +10,19 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
 
 #if defined(WIN32)
   #include <windows.h>
 #else
-  #include <string.h>
   #include <termios.h>
   #include <arpa/inet.h>
+  #include <sys/ioctl.h>
+#endif
+
+#if defined(linux)
+  #include <linux/serial.h>
 #endif
 
 #include "rosco.h"
@@ -38,6 +44,22 @@ void mems_init(mems_info *info)
     info->sd = 0;
     pthread_mutex_init(&info->mutex, NULL);
 #endif
+    info->transport = NULL;
+    info->transport_ctx = NULL;
+    info->last_activity_us = 0;
+    info->last_command_us = 0;
+    memset(&info->anchor, 0, sizeof(info->anchor));
+    info->last_request_us = 0;
+    info->last_response_us = 0;
+    info->keepalive_ms = 0;
+    info->heartbeats_sent = 0;
+    info->heartbeats_skipped = 0;
+    info->iac_spacing_us = 0;
+    info->profile = mems_default_profile();
+    mems_default_connection_options(&info->options);
+    info->latency.is_ftdi = false;
+    info->latency.before_ms = -1;
+    info->latency.after_ms = -1;
 }
 
 /**
@@ -46,19 +68,16 @@ void mems_init(mems_info *info)
  */
 void mems_cleanup(mems_info *info)
 {
-#if defined(WIN32)
     if (mems_is_connected(info))
     {
-        CloseHandle(info->sd);
-        info->sd = INVALID_HANDLE_VALUE;
+        info->transport->close(info->transport_ctx);
+        info->transport = NULL;
+        info->transport_ctx = NULL;
     }
+
+#if defined(WIN32)
     CloseHandle(info->mutex);
 #else
-    if (mems_is_connected(info))
-    {
-        close(info->sd);
-        info->sd = 0;
-    }
     pthread_mutex_destroy(&info->mutex);
 #endif
 }
@@ -79,33 +98,49 @@ librosco_version mems_get_lib_version()
 }
 
 /**
- * Closes the serial device.
+ * Closes the serial device (or other transport).
  * @param info State information for the current connection.
  */
 void mems_disconnect(mems_info *info)
 {
-#if defined(WIN32)
-    if (WaitForSingleObject(info->mutex, INFINITE) == WAIT_OBJECT_0)
+    if (mems_lock(info))
     {
         if (mems_is_connected(info))
         {
-            CloseHandle(info->sd);
-            info->sd = INVALID_HANDLE_VALUE;
+            info->transport->close(info->transport_ctx);
+            info->transport = NULL;
+            info->transport_ctx = NULL;
         }
 
-        ReleaseMutex(info->mutex);
-    }
-#else
-    pthread_mutex_lock(&info->mutex);
-
-    if (mems_is_connected(info))
-    {
-        close(info->sd);
-        info->sd = 0;
+        mems_unlock(info);
     }
+}
 
-    pthread_mutex_unlock(&info->mutex);
+/**
+ * Fills in the line settings that match the ECU's diagnostic port and the
+ * library's historical read timeout behavior.
+ * @param options Options struct to initialize
+ */
+void mems_default_connection_options(mems_connection_options* options)
+{
+    options->baud = MEMS_DEFAULT_BAUD;
+    options->vmin = 0;
+#if defined(linux) || defined(__APPLE__)
+    // when waiting for responses, wait until we haven't received any
+    // characters for a period of time before returning with failure
+    options->vtime = 1;
+#elif defined(WIN32)
+    // the Win32 read timeouts (vtime * 100 ms) keep their historical 100 ms
+    options->vtime = 1;
+#else
+    // This is set higher than the 0.1 seconds used by the Linux/OSX
+    // code, as values much lower than this cause the first echoed
+    // byte to be missed when running under BSD.
+    options->vtime = 5;
 #endif
+    options->low_latency = false;
+    options->ftdi_latency_ms = 0;
+    options->sysfs_root = NULL;
 }
 
 /**
@@ -116,24 +151,110 @@ void mems_disconnect(mems_info *info)
  *   baud rate was set; false otherwise.
  */
 bool mems_connect(mems_info *info, const char *devPath)
+{
+    mems_connection_options options;
+
+    mems_default_connection_options(&options);
+
+    return mems_connect_with_options(info, devPath, &options);
+}
+
+/**
+ * Opens the serial port with the given line settings (or returns with
+ * success if it is already open.)
+ * @param info State information for the current connection.
+ * @param devPath Full path to the serial device (e.g. "/dev/ttyUSB0" or "COM2")
+ * @param options Line settings to apply to the device
+ * @return True if the serial device was successfully opened and configured;
+ *   false otherwise.
+ */
+bool mems_connect_with_options(mems_info *info, const char *devPath, const mems_connection_options* options)
 {
     bool result = false;
 
 #if defined(WIN32)
     if (WaitForSingleObject(info->mutex, INFINITE) == WAIT_OBJECT_0)
     {
-        result = mems_is_connected(info) || mems_openserial(info, devPath);
+        result = mems_is_connected(info) || mems_openserial(info, devPath, options);
         ReleaseMutex(info->mutex);
     }
 #else // Linux/Unix
     pthread_mutex_lock(&info->mutex);
-    result = mems_is_connected(info) || mems_openserial(info, devPath);
+    result = mems_is_connected(info) || mems_openserial(info, devPath, options);
     pthread_mutex_unlock(&info->mutex);
 #endif
 
     return result;
 }
 
+#if !defined(WIN32)
+/**
+ * Converts a numeric baud rate to the corresponding termios speed constant.
+ * @return True if the rate is supported on this platform, false otherwise
+ */
+bool mems_baud_to_speed(uint32_t baud, speed_t* speed)
+{
+    static const struct { uint32_t baud; speed_t speed; } rates[] = {
+        { 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+        { 19200, B19200 }, { 38400, B38400 },
+#ifdef B57600
+        { 57600, B57600 },
+#endif
+#ifdef B115200
+        { 115200, B115200 },
+#endif
+#ifdef B230400
+        { 230400, B230400 },
+#endif
+#ifdef B460800
+        { 460800, B460800 },
+#endif
+#ifdef B921600
+        { 921600, B921600 },
+#endif
+    };
+    unsigned int idx;
+
+    for (idx = 0; idx < sizeof(rates) / sizeof(rates[0]); ++idx)
+    {
+        if (rates[idx].baud == baud)
+        {
+            *speed = rates[idx].speed;
+            return true;
+        }
+    }
+
+    return false;
+}
+#endif
+
+/**
+ * Asks the serial driver to hand received bytes to the reader immediately
+ * rather than batching them. Not all drivers support this (pseudo-terminals
+ * do not), so failure is reported but is not fatal.
+ */
+static void mems_set_low_latency(mems_info *info)
+{
+#if defined(linux)
+    struct serial_struct serinfo;
+
+    if ((ioctl(info->sd, TIOCGSERIAL, &serinfo) == 0))
+    {
+        serinfo.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(info->sd, TIOCSSERIAL, &serinfo) != 0)
+        {
+            dprintf_err("mems_set_low_latency(): TIOCSSERIAL failed\n");
+        }
+    }
+    else
+    {
+        dprintf_err("mems_set_low_latency(): driver does not support TIOCGSERIAL\n");
+    }
+#else
+    dprintf_err("mems_set_low_latency(): not supported on this platform\n");
+#endif
+}
+
 /**
  * Opens the serial device for the USB<->TTL/serial converter and sets the
  * parameters for the link to match those on the MEMS ECU.
@@ -144,14 +265,21 @@ bool mems_connect(mems_info *info, const char *devPath)
  * Example: /dev/cuaU0 (instead of /dev/ttyU0)
  * @return True if the open/setup was successful, false otherwise
  */
-bool mems_openserial(mems_info *info, const char *devPath)
+bool mems_openserial(mems_info *info, const char *devPath, const mems_connection_options* options)
 {
     bool retVal = false;
 
 #if defined(linux) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__APPLE__)
 
     struct termios newtio;
-    bool success = true;
+    speed_t speed;
+    bool success = mems_baud_to_speed(options->baud, &speed);
+
+    if (!success)
+    {
+        dprintf_err("mems_openserial(): unsupported baud rate %u\n", options->baud);
+        return false;
+    }
 
     info->sd = open(devPath, O_RDWR | O_NOCTTY);
 
@@ -174,20 +302,12 @@ bool mems_openserial(mems_info *info, const char *devPath)
             newtio.c_iflag &= ~(INLCR | ICRNL | IGNCR | IXON | IXOFF | IXANY);
             newtio.c_oflag &= ~OPOST;
 
-#if defined(linux) || defined(__APPLE__)
-            // when waiting for responses, wait until we haven't received any
-            // characters for a period of time before returning with failure
-            newtio.c_cc[VTIME] = 1;
-            newtio.c_cc[VMIN] = 0;
-#else // BSD and other UNIXes
-            // This is set higher than the 0.1 seconds used by the Linux/OSX
-            // code, as values much lower than this cause the first echoed
-            // byte to be missed when running under BSD.
-            newtio.c_cc[VTIME] = 5;
-            newtio.c_cc[VMIN] = 0;
-#endif
-            cfsetispeed(&newtio, B9600);
-            cfsetospeed(&newtio, B9600);
+            // read timeout policy (see mems_default_connection_options())
+            newtio.c_cc[VTIME] = options->vtime;
+            newtio.c_cc[VMIN] = options->vmin;
+
+            cfsetispeed(&newtio, speed);
+            cfsetospeed(&newtio, speed);
 
             // flush the serial buffers and set the new parameters
             if ((tcflush(info->sd, TCIFLUSH) != 0) ||
@@ -198,6 +318,18 @@ bool mems_openserial(mems_info *info, const char *devPath)
             }
         }
 
+        if (success && options->low_latency)
+        {
+            mems_set_low_latency(info);
+        }
+
+        // shorten the USB-serial adapter's receive batching, if requested;
+        // failure (e.g. insufficient privileges) is recorded but not fatal
+        if (success && (options->ftdi_latency_ms > 0))
+        {
+            mems_tune_ftdi_latency(devPath, options->sysfs_root, options->ftdi_latency_ms, &info->latency);
+        }
+
         retVal = success;
 
         // close the device if it couldn't be configured
@@ -222,7 +354,7 @@ bool mems_openserial(mems_info *info, const char *devPath)
         if (GetCommState(info->sd, &dcb) == TRUE)
         {
             // set the serial port parameters
-            dcb.BaudRate = 9600;
+            dcb.BaudRate = options->baud;
             dcb.fParity = FALSE;
             dcb.fOutxCtsFlow = FALSE;
             dcb.fOutxDsrFlow = FALSE;
@@ -235,10 +367,11 @@ bool mems_openserial(mems_info *info, const char *devPath)
             if ((SetCommState(info->sd, &dcb) == TRUE) &&
                 (GetCommTimeouts(info->sd, &commTimeouts) == TRUE))
             {
-                // modify the COM port parameters to wait 100 ms before timing out
-                commTimeouts.ReadIntervalTimeout = 100;
+                // modify the COM port parameters to wait the equivalent of
+                // VTIME (in tenths of a second) before timing out
+                commTimeouts.ReadIntervalTimeout = options->vtime * 100;
                 commTimeouts.ReadTotalTimeoutMultiplier = 0;
-                commTimeouts.ReadTotalTimeoutConstant = 100;
+                commTimeouts.ReadTotalTimeoutConstant = options->vtime * 100;
 
                 if (SetCommTimeouts(info->sd, &commTimeouts) == TRUE)
                 {
@@ -257,20 +390,22 @@ bool mems_openserial(mems_info *info, const char *devPath)
 
 #endif
 
+    if (retVal)
+    {
+        info->options = *options;
+        info->transport = &mems_serial_transport;
+        info->transport_ctx = info;
+    }
+
     return retVal;
 }
 
 /**
- * Checks the file descriptor for the serial device to determine if it has
- * already been opened.
- * @return True if the serial device is open; false otherwise.
+ * Checks whether a transport (normally the serial device) has been opened.
+ * @return True if the connection is open; false otherwise.
  */
 bool mems_is_connected(mems_info* info)
 {
-#if defined(WIN32)
-    return (info->sd != INVALID_HANDLE_VALUE);
-#else
-    return (info->sd > 0);
-#endif
+    return (info->transport != NULL);
 }
 
@@ -0,0 +1,258 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// shm.c: This file contains routines that publish acquired frames into
+//        a POSIX shared-memory ring, and that let other processes on
+//        the same host consume them without system calls or copies.
+
+#if !defined(WIN32)
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * Creates (or replaces) a shared-memory frame ring and maps it for writing.
+ * @param pub Publisher state to initialize
+ * @param name Name of the shared-memory object (e.g. "/rosco")
+ * @param capacity Number of records; rounded up to the next power of two
+ * @param d0_response D0 response of the ECU being published, or NULL
+ * @return True if the ring was created, false otherwise
+ */
+bool mems_shm_create(mems_shm_publisher* pub, const char* name, uint32_t capacity, const uint8_t* d0_response)
+{
+  uint32_t size = 1;
+  int fd;
+  void* map;
+
+  memset(pub, 0, sizeof(mems_shm_publisher));
+
+  if ((capacity == 0) || (strlen(name) >= sizeof(pub->name)))
+  {
+    return false;
+  }
+
+  while (size < capacity)
+  {
+    size <<= 1;
+  }
+
+  pub->size = sizeof(mems_shm_header) + ((size_t)size * sizeof(mems_shm_record));
+
+  shm_unlink(name);
+  if ((fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644)) < 0)
+  {
+    dprintf_err("mems_shm_create(): could not create %s\n", name);
+    return false;
+  }
+
+  if (ftruncate(fd, pub->size) != 0)
+  {
+    close(fd);
+    shm_unlink(name);
+    return false;
+  }
+
+  map = mmap(NULL, pub->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED)
+  {
+    shm_unlink(name);
+    return false;
+  }
+
+  strcpy(pub->name, name);
+  pub->header = (mems_shm_header*)map;
+  pub->records = (mems_shm_record*)((uint8_t*)map + sizeof(mems_shm_header));
+
+  pub->header->version = MEMS_SHM_VERSION;
+  pub->header->capacity = size;
+  pub->header->record_size = sizeof(mems_shm_record);
+  if (d0_response)
+  {
+    memcpy(pub->header->d0_response, d0_response, MEMS_D0_RESPONSE_LEN);
+  }
+  pub->header->head = 0;
+
+  // readers check the magic last, so it must be visible only once the rest
+  // of the header is in place
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(pub->header->magic, MEMS_SHM_MAGIC, sizeof(pub->header->magic));
+
+  return true;
+}
+
+/**
+ * Writes a pair of frames into the next record of the ring. A record's
+ * sequence field is cleared while it is being written and set only once it
+ * is complete, so readers can detect records that were overwritten under them.
+ */
+void mems_shm_publish(mems_shm_publisher* pub, uint64_t timestamp_us,
+                      const mems_data_frame_80* frame80, const mems_data_frame_7d* frame7d)
+{
+  uint64_t n = pub->header->head;
+  mems_shm_record* rec = &pub->records[n & (pub->header->capacity - 1)];
+
+  __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  rec->timestamp_us = timestamp_us;
+  memcpy(&rec->frame80, frame80, sizeof(mems_data_frame_80));
+  memcpy(&rec->frame7d, frame7d, sizeof(mems_data_frame_7d));
+
+  __atomic_store_n(&rec->seq, n + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&pub->header->head, n + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Frame ring subscriber that publishes each acquired frame to shared memory.
+ * Register with mems_ring_subscribe(), passing the mems_shm_publisher as the context.
+ */
+void mems_shm_frame_callback(const mems_frame* frame, void* publisher)
+{
+  mems_shm_publish((mems_shm_publisher*)publisher, frame->response_us, &frame->frame80, &frame->frame7d);
+}
+
+/**
+ * Unmaps and removes the shared-memory ring. Readers that are still attached
+ * keep their mappings until they detach.
+ */
+void mems_shm_destroy(mems_shm_publisher* pub)
+{
+  if (pub->header)
+  {
+    munmap(pub->header, pub->size);
+    shm_unlink(pub->name);
+    pub->header = NULL;
+    pub->records = NULL;
+  }
+}
+
+/**
+ * Maps an existing shared-memory frame ring read-only. Iteration starts with
+ * the next record published after attaching.
+ * @param reader Reader state to initialize
+ * @param name Name of the shared-memory object
+ * @return True if the ring was mapped, false otherwise
+ */
+bool mems_shm_attach(mems_shm_reader* reader, const char* name)
+{
+  struct stat st;
+  const mems_shm_header* header;
+  void* map;
+  int fd;
+
+  memset(reader, 0, sizeof(mems_shm_reader));
+
+  if ((fd = shm_open(name, O_RDONLY, 0)) < 0)
+  {
+    dprintf_err("mems_shm_attach(): could not open %s\n", name);
+    return false;
+  }
+
+  if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(mems_shm_header)))
+  {
+    close(fd);
+    return false;
+  }
+
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED)
+  {
+    return false;
+  }
+
+  header = (const mems_shm_header*)map;
+  if ((memcmp(header->magic, MEMS_SHM_MAGIC, sizeof(header->magic)) != 0) ||
+      (header->version != MEMS_SHM_VERSION) ||
+      (header->record_size != sizeof(mems_shm_record)) ||
+      ((size_t)st.st_size < sizeof(mems_shm_header) + ((size_t)header->capacity * sizeof(mems_shm_record))))
+  {
+    dprintf_err("mems_shm_attach(): %s is not a supported frame ring\n", name);
+    munmap(map, st.st_size);
+    return false;
+  }
+
+  reader->size = st.st_size;
+  reader->header = header;
+  reader->records = (const mems_shm_record*)((const uint8_t*)map + sizeof(mems_shm_header));
+  reader->next = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+
+  return true;
+}
+
+/**
+ * Returns the next published record, by reference into the shared mapping.
+ * If the reader has fallen more than a full ring behind, the records it
+ * missed are counted in reader->missed and it skips to the oldest one still
+ * available. Because the publisher may overwrite the record while it is in
+ * use, call mems_shm_still_valid() after consuming it.
+ * @return Pointer to the record, or NULL if no new record is available
+ */
+const mems_shm_record* mems_shm_next(mems_shm_reader* reader)
+{
+  uint32_t capacity = reader->header->capacity;
+  const mems_shm_record* rec;
+  uint64_t head;
+
+  for (;;)
+  {
+    head = __atomic_load_n(&reader->header->head, __ATOMIC_ACQUIRE);
+
+    if (reader->next >= head)
+    {
+      return NULL;
+    }
+
+    if (head - reader->next > capacity)
+    {
+      reader->missed += (head - capacity) - reader->next;
+      reader->next = head - capacity;
+    }
+
+    rec = &reader->records[reader->next & (capacity - 1)];
+    if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) == reader->next + 1)
+    {
+      reader->next++;
+      return rec;
+    }
+
+    // the record was overwritten between reading the head and reaching it
+    reader->missed++;
+    reader->next++;
+  }
+}
+
+/**
+ * Checks that the record most recently returned by mems_shm_next() was not
+ * overwritten while it was being consumed.
+ * @return True if the data read from the record is consistent
+ */
+bool mems_shm_still_valid(const mems_shm_reader* reader, const mems_shm_record* record)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return (__atomic_load_n(&record->seq, __ATOMIC_RELAXED) == reader->next);
+}
+
+/**
+ * Unmaps a shared-memory ring.
+ */
+void mems_shm_detach(mems_shm_reader* reader)
+{
+  if (reader->header)
+  {
+    munmap((void*)reader->header, reader->size);
+    reader->header = NULL;
+    reader->records = NULL;
+  }
+}
+
+#endif // !WIN32
@@ -0,0 +1,376 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// simulator.c: This file contains a simple simulation of the ECU's side
+//              of the ROSCO protocol, which can be served over a
+//              pseudo-terminal to test and benchmark front-ends without
+//              a car.
+
+#if !defined(WIN32)
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+/**
+ * Sets up the simulator with a plausible idling Mini SPi.
+ * @param sim Simulator state to initialize
+ */
+void mems_sim_init(mems_sim* sim)
+{
+  memset(sim, 0, sizeof(mems_sim));
+
+  sim->d0_response[0] = 0x99;
+  sim->d0_response[1] = 0x00;
+  sim->d0_response[2] = 0x03;
+  sim->d0_response[3] = 0x03;
+
+  sim->frame80.bytes_in_frame = sizeof(mems_data_frame_80);
+  sim->frame80.engine_rpm_hi = 0x03;     // 850 RPM
+  sim->frame80.engine_rpm_lo = 0x52;
+  sim->frame80.coolant_temp = 90;
+  sim->frame80.ambient_temp = 20;
+  sim->frame80.intake_air_temp = 30;
+  sim->frame80.fuel_temp = 25;
+  sim->frame80.map_kpa = 35;
+  sim->frame80.battery_voltage = 140;    // 14.0 V
+  sim->frame80.throttle_pot = 30;
+  sim->frame80.idle_switch = 1;
+  sim->frame80.iac_position = 0x30;
+  sim->frame80.ignition_advance = 72;    // 12 degrees
+  sim->frame80.coil_time_hi = 0x07;
+  sim->frame80.coil_time_lo = 0xD0;
+
+  sim->frame7d.bytes_in_frame = sizeof(mems_data_frame_7d);
+  sim->frame7d.lambda_voltage = 90;
+  sim->frame7d.lambda_status = 1;
+  sim->frame7d.closed_loop = 1;
+  sim->frame7d.long_term_fuel_trim = 128;
+  sim->frame7d.idle_base_pos = 0x30;
+
+  sim->iac_position = 0x30;
+  sim->iac_steps_per_cmd = 1;
+  mems_default_connection_options(&sim->options);
+  sim->master_fd = -1;
+  sim->slave_fd = -1;
+
+  pthread_mutex_init(&sim->mutex, NULL);
+}
+
+/**
+ * Applies an open or close command to the simulated valve. Like the real
+ * stepper, it only moves if the previous command was long enough ago.
+ */
+static void sim_step_iac(mems_sim* sim, bool open)
+{
+  uint64_t now = mems_monotonic_us();
+  int pos = sim->iac_position;
+
+  if ((sim->iac_min_spacing_us > 0) &&
+      (now - sim->iac_last_move_us < sim->iac_min_spacing_us))
+  {
+    return;
+  }
+  sim->iac_last_move_us = now;
+
+  pos += open ? sim->iac_steps_per_cmd : -sim->iac_steps_per_cmd;
+  if (pos < 0)
+  {
+    pos = 0;
+  }
+  else if (pos > IAC_MAXIMUM)
+  {
+    pos = IAC_MAXIMUM;
+  }
+
+  sim->iac_position = pos;
+}
+
+/**
+ * Handles the bytes of the simulated memory read commands, if enabled.
+ * @return True if the byte was consumed as part of a memory read
+ */
+static bool sim_memory_respond(mems_sim* sim, uint8_t byte, uint8_t* response, uint16_t* len)
+{
+  const mems_memory_protocol* proto = &sim->memory_protocol;
+  uint16_t idx;
+
+  if (sim->memory == NULL)
+  {
+    return false;
+  }
+
+  if (sim->address_bytes_pending > 0)
+  {
+    sim->memory_address = (sim->memory_address << 8) | byte;
+    sim->address_bytes_pending--;
+  }
+  else if (byte == proto->address_cmd)
+  {
+    sim->memory_address = 0;
+    sim->address_bytes_pending = proto->address_len;
+  }
+  else if (byte == proto->read_cmd)
+  {
+    for (idx = 0; idx < proto->block_len; ++idx)
+    {
+      response[1 + idx] = sim->memory[(sim->memory_address + idx) % sim->memory_size];
+    }
+    *len += proto->block_len;
+
+    if (proto->auto_increment)
+    {
+      sim->memory_address += proto->block_len;
+    }
+  }
+  else
+  {
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Produces the complete response (including the echo of the command byte)
+ * that the simulated ECU sends for a single command byte.
+ * @param sim Simulator state
+ * @param cmd Command byte received from the host
+ * @param response Buffer of at least MEMS_SIM_MAX_RESPONSE bytes
+ * @return Number of bytes placed in the response buffer
+ */
+uint16_t mems_sim_respond(mems_sim* sim, uint8_t cmd, uint8_t* response)
+{
+  uint16_t len = 1;
+
+  pthread_mutex_lock(&sim->mutex);
+
+  response[0] = cmd;
+
+  if (sim_memory_respond(sim, cmd, response, &len))
+  {
+    pthread_mutex_unlock(&sim->mutex);
+    return len;
+  }
+
+  switch (cmd)
+  {
+  case 0xCA:
+  case 0x75:
+    break;
+
+  case 0xD0:
+    memcpy(response + 1, sim->d0_response, MEMS_D0_RESPONSE_LEN);
+    len += MEMS_D0_RESPONSE_LEN;
+    break;
+
+  case MEMS_ReqData80:
+    sim->frame80.iac_position = sim->iac_position;
+    memcpy(response + 1, &sim->frame80, sizeof(mems_data_frame_80));
+    len += sizeof(mems_data_frame_80);
+    break;
+
+  case MEMS_ReqData7D:
+    memcpy(response + 1, &sim->frame7d, sizeof(mems_data_frame_7d));
+    len += sizeof(mems_data_frame_7d);
+    break;
+
+  case MEMS_GetIACPosition:
+    response[len++] = sim->iac_position;
+    break;
+
+  case MEMS_OpenIAC:
+  case MEMS_CloseIAC:
+    sim_step_iac(sim, cmd == MEMS_OpenIAC);
+    response[len++] = sim->iac_position;
+    break;
+
+  case MEMS_ClearFaults:
+    sim->frame80.dtc0 = 0;
+    sim->frame80.dtc1 = 0;
+    response[len++] = 0x00;
+    break;
+
+  case MEMS_Heartbeat:
+  case MEMS_FuelPumpOn:
+  case MEMS_FuelPumpOff:
+  case MEMS_PTCRelayOn:
+  case MEMS_PTCRelayOff:
+  case MEMS_ACRelayOn:
+  case MEMS_ACRelayOff:
+  case MEMS_TestInjectors:
+  case MEMS_FireCoil:
+    response[len++] = 0x00;
+    break;
+
+  default:
+    // unrecognized commands are echoed without any data
+    break;
+  }
+
+  pthread_mutex_unlock(&sim->mutex);
+
+  return len;
+}
+
+/**
+ * Sleeps for the time it would take to transmit the given number of bytes
+ * (8N1) at the simulator's configured line rate.
+ */
+static void sim_pace(const mems_sim* sim, uint16_t bytes)
+{
+  if ((sim->options.baud > 0) && (bytes > 0))
+  {
+    usleep(((uint64_t)bytes * 10 * 1000000) / sim->options.baud);
+  }
+}
+
+/**
+ * Services the master side of the pseudo-terminal until the simulator is stopped.
+ * Like the ECU's UART, each response goes out a byte at a time at the line
+ * rate, so the host sees the echo before the rest of a long frame.
+ */
+static void* sim_thread(void* arg)
+{
+  mems_sim* sim = (mems_sim*)arg;
+  struct pollfd pfd;
+  uint8_t cmd;
+  uint8_t response[MEMS_SIM_MAX_RESPONSE];
+  uint16_t len;
+  uint16_t idx;
+
+  pfd.fd = sim->master_fd;
+  pfd.events = POLLIN;
+
+  while (sim->running)
+  {
+    if ((poll(&pfd, 1, 50) <= 0) || !(pfd.revents & POLLIN))
+    {
+      continue;
+    }
+
+    if (read(sim->master_fd, &cmd, 1) == 1)
+    {
+      len = mems_sim_respond(sim, cmd, response);
+      if (sim->response_delay_us > 0)
+      {
+        usleep(sim->response_delay_us);
+      }
+
+      for (idx = 0; idx < len; ++idx)
+      {
+        sim_pace(sim, 1);
+        if (write(sim->master_fd, &response[idx], 1) != 1)
+        {
+          dprintf_err("mems_sim: short write on pseudo-terminal\n");
+          break;
+        }
+      }
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Creates a pseudo-terminal, applies the given line settings to it, and
+ * starts a thread that answers commands written to it. The path of the
+ * device to connect to is placed in sim->device_path.
+ * @param sim Simulator state, initialized with mems_sim_init()
+ * @param options Line settings; the baud rate also paces the simulated
+ *   transmission of each response. May be NULL to use the defaults.
+ * @return True if the simulator was started, false otherwise
+ */
+bool mems_sim_start_pty(mems_sim* sim, const mems_connection_options* options)
+{
+  struct termios tio;
+  speed_t speed;
+  const char* name;
+
+  if (options)
+  {
+    sim->options = *options;
+  }
+
+  if (!mems_baud_to_speed(sim->options.baud, &speed))
+  {
+    dprintf_err("mems_sim_start_pty(): unsupported baud rate %u\n", sim->options.baud);
+    return false;
+  }
+
+  if (((sim->master_fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0) ||
+      (grantpt(sim->master_fd) != 0) ||
+      (unlockpt(sim->master_fd) != 0) ||
+      ((name = ptsname(sim->master_fd)) == NULL))
+  {
+    dprintf_err("mems_sim_start_pty(): could not create pseudo-terminal\n");
+    if (sim->master_fd >= 0)
+    {
+      close(sim->master_fd);
+      sim->master_fd = -1;
+    }
+    return false;
+  }
+
+  strncpy(sim->device_path, name, sizeof(sim->device_path) - 1);
+
+  // Hold the slave side open so that the master does not see a hangup
+  // between client connections, and put it in raw mode so that the
+  // responses are not echoed back to the simulator before the client
+  // has configured the line.
+  if ((sim->slave_fd = open(sim->device_path, O_RDWR | O_NOCTTY)) >= 0)
+  {
+    if (tcgetattr(sim->slave_fd, &tio) == 0)
+    {
+      cfmakeraw(&tio);
+      tio.c_cc[VMIN] = sim->options.vmin;
+      tio.c_cc[VTIME] = sim->options.vtime;
+      cfsetispeed(&tio, speed);
+      cfsetospeed(&tio, speed);
+      tcsetattr(sim->slave_fd, TCSANOW, &tio);
+    }
+  }
+
+  sim->running = true;
+  if (pthread_create(&sim->thread, NULL, sim_thread, sim) != 0)
+  {
+    sim->running = false;
+    mems_sim_stop(sim);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Stops the service thread (if running) and closes the pseudo-terminal.
+ */
+void mems_sim_stop(mems_sim* sim)
+{
+  if (sim->running)
+  {
+    sim->running = false;
+    pthread_join(sim->thread, NULL);
+  }
+
+  if (sim->slave_fd >= 0)
+  {
+    close(sim->slave_fd);
+    sim->slave_fd = -1;
+  }
+  if (sim->master_fd >= 0)
+  {
+    close(sim->master_fd);
+    sim->master_fd = -1;
+  }
+}
+
+#endif // !WIN32
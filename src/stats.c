@@ -0,0 +1,292 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// stats.c: This file contains a streaming statistics engine that keeps
+//          running, windowed and percentile statistics of the decoded
+//          channels with constant time and memory per sample.
+
+#include <math.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Quantiles estimated by the sketches, in the order of the snapshot fields
+static const double stats_quantiles[MEMS_STATS_QUANTILES] = { 0.50, 0.90, 0.99 };
+
+/**
+ * Starts tracking statistics for the given channels.
+ * @param stats Statistics state to initialize
+ * @param channel_mask Bitmap with bit (1 << field) set for each channel to track
+ */
+void mems_stats_init(mems_stats* stats, uint32_t channel_mask)
+{
+  memset(stats, 0, sizeof(mems_stats));
+  stats->channel_mask = channel_mask & ((1u << MEMS_Field_Count) - 1);
+}
+
+/**
+ * Adds a sample to a P-square quantile estimator.
+ */
+static void sketch_add(mems_quantile_sketch* sk, double p, uint64_t count, float x)
+{
+  const double dn[5] = { 0.0, p / 2.0, p, (1.0 + p) / 2.0, 1.0 };
+  double d;
+  double qp;
+  float tmp;
+  int ds;
+  int i;
+  int k;
+
+  // the first five samples are kept sorted as the initial markers
+  if (count <= 5)
+  {
+    i = (int)count - 1;
+    sk->q[i] = x;
+    while ((i > 0) && (sk->q[i - 1] > sk->q[i]))
+    {
+      tmp = sk->q[i - 1];
+      sk->q[i - 1] = sk->q[i];
+      sk->q[i] = tmp;
+      i--;
+    }
+
+    if (count == 5)
+    {
+      for (i = 0; i < 5; ++i)
+      {
+        sk->n[i] = i;
+      }
+      sk->np[0] = 0.0;
+      sk->np[1] = 2.0 * p;
+      sk->np[2] = 4.0 * p;
+      sk->np[3] = 2.0 + (2.0 * p);
+      sk->np[4] = 4.0;
+    }
+    return;
+  }
+
+  if (x < sk->q[0])
+  {
+    sk->q[0] = x;
+    k = 0;
+  }
+  else if (x >= sk->q[4])
+  {
+    sk->q[4] = x;
+    k = 3;
+  }
+  else
+  {
+    for (k = 0; (k < 3) && (x >= sk->q[k + 1]); ++k)
+    {
+    }
+  }
+
+  for (i = k + 1; i < 5; ++i)
+  {
+    sk->n[i]++;
+  }
+  for (i = 0; i < 5; ++i)
+  {
+    sk->np[i] += dn[i];
+  }
+
+  // move the middle markers towards their desired positions
+  for (i = 1; i < 4; ++i)
+  {
+    d = sk->np[i] - sk->n[i];
+    if (((d >= 1.0) && (sk->n[i + 1] - sk->n[i] > 1)) ||
+        ((d <= -1.0) && (sk->n[i - 1] - sk->n[i] < -1)))
+    {
+      ds = (d > 0) ? 1 : -1;
+
+      qp = sk->q[i] + ((double)ds / (sk->n[i + 1] - sk->n[i - 1])) *
+           (((sk->n[i] - sk->n[i - 1] + ds) * (sk->q[i + 1] - sk->q[i]) / (sk->n[i + 1] - sk->n[i])) +
+            ((sk->n[i + 1] - sk->n[i] - ds) * (sk->q[i] - sk->q[i - 1]) / (sk->n[i] - sk->n[i - 1])));
+
+      if ((qp <= sk->q[i - 1]) || (qp >= sk->q[i + 1]))
+      {
+        // the parabolic prediction is out of order; fall back to linear
+        qp = sk->q[i] + ds * (sk->q[i + ds] - sk->q[i]) / (sk->n[i + ds] - sk->n[i]);
+      }
+
+      sk->q[i] = (float)qp;
+      sk->n[i] += ds;
+    }
+  }
+}
+
+/**
+ * Returns the current estimate of a quantile.
+ */
+static float sketch_estimate(const mems_quantile_sketch* sk, double p, uint64_t count)
+{
+  if (count >= 5)
+  {
+    return sk->q[2];
+  }
+
+  // fewer than five samples: nearest rank among those kept so far
+  return sk->q[(int)(p * (count - 1) + 0.5)];
+}
+
+/**
+ * Pushes a sample number onto a monotonic queue, dropping the candidates it
+ * supersedes and those that have left the window.
+ * @param want_max True for the maximum queue, false for the minimum queue
+ */
+static void queue_push(mems_channel_stats* ch, uint64_t* queue, uint32_t* head, uint32_t* len,
+                       uint64_t sample, bool want_max)
+{
+  float x = ch->window[sample % MEMS_STATS_WINDOW];
+  float back;
+
+  while ((*len > 0) && (queue[*head] + MEMS_STATS_WINDOW <= sample))
+  {
+    *head = (*head + 1) % MEMS_STATS_WINDOW;
+    (*len)--;
+  }
+
+  while (*len > 0)
+  {
+    back = ch->window[queue[(*head + *len - 1) % MEMS_STATS_WINDOW] % MEMS_STATS_WINDOW];
+    if (want_max ? (back > x) : (back < x))
+    {
+      break;
+    }
+    (*len)--;
+  }
+
+  queue[(*head + *len) % MEMS_STATS_WINDOW] = sample;
+  (*len)++;
+}
+
+/**
+ * Adds one sample to a channel and recomputes its snapshot.
+ */
+static void channel_add(mems_channel_stats* ch, float x)
+{
+  mems_stats_snapshot* snap = &ch->snapshot;
+  uint64_t sample = snap->count;
+  uint32_t slot = sample % MEMS_STATS_WINDOW;
+  uint32_t in_window;
+  double delta;
+  double var;
+  int idx;
+
+  // running statistics (Welford)
+  snap->count++;
+  delta = x - ch->mean;
+  ch->mean += delta / snap->count;
+  ch->m2 += delta * (x - ch->mean);
+  if ((sample == 0) || (x < snap->min))
+  {
+    snap->min = x;
+  }
+  if ((sample == 0) || (x > snap->max))
+  {
+    snap->max = x;
+  }
+  snap->mean = (float)ch->mean;
+  snap->stddev = (snap->count > 1) ? (float)sqrt(ch->m2 / (snap->count - 1)) : 0.0f;
+
+  // windowed statistics
+  if (sample >= MEMS_STATS_WINDOW)
+  {
+    ch->window_sum -= ch->window[slot];
+    ch->window_sumsq -= (double)ch->window[slot] * ch->window[slot];
+  }
+  ch->window[slot] = x;
+  ch->window_sum += x;
+  ch->window_sumsq += (double)x * x;
+
+  if (slot == MEMS_STATS_WINDOW - 1)
+  {
+    // resum once per window so that rounding errors don't accumulate
+    ch->window_sum = 0.0;
+    ch->window_sumsq = 0.0;
+    for (idx = 0; idx < MEMS_STATS_WINDOW; ++idx)
+    {
+      ch->window_sum += ch->window[idx];
+      ch->window_sumsq += (double)ch->window[idx] * ch->window[idx];
+    }
+  }
+
+  in_window = (snap->count < MEMS_STATS_WINDOW) ? (uint32_t)snap->count : MEMS_STATS_WINDOW;
+  snap->window_mean = (float)(ch->window_sum / in_window);
+  var = (in_window > 1) ?
+        (ch->window_sumsq - (ch->window_sum * ch->window_sum / in_window)) / (in_window - 1) : 0.0;
+  snap->window_stddev = (var > 0.0) ? (float)sqrt(var) : 0.0f;
+
+  queue_push(ch, ch->min_queue, &ch->min_head, &ch->min_len, sample, false);
+  queue_push(ch, ch->max_queue, &ch->max_head, &ch->max_len, sample, true);
+  snap->window_min = ch->window[ch->min_queue[ch->min_head] % MEMS_STATS_WINDOW];
+  snap->window_max = ch->window[ch->max_queue[ch->max_head] % MEMS_STATS_WINDOW];
+
+  // percentile sketches
+  for (idx = 0; idx < MEMS_STATS_QUANTILES; ++idx)
+  {
+    sketch_add(&ch->quantiles[idx], stats_quantiles[idx], snap->count, x);
+  }
+  snap->p50 = sketch_estimate(&ch->quantiles[0], stats_quantiles[0], snap->count);
+  snap->p90 = sketch_estimate(&ch->quantiles[1], stats_quantiles[1], snap->count);
+  snap->p99 = sketch_estimate(&ch->quantiles[2], stats_quantiles[2], snap->count);
+}
+
+/**
+ * Adds a decoded sample to the statistics of every tracked channel. Must
+ * only be called from one thread at a time.
+ */
+void mems_stats_update(mems_stats* stats, const mems_data* data)
+{
+  int field;
+
+  // odd sequence: readers retry until the update is complete
+  __atomic_store_n(&stats->sequence, stats->sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  for (field = 0; field < MEMS_Field_Count; ++field)
+  {
+    if (stats->channel_mask & (1u << field))
+    {
+      channel_add(&stats->channels[field], mems_field_value(data, (enum mems_field)field));
+    }
+  }
+
+  __atomic_store_n(&stats->sequence, stats->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Frame ring subscriber that adds each acquired frame to the statistics.
+ * Register with mems_ring_subscribe(), passing the mems_stats as the context.
+ */
+void mems_stats_frame_callback(const mems_frame* frame, void* stats)
+{
+  mems_stats_update((mems_stats*)stats, &frame->data);
+}
+
+/**
+ * Reads a consistent copy of the statistics of one channel. This may be
+ * called from any thread while samples are being added, without locking.
+ * @return False if the channel is not tracked
+ */
+bool mems_stats_read(const mems_stats* stats, enum mems_field channel, mems_stats_snapshot* snapshot)
+{
+  uint32_t before;
+  uint32_t after;
+
+  if ((channel < 0) || (channel >= MEMS_Field_Count) || !(stats->channel_mask & (1u << channel)))
+  {
+    return false;
+  }
+
+  do
+  {
+    before = __atomic_load_n(&stats->sequence, __ATOMIC_ACQUIRE);
+    memcpy(snapshot, &stats->channels[channel].snapshot, sizeof(mems_stats_snapshot));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&stats->sequence, __ATOMIC_RELAXED);
+  } while ((before & 1) || (before != after));
+
+  return true;
+}
@@ -0,0 +1,163 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// sysfs.c: This file contains routines that locate the USB-serial
+//          adapter behind a serial device path in sysfs and tune its
+//          latency timer. The sysfs root is a parameter so that a fake
+//          directory tree may stand in for /sys.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+#if defined(linux)
+
+#define MEMS_SYSFS_DEFAULT_ROOT "/sys"
+#define MEMS_FTDI_DRIVER_NAME   "ftdi_sio"
+
+/**
+ * Returns a pointer to the final component of a path.
+ */
+static const char* last_component(const char* path)
+{
+  const char* slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+/**
+ * Reads a single integer from a sysfs attribute file.
+ * @return True if the file was read and contained an integer
+ */
+bool mems_sysfs_read_int(const char* path, int* value)
+{
+  FILE* fp;
+  bool status = false;
+
+  if ((fp = fopen(path, "r")) != NULL)
+  {
+    status = (fscanf(fp, "%d", value) == 1);
+    fclose(fp);
+  }
+
+  return status;
+}
+
+/**
+ * Writes a single integer to a sysfs attribute file.
+ * @return True if the value was written (which usually requires privileges)
+ */
+bool mems_sysfs_write_int(const char* path, int value)
+{
+  FILE* fp;
+  bool status = false;
+
+  if ((fp = fopen(path, "w")) != NULL)
+  {
+    status = (fprintf(fp, "%d\n", value) > 0);
+    status = (fclose(fp) == 0) && status;
+  }
+
+  return status;
+}
+
+/**
+ * Determines the tty name (e.g. "ttyUSB0") behind a device path, following
+ * any symlinks such as those in /dev/serial/by-id.
+ * @return True if the name fits in the supplied buffer
+ */
+static bool tty_name(const char* devPath, char* name, size_t len)
+{
+  char resolved[PATH_MAX];
+  const char* base = devPath;
+
+  if (realpath(devPath, resolved) != NULL)
+  {
+    base = resolved;
+  }
+
+  base = last_component(base);
+  if ((*base == '\0') || (strlen(base) >= len))
+  {
+    return false;
+  }
+
+  strcpy(name, base);
+  return true;
+}
+
+/**
+ * Identifies whether the device is handled by the FTDI driver and, if so,
+ * sets its latency timer. The timer defaults to 16 ms, which dominates the
+ * turnaround time of the single-byte exchanges used by the ROSCO protocol;
+ * 1 ms is the minimum.
+ * @param devPath Path to the serial device (e.g. "/dev/ttyUSB0")
+ * @param sysfs_root Root of the sysfs tree, or NULL for "/sys"
+ * @param latency_ms Desired latency timer value in ms
+ * @param report Filled with the detection result and the before/after values
+ * @return True if the device is an FTDI adapter whose timer now reads back
+ *   as the desired value; false otherwise
+ */
+bool mems_tune_ftdi_latency(const char* devPath, const char* sysfs_root, uint8_t latency_ms,
+                            mems_latency_report* report)
+{
+  char name[64];
+  char path[PATH_MAX];
+  char driver[PATH_MAX];
+  int value;
+
+  report->is_ftdi = false;
+  report->before_ms = -1;
+  report->after_ms = -1;
+
+  if (sysfs_root == NULL)
+  {
+    sysfs_root = MEMS_SYSFS_DEFAULT_ROOT;
+  }
+
+  if (!tty_name(devPath, name, sizeof(name)))
+  {
+    return false;
+  }
+
+  snprintf(path, sizeof(path), "%s/class/tty/%s/device/driver", sysfs_root, name);
+  if ((realpath(path, driver) == NULL) || (strcmp(last_component(driver), MEMS_FTDI_DRIVER_NAME) != 0))
+  {
+    return false;
+  }
+  report->is_ftdi = true;
+
+  snprintf(path, sizeof(path), "%s/class/tty/%s/device/latency_timer", sysfs_root, name);
+  if (mems_sysfs_read_int(path, &value))
+  {
+    report->before_ms = value;
+  }
+
+  if ((report->before_ms != latency_ms) && !mems_sysfs_write_int(path, latency_ms))
+  {
+    dprintf_err("mems_tune_ftdi_latency(): not permitted to write %s\n", path);
+  }
+
+  if (mems_sysfs_read_int(path, &value))
+  {
+    report->after_ms = value;
+  }
+
+  return (report->after_ms == latency_ms);
+}
+
+#else
+
+bool mems_tune_ftdi_latency(const char* devPath, const char* sysfs_root, uint8_t latency_ms,
+                            mems_latency_report* report)
+{
+  report->is_ftdi = false;
+  report->before_ms = -1;
+  report->after_ms = -1;
+
+  return false;
+}
+
+#endif
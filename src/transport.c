@@ -0,0 +1,717 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// transport.c: This file contains the transports that can carry a
+//              connection to the ECU: the serial port, a TCP socket to
+//              a serial bridge, replay of a capture file, and an
+//              in-memory loopback to the ECU simulator.
+
+#if defined(WIN32) && defined(linux)
+#error "Only one of 'WIN32' or 'linux' may be defined."
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(WIN32)
+  #include <windows.h>
+#else
+  #include <unistd.h>
+  #include <poll.h>
+  #include <netdb.h>
+  #include <sys/socket.h>
+  #include <netinet/in.h>
+  #include <netinet/tcp.h>
+#endif
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Read timeout used by the socket transport when no other is requested
+#define MEMS_TCP_DEFAULT_TIMEOUT_MS 100
+//! Capacity of the response queues used by the replay and loopback transports
+#define MEMS_QUEUE_SIZE 8192
+
+/**
+ * Simple FIFO of bytes used by the transports that synthesize responses.
+ */
+typedef struct
+{
+  uint8_t data[MEMS_QUEUE_SIZE];
+  uint16_t head;
+  uint16_t count;
+} byte_queue;
+
+static bool queue_push(byte_queue* q, const uint8_t* bytes, uint16_t len)
+{
+  uint16_t idx;
+
+  if (q->count + len > MEMS_QUEUE_SIZE)
+  {
+    return false;
+  }
+
+  for (idx = 0; idx < len; ++idx)
+  {
+    q->data[(q->head + q->count + idx) % MEMS_QUEUE_SIZE] = bytes[idx];
+  }
+  q->count += len;
+
+  return true;
+}
+
+static uint16_t queue_pop(byte_queue* q, uint8_t* bytes, uint16_t len)
+{
+  uint16_t idx;
+
+  if (len > q->count)
+  {
+    len = q->count;
+  }
+
+  for (idx = 0; idx < len; ++idx)
+  {
+    bytes[idx] = q->data[(q->head + idx) % MEMS_QUEUE_SIZE];
+  }
+  q->head = (q->head + len) % MEMS_QUEUE_SIZE;
+  q->count -= len;
+
+  return len;
+}
+
+/*
+ * Serial port transport. The context is the mems_info itself, as the
+ * descriptor is kept in mems_info::sd for compatibility. With no explicit
+ * timeout, the read waits according to the VTIME setting of the port.
+ */
+
+static int serial_read(void* ctx, uint8_t* buffer, uint16_t quantity, int timeout_ms)
+{
+  mems_info* info = (mems_info*)ctx;
+  int bytesRead = -1;
+
+#if defined(WIN32)
+  DWORD w32BytesRead = 0;
+  if (ReadFile(info->sd, (UCHAR *) buffer, quantity, &w32BytesRead, NULL) == TRUE)
+  {
+    bytesRead = w32BytesRead;
+  }
+#else
+  struct pollfd pfd;
+
+  if (timeout_ms >= 0)
+  {
+    pfd.fd = info->sd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+    {
+      return 0;
+    }
+  }
+  bytesRead = read(info->sd, buffer, quantity);
+#endif
+
+  return bytesRead;
+}
+
+static int serial_write(void* ctx, const uint8_t* buffer, uint16_t quantity)
+{
+  mems_info* info = (mems_info*)ctx;
+  int bytesWritten = -1;
+
+#if defined(WIN32)
+  DWORD w32BytesWritten = 0;
+  if ((WriteFile(info->sd, (UCHAR *) buffer, quantity, &w32BytesWritten, NULL) == TRUE) &&
+      (w32BytesWritten == quantity))
+  {
+    bytesWritten = w32BytesWritten;
+  }
+#else
+  bytesWritten = write(info->sd, buffer, quantity);
+#endif
+
+  return bytesWritten;
+}
+
+static void serial_close(void* ctx)
+{
+  mems_info* info = (mems_info*)ctx;
+
+#if defined(WIN32)
+  CloseHandle(info->sd);
+  info->sd = INVALID_HANDLE_VALUE;
+#else
+  close(info->sd);
+  info->sd = 0;
+#endif
+}
+
+const mems_transport_ops mems_serial_transport = {
+  "serial", serial_read, serial_write, serial_close, NULL, NULL
+};
+
+/*
+ * Capture replay transport. Answers the protocol's commands from the frames
+ * in a capture file, so front-ends and analysis code can be exercised
+ * against recorded data. Each 0x80 request advances to the next recorded
+ * frame pair; the replay ends (with a read timeout) after the last one.
+ * The frames are given the request and response times that were recorded
+ * with them, moved onto the current monotonic clock.
+ */
+
+typedef struct
+{
+  mems_capture_reader reader;
+  byte_queue responses;
+  mems_data_frame_80 frame80;
+  mems_data_frame_7d frame7d;
+  //! Recorded times of the current frame, relative to the start of the capture
+  uint64_t request_us;
+  uint64_t response_us;
+  bool realtime;
+  bool started;
+  //! Monotonic time that corresponds to the start of the capture
+  uint64_t start_us;
+} replay_ctx;
+
+/**
+ * Advances to the next frame record, optionally waiting until it is due.
+ */
+static bool replay_next_frame(replay_ctx* replay)
+{
+  mems_capture_record record;
+  mems_capture_frame_times times;
+  uint8_t payload[sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d) + sizeof(mems_capture_frame_times)];
+  uint64_t elapsed;
+
+  while (mems_capture_next(&replay->reader, &record, payload, sizeof(payload)))
+  {
+    if ((record.type == MEMS_Record_Frames) &&
+        (record.length >= sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d)))
+    {
+      memcpy(&replay->frame80, payload, sizeof(mems_data_frame_80));
+      memcpy(&replay->frame7d, payload + sizeof(mems_data_frame_80), sizeof(mems_data_frame_7d));
+
+      // version 1 captures didn't record when the frames were requested
+      replay->request_us = record.timestamp_us;
+      replay->response_us = record.timestamp_us;
+      if (record.length >= sizeof(payload))
+      {
+        memcpy(&times, payload + sizeof(mems_data_frame_80) + sizeof(mems_data_frame_7d), sizeof(times));
+        replay->request_us = times.request_us;
+      }
+
+      // unless the session's anchor was taken first, the first frame is due now
+      if (!replay->started)
+      {
+        replay->start_us = mems_monotonic_us() - record.timestamp_us;
+        replay->started = true;
+      }
+
+      if (replay->realtime)
+      {
+        elapsed = mems_monotonic_us() - replay->start_us;
+        if (record.timestamp_us > elapsed)
+        {
+          mems_sleep_us(record.timestamp_us - elapsed);
+        }
+      }
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static int replay_write(void* ctx, const uint8_t* buffer, uint16_t quantity)
+{
+  replay_ctx* replay = (replay_ctx*)ctx;
+  uint8_t zero = 0x00;
+  uint16_t idx;
+  bool ok = true;
+
+  for (idx = 0; ok && (idx < quantity); ++idx)
+  {
+    switch (buffer[idx])
+    {
+    case 0xD0:
+      ok = queue_push(&replay->responses, &buffer[idx], 1) &&
+           queue_push(&replay->responses, replay->reader.header.d0_response, MEMS_D0_RESPONSE_LEN);
+      break;
+
+    case MEMS_ReqData80:
+      if (replay_next_frame(replay))
+      {
+        ok = queue_push(&replay->responses, &buffer[idx], 1) &&
+             queue_push(&replay->responses, (uint8_t*)&replay->frame80, sizeof(mems_data_frame_80));
+      }
+      break;
+
+    case MEMS_ReqData7D:
+      ok = queue_push(&replay->responses, &buffer[idx], 1) &&
+           queue_push(&replay->responses, (uint8_t*)&replay->frame7d, sizeof(mems_data_frame_7d));
+      break;
+
+    case 0xCA:
+    case 0x75:
+      ok = queue_push(&replay->responses, &buffer[idx], 1);
+      break;
+
+    default:
+      // everything else is acknowledged with a single zero byte
+      ok = queue_push(&replay->responses, &buffer[idx], 1) &&
+           queue_push(&replay->responses, &zero, 1);
+      break;
+    }
+  }
+
+  return ok ? quantity : (idx - 1);
+}
+
+static int replay_read(void* ctx, uint8_t* buffer, uint16_t quantity, int timeout_ms)
+{
+  // the responses are queued as the commands are written, so there is
+  // never anything to wait for
+  (void)timeout_ms;
+  return queue_pop(&((replay_ctx*)ctx)->responses, buffer, quantity);
+}
+
+static void replay_close(void* ctx)
+{
+  mems_capture_reader_close(&((replay_ctx*)ctx)->reader);
+  free(ctx);
+}
+
+static bool replay_frame_times(void* ctx, uint64_t* request_us, uint64_t* response_us)
+{
+  replay_ctx* replay = (replay_ctx*)ctx;
+
+  *request_us = replay->start_us + replay->request_us;
+  *response_us = replay->start_us + replay->response_us;
+
+  return true;
+}
+
+/**
+ * Provides the wall-clock time at which the capture was opened, as the
+ * anchor of the replayed session. The start of the capture is placed at
+ * the current time.
+ */
+static bool replay_anchor(void* ctx, mems_clock_anchor* anchor)
+{
+  replay_ctx* replay = (replay_ctx*)ctx;
+
+  if (!replay->started)
+  {
+    replay->start_us = mems_monotonic_us();
+    replay->started = true;
+  }
+
+  *anchor = replay->reader.header.anchor;
+  anchor->monotonic_us = replay->start_us;
+
+  return true;
+}
+
+static const mems_transport_ops replay_transport = {
+  "replay", replay_read, replay_write, replay_close, replay_frame_times, replay_anchor
+};
+
+#if !defined(WIN32)
+
+/*
+ * TCP transport, for serial ports exported over the network by a bridge
+ * (such as ser2net). Commands are queued and sent as a single segment when
+ * the protocol next waits for a response, so pipelined commands are not
+ * split across packets.
+ */
+
+typedef struct
+{
+  int fd;
+  uint8_t out[256];
+  uint16_t out_len;
+} tcp_ctx;
+
+static bool tcp_flush(tcp_ctx* tcp)
+{
+  ssize_t sent;
+  uint16_t offset = 0;
+
+  while (offset < tcp->out_len)
+  {
+    sent = send(tcp->fd, tcp->out + offset, tcp->out_len - offset, 0);
+    if (sent <= 0)
+    {
+      return false;
+    }
+    offset += sent;
+  }
+  tcp->out_len = 0;
+
+  return true;
+}
+
+static int tcp_write(void* ctx, const uint8_t* buffer, uint16_t quantity)
+{
+  tcp_ctx* tcp = (tcp_ctx*)ctx;
+  uint16_t idx;
+
+  for (idx = 0; idx < quantity; ++idx)
+  {
+    if ((tcp->out_len == sizeof(tcp->out)) && !tcp_flush(tcp))
+    {
+      return -1;
+    }
+    tcp->out[tcp->out_len++] = buffer[idx];
+  }
+
+  return quantity;
+}
+
+static int tcp_read(void* ctx, uint8_t* buffer, uint16_t quantity, int timeout_ms)
+{
+  tcp_ctx* tcp = (tcp_ctx*)ctx;
+  struct pollfd pfd;
+
+  if (!tcp_flush(tcp))
+  {
+    return -1;
+  }
+
+  pfd.fd = tcp->fd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, (timeout_ms >= 0) ? timeout_ms : MEMS_TCP_DEFAULT_TIMEOUT_MS) <= 0)
+  {
+    return 0;
+  }
+
+  return recv(tcp->fd, buffer, quantity, 0);
+}
+
+static void tcp_close(void* ctx)
+{
+  tcp_ctx* tcp = (tcp_ctx*)ctx;
+
+  tcp_flush(tcp);
+  close(tcp->fd);
+  free(tcp);
+}
+
+static const mems_transport_ops tcp_transport = {
+  "tcp", tcp_read, tcp_write, tcp_close, NULL, NULL
+};
+
+/*
+ * In-memory loopback transport. Each byte written is answered immediately
+ * by the ECU simulator (or simply looped back, if there is no simulator),
+ * without any system calls, for use in unit tests and benchmarks.
+ */
+
+typedef struct
+{
+  mems_sim* sim;
+  bool owns_sim;
+  byte_queue responses;
+} loopback_ctx;
+
+static int loopback_write(void* ctx, const uint8_t* buffer, uint16_t quantity)
+{
+  loopback_ctx* loop = (loopback_ctx*)ctx;
+  uint8_t response[MEMS_SIM_MAX_RESPONSE];
+  uint16_t len;
+  uint16_t idx;
+
+  for (idx = 0; idx < quantity; ++idx)
+  {
+    if (loop->sim)
+    {
+      len = mems_sim_respond(loop->sim, buffer[idx], response);
+    }
+    else
+    {
+      response[0] = buffer[idx];
+      len = 1;
+    }
+
+    if (!queue_push(&loop->responses, response, len))
+    {
+      return idx;
+    }
+  }
+
+  return quantity;
+}
+
+static int loopback_read(void* ctx, uint8_t* buffer, uint16_t quantity, int timeout_ms)
+{
+  // the responses are queued as the commands are written, so there is
+  // never anything to wait for
+  (void)timeout_ms;
+  return queue_pop(&((loopback_ctx*)ctx)->responses, buffer, quantity);
+}
+
+static void loopback_close(void* ctx)
+{
+  loopback_ctx* loop = (loopback_ctx*)ctx;
+
+  if (loop->owns_sim)
+  {
+    pthread_mutex_destroy(&loop->sim->mutex);
+    free(loop->sim);
+  }
+  free(loop);
+}
+
+static const mems_transport_ops loopback_transport = {
+  "loopback", loopback_read, loopback_write, loopback_close, NULL, NULL
+};
+
+#endif // !WIN32
+
+/**
+ * Attaches an already-opened transport to the connection.
+ * @param info State information for the current connection
+ * @param ops Transport operations
+ * @param ctx Transport state, which is passed to each operation and released
+ *   by ops->close() when the connection is closed
+ * @return True if the transport was attached; false if the connection is
+ *   already open
+ */
+bool mems_connect_transport(mems_info* info, const mems_transport_ops* ops, void* ctx)
+{
+  bool result = false;
+
+  if (mems_lock(info))
+  {
+    if (!mems_is_connected(info))
+    {
+      info->transport = ops;
+      info->transport_ctx = ctx;
+      result = true;
+    }
+    mems_unlock(info);
+  }
+
+  return result;
+}
+
+/**
+ * Connects to a capture file, which then answers data requests with the
+ * recorded frames in order.
+ * @param info State information for the current connection
+ * @param capturePath Path of the capture file
+ * @param realtime If true, each frame is withheld until the time at which it
+ *   was recorded (relative to the first frame); otherwise frames are
+ *   returned as fast as they are requested
+ * @return True if the capture was opened, false otherwise
+ */
+bool mems_connect_replay(mems_info* info, const char* capturePath, bool realtime)
+{
+  replay_ctx* replay = calloc(1, sizeof(replay_ctx));
+
+  if (replay == NULL)
+  {
+    return false;
+  }
+
+  replay->realtime = realtime;
+
+  if (!mems_capture_reader_open(&replay->reader, capturePath) ||
+      !mems_connect_transport(info, &replay_transport, replay))
+  {
+    replay_close(replay);
+    return false;
+  }
+
+  return true;
+}
+
+#if !defined(WIN32)
+
+/**
+ * Connects to a serial bridge that exposes the ECU's port over TCP.
+ * The bridge is expected to already be configured for the ECU's line settings.
+ * @param info State information for the current connection
+ * @param host Name or address of the bridge
+ * @param port TCP port of the bridge
+ * @return True if the connection was established, false otherwise
+ */
+bool mems_connect_tcp(mems_info* info, const char* host, uint16_t port)
+{
+  struct addrinfo hints;
+  struct addrinfo* result;
+  struct addrinfo* ai;
+  char service[8];
+  tcp_ctx* tcp;
+  int fd = -1;
+  int flag = 1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  snprintf(service, sizeof(service), "%u", port);
+
+  if (getaddrinfo(host, service, &hints, &result) != 0)
+  {
+    dprintf_err("mems_connect_tcp(): could not resolve %s\n", host);
+    return false;
+  }
+
+  for (ai = result; (ai != NULL) && (fd < 0); ai = ai->ai_next)
+  {
+    if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) >= 0)
+    {
+      if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+      {
+        close(fd);
+        fd = -1;
+      }
+    }
+  }
+  freeaddrinfo(result);
+
+  if (fd < 0)
+  {
+    dprintf_err("mems_connect_tcp(): could not connect to %s:%u\n", host, port);
+    return false;
+  }
+
+  // every exchange is a handful of bytes, so don't let Nagle delay them
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+
+  if ((tcp = calloc(1, sizeof(tcp_ctx))) == NULL)
+  {
+    close(fd);
+    return false;
+  }
+  tcp->fd = fd;
+
+  if (!mems_connect_transport(info, &tcp_transport, tcp))
+  {
+    tcp_close(tcp);
+    return false;
+  }
+
+  return true;
+}
+
+/**
+ * Connects to an in-memory simulated ECU.
+ * @param info State information for the current connection
+ * @param sim Simulator to answer commands; if NULL, a simulator with the
+ *   default state is created (and released when the connection is closed)
+ * @return True if the connection was established, false otherwise
+ */
+bool mems_connect_loopback(mems_info* info, mems_sim* sim)
+{
+  loopback_ctx* loop = calloc(1, sizeof(loopback_ctx));
+
+  if (loop == NULL)
+  {
+    return false;
+  }
+
+  if (sim == NULL)
+  {
+    if ((sim = malloc(sizeof(mems_sim))) == NULL)
+    {
+      free(loop);
+      return false;
+    }
+    mems_sim_init(sim);
+    loop->owns_sim = true;
+  }
+  loop->sim = sim;
+
+  if (!mems_connect_transport(info, &loopback_transport, loop))
+  {
+    loopback_close(loop);
+    return false;
+  }
+
+  return true;
+}
+
+#endif // !WIN32
+
+/**
+ * Connects using a device specification string, which selects the transport:
+ *   "tcp:<host>:<port>"  - serial bridge over TCP
+ *   "replay:<path>"      - capture file, replayed as fast as requested
+ *   "replay-rt:<path>"   - capture file, replayed at the recorded rate
+ *   "sim"                - in-memory simulated ECU
+ *   anything else        - path to a serial device
+ * @param info State information for the current connection
+ * @param spec Device specification
+ * @param options Line settings for serial devices (ignored by other transports)
+ * @return True if the connection was established, false otherwise
+ */
+bool mems_connect_spec(mems_info* info, const char* spec, const mems_connection_options* options)
+{
+#if !defined(WIN32)
+  char host[256];
+  const char* colon;
+
+  if (strncmp(spec, "tcp:", 4) == 0)
+  {
+    colon = strrchr(spec + 4, ':');
+    if ((colon == NULL) || ((size_t)(colon - (spec + 4)) >= sizeof(host)))
+    {
+      return false;
+    }
+    memcpy(host, spec + 4, colon - (spec + 4));
+    host[colon - (spec + 4)] = '\0';
+    return mems_connect_tcp(info, host, (uint16_t)strtoul(colon + 1, NULL, 10));
+  }
+
+  if (strcmp(spec, "sim") == 0)
+  {
+    return mems_connect_loopback(info, NULL);
+  }
+#endif
+
+  if (strncmp(spec, "replay:", 7) == 0)
+  {
+    return mems_connect_replay(info, spec + 7, false);
+  }
+
+  if (strncmp(spec, "replay-rt:", 10) == 0)
+  {
+    return mems_connect_replay(info, spec + 10, true);
+  }
+
+  return mems_connect_with_options(info, spec, options);
+}
+
+/**
+ * Performs a single read from the connection's transport, returning whatever
+ * data arrives (up to 'quantity' bytes) within the timeout. Intended for
+ * front-ends that exchange arbitrary bytes with the ECU; the caller should
+ * hold no expectation about how many bytes a single call returns.
+ * @param timeout_ms Time to wait for data, or -1 for the transport's default
+ * @return Number of bytes read, 0 on timeout, or -1 on error
+ */
+int16_t mems_transport_read(mems_info* info, uint8_t* buffer, uint16_t quantity, int timeout_ms)
+{
+  if (!mems_is_connected(info))
+  {
+    return -1;
+  }
+
+  return info->transport->read(info->transport_ctx, buffer, quantity, timeout_ms);
+}
+
+/**
+ * Writes bytes to the connection's transport.
+ * @return Number of bytes written, or -1 on error
+ */
+int16_t mems_transport_write(mems_info* info, const uint8_t* buffer, uint16_t quantity)
+{
+  if (!mems_is_connected(info))
+  {
+    return -1;
+  }
+
+  return info->transport->write(info->transport_ctx, buffer, quantity);
+}
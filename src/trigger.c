@@ -0,0 +1,301 @@
+// librosco - a communications library for the Rover MEMS ECU
+//
+// trigger.c: This file contains the trigger capture, which holds the
+//            most recent frames in a fixed history and writes them to a
+//            capture file only around the moments when a condition of
+//            interest (a stall, a fault, a lambda flip) is seen.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rosco.h"
+#include "rosco_internal.h"
+
+//! Highest frame rate assumed when sizing the history from the pre-trigger window
+#define MEMS_TRIGGER_MAX_RATE_HZ 64
+//! Longest trigger specification accepted
+#define MEMS_TRIGGER_SPEC_LEN 128
+//! Conditions that describe a change rather than a state, and so fire on every frame that holds them
+#define MEMS_TRIGGER_CHANGES ((1 << MEMS_Trigger_FaultChange) | (1 << MEMS_Trigger_LambdaFlip))
+
+/**
+ * Parses a trigger specification: a comma-separated list of conditions
+ * ("rpmdrop=<rpm/s>", "faults", "idle=<error>", "lambda") and window
+ * lengths ("pre=<ms>", "post=<ms>"). The windows default to 10 s before and
+ * 5 s after the trigger, and the history is sized to hold the pre-trigger
+ * window at up to MEMS_TRIGGER_MAX_RATE_HZ frames per second.
+ * @return True if the specification was valid and enabled at least one condition
+ */
+bool mems_parse_trigger_options(const char* spec, mems_trigger_options* options)
+{
+  char copy[MEMS_TRIGGER_SPEC_LEN];
+  char* token;
+  unsigned int val;
+  float rate;
+
+  memset(options, 0, sizeof(mems_trigger_options));
+  options->pre_trigger_ms = 10000;
+  options->post_trigger_ms = 5000;
+
+  if (strlen(spec) >= sizeof(copy))
+  {
+    return false;
+  }
+  strcpy(copy, spec);
+
+  for (token = strtok(copy, ","); token != NULL; token = strtok(NULL, ","))
+  {
+    if ((sscanf(token, "rpmdrop=%f", &rate) == 1) && (rate > 0.0f))
+    {
+      options->conditions |= (1 << MEMS_Trigger_RPMDrop);
+      options->rpm_drop_per_s = rate;
+    }
+    else if (strcmp(token, "faults") == 0)
+    {
+      options->conditions |= (1 << MEMS_Trigger_FaultChange);
+    }
+    else if ((sscanf(token, "idle=%u", &val) == 1) && (val > 0) && (val <= UINT16_MAX))
+    {
+      options->conditions |= (1 << MEMS_Trigger_IdleError);
+      options->idle_error_limit = val;
+    }
+    else if (strcmp(token, "lambda") == 0)
+    {
+      options->conditions |= (1 << MEMS_Trigger_LambdaFlip);
+    }
+    else if (sscanf(token, "pre=%u", &val) == 1)
+    {
+      options->pre_trigger_ms = val;
+    }
+    else if (sscanf(token, "post=%u", &val) == 1)
+    {
+      options->post_trigger_ms = val;
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  options->capacity = (uint32_t)(((uint64_t)options->pre_trigger_ms * MEMS_TRIGGER_MAX_RATE_HZ) / 1000) + 1;
+
+  return (options->conditions != 0);
+}
+
+/**
+ * Allocates the frame history for a trigger capture. This is the only
+ * allocation made; adding frames does not allocate.
+ * @param trigger Trigger state to initialize
+ * @param options Conditions and window lengths; the capacity is rounded up
+ *   to the next power of two
+ * @param writer Open capture file to which the windows are written
+ * @return True if the history was allocated
+ */
+bool mems_trigger_init(mems_trigger* trigger, const mems_trigger_options* options, mems_capture_writer* writer)
+{
+  uint32_t size = 1;
+
+  memset(trigger, 0, sizeof(mems_trigger));
+
+  if (options->capacity == 0)
+  {
+    return false;
+  }
+
+  while (size < options->capacity)
+  {
+    size <<= 1;
+  }
+
+  if ((trigger->history = calloc(size, sizeof(mems_trigger_sample))) == NULL)
+  {
+    return false;
+  }
+
+  trigger->options = *options;
+  trigger->writer = writer;
+  trigger->capacity = size;
+
+  return true;
+}
+
+/**
+ * Releases the frame history of a trigger capture. The capture file is left open.
+ */
+void mems_trigger_free(mems_trigger* trigger)
+{
+  free(trigger->history);
+  trigger->history = NULL;
+  trigger->capacity = 0;
+}
+
+/**
+ * Writes the frames in the history from trigger->written up to (but not
+ * including) the given index.
+ */
+static void write_history(mems_trigger* trigger, uint64_t end)
+{
+  const mems_trigger_sample* sample;
+  uint64_t start_us = trigger->writer->start_us;
+
+  for (; trigger->written < end; trigger->written++)
+  {
+    sample = &trigger->history[trigger->written & (trigger->capacity - 1)];
+    mems_capture_write_frames_at(trigger->writer,
+                                 (sample->request_us > start_us) ? (sample->request_us - start_us) : 0,
+                                 (sample->timestamp_us > start_us) ? (sample->timestamp_us - start_us) : 0,
+                                 &sample->frame80, &sample->frame7d);
+  }
+}
+
+/**
+ * Evaluates the enabled conditions against the newest frame.
+ * @return Bitmap of the conditions that hold for this frame
+ */
+static uint32_t evaluate(const mems_trigger* trigger, const mems_frame* frame, uint64_t timestamp_us,
+                         float* values)
+{
+  const mems_trigger_options* opt = &trigger->options;
+  uint32_t hold = 0;
+
+  if ((opt->conditions & (1 << MEMS_Trigger_RPMDrop)) &&
+      (timestamp_us > trigger->last_us) && (frame->data.engine_rpm < trigger->last_rpm))
+  {
+    values[MEMS_Trigger_RPMDrop] = (trigger->last_rpm - frame->data.engine_rpm) * 1000000.0f /
+                                   (float)(timestamp_us - trigger->last_us);
+    if (values[MEMS_Trigger_RPMDrop] >= opt->rpm_drop_per_s)
+    {
+      hold |= (1 << MEMS_Trigger_RPMDrop);
+    }
+  }
+
+  if ((opt->conditions & (1 << MEMS_Trigger_FaultChange)) &&
+      (frame->data.fault_codes != trigger->last_faults))
+  {
+    values[MEMS_Trigger_FaultChange] = frame->data.fault_codes;
+    hold |= (1 << MEMS_Trigger_FaultChange);
+  }
+
+  if ((opt->conditions & (1 << MEMS_Trigger_IdleError)) &&
+      (frame->data.idle_error >= opt->idle_error_limit))
+  {
+    values[MEMS_Trigger_IdleError] = frame->data.idle_error;
+    hold |= (1 << MEMS_Trigger_IdleError);
+  }
+
+  if ((opt->conditions & (1 << MEMS_Trigger_LambdaFlip)) &&
+      (frame->frame7d.lambda_status != trigger->last_lambda))
+  {
+    values[MEMS_Trigger_LambdaFlip] = frame->frame7d.lambda_status;
+    hold |= (1 << MEMS_Trigger_LambdaFlip);
+  }
+
+  return hold;
+}
+
+/**
+ * Adds a frame to the history and checks the trigger conditions. A level
+ * condition (RPM drop, idle error) fires when it starts to hold, so one
+ * that is sustained fires only once; a change fires whenever it is seen.
+ * When one fires with no trigger active, the frames still held from the
+ * pre-trigger window are written out, followed by a MEMS_Record_Trigger
+ * record; frames then continue to be written until the post-trigger window
+ * has passed. Firing again within the post-trigger window extends it.
+ *
+ * Outside the windows, the only work per frame is a copy into the history
+ * and a few comparisons.
+ * @param trigger Trigger state set up with mems_trigger_init()
+ * @param frame Newly acquired frame
+ * @param timestamp_us Monotonic time at which the frame was acquired
+ * @return True if a condition fired on this frame
+ */
+bool mems_trigger_add(mems_trigger* trigger, const mems_frame* frame, uint64_t timestamp_us)
+{
+  mems_trigger_sample* slot = &trigger->history[trigger->count & (trigger->capacity - 1)];
+  mems_trigger_event event;
+  float values[MEMS_Trigger_Count];
+  uint64_t pre_us = (uint64_t)trigger->options.pre_trigger_ms * 1000;
+  uint64_t oldest;
+  uint32_t hold = 0;
+  uint32_t rising;
+  uint64_t latency = frame->response_us - frame->request_us;
+  int cond;
+
+  // the request is placed on the caller's clock by the frame's own latency
+  slot->timestamp_us = timestamp_us;
+  slot->request_us = (latency < timestamp_us) ? (timestamp_us - latency) : 0;
+  slot->seq = frame->seq;
+  slot->frame80 = frame->frame80;
+  slot->frame7d = frame->frame7d;
+
+  // the first frame is the reference against which changes are detected
+  if (trigger->count > 0)
+  {
+    hold = evaluate(trigger, frame, timestamp_us, values);
+  }
+  rising = hold & (~trigger->holding | MEMS_TRIGGER_CHANGES);
+
+  trigger->count++;
+  trigger->holding = hold;
+  trigger->last_us = timestamp_us;
+  trigger->last_rpm = frame->data.engine_rpm;
+  trigger->last_faults = frame->data.fault_codes;
+  trigger->last_lambda = frame->frame7d.lambda_status;
+
+  if (rising)
+  {
+    if (trigger->post_until_us == 0)
+    {
+      // write the part of the pre-trigger window that is still held,
+      // skipping anything already written by an earlier trigger
+      oldest = trigger->count - 1;
+      while ((oldest > trigger->written) && (trigger->count - oldest < trigger->capacity) &&
+             (timestamp_us - trigger->history[(oldest - 1) & (trigger->capacity - 1)].timestamp_us <= pre_us))
+      {
+        oldest--;
+      }
+      trigger->written = oldest;
+      write_history(trigger, trigger->count - 1);
+    }
+
+    for (cond = 0; cond < MEMS_Trigger_Count; ++cond)
+    {
+      if (rising & (1 << cond))
+      {
+        memset(&event, 0, sizeof(event));
+        event.condition = cond;
+        event.seq = frame->seq;
+        event.value = values[cond];
+        mems_capture_write(trigger->writer, MEMS_Record_Trigger,
+                           (timestamp_us > trigger->writer->start_us) ? (timestamp_us - trigger->writer->start_us) : 0,
+                           &event, sizeof(event));
+        trigger->fired++;
+      }
+    }
+
+    trigger->post_until_us = timestamp_us + ((uint64_t)trigger->options.post_trigger_ms * 1000);
+  }
+
+  if (trigger->post_until_us != 0)
+  {
+    write_history(trigger, trigger->count);
+    if (timestamp_us >= trigger->post_until_us)
+    {
+      trigger->post_until_us = 0;
+      fflush(trigger->writer->fp);
+    }
+  }
+
+  return (rising != 0);
+}
+
+/**
+ * Frame ring subscriber that adds each acquired frame to a trigger capture,
+ * timestamped with the time its response arrived. Register with
+ * mems_ring_subscribe(), passing the mems_trigger as the context.
+ */
+void mems_trigger_frame_callback(const mems_frame* frame, void* trigger)
+{
+  mems_trigger_add((mems_trigger*)trigger, frame, frame->response_us);
+}
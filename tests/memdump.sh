@@ -0,0 +1,26 @@
+#!/bin/sh
+#
+# Dumps the memory image generated by memssim -M through its pseudo-terminal
+# with readmems, and checks the length and CRC-32 of the result.
+#
+# Usage: memdump.sh <memssim> <readmems> <work directory>
+
+memssim="$1"
+readmems="$2"
+dump="$3/memdump.bin"
+out="$3/memdump.pty"
+protocol="addr=A0:2,read=A1,block=64,inc"
+
+rm -f "$dump" "$out"
+"$memssim" -b 115200 -M "$protocol" > "$out" &
+pid=$!
+trap 'kill $pid 2>/dev/null' EXIT
+
+tries=0
+while [ ! -s "$out" ] && [ $tries -lt 50 ]; do
+  sleep 0.1
+  tries=$((tries + 1))
+done
+
+"$readmems" -b 115200 -M "$protocol" "$(head -n 1 "$out")" dump "$dump" 0 16384 |
+  grep "Complete: 16384 bytes from 0x0, CRC-32 F455A66B"